@@ -0,0 +1,260 @@
+/*
+ *  cb_bench.c - cost of wrapping around the end of a circular buffer
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "misc.h"
+#include "circ_buf.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The benchmark moves data through buffers of each size four times: with
+ * plain memory, where a region crossing the end of the buffer is split in
+ * two, with a mirrored buffer, where it never is, with a chain of pooled
+ * segments, where a region is split at every segment boundary, and with
+ * plain memory backed by huge pages (where the system provides them).  The
+ * chunk size doesn't divide the buffer or segment size, so the data wraps at
+ * a different place on every lap.
+ *
+ * The "copy" test appends and extracts chunks, as the buffer is used by the
+ * datagram and line based code.  The "pipe" and "socketpair" tests write
+ * chunks from the buffer into a pipe or a unix stream socket and read them
+ * back, so each transfer is a writev or readv of one or more iovecs.  The
+ * buffer is kept half full throughout.
+ *
+ * Each test is run with every chunk size, unless one is given with -c.  One
+ * line of key=value pairs is printed per test, chunk size, buffer size and
+ * backend.
+ */
+
+static const size_t sizes[] = { 8192, 131072, 4194304, 0 };
+static size_t chunks[] = { 64, 1460, 4096, 0 };
+
+static size_t megabytes = 4096;
+static size_t chunk;
+
+
+static const char *tests[] = { "copy", "pipe", "socketpair", NULL };
+static const char *backends[] = { "plain", "mirrored", "chained", "huge",
+                                  NULL };
+
+
+static int run(const char *test, size_t size, const char *backend);
+static size_t copy(circ_buf_t *cb, size_t total, uint8_t *data,
+		unsigned long *splits);
+static size_t transfer(circ_buf_t *cb, size_t total, const int *fds,
+		unsigned long *splits);
+static unsigned long count_splits(const circ_buf_t *cb);
+
+
+
+const char *get_program_name(void)
+{
+	return "cb_bench";
+}
+
+
+
+int main(int argc, char **argv)
+{
+	int c, i, j, k, l, err = 0;
+
+	while ((c = getopt(argc, argv, "m:c:")) >= 0) {
+		switch (c) {
+		case 'm':
+			if (safe_atoi(optarg, &i) || i <= 0)
+				fatal("invalid size");
+			megabytes = i;
+			break;
+		case 'c':
+			if (safe_atoi(optarg, &i) || i <= 0 || i > 4096)
+				fatal("invalid chunk size");
+			chunks[0] = i;
+			chunks[1] = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes] "
+			        "[-c chunk]\n", get_program_name());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; tests[i] != NULL; ++i) {
+		for (j = 0; chunks[j] != 0; ++j) {
+			chunk = chunks[j];
+			for (k = 0; sizes[k] != 0; ++k) {
+				for (l = 0; backends[l] != NULL; ++l)
+					err |= run(tests[i], sizes[k],
+					           backends[l]);
+			}
+		}
+	}
+
+	return (err)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+static int run(const char *test, size_t size, const char *backend)
+{
+	circ_buf_t cb;
+	uint8_t *data;
+	struct timespec start, end;
+	size_t total, moved;
+	unsigned long splits = 0;
+	int fds[2];
+	double secs;
+	bool ok;
+
+	cb_set_mirroring((strcmp(backend, "mirrored") == 0)? 1 : 0);
+	cb_set_huge_pages((strcmp(backend, "huge") == 0)? 1 : 0);
+	cb_init(&cb, size);
+	if ((strcmp(backend, "mirrored") == 0 && !cb_is_mirrored(&cb)) ||
+	    (strcmp(backend, "huge") == 0 && !cb_is_huge(&cb))) {
+		printf("test=%s size=%lu buffer=%s unsupported\n",
+		       test, (unsigned long)size, backend);
+		cb_destroy(&cb);
+		return 0;
+	}
+	if (strcmp(backend, "chained") == 0)
+		cb_chain(&cb);
+
+	/* the other tests do a syscall per chunk, so move less through them,
+	 * and less again with small chunks */
+	total = megabytes << 20;
+	if (strcmp(test, "copy") != 0)
+		total /= 8;
+	if (chunk < 1024)
+		total /= 8;
+	total -= total % chunk;
+
+	data = (uint8_t *)xmalloc(chunk);
+	memset(data, 'x', chunk);
+
+	/* fill the buffer half way */
+	while (cb_used(&cb) + chunk <= size / 2)
+		cb_append(&cb, data, chunk);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (strcmp(test, "pipe") == 0) {
+		if (pipe(fds) != 0)
+			fatal("pipe failed: %s", strerror(errno));
+		moved = transfer(&cb, total, fds, &splits);
+		close(fds[0]);
+		close(fds[1]);
+	} else if (strcmp(test, "socketpair") == 0) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			fatal("socketpair failed: %s", strerror(errno));
+		moved = transfer(&cb, total, fds, &splits);
+		close(fds[0]);
+		close(fds[1]);
+	} else {
+		moved = copy(&cb, total, data, &splits);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ok = (moved == total);
+
+	printf("test=%s size=%lu buffer=%s chunk=%lu bytes=%lu secs=%.3f "
+	       "MB/s=%.1f ns_per_chunk=%.1f split_transfers=%lu%s\n",
+	       test, (unsigned long)size, backend,
+	       (unsigned long)chunk, (unsigned long)moved, secs,
+	       (moved / 1048576.0) / secs, secs * 1e9 / (moved / chunk),
+	       splits, ok? "" : " FAILED");
+
+	free(data);
+	cb_destroy(&cb);
+
+	return ok? 0 : 1;
+}
+
+
+
+/* append and extract chunks until total bytes have been moved through */
+static size_t copy(circ_buf_t *cb, size_t total, uint8_t *data,
+		unsigned long *splits)
+{
+	size_t moved = 0;
+	ssize_t rr;
+
+	while (moved < total) {
+		*splits += count_splits(cb);
+		if (cb_append(cb, data, chunk) != (ssize_t)chunk)
+			break;
+		rr = cb_extract(cb, data, chunk);
+		if (rr != (ssize_t)chunk)
+			break;
+		moved += rr;
+	}
+
+	return moved;
+}
+
+
+
+/* write chunks into fds[1] and read them back from fds[0] into the buffer
+ * until total bytes have been moved through */
+static size_t transfer(circ_buf_t *cb, size_t total, const int *fds,
+		unsigned long *splits)
+{
+	size_t moved = 0;
+	ssize_t rr;
+
+	while (moved < total) {
+		*splits += count_splits(cb);
+		rr = cb_write(cb, fds[1], chunk);
+		if (rr != (ssize_t)chunk)
+			break;
+		rr = cb_read(cb, fds[0], chunk);
+		if (rr != (ssize_t)chunk)
+			break;
+		moved += rr;
+	}
+
+	return moved;
+}
+
+
+
+/* returns how many extra iovecs the next transfers into and out of the
+ * buffer need */
+static unsigned long count_splits(const circ_buf_t *cb)
+{
+	struct iovec iov[CB_MAX_IOV];
+	int n, splits = 0;
+
+	/* a chain may not have the segments for the space yet */
+	if ((n = cb_space_iov(cb, chunk, iov)) > 1)
+		splits += n - 1;
+	if ((n = cb_data_iov(cb, chunk, iov)) > 1)
+		splits += n - 1;
+	return splits;
+}
@@ -0,0 +1,281 @@
+/*
+ *  clock_bench.c - cost of the clock reads made for stream timeouts
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "misc.h"
+#include "clock.h"
+#include "circ_buf.h"
+#include "io_stream.h"
+#include "readwrite.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The benchmark first times each way of reading the clock: through the vDSO
+ * (gettimeofday and clock_gettime) and as a real system call.  It then
+ * relays data through readwrite over socket pairs with small buffers, so
+ * that every read and write moves at most one MTU, and counts how often
+ * the clock was read.  Reading the time of day for every transfer and
+ * again for the idle timeout of every loop iteration (as nc6 used to do)
+ * costs at least one read per transfer more than the cached clock, which
+ * is read once per iteration.
+ *
+ * One line of key=value pairs is printed per clock and per MTU.
+ */
+
+static const size_t mtus[] = { 16, 64, 256, 1024, 0 };
+
+static size_t megabytes = 16;
+static unsigned long iterations = 10000000;
+
+
+static double time_clock(const char *name);
+static int relay(size_t mtu, double uncached_ns, double cached_ns);
+static void writer(int fd, size_t total, size_t mtu);
+static void reader(int fd);
+
+
+
+const char *get_program_name(void)
+{
+	return "clock_bench";
+}
+
+
+
+int main(int argc, char **argv)
+{
+	double gtod_ns, cached_ns;
+	int c, i, err = 0;
+
+	while ((c = getopt(argc, argv, "m:n:")) >= 0) {
+		switch (c) {
+		case 'm':
+			if (safe_atoi(optarg, &i) || i <= 0)
+				fatal("invalid size");
+			megabytes = i;
+			break;
+		case 'n':
+			if (safe_atoi(optarg, &i) || i <= 0)
+				fatal("invalid iteration count");
+			iterations = i;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes] "
+			        "[-n iterations]\n", get_program_name());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	gtod_ns = time_clock("gettimeofday");
+	time_clock("monotonic");
+	time_clock("monotonic-coarse");
+	time_clock("monotonic-syscall");
+
+	/* the cost of the clock that nc6 uses */
+	clock_update();
+	cached_ns = time_clock(clock_name());
+
+	for (i = 0; mtus[i] != 0; ++i)
+		err |= relay(mtus[i], gtod_ns, cached_ns);
+
+	return (err)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+static void read_clock(const char *name)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	if (strcmp(name, "gettimeofday") == 0)
+		gettimeofday(&tv, NULL);
+	else if (strcmp(name, "monotonic") == 0)
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+#ifdef CLOCK_MONOTONIC_COARSE
+	else if (strcmp(name, "monotonic-coarse") == 0)
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#endif
+	else
+		syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+}
+
+
+
+/* returns the cost of a clock read in nanoseconds */
+static double time_clock(const char *name)
+{
+	struct timespec start, end;
+	unsigned long i, n = iterations;
+	double ns;
+
+	/* a real syscall is much slower, so don't wait all day for it */
+	if (strcmp(name, "monotonic-syscall") == 0)
+		n /= 10;
+
+	/* the comparisons are the same for every clock, so the relative
+	 * costs are fair even though the absolute ones are inflated */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; ++i)
+		read_clock(name);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+	      (end.tv_nsec - start.tv_nsec)) / n;
+	printf("clock=%s reads=%lu ns_per_read=%.1f\n", name, n, ns);
+
+	return ns;
+}
+
+
+
+static int relay(size_t mtu, double uncached_ns, double cached_ns)
+{
+	int remote[2], local[2];
+	int devnull, rr;
+	pid_t wpid, rpid;
+	circ_buf_t remote_buf, local_buf;
+	io_stream_t remote_ios, local_ios;
+	unsigned long reads, transfers, uncached;
+	size_t total = megabytes << 20;
+	bool ok;
+	struct timespec start, end;
+	double secs;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, remote) != 0 ||
+	    socketpair(PF_UNIX, SOCK_STREAM, 0, local) != 0)
+		fatal("socketpair failed: %s", strerror(errno));
+	if ((devnull = open("/dev/null", O_RDONLY)) < 0)
+		fatal("cannot open /dev/null: %s", strerror(errno));
+
+	if ((wpid = fork()) < 0)
+		fatal("fork failed: %s", strerror(errno));
+	if (wpid == 0) {
+		close(remote[0]);
+		close(local[0]);
+		close(local[1]);
+		writer(remote[1], total, mtu);
+		_exit(EXIT_SUCCESS);
+	}
+	close(remote[1]);
+
+	if ((rpid = fork()) < 0)
+		fatal("fork failed: %s", strerror(errno));
+	if (rpid == 0) {
+		close(remote[0]);
+		close(local[0]);
+		reader(local[1]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(local[1]);
+
+	/* buffers of one mtu limit every transfer to at most that much */
+	cb_init(&remote_buf, mtu);
+	cb_init(&local_buf, mtu);
+	ios_init_socket(&remote_ios, "remote", remote[0], SOCK_STREAM,
+	                &remote_buf, &local_buf);
+	ios_init(&local_ios, "local", devnull, local[0], SOCK_STREAM,
+	         &local_buf, &remote_buf);
+
+	/* an idle timeout makes readwrite consult the clock every iteration,
+	 * as it does in normal use */
+	ios_set_idle_timeout(&remote_ios, 60);
+
+	reads = clock_reads();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rr = readwrite(&remote_ios, &local_ios);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	reads = clock_reads() - reads;
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ok = (rr == 0 && ios_bytes_received(&remote_ios) == total);
+
+	/* each byte is both read from remote and written to local */
+	transfers = 2 * ((ios_bytes_received(&remote_ios) + mtu - 1) / mtu);
+	uncached = transfers + reads;
+
+	printf("mtu=%lu bytes=%lu secs=%.3f transfers>=%lu clock=%s "
+	       "clock_reads=%lu uncached_reads>=%lu saved_ms>=%.1f%s\n",
+	       (unsigned long)mtu, (unsigned long)ios_bytes_received(&remote_ios),
+	       secs, transfers, clock_name(), reads, uncached,
+	       (uncached * uncached_ns - reads * cached_ns) / 1e6,
+	       ok? "" : " FAILED");
+
+	io_stream_destroy(&local_ios);
+	io_stream_destroy(&remote_ios);
+	cb_destroy(&local_buf);
+	cb_destroy(&remote_buf);
+	waitpid(wpid, NULL, 0);
+	waitpid(rpid, NULL, 0);
+
+	return ok? 0 : 1;
+}
+
+
+
+/* write total bytes in chunks of mtu */
+static void writer(int fd, size_t total, size_t mtu)
+{
+	char *buf = xmalloc(mtu);
+	ssize_t rr;
+
+	memset(buf, 'x', mtu);
+	while (total > 0) {
+		rr = write(fd, buf, (total < mtu)? total : mtu);
+		if (rr < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("write failed: %s", strerror(errno));
+		}
+		total -= rr;
+	}
+	close(fd);
+}
+
+
+
+/* discard everything until eof */
+static void reader(int fd)
+{
+	char buf[65536];
+	ssize_t rr;
+
+	while ((rr = read(fd, buf, sizeof(buf))) != 0) {
+		if (rr < 0 && errno != EINTR)
+			fatal("read failed: %s", strerror(errno));
+	}
+	close(fd);
+}
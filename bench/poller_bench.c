@@ -0,0 +1,275 @@
+/*
+ *  poller_bench.c - poller backend benchmark over loopback connections
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "misc.h"
+#include "poller.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * The benchmark relays data from a writer process over a number of loopback
+ * TCP connections, waiting for it with each poller backend in turn.  It
+ * counts the syscalls issued on the receiving side the same way readwrite
+ * does: a wait per loop iteration, registration updates and reads.  Idle
+ * connections can be added to show the cost of pollers that scan every fd.
+ *
+ * One line of key=value pairs is printed per backend.
+ */
+
+static const char *backend_names[] = {
+	"select", "poll", "epoll", "epoll-et", NULL
+};
+
+static int nconns = 4;
+static int nidle = 0;
+static size_t megabytes = 256;
+static size_t read_size = 8192;
+
+
+static void make_pair(int listener, const struct sockaddr_in *sin, int *fds);
+static void writer(const int *fds, int n, size_t total);
+static int run(const char *backend);
+
+
+
+const char *get_program_name(void)
+{
+	return "poller_bench";
+}
+
+
+
+int main(int argc, char **argv)
+{
+	int c, i, err = 0;
+
+	while ((c = getopt(argc, argv, "c:i:m:b:")) >= 0) {
+		switch (c) {
+		case 'c':
+			if (safe_atoi(optarg, &nconns) || nconns <= 0)
+				fatal("invalid connection count");
+			break;
+		case 'i':
+			if (safe_atoi(optarg, &nidle) || nidle < 0)
+				fatal("invalid idle connection count");
+			break;
+		case 'm':
+			if (safe_atoi(optarg, &i) || i <= 0)
+				fatal("invalid size");
+			megabytes = i;
+			break;
+		case 'b':
+			if (safe_atoi(optarg, &i) || i <= 0)
+				fatal("invalid read size");
+			read_size = i;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c conns] [-i idle] "
+			        "[-m megabytes] [-b readsize] [backend...]\n",
+			        get_program_name());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (optind < argc) {
+		for (i = optind; i < argc; ++i)
+			err |= run(argv[i]);
+	} else {
+		for (i = 0; backend_names[i] != NULL; ++i)
+			err |= run(backend_names[i]);
+	}
+
+	return (err)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+static int run(const char *backend)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int listener, i, fd, active, rr;
+	int total = nconns + nidle;
+	int (*pairs)[2];
+	poller_t poller;
+	pid_t pid;
+	char *buf;
+	unsigned long reads = 0, syscalls;
+	unsigned long long bytes = 0;
+	struct timeval start, end;
+	double secs, mb;
+
+	if (poller_set_default(backend) != 0) {
+		printf("backend=%s unsupported\n", backend);
+		return 0;
+	}
+
+	listener = socket(PF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listener < 0 ||
+	    bind(listener, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(listener, SOMAXCONN) != 0 ||
+	    getsockname(listener, (struct sockaddr *)&sin, &len) != 0)
+		fatal("cannot listen on loopback: %s", strerror(errno));
+
+	/* pairs[i][0] is the receiving end, pairs[i][1] the sending end */
+	pairs = xmalloc(total * sizeof(*pairs));
+	for (i = 0; i < total; ++i)
+		make_pair(listener, &sin, pairs[i]);
+	close(listener);
+
+	if ((pid = fork()) < 0)
+		fatal("fork failed: %s", strerror(errno));
+	if (pid == 0) {
+		int *out = xmalloc(nconns * sizeof(int));
+		for (i = 0; i < total; ++i) {
+			close(pairs[i][0]);
+			if (i < nconns)
+				out[i] = pairs[i][1];
+		}
+		writer(out, nconns, megabytes << 20);
+		_exit(EXIT_SUCCESS);
+	}
+
+	for (i = 0; i < nconns; ++i)
+		close(pairs[i][1]);
+
+	buf = xmalloc(read_size);
+	poller_init(&poller);
+	for (i = 0; i < total; ++i)
+		nonblock(pairs[i][0]);
+
+	gettimeofday(&start, NULL);
+
+	for (active = nconns; active > 0;) {
+		/* like readwrite, the registrations are refreshed every
+		 * iteration - persistent backends only issue a syscall
+		 * when they change */
+		for (i = 0; i < total; ++i)
+			if (pairs[i][0] >= 0)
+				poller_set(&poller, pairs[i][0], POLLER_READ);
+
+		rr = poller_wait(&poller, NULL);
+		if (rr < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("%s error: %s", poller_name(&poller),
+			      strerror(errno));
+		}
+
+		for (i = 0; i < total; ++i) {
+			fd = pairs[i][0];
+			if (fd < 0 || !(poller_revents(&poller, fd) & POLLER_READ))
+				continue;
+
+			rr = read(fd, buf, read_size);
+			reads++;
+			if (rr > 0) {
+				bytes += rr;
+			} else if (rr < 0 && errno == EAGAIN) {
+				poller_clear(&poller, fd, POLLER_READ);
+			} else if (rr < 0) {
+				fatal("read error: %s", strerror(errno));
+			} else {
+				poller_del(&poller, fd);
+				close(fd);
+				pairs[i][0] = -1;
+				active--;
+			}
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	waitpid(pid, NULL, 0);
+
+	timersub(&end, &start, &end);
+	secs = end.tv_sec + end.tv_usec / 1e6;
+	mb = bytes / 1048576.0;
+	syscalls = poller.waits + poller.updates + reads;
+
+	printf("backend=%s conns=%d idle=%d read_size=%lu bytes=%llu "
+	       "seconds=%.3f waits=%lu updates=%lu reads=%lu "
+	       "syscalls_per_mb=%.1f mb_per_sec=%.1f\n",
+	       backend, nconns, nidle, (unsigned long)read_size, bytes,
+	       secs, poller.waits, poller.updates, reads,
+	       (mb > 0)? syscalls / mb : 0.0, (secs > 0)? mb / secs : 0.0);
+
+	for (i = nconns; i < total; ++i) {
+		poller_del(&poller, pairs[i][0]);
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	poller_destroy(&poller);
+	free(pairs);
+	free(buf);
+
+	return (bytes == (unsigned long long)megabytes << 20)? 0 : -1;
+}
+
+
+
+static void make_pair(int listener, const struct sockaddr_in *sin, int *fds)
+{
+	fds[1] = socket(PF_INET, SOCK_STREAM, 0);
+	if (fds[1] < 0 ||
+	    connect(fds[1], (const struct sockaddr *)sin, sizeof(*sin)) != 0)
+		fatal("cannot connect on loopback: %s", strerror(errno));
+	fds[0] = accept(listener, NULL, NULL);
+	if (fds[0] < 0)
+		fatal("accept failed: %s", strerror(errno));
+}
+
+
+
+/* spread total bytes over the connections, a chunk at a time */
+static void writer(const int *fds, int n, size_t total)
+{
+	static char chunk[65536];
+	size_t per_conn = total / n, done, len;
+	int i;
+
+	memset(chunk, 'x', sizeof(chunk));
+	for (done = 0; done < per_conn; done += len) {
+		len = MIN(sizeof(chunk), per_conn - done);
+		for (i = 0; i < n; ++i) {
+			if (write(fds[i], chunk, len) != (ssize_t)len)
+				fatal("write error: %s", strerror(errno));
+		}
+	}
+	for (i = 0; i < n; ++i)
+		close(fds[i]);
+}
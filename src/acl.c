@@ -0,0 +1,391 @@
+/*
+ *  acl.c - compiled access lists for incoming connections - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "acl.h"
+#include "misc.h"
+#include "netsupport.h"
+#include "resolver.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+
+/* the port bitmap has a bit for each port from 0 to 65535 */
+#define PORT_BITMAP_SIZE	(65536 / 8)
+/* initial number of nodes allocated for each trie */
+#define TRIE_INITIAL_SIZE	16
+
+
+static int add_host(acl_t *acl, const char *host,
+		const struct addrinfo *hints);
+static int add_prefix(acl_t *acl, char *entry);
+static int add_address(acl_t *acl, const struct sockaddr *sa, int len);
+static int address_key(const struct sockaddr *sa,
+		const unsigned char **addr, int *bits);
+static void trie_init(acl_trie_t *t);
+static void trie_insert(acl_trie_t *t, const unsigned char *addr, int bits);
+static bool trie_lookup(const acl_trie_t *t,
+		const unsigned char *addr, int bits);
+
+
+
+int acl_compile(acl_t *acl, const char *addresses, const char *services,
+		const struct addrinfo *hints)
+{
+	port_range_t *ranges;
+	char *list, *entry, *next;
+	int nranges, nentries, i, port, err;
+
+	assert(acl != NULL);
+	assert(addresses == NULL || strlen(addresses) > 0);
+	assert(services == NULL || strlen(services) > 0);
+	assert(hints != NULL);
+
+	acl->any_address = (addresses == NULL);
+	trie_init(&(acl->inet));
+	trie_init(&(acl->inet6));
+	acl->ports = NULL;
+
+	/* mark the allowed ports in the bitmap */
+	if (services != NULL) {
+		nranges = parse_port_ranges(services, hints, &ranges);
+		if (nranges < 0) {
+			acl_destroy(acl);
+			return -1;
+		}
+		acl->ports = (unsigned char *)xmalloc(PORT_BITMAP_SIZE);
+		memset(acl->ports, 0, PORT_BITMAP_SIZE);
+		for (i = 0; i < nranges; ++i) {
+			for (port = ranges[i].first;
+			     port <= ranges[i].last; ++port)
+				acl->ports[port >> 3] |= 1 << (port & 7);
+		}
+		free(ranges);
+	}
+
+	if (addresses == NULL)
+		return 0;
+
+	/* start all the names being looked up at once */
+	list = xstrdup(addresses);
+	for (entry = list; entry != NULL; entry = next) {
+		if ((next = strchr(entry, ',')) != NULL)
+			*next = '\0';
+		if (*entry != '\0' && strchr(entry, '/') == NULL)
+			resolver_prefetch(entry, NULL, hints);
+		if (next != NULL)
+			*next++ = ',';
+	}
+
+	/* then add the addresses of each entry to the tries */
+	err = 0;
+	nentries = 0;
+	for (entry = list; entry != NULL && err == 0; entry = next) {
+		if ((next = strchr(entry, ',')) != NULL)
+			*next++ = '\0';
+		if (*entry == '\0')
+			continue;
+
+		if (strchr(entry, '/') != NULL)
+			err = add_prefix(acl, entry);
+		else
+			err = add_host(acl, entry, hints);
+		nentries++;
+	}
+	free(list);
+
+	if (err == 0 && nentries == 0) {
+		warning(_("no addresses given in '%s'"), addresses);
+		err = -1;
+	}
+
+	if (err != 0) {
+		acl_destroy(acl);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+void acl_destroy(acl_t *acl)
+{
+	assert(acl != NULL);
+
+	free(acl->inet.nodes);
+	acl->inet.nodes = NULL;
+	free(acl->inet6.nodes);
+	acl->inet6.nodes = NULL;
+	free(acl->ports);
+	acl->ports = NULL;
+}
+
+
+
+bool acl_allows(const acl_t *acl, const struct sockaddr *sa,
+		socklen_t salen)
+{
+	const unsigned char *addr;
+	int port, bits;
+
+	assert(acl != NULL);
+	assert(sa != NULL);
+	assert(salen > 0);
+	while (0&&salen);
+
+	if (acl->ports != NULL) {
+		port = sockaddr_port(sa);
+		if (port < 0 || (acl->ports[port >> 3] & (1 << (port & 7))) == 0)
+			return false;
+	}
+
+	if (acl->any_address)
+		return true;
+
+	switch (address_key(sa, &addr, &bits)) {
+	case AF_INET:
+		return trie_lookup(&(acl->inet), addr, bits);
+#ifdef ENABLE_IPV6
+	case AF_INET6:
+		return trie_lookup(&(acl->inet6), addr, bits);
+#endif
+	default:
+		return false;
+	}
+}
+
+
+
+/* allow all the addresses of a host */
+static int add_host(acl_t *acl, const char *host,
+		const struct addrinfo *hints)
+{
+	struct addrinfo *res = NULL, *ptr;
+	int err;
+
+	err = getaddrinfo_ex(host, NULL, hints, &res);
+	if (err != 0) {
+		/* some errors just indicate that the host has no addresses
+		 * that could connect, so it allows nothing */
+		if (gai_family_error(err))
+			return 0;
+		warning(_("forward host lookup failed "
+		        "for remote endpoint %s: %s"), host, gai_strerror(err));
+		return -1;
+	}
+
+	/* check the results of getaddrinfo */
+	assert(res != NULL);
+
+	for (ptr = res; ptr != NULL; ptr = ptr->ai_next)
+		add_address(acl, ptr->ai_addr, -1);
+
+	freeaddrinfo_ex(res);
+	return 0;
+}
+
+
+
+/* allow the addresses of an address/length prefix */
+static int add_prefix(acl_t *acl, char *entry)
+{
+	struct addrinfo hints, *res = NULL;
+	char *sep, *prefix;
+	size_t len;
+	int bits, err;
+
+	sep = strrchr(entry, '/');
+	assert(sep != NULL);
+	*sep = '\0';
+
+	/* IPv6 prefixes may be enclosed in brackets */
+	prefix = entry;
+	len = strlen(prefix);
+	if (len > 2 && prefix[0] == '[' && prefix[len - 1] == ']') {
+		prefix[len - 1] = '\0';
+		prefix++;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	err = getaddrinfo_ex(prefix, NULL, &hints, &res);
+	if (err == 0) {
+		/* -1 is reserved for single addresses */
+		err = safe_atoi(sep + 1, &bits);
+		if (err == 0 && bits < 0)
+			err = -1;
+		if (err == 0)
+			err = add_address(acl, res->ai_addr, bits);
+		freeaddrinfo_ex(res);
+	}
+
+	/* restore the entry for the error message */
+	if (prefix != entry)
+		prefix[len - 2] = ']';
+	*sep = '/';
+
+	if (err != 0) {
+		warning(_("invalid address prefix '%s'"), entry);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/* allow the addresses sharing the first len bits with sa, or just sa if len
+ * is -1.  Returns -1 if len is too long for the address */
+static int add_address(acl_t *acl, const struct sockaddr *sa, int len)
+{
+	const unsigned char *addr;
+	int bits;
+
+	switch (address_key(sa, &addr, &bits)) {
+	case AF_INET:
+		/* IPv4 mapped prefixes cover the IPv4 addresses, so they must
+		 * be long enough to reach into the IPv4 part */
+		if (len >= 0 && sa->sa_family != AF_INET) {
+			if (len < 128 - 32)
+				return -1;
+			len -= 128 - 32;
+		}
+		if (len < -1 || len > bits)
+			return -1;
+		trie_insert(&(acl->inet), addr, (len < 0)? bits : len);
+		return 0;
+#ifdef ENABLE_IPV6
+	case AF_INET6:
+		if (len < -1 || len > bits)
+			return -1;
+		trie_insert(&(acl->inet6), addr, (len < 0)? bits : len);
+		return 0;
+#endif
+	default:
+		/* other families can't connect */
+		return 0;
+	}
+}
+
+
+
+/* the family of sa and the address bytes (and the number of bits in them)
+ * to find in the trie for that family.  IPv4 mapped IPv6 addresses are
+ * treated as the IPv4 address they map.  Returns -1 for other families */
+static int address_key(const struct sockaddr *sa,
+		const unsigned char **addr, int *bits)
+{
+#ifdef ENABLE_IPV6
+	const struct in6_addr *a6;
+#endif
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		*addr = (const unsigned char *)
+			&(((const struct sockaddr_in *)sa)->sin_addr);
+		*bits = 32;
+		return AF_INET;
+#ifdef ENABLE_IPV6
+	case AF_INET6:
+		a6 = &(((const struct sockaddr_in6 *)sa)->sin6_addr);
+		if (IN6_IS_ADDR_V4MAPPED(a6)) {
+			*addr = &(a6->s6_addr[12]);
+			*bits = 32;
+			return AF_INET;
+		}
+		*addr = a6->s6_addr;
+		*bits = 128;
+		return AF_INET6;
+#endif
+	default:
+		return -1;
+	}
+}
+
+
+
+static void trie_init(acl_trie_t *t)
+{
+	t->size = TRIE_INITIAL_SIZE;
+	t->nodes = (acl_node_t *)xmalloc(t->size * sizeof(acl_node_t));
+	t->nnodes = 1;
+	t->nodes[0].child[0] = t->nodes[0].child[1] = 0;
+	t->nodes[0].allowed = false;
+}
+
+
+
+/* the bit of addr at position i, counting from the most significant */
+#define addr_bit(ADDR, I)	(((ADDR)[(I) >> 3] >> (7 - ((I) & 7))) & 1)
+
+/* allow the addresses with the first bits of addr as their prefix */
+static void trie_insert(acl_trie_t *t, const unsigned char *addr, int bits)
+{
+	int node = 0, child, bit, i;
+
+	for (i = 0; i < bits; ++i) {
+		/* a shorter prefix already covers it */
+		if (t->nodes[node].allowed)
+			return;
+
+		bit = addr_bit(addr, i);
+		child = t->nodes[node].child[bit];
+		if (child == 0) {
+			if (t->nnodes == t->size) {
+				t->size *= 2;
+				t->nodes = (acl_node_t *)xrealloc(t->nodes,
+				           t->size * sizeof(acl_node_t));
+			}
+			child = t->nnodes++;
+			t->nodes[child].child[0] = 0;
+			t->nodes[child].child[1] = 0;
+			t->nodes[child].allowed = false;
+			t->nodes[node].child[bit] = child;
+		}
+		node = child;
+	}
+
+	/* any longer prefixes beneath it are now redundant */
+	t->nodes[node].allowed = true;
+	t->nodes[node].child[0] = t->nodes[node].child[1] = 0;
+}
+
+
+
+/* returns true if an allowed prefix matches addr, which takes at most one
+ * step per bit of the address */
+static bool trie_lookup(const acl_trie_t *t,
+		const unsigned char *addr, int bits)
+{
+	int node = 0, i;
+
+	for (i = 0; i < bits; ++i) {
+		if (t->nodes[node].allowed)
+			return true;
+		node = t->nodes[node].child[addr_bit(addr, i)];
+		if (node == 0)
+			return false;
+	}
+
+	return t->nodes[node].allowed;
+}
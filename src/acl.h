@@ -0,0 +1,64 @@
+/*
+ *  acl.h - compiled access lists for incoming connections - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef ACL_H
+#define ACL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* a node of a binary trie of address prefixes, branching on one bit of the
+ * address at each level */
+typedef struct acl_node {
+	int child[2];   /* index of the child for each bit value, 0 if none */
+	bool allowed;   /* addresses with this prefix are allowed */
+} acl_node_t;
+
+typedef struct acl_trie {
+	acl_node_t *nodes;  /* nodes[0] is the root */
+	int nnodes;
+	int size;           /* allocated size of nodes */
+} acl_trie_t;
+
+/* the remote addresses and ports that connections are allowed from,
+ * compiled so that checking a connection needs no lookups */
+typedef struct acl {
+	bool any_address;        /* no addresses were specified */
+	acl_trie_t inet;
+	acl_trie_t inet6;
+	unsigned char *ports;    /* bitmap of allowed ports, NULL if any */
+} acl_t;
+
+/* compile an access list from a comma separated list of addresses (names,
+ * numeric addresses or address/length prefixes) and a comma separated list
+ * of ports (or lo-hi ranges of them).  Either list may be NULL to allow
+ * any address or port.  Names are looked up as per hints.  Returns 0 on
+ * success, or -1 (having output an error) if the lists are invalid */
+int acl_compile(acl_t *acl, const char *addresses, const char *services,
+		const struct addrinfo *hints);
+void acl_destroy(acl_t *acl);
+
+/* returns true if connections from sa are allowed */
+bool acl_allows(const acl_t *acl, const struct sockaddr *sa,
+		socklen_t salen);
+
+#endif/*ACL_H*/
@@ -23,6 +23,10 @@
 #include "afindep.h"
 #include "misc.h"
 #include "netsupport.h"
+#include "resolver.h"
+#include "acl.h"
+#include "poller.h"
+#include "clock.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -31,17 +35,129 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <limits.h>
-
-
+#include <sys/resource.h>
+
+
+/* a connection attempt in progress */
+typedef struct attempt {
+	int fd;
+	const struct addrinfo *ai;
+	struct timeval deadline;  /* when it times out, if there's a timeout */
+} attempt_t;
+
+/* the local addresses and ports that connections are made from (-s and -p
+ * in connect mode).  Each connection starts from the next combination of
+ * them in turn, beginning at a random one so that separate processes
+ * spread out too */
+typedef struct source_set {
+	struct addrinfo *addrs;  /* the addresses (with port 0), or NULL */
+	port_range_t *ranges;    /* the ports, or NULL to leave it to the
+	                          * kernel */
+	int nranges;
+	unsigned long nports;    /* total number of ports in the ranges */
+	unsigned long next;      /* the next combination to try */
+} source_set_t;
+
+/* the most combinations of source address and port tried for one attempt
+ * before giving up on it */
+static const int SOURCE_MAX_TRIES = 64;
+
+/* how long a connection attempt is given before one to the next address is
+ * started alongside it (the "Connection Attempt Delay" of RFC 8305) */
+static const struct timeval CONNECTION_ATTEMPT_DELAY = { 0, 250000 };
+
+
+/* the position of a scan in its hosts, their addresses and the ports */
+typedef struct scan_cursor {
+	const char * const *hosts;
+	int nhosts;
+	int host;                  /* the next host to be looked up */
+	struct addrinfo **res;     /* lookup results for each host */
+	const struct addrinfo *ai; /* the address being scanned */
+	port_range_t *ranges;
+	int nranges;
+	int range;                 /* the range being scanned */
+	int port;                  /* the next port in that range */
+} scan_cursor_t;
+
+/* a scan connection attempt, linked into a queue in the order they were
+ * started (which, as they are all given the same timeout, is the order
+ * they time out in) or into the list of free attempts */
+typedef struct scan_attempt {
+	int fd;
+	struct addrinfo ai;
+	struct sockaddr_storage addr;
+	struct timeval deadline;
+	int prev;
+	int next;
+} scan_attempt_t;
+
+typedef struct scan_queue {
+	scan_attempt_t *attempts;
+	int head;        /* the oldest attempt in flight, or -1 */
+	int tail;        /* the newest attempt in flight, or -1 */
+	int free;        /* the first free attempt, or -1 */
+	int nactive;     /* number of attempts in flight */
+	int *by_fd;      /* index of the attempt for each fd */
+	int by_fd_size;
+} scan_queue_t;
+
+/* file descriptors left for other uses when the scan concurrency is limited
+ * by the number that can be open */
+static const int SCAN_FD_RESERVE = 16;
+/* the number of hosts looked up ahead of the one being scanned */
+static const int SCAN_LOOKUP_AHEAD = 8;
+
+/* the most connections accepted from one listening socket before moving on
+ * to the next ready one, so that a busy socket can't starve the others */
+static const int ACCEPT_BATCH = 16;
+
+/* results of accept_connection */
+#define ACCEPT_NONE	0   /* nothing was pending */
+#define ACCEPT_REFUSED	1   /* the access list refused the connection */
+#define ACCEPT_PASSED	2   /* the connection was passed to the callback */
+
+
+static void prefetch_source(const struct addrinfo *hints,
+		const char *local_address);
+static int lookup_source(const struct addrinfo *hints,
+		const char *local_address, const char *local_service,
+		source_set_t *src);
+static void free_source(source_set_t *src);
+static void source_hints(const struct addrinfo *hints,
+		struct addrinfo *src_hints);
+static int source_count(const source_set_t *src, int family);
+static int bind_source(int fd, int family, source_set_t *src);
+static int start_attempt(const struct addrinfo *ai,
+		const struct addrinfo *hints, source_set_t *src,
+		set_sockopt_handler_t set_sockopt_handler, void *hdata,
+		bool racing, bool *connected);
+static void report_failure(const struct addrinfo *ai,
+		const struct addrinfo *hints);
+static void time_left(const struct timeval *deadline, struct timeval *left);
+static bool next_target(scan_cursor_t *c, const struct addrinfo *hints,
+		struct addrinfo *ai, struct sockaddr_storage *addr);
+static int limit_concurrency(int concurrency, const poller_t *poller);
+static int queue_add(scan_queue_t *q, int fd);
+static void queue_remove(scan_queue_t *q, poller_t *poller, int i);
+static bool connected_to_self(int fd, const struct addrinfo *ai);
+static int accept_connection(int fd, int socktype, poller_t *poller,
+		const acl_t *acl, const struct addrinfo *hints,
+		listen_callback_t callback, void *cdata);
+static int receive_datagram(int fd, poller_t *poller, const acl_t *acl,
+		listen_datagram_t callback, void *cdata);
+static void report_accepts(unsigned long accepted, unsigned long wakeups,
+		int most_accepted);
+static void report_open(const struct addrinfo *ai,
+		const struct addrinfo *hints);
+static struct addrinfo *interleave_families(struct addrinfo *ai);
 static bool skip_address(const struct addrinfo *ai);
 #ifdef ENABLE_IPV6
 static struct addrinfo *order_ipv6_first(struct addrinfo *ai);
 #endif
-static bool is_allowed(const struct sockaddr *sa, socklen_t salen,
-		const struct addrinfo *hints,
-		const char *address, const char *service);
 
 
 
@@ -51,9 +167,15 @@ int afindep_connect(struct addrinfo hints,
 		set_sockopt_handler_t set_sockopt_handler, void *hdata,
 		time_t timeout, int *rt_socktype)
 {
-	int err, fd = -1;
-	struct addrinfo *res = NULL, *ptr;
-	bool connect_attempted = false;
+	int err, fd = -1, n, ncandidates, i, j, nattempts, optval;
+	struct addrinfo *res = NULL, *ptr, *ai;
+	source_set_t src;
+	const struct addrinfo *winner = NULL;
+	bool connect_attempted = false, connected, unbindable = true;
+	attempt_t *attempts;
+	poller_t poller;
+	struct timeval next_start, tv, left, *tvp;
+	socklen_t len;
 	char name_buf[AI_STR_SIZE];
 
 	/* make sure arguments are valid and preconditions are respected */
@@ -68,39 +190,473 @@ int afindep_connect(struct addrinfo hints,
 	hints.ai_flags |= AI_ADDRCONFIG;
 #endif
 
+	/* look up the source addresses in the background, while the remote
+	 * address is looked up */
+	prefetch_source(&hints, local_address);
+
 	/* get the address of the remote end of the connection */
 	err = getaddrinfo_ex(remote_address, remote_service, &hints, &res);
 	if (err != 0) {
 		warning(_("forward host lookup failed "
-		        "for remote endpoint %s: %s"), gai_strerror(err));
-		return -1;
+		        "for remote endpoint %s: %s"),
+		        remote_address, gai_strerror(err));
+		/* an unknown name or service is taken to be a mistake, but
+		 * a failure to get an answer may go away */
+		return (err == EAI_NONAME || err == EAI_SERVICE ||
+		        err == EAI_FAMILY || err == EAI_SOCKTYPE)? -2 : -1;
 	}
 
 	/* check the results of getaddrinfo */
 	assert(res != NULL);
 
-	/* try connecting to any of the addresses returned by getaddrinfo */
+	/* and the sources, once for all the attempts */
+	if (lookup_source(&hints, local_address, local_service, &src) != 0) {
+		freeaddrinfo_ex(res);
+		return -2;
+	}
+
+	/* alternate between the address families, starting with the one
+	 * getaddrinfo prefers, so that a broken path for one family is soon
+	 * raced against the other */
+	res = interleave_families(res);
+
+	n = ncandidates = 0;
 	for (ptr = res; ptr != NULL; ptr = ptr->ai_next) {
+		n++;
+		if (skip_address(ptr) == false)
+			ncandidates++;
+	}
+	attempts = (attempt_t *)xmalloc(n * sizeof(attempt_t));
+	nattempts = 0;
+	poller_init(&poller);
+
+	/* start an attempt on each address in turn, allowing each a head
+	 * start of CONNECTION_ATTEMPT_DELAY over the next one, until one of
+	 * them connects */
+	clock_update();
+	next_start = *clock_now();
+	ptr = res;
+	for (;;) {
+		if (ptr != NULL && (nattempts == 0 ||
+		    !timercmp(clock_now(), &next_start, <)))
+		{
+			ai = ptr;
+			ptr = ptr->ai_next;
 
-		/* only accept results we can handle */
-		if (skip_address(ptr) == true) continue;
+			/* only accept results we can handle */
+			if (skip_address(ai) == true) continue;
+
+			/* we are going to try to connect to this address */
+			connect_attempted = true;
+
+			fd = start_attempt(ai, &hints, &src,
+			                   set_sockopt_handler, hdata,
+			                   (ncandidates > 1), &connected);
+			if (fd == -2)
+				break;
+			if (fd != -3)
+				unbindable = false;
+			/* on to the next address straight away */
+			if (fd < 0)
+				continue;
+			if (connected) {
+				winner = ai;
+				break;
+			}
+
+			attempts[nattempts].fd = fd;
+			attempts[nattempts].ai = ai;
+			if (timeout > 0) {
+				tv.tv_sec = timeout;
+				tv.tv_usec = 0;
+				timeradd(clock_now(), &tv,
+				         &(attempts[nattempts].deadline));
+			}
+			nattempts++;
+			poller_set(&poller, fd, POLLER_WRITE);
+			timeradd(clock_now(), &CONNECTION_ATTEMPT_DELAY,
+			         &next_start);
+			fd = -1;
+			continue;
+		}
+
+		/* all possibilities have been exhausted */
+		if (nattempts == 0)
+			break;
+
+		/* wait for an attempt to complete, for the next one to be
+		 * due, or for the earliest timeout */
+		tvp = NULL;
+		if (ptr != NULL) {
+			time_left(&next_start, &tv);
+			tvp = &tv;
+		}
+		for (i = 0; timeout > 0 && i < nattempts; ++i) {
+			time_left(&(attempts[i].deadline), &left);
+			if (tvp == NULL || timercmp(&left, tvp, <)) {
+				tv = left;
+				tvp = &tv;
+			}
+		}
+
+		err = poller_wait(&poller, tvp);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			warning("%s error: %s", poller_name(&poller),
+			        strerror(errno));
+			break;
+		}
+
+		/* find out how the attempts that are ready went */
+		for (i = 0; i < poller_nready(&poller); ++i) {
+			for (j = 0; j < nattempts; ++j) {
+				if (attempts[j].fd == poller_ready_fd(&poller, i))
+					break;
+			}
+			assert(j < nattempts);
+
+			len = sizeof(optval);
+			if (getsockopt(attempts[j].fd, SOL_SOCKET, SO_ERROR,
+			               &optval, &len) != 0)
+				optval = errno;
+			if (optval == 0) {
+				fd = attempts[j].fd;
+				winner = attempts[j].ai;
+				poller_del(&poller, fd);
+				attempts[j] = attempts[--nattempts];
+				break;
+			}
+
+			/* a failure brings the next attempt forward */
+			errno = optval;
+			report_failure(attempts[j].ai, &hints);
+			poller_del(&poller, attempts[j].fd);
+			close(attempts[j].fd);
+			attempts[j] = attempts[--nattempts];
+			next_start = *clock_now();
+		}
+		if (winner != NULL)
+			break;
+
+		/* drop the attempts that have timed out */
+		for (i = 0; timeout > 0 && i < nattempts; ) {
+			if (timercmp(&(attempts[i].deadline), clock_now(), >)) {
+				++i;
+				continue;
+			}
+			errno = ETIMEDOUT;
+			report_failure(attempts[i].ai, &hints);
+			poller_del(&poller, attempts[i].fd);
+			close(attempts[i].fd);
+			attempts[i] = attempts[--nattempts];
+		}
+	}
+
+	/* abandon the attempts that lost the race */
+	for (i = 0; i < nattempts; ++i) {
+		poller_del(&poller, attempts[i].fd);
+		close(attempts[i].fd);
+	}
+	poller_destroy(&poller);
+	free(attempts);
+
+	/* if the connection failed, output an error message */
+	if (winner == NULL) {
+		/* if a connection was attempted, an error has been output */
+		if (fd == -2) {
+			/* the socket couldn't be created */
+		} else if (connect_attempted == false) {
+			warning(_("forward lookup returned "
+			        "no useful socket types"));
+			fd = -2;
+		} else if (unbindable) {
+			warning(_("unable to bind to source addr/port "
+			        "when connecting to address %s, service %s"),
+			        remote_address, remote_service);
+			fd = -2;
+		} else {
+			warning(_("unable to connect "
+			        "to address %s, service %s"), 
+			        remote_address, remote_service);
+			fd = -1;
+		}
+		free_source(&src);
+		freeaddrinfo_ex(res);
+		return fd;
+	}
+
+	assert(fd >= 0);
+
+	/* let the user know the connection has been established */
+	if (verbose_mode()) {
+		xgetnameinfo_ex(winner->ai_addr, winner->ai_addrlen,
+		                name_buf, sizeof(name_buf),
+		                (hints.ai_flags & AI_NUMERICHOST));
+		warning(_("%s open"), name_buf);
+	}
 
-		/* we are going to try to connect to this address */
-		connect_attempted = true;
+	/* return the socktype */
+	if (rt_socktype != NULL)
+		*rt_socktype = winner->ai_socktype;
+
+	/* cleanup addrinfo structures */
+	free_source(&src);
+	freeaddrinfo_ex(res);
+
+	return fd;
+}
+
+
+
+/* start looking up each of a comma separated list of source addresses */
+static void prefetch_source(const struct addrinfo *hints,
+		const char *local_address)
+{
+	struct addrinfo src_hints;
+	char *list, *entry, *next;
+
+	if (local_address == NULL)
+		return;
+
+	source_hints(hints, &src_hints);
+	list = xstrdup(local_address);
+	for (entry = list; entry != NULL; entry = next) {
+		if ((next = strchr(entry, ',')) != NULL)
+			*next++ = '\0';
+		if (*entry != '\0')
+			resolver_prefetch(entry, NULL, &src_hints);
+	}
+	free(list);
+}
 
+
+
+/* look up the sources for connections made as per hints, from a comma
+ * separated list of local addresses and a list of local ports and lo-hi
+ * ranges (either of which may be NULL).  Returns 0 on success (with no
+ * addresses in src if there is no source to bind to) or -1 if the lookup
+ * failed */
+static int lookup_source(const struct addrinfo *hints,
+		const char *local_address, const char *local_service,
+		source_set_t *src)
+{
+	struct addrinfo src_hints, *res, **tail;
+	char *list, *entry, *next;
+	int i, err;
+
+	memset(src, 0, sizeof(source_set_t));
+	if (local_address == NULL && local_service == NULL)
+		return 0;
+
+	if (local_service != NULL) {
+		src->nranges = parse_port_ranges(local_service, hints,
+		                                 &(src->ranges));
+		if (src->nranges < 0) {
+			src->ranges = NULL;
+			return -1;
+		}
+		for (i = 0; i < src->nranges; ++i) {
+			src->nports += src->ranges[i].last -
+			               src->ranges[i].first + 1;
+		}
+	}
+
+	/* the results for each address are appended to the list, and just
+	 * the ports given binds to the wildcard address of each family */
+	source_hints(hints, &src_hints);
+	list = xstrdup(local_address? local_address : "");
+	tail = &(src->addrs);
+	err = 0;
+	for (entry = list; entry != NULL && err == 0; entry = next) {
+		if ((next = strchr(entry, ',')) != NULL)
+			*next++ = '\0';
+		if (*entry == '\0' && local_address != NULL)
+			continue;
+
+		res = NULL;
+		err = getaddrinfo_ex((*entry != '\0')? entry : NULL,
+		                     (*entry != '\0')? NULL : "0",
+		                     &src_hints, &res);
+		if (err != 0 && gai_family_error(err) &&
+		    local_address != NULL && strchr(local_address, ',') != NULL)
+		{
+			/* a listed address of another family isn't used */
+			err = 0;
+			continue;
+		}
+		if (err != 0) {
+			warning(_("forward host lookup failed "
+			        "for local endpoint %s (%s): %s"),
+			        (*entry != '\0')? entry : _("[unspecified]"),
+			        local_service? local_service :
+			                       _("[unspecified]"),
+			        gai_strerror(err));
+			break;
+		}
+
+		/* check the results of getaddrinfo */
+		assert(res != NULL);
+
+		*tail = res;
+		while (*tail != NULL)
+			tail = &((*tail)->ai_next);
+	}
+	free(list);
+
+	if (err == 0 && src->addrs == NULL) {
+		warning(_("no addresses given in '%s'"), local_address);
+		err = -1;
+	}
+	if (err != 0) {
+		free_source(src);
+		return -1;
+	}
+
+	/* start at a different combination in each process */
+	src->next = (unsigned long)random() ^ (unsigned long)getpid();
+	return 0;
+}
+
+
+
+static void free_source(source_set_t *src)
+{
+	freeaddrinfo_ex(src->addrs);
+	src->addrs = NULL;
+	free(src->ranges);
+	src->ranges = NULL;
+}
+
+
+
+/* the hints for looking up the source address of connections made as per
+ * hints (a missing source address is the wildcard address) */
+static void source_hints(const struct addrinfo *hints,
+		struct addrinfo *src_hints)
+{
+	memset(src_hints, 0, sizeof(struct addrinfo));
+	src_hints->ai_family   = hints->ai_family;
+	src_hints->ai_socktype = hints->ai_socktype;
+	src_hints->ai_protocol = hints->ai_protocol;
+	src_hints->ai_flags    = hints->ai_flags | AI_PASSIVE;
+}
+
+
+
+/* the number of combinations of source address and port for connections
+ * to the family, or 0 if there are no sources to bind to */
+static int source_count(const source_set_t *src, int family)
+{
+	const struct addrinfo *ptr;
+	unsigned long n = 0;
+
+	for (ptr = src->addrs; ptr != NULL; ptr = ptr->ai_next) {
+		if (ptr->ai_family == family)
+			n++;
+	}
+	if (src->ranges != NULL)
+		n *= src->nports;
+
+	return (int)MIN(n, (unsigned long)INT_MAX);
+}
+
+
+
+/* bind fd to the next combination of source address (of the family) and
+ * port.  Without ports, the kernel is left to choose the port when the
+ * socket connects, so that it only has to be unique for the destination.
+ * Returns as bind(2) */
+static int bind_source(int fd, int family, source_set_t *src)
+{
+	const struct addrinfo *ptr;
+	struct sockaddr_storage addr;
+	unsigned long n, c, p;
+	int i;
+
+	for (n = 0, ptr = src->addrs; ptr != NULL; ptr = ptr->ai_next) {
+		if (ptr->ai_family == family)
+			n++;
+	}
+	assert(n > 0);
+
+	/* the addresses are taken in turn, then the ports */
+	c = src->next++;
+	for (ptr = src->addrs, p = c % n; ; ptr = ptr->ai_next) {
+		if (ptr->ai_family == family && p-- == 0)
+			break;
+	}
+	memcpy(&addr, ptr->ai_addr, ptr->ai_addrlen);
+
+	if (src->ranges != NULL) {
+		p = (c / n) % src->nports;
+		for (i = 0; p > (unsigned long)(src->ranges[i].last -
+		                                 src->ranges[i].first); ++i)
+			p -= src->ranges[i].last - src->ranges[i].first + 1;
+		sockaddr_set_port((struct sockaddr *)&addr,
+		                  src->ranges[i].first + (int)p);
+	} else {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		int on = 1;
+		/* not supported for some sockets - it is only an
+		 * optimisation */
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+		           &on, sizeof(on));
+#endif
+	}
+
+	return bind(fd, (struct sockaddr *)&addr, ptr->ai_addrlen);
+}
+
+
+
+/* create a socket for ai, bind it to the next of the sources in src (of the
+ * same family) if there are any, and start connecting it without blocking.
+ * If the source is in use, other sources are tried.  racing is set when
+ * the attempt may race attempts on other addresses.  Returns the socket,
+ * with connected set if the connection completed straight away, -1 if the
+ * address should be passed over (having reported why in verbose mode), -2
+ * if the socket couldn't be created, or -3 if it couldn't be bound to a
+ * source in a way that won't change (ie. not just because it is in use) */
+static int start_attempt(const struct addrinfo *ai,
+		const struct addrinfo *hints, source_set_t *src,
+		set_sockopt_handler_t set_sockopt_handler, void *hdata,
+		bool racing, bool *connected)
+{
+	int err, fd, tries, ntries;
+	char name_buf[AI_STR_SIZE];
+
+	*connected = false;
+
+	ntries = MIN(source_count(src, ai->ai_family), SOURCE_MAX_TRIES);
+	if (ntries == 0 && src->addrs != NULL) {
+		/* there is no source address of this family */
+		if (verbose_mode()) {
+			xgetnameinfo_ex(ai->ai_addr, ai->ai_addrlen,
+			        name_buf, sizeof(name_buf),
+			        (hints->ai_flags & AI_NUMERICHOST));
+			warning(_("bind to source addr/port "
+			     "failed when connecting to "
+			     "%s: %s"), name_buf,
+			     strerror(EAFNOSUPPORT));
+		}
+		return -3;
+	}
+
+	for (tries = 1; ; ++tries) {
 		/* create the socket */
-		fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (fd < 0) {
 			/* ignore this address if it is not supported */
-			if (!unsupported_sock_error(errno))
-				continue;
+			if (unsupported_sock_error(errno))
+				return -1;
 			warning("cannot create the socket: %s",
-				strerror(errno));
-			return -1;
+			        strerror(errno));
+			return -2;
 		}
-		
+
 #if defined(ENABLE_IPV6) && defined(IPV6_V6ONLY)
-		if (ptr->ai_family == PF_INET6) {
+		if (ai->ai_family == PF_INET6) {
 			int on = 1;
 			/* in case of error, we will go on anyway... */
 			err = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
@@ -113,125 +669,451 @@ int afindep_connect(struct addrinfo hints,
 		if (set_sockopt_handler != NULL)
 			set_sockopt_handler(fd, hdata);
 
-		/* setup name_buf if we're in verbose mode */
-		if (verbose_mode())
-			xgetnameinfo_ex(ptr->ai_addr, ptr->ai_addrlen, 
-			                name_buf, sizeof(name_buf),
-			                (hints.ai_flags & AI_NUMERICHOST));
-					
+#ifdef TCP_FASTOPEN_CONNECT
+		/* a fast open connect completes at once, before any SYN is
+		 * sent, so it would win the race whether or not the address
+		 * can be reached */
+		if (racing && ai->ai_socktype == SOCK_STREAM) {
+			int off = 0;
+			/* fails harmlessly if this socket does not use TCP */
+			setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+			           &off, sizeof(off));
+		}
+#endif
+
 		/* setup local source address and/or service */
-		if (local_address != NULL || local_service != NULL) {
-			struct addrinfo src_hints, *src_res = NULL, *src_ptr;
-		
-			/* setup hints structure to be passed to getaddrinfo */
-			memset(&src_hints, 0, sizeof(src_hints));
-			src_hints.ai_family   = ptr->ai_family;
-			src_hints.ai_flags    = AI_PASSIVE;
-			src_hints.ai_socktype = ptr->ai_socktype;
-			src_hints.ai_protocol = ptr->ai_protocol;
-			src_hints.ai_flags    = hints.ai_flags;
-
-			/* get the local IP address of the connection */
-			err = getaddrinfo_ex(local_address, local_service,
-			                  &src_hints, &src_res);
-			if (err != 0) {
-				if (verbose_mode()) {
-					warning(_("lookup of source addr/port "
-					     "failed when connecting to "
-					     "%s: %s"), name_buf,
-					     gai_strerror(err));
-				}
-				close(fd);
-				fd = -1;
+		if (ntries > 0 && bind_source(fd, ai->ai_family, src) != 0) {
+			err = errno;
+			close(fd);
+
+			/* try another source if this one is taken */
+			if ((err == EADDRINUSE || err == EADDRNOTAVAIL) &&
+			    tries < ntries)
 				continue;
+
+			if (verbose_mode()) {
+				xgetnameinfo_ex(ai->ai_addr, ai->ai_addrlen,
+				        name_buf, sizeof(name_buf),
+				        (hints->ai_flags & AI_NUMERICHOST));
+				warning(_("bind to source addr/port "
+				     "failed when connecting to "
+				     "%s: %s"), name_buf,
+				     strerror(err));
 			}
+			return (err == EADDRINUSE)? -1 : -3;
+		}
 
-			/* check the results of getaddrinfo */
-			assert(src_res != NULL);
+		/* start the connection - it is complete (or failed) when fd
+		 * becomes writable */
+		nonblock(fd);
+		err = connect(fd, ai->ai_addr, ai->ai_addrlen);
+		if (err == 0) {
+			*connected = true;
+			return fd;
+		}
+		if (errno == EINPROGRESS)
+			return fd;
 
-			/* try binding to any of the addresses */
-			for (src_ptr = src_res; src_ptr != NULL;
-			     src_ptr = src_ptr->ai_next)
-			{
-				err = bind(fd, src_ptr->ai_addr,
-					   src_ptr->ai_addrlen);
-				if (err == 0) break;
+		/* the source may already be connected to this destination,
+		 * or have no ports left for it */
+		if ((errno == EADDRNOTAVAIL || errno == EADDRINUSE) &&
+		    tries < ntries) {
+			close(fd);
+			continue;
+		}
+
+		report_failure(ai, hints);
+		close(fd);
+		return -1;
+	}
+}
+
+
+
+/* report why the attempt to connect to ai failed (as per errno) in verbose
+ * mode */
+static void report_failure(const struct addrinfo *ai,
+		const struct addrinfo *hints)
+{
+	char name_buf[AI_STR_SIZE];
+	int err = errno;
+
+	if (!verbose_mode())
+		return;
+
+	xgetnameinfo_ex(ai->ai_addr, ai->ai_addrlen, name_buf,
+	                sizeof(name_buf), (hints->ai_flags & AI_NUMERICHOST));
+
+	/* use different error message for timeout */
+	if (err == ETIMEDOUT) {
+		/* connection timed out */
+		warning(_("timeout while connecting to %s"), name_buf);
+	}
+	else {
+		/* connection failed */
+		warning(_("cannot connect to %s: %s"),
+		        name_buf, strerror(err));
+	}
+}
+
+
+
+/* the time until deadline, or zero if it has passed */
+static void time_left(const struct timeval *deadline, struct timeval *left)
+{
+	if (timercmp(deadline, clock_now(), >))
+		timersub(deadline, clock_now(), left);
+	else
+		timerclear(left);
+}
+
+
+
+int afindep_scan(struct addrinfo hints,
+		const char * const *remote_addresses, int naddresses,
+		const char *remote_services,
+		const char *local_address, const char *local_service,
+		set_sockopt_handler_t set_sockopt_handler, void *hdata,
+		time_t timeout, int concurrency)
+{
+	scan_cursor_t cursor;
+	scan_queue_t queue;
+	scan_attempt_t *at;
+	source_set_t src;
+	poller_t poller;
+	struct timeval tv;
+	socklen_t len;
+	bool connected, failed = false;
+	int err, fd, i, optval, nopen = 0;
+
+	/* make sure arguments are valid and preconditions are respected */
+	assert(remote_addresses != NULL && naddresses > 0);
+	assert(remote_services != NULL && strlen(remote_services) > 0);
+	assert(local_address == NULL || strlen(local_address) > 0);
+	assert(local_service == NULL || strlen(local_service) > 0);
+	assert(timeout > 0);
+	assert(concurrency > 0);
+
+#ifdef HAVE_GETADDRINFO_AI_ADDRCONFIG
+	/* make calls to getaddrinfo send AAAA queries only if at least one
+	 * IPv6 interface is configured */
+	hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+
+	/* work out which ports are to be scanned */
+	memset(&cursor, 0, sizeof(cursor));
+	cursor.nranges = parse_port_ranges(remote_services, &hints,
+	                                   &(cursor.ranges));
+	if (cursor.nranges < 0)
+		return -1;
+
+	/* the sources are the same for all the attempts */
+	if (lookup_source(&hints, local_address, local_service, &src) != 0) {
+		free(cursor.ranges);
+		return -1;
+	}
+
+	/* the hosts are looked up as the scan reaches them */
+	cursor.hosts = remote_addresses;
+	cursor.nhosts = naddresses;
+	cursor.res = (struct addrinfo **)
+		xmalloc(naddresses * sizeof(struct addrinfo *));
+	for (i = 0; i < naddresses; ++i)
+		cursor.res[i] = NULL;
+
+	poller_init(&poller);
+	concurrency = limit_concurrency(concurrency, &poller);
+
+	/* all the attempts start out free */
+	queue.attempts = (scan_attempt_t *)
+		xmalloc(concurrency * sizeof(scan_attempt_t));
+	for (i = 0; i < concurrency; ++i)
+		queue.attempts[i].next = i + 1;
+	queue.attempts[concurrency - 1].next = -1;
+	queue.head = queue.tail = -1;
+	queue.free = 0;
+	queue.nactive = 0;
+	queue.by_fd = NULL;
+	queue.by_fd_size = 0;
+
+	clock_update();
+	for (;;) {
+		/* keep as many attempts in flight as allowed */
+		while (queue.nactive < concurrency) {
+			at = &(queue.attempts[queue.free]);
+			if (next_target(&cursor, &hints,
+			                &(at->ai), &(at->addr)) == false)
+				break;
+
+			fd = start_attempt(&(at->ai), &hints, &src,
+			                   set_sockopt_handler, hdata,
+			                   false, &connected);
+			if (fd == -2) {
+				failed = true;
+				break;
 			}
-			
-			if (err != 0) {
-				/* make sure we have tried all addresses */
-				assert(src_ptr == NULL);
-				
-				if (verbose_mode()) {
-					warning(_("bind to source addr/port "
-					     "failed when connecting to "
-					     "%s: %s"), name_buf,
-					     strerror(errno));
+			if (fd < 0)
+				continue;
+			if (connected) {
+				if (!connected_to_self(fd, &(at->ai))) {
+					report_open(&(at->ai), &hints);
+					nopen++;
 				}
-				freeaddrinfo_ex(src_res);
 				close(fd);
-				fd = -1;
 				continue;
 			}
 
-			freeaddrinfo_ex(src_res);
+			i = queue_add(&queue, fd);
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+			timeradd(clock_now(), &tv, &(queue.attempts[i].deadline));
+			poller_set(&poller, fd, POLLER_WRITE);
 		}
 
-		/* attempt the connection */
-		err = connect_with_timeout(fd,
-				ptr->ai_addr, ptr->ai_addrlen, timeout);
+		/* the scan is over once nothing more is in flight */
+		if (failed || queue.nactive == 0)
+			break;
 
-		/* exit from the loop if we have a valid connection */
-		if (err == 0)
+		/* wait for attempts to complete, or the oldest to time out */
+		time_left(&(queue.attempts[queue.head].deadline), &tv);
+		err = poller_wait(&poller, &tv);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			warning("%s error: %s", poller_name(&poller),
+			        strerror(errno));
+			failed = true;
 			break;
+		}
 
-		/* check error code */
-		if (verbose_mode()) {
-			/* use different error message for timeout */
-			if (errno == ETIMEDOUT) {
-				/* connection timed out */
-				warning(_("timeout while connecting to %s"),
-				        name_buf);
-			}
-			else {
-				/* connection failed */
-				warning(_("cannot connect to %s: %s"),
-				        name_buf, strerror(errno));
+		/* find out how the attempts that are ready went */
+		for (i = 0; i < poller_nready(&poller); ++i) {
+			fd = poller_ready_fd(&poller, i);
+			assert(fd < queue.by_fd_size);
+			at = &(queue.attempts[queue.by_fd[fd]]);
+
+			len = sizeof(optval);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR,
+			               &optval, &len) != 0)
+				optval = errno;
+			if (optval == 0 && connected_to_self(fd, &(at->ai)))
+				optval = ECONNREFUSED;
+			if (optval == 0) {
+				report_open(&(at->ai), &hints);
+				nopen++;
+			} else {
+				errno = optval;
+				report_failure(&(at->ai), &hints);
 			}
+			queue_remove(&queue, &poller, queue.by_fd[fd]);
+		}
+
+		/* drop the attempts that have timed out */
+		while (queue.head >= 0 &&
+		       !timercmp(&(queue.attempts[queue.head].deadline),
+		                 clock_now(), >))
+		{
+			errno = ETIMEDOUT;
+			report_failure(&(queue.attempts[queue.head].ai), &hints);
+			queue_remove(&queue, &poller, queue.head);
 		}
-		close(fd);
-		fd = -1;
 	}
 
-	/* either all possibilities were exahusted, or a connection was made */
-	assert(ptr == NULL || fd >= 0);
-	
-	/* if the connection failed, output an error message */
-	if (ptr == NULL) {
-		/* if a connection was attempted, an error has been output */
-		if (connect_attempted == false) {
-			warning(_("forward lookup returned "
-			        "no useful socket types"));
+	/* abandon any attempts left after an error */
+	while (queue.head >= 0)
+		queue_remove(&queue, &poller, queue.head);
+
+	poller_destroy(&poller);
+	free(queue.by_fd);
+	free(queue.attempts);
+	for (i = 0; i < naddresses; ++i) {
+		if (cursor.res[i] != NULL)
+			freeaddrinfo_ex(cursor.res[i]);
+	}
+	free(cursor.res);
+	free(cursor.ranges);
+	free_source(&src);
+
+	return failed? -1 : nopen;
+}
+
+
+
+/* fill out ai (with its address in addr) for the next address and port to
+ * be scanned, advancing the cursor.  Returns false once all have been */
+static bool next_target(scan_cursor_t *c, const struct addrinfo *hints,
+		struct addrinfo *ai, struct sockaddr_storage *addr)
+{
+	int err, i;
+
+	while (c->ai == NULL || c->range == c->nranges) {
+		if (c->ai != NULL) {
+			/* all the ports on this address have been scanned */
+			c->ai = c->ai->ai_next;
+		} else if (c->host < c->nhosts) {
+			/* so on to the addresses of the next host, while the
+			 * hosts after it are looked up in the background */
+			for (i = c->host + 1;
+			     i < c->nhosts && i <= c->host + SCAN_LOOKUP_AHEAD;
+			     ++i)
+				resolver_prefetch(c->hosts[i], NULL, hints);
+			err = getaddrinfo_ex(c->hosts[c->host], NULL, hints,
+			                     &(c->res[c->host]));
+			if (err != 0) {
+				warning(_("forward host lookup failed "
+				        "for remote endpoint %s: %s"),
+				        c->hosts[c->host], gai_strerror(err));
+				c->res[c->host] = NULL;
+			}
+			c->ai = c->res[c->host++];
 		} else {
-			warning(_("unable to connect "
-			        "to address %s, service %s"), 
-			        remote_address, remote_service);
+			return false;
 		}
-		return -1;
+
+		/* only scan the addresses we can handle */
+		c->range = (c->ai != NULL && skip_address(c->ai))?
+		           c->nranges : 0;
+		c->port = c->ranges[0].first;
 	}
 
-	/* let the user know the connection has been established */
-	if (verbose_mode())
-		warning(_("%s open"), name_buf);
+	*ai = *(c->ai);
+	ai->ai_next = NULL;
+	memcpy(addr, c->ai->ai_addr, c->ai->ai_addrlen);
+	ai->ai_addr = (struct sockaddr *)addr;
+	sockaddr_set_port(ai->ai_addr, c->port);
 
-	/* return the socktype */
-	if (rt_socktype != NULL)
-		*rt_socktype = ptr->ai_socktype;
+	if (c->port++ == c->ranges[c->range].last &&
+	    ++(c->range) < c->nranges)
+		c->port = c->ranges[c->range].first;
 
-	/* cleanup addrinfo structure */
-	freeaddrinfo_ex(res);
+	return true;
+}
 
-	return fd;
+
+
+/* reduce the number of attempts to have in flight to what the poller and
+ * the open file limit allow, raising the latter if need be */
+static int limit_concurrency(int concurrency, const poller_t *poller)
+{
+	int limit;
+	struct rlimit rl;
+	rlim_t want = (rlim_t)concurrency + SCAN_FD_RESERVE;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < want) {
+		rl.rlim_cur = MIN(want, rl.rlim_max);
+		/* in case of error, we will go on anyway... */
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	limit = (int)sysconf(_SC_OPEN_MAX);
+	if (limit > 0)
+		limit = MAX(limit - SCAN_FD_RESERVE, 1);
+	else
+		limit = concurrency;
+
+	if (poller->backend == POLLER_SELECT)
+		limit = MIN(limit, FD_SETSIZE - SCAN_FD_RESERVE);
+
+	if (limit < concurrency) {
+		if (verbose_mode())
+			warning(_("limiting scan to %d connects in flight"),
+			        limit);
+		concurrency = limit;
+	}
+
+	return concurrency;
+}
+
+
+
+/* take a free attempt for fd and link it at the tail of the queue,
+ * returning its index */
+static int queue_add(scan_queue_t *q, int fd)
+{
+	scan_attempt_t *at;
+	int i, size;
+
+	assert(q->free >= 0);
+	assert(fd >= 0);
+
+	i = q->free;
+	at = &(q->attempts[i]);
+	q->free = at->next;
+
+	at->fd = fd;
+	at->prev = q->tail;
+	at->next = -1;
+	if (q->tail >= 0)
+		q->attempts[q->tail].next = i;
+	else
+		q->head = i;
+	q->tail = i;
+	q->nactive++;
+
+	/* index the attempt by its fd */
+	if (fd >= q->by_fd_size) {
+		size = MAX(fd + 1, 2 * q->by_fd_size);
+		q->by_fd = (int *)xrealloc(q->by_fd, size * sizeof(int));
+		q->by_fd_size = size;
+	}
+	q->by_fd[fd] = i;
+
+	return i;
+}
+
+
+
+/* close the attempt at index i, moving it from the queue to the free list */
+static void queue_remove(scan_queue_t *q, poller_t *poller, int i)
+{
+	scan_attempt_t *at = &(q->attempts[i]);
+
+	assert(q->nactive > 0);
+
+	poller_del(poller, at->fd);
+	close(at->fd);
+
+	if (at->prev >= 0)
+		q->attempts[at->prev].next = at->next;
+	else
+		q->head = at->next;
+	if (at->next >= 0)
+		q->attempts[at->next].prev = at->prev;
+	else
+		q->tail = at->prev;
+
+	at->next = q->free;
+	q->free = i;
+	q->nactive--;
+}
+
+
+
+/* a connect from an ephemeral port to the same local port can end up
+ * connected to itself (by a TCP simultaneous open), showing the port as open
+ * when nothing is listening on it */
+static bool connected_to_self(int fd, const struct addrinfo *ai)
+{
+	struct sockaddr_storage local;
+	socklen_t len = sizeof(local);
+
+	if (getsockname_ex(fd, (struct sockaddr *)&local, &len) != 0)
+		return false;
+	return sockaddr_compare((struct sockaddr *)&local, len,
+	                        ai->ai_addr, ai->ai_addrlen);
+}
+
+
+
+/* output the address and port of a successful scan attempt */
+static void report_open(const struct addrinfo *ai,
+		const struct addrinfo *hints)
+{
+	char name_buf[AI_STR_SIZE];
+
+	xgetnameinfo_ex(ai->ai_addr, ai->ai_addrlen, name_buf,
+	                sizeof(name_buf), (hints->ai_flags & AI_NUMERICHOST));
+	printf(_("%s open\n"), name_buf);
+	fflush(stdout);
 }
 
 
@@ -240,18 +1122,23 @@ int afindep_listener(struct addrinfo hints,
 		const char *local_address, const char *local_service,
 		const char *remote_address, const char *remote_service,
 		set_sockopt_handler_t set_sockopt_handler, void *hdata,
-		listen_callback_t callback, void *cdata,
-		time_t timeout, int max_accept)
+		listen_callback_t callback, listen_datagram_t datagram_callback,
+		void *cdata,
+		listen_wait_handler_t wait_handler, void *wdata,
+		int backlog, time_t timeout, int max_accept)
 {
-	int nfd, i, fd, err, maxfd = -1;
+	int nfd, fd, err;
 	struct addrinfo *res = NULL, *ptr;
 #ifdef ENABLE_IPV6
 	bool set_ipv6_only = false;
 	bool bound_ipv6_any = false;
 #endif
-	bound_socket_t *bound_sockets = NULL;
-	fd_set accept_fdset;
+	bound_socket_t *bound_sockets = NULL, *bs;
+	poller_t poller;
+	acl_t acl;
 	char name_buf[AI_STR_SIZE];
+	unsigned long turn, wakeups, accepted;
+	int most_accepted;
 
 	/* make sure arguments are valid and preconditions are respected */
 	assert(remote_address == NULL || strlen(remote_address) > 0);
@@ -320,9 +1207,6 @@ int afindep_listener(struct addrinfo hints,
 	res = order_ipv6_first(res);
 #endif
 
-	/* initialize accept_fdset */
-	FD_ZERO(&accept_fdset);
-	
 	/* try binding to all of the addresses returned by getaddrinfo */
 	nfd = 0;
 	for (ptr = res; ptr != NULL; ptr = ptr->ai_next) {
@@ -386,7 +1270,7 @@ int afindep_listener(struct addrinfo hints,
 		}
 
 		if (ptr->ai_socktype == SOCK_STREAM) {
-			err = listen(fd, SOMAXCONN);
+			err = listen(fd, backlog);
 			if (err != 0) {
 				warning(_("cannot listen on %s: %s"),
 				        name_buf, strerror(errno));
@@ -412,9 +1296,6 @@ int afindep_listener(struct addrinfo hints,
 		bound_sockets =	add_bound_socket(bound_sockets, fd, 
 				                 ptr->ai_socktype);
 
-		/* add fd to accept_fdset */
-		FD_SET(fd, &accept_fdset);
-		maxfd = MAX(maxfd, fd);
 		nfd++;
 	}
 
@@ -425,17 +1306,30 @@ int afindep_listener(struct addrinfo hints,
 		return -1;
 	}
 
+	/* compile the allowed remote addresses and ports once, so that no
+	 * lookups are needed to check each connection */
+	if (acl_compile(&acl, remote_address, remote_service, &hints) < 0) {
+		free_bound_sockets(bound_sockets);
+		return -1;
+	}
+
+	/* watch all the bound sockets for incoming connections.  They are all
+	 * nonblocking, so that each can be drained of pending connections
+	 * until accept returns EAGAIN */
+	poller_init(&poller);
+	for (bs = bound_sockets; bs != NULL; bs = bs->next) {
+		nonblock(bs->fd);
+		poller_set(&poller, bs->fd, POLLER_READ);
+	}
+
 	/* enter into the accept loop */
- 	for (;;) {
-		fd_set tmp_ap_fdset;
+	turn = 0;
+	wakeups = accepted = 0;
+	most_accepted = 0;
+	while (max_accept != 0) {
 		struct timeval tv, *tvp = NULL;
-		struct sockaddr_storage dest;
-		socklen_t destlen;
-		int ns, socktype;
-		char c_name_buf[AI_STR_SIZE];
-
-		/* make a copy of accept_fdset before passing to select */
-		memcpy(&tmp_ap_fdset, &accept_fdset, sizeof(fd_set));
+		int nready, socktype, batch, n, i;
+		bool sessions;
 
 		/* setup timeout */
 		if (timeout > 0) {
@@ -445,138 +1339,275 @@ int afindep_listener(struct addrinfo hints,
 		}
 
 		/* wait for an incoming connection */
-		err = select(maxfd + 1, &tmp_ap_fdset, NULL, NULL, tvp);
+		if (wait_handler != NULL)
+			err = wait_handler(&poller, tvp, wdata);
+		else
+			err = poller_wait(&poller, tvp);
 
 		if (err <= 0) {
 			if (err < 0 && errno == EINTR)
 				continue;
-			if (err == 0)
+			if (err == 0) {
 				warning(_("connection timed out"));
-			else
-				warning("select error: %s", strerror(errno));
+				report_accepts(accepted, wakeups, most_accepted);
+			} else {
+				warning("%s error: %s", poller_name(&poller),
+				        strerror(errno));
+			}
+			poller_destroy(&poller);
+			acl_destroy(&acl);
 			free_bound_sockets(bound_sockets);
 			return -1;
 		}
-		
-		/* find the ready filedescriptor */
-		for (fd = 0; fd <= maxfd && !FD_ISSET(fd, &tmp_ap_fdset); ++fd)
-			;
+		wakeups++;
+
+		/* service each ready socket in turn, starting from a different
+		 * one after each wakeup so that none is always served last */
+		nready = poller_nready(&poller);
+		n = 0;
+		for (i = 0; i < nready && max_accept != 0; ++i) {
+			fd = poller_ready_fd(&poller, (turn + i) % nready);
+
+			/* find socket type in bound_sockets */
+			socktype = get_bound_socket_type(bound_sockets, fd);
+
+			/* datagrams are passed to the sessions of their
+			 * senders if there is a callback for them */
+			sessions = (socktype == SOCK_DGRAM &&
+			            datagram_callback != NULL);
+
+			/* drain stream sockets of up to a batch of connections
+			 * (or datagrams, for sessions), but otherwise take a
+			 * single datagram, as it stays queued until the
+			 * connection made for it reads it */
+			batch = (socktype == SOCK_STREAM || sessions)?
+			        ACCEPT_BATCH : 1;
+			for (; batch > 0 && max_accept != 0; --batch) {
+				if (sessions)
+					err = receive_datagram(fd, &poller,
+					          &acl, datagram_callback,
+					          cdata);
+				else
+					err = accept_connection(fd, socktype,
+					          &poller, &acl, &hints,
+					          callback, cdata);
+				if (err < 0) {
+					poller_destroy(&poller);
+					acl_destroy(&acl);
+					free_bound_sockets(bound_sockets);
+					return -1;
+				}
+				if (err == ACCEPT_NONE)
+					break;
+				if (err == ACCEPT_REFUSED || sessions)
+					continue;
+
+				n++;
+				if (max_accept > 0)
+					max_accept--;
+			}
+		}
+		turn++;
 
-		/* if none were ready, loop to select again */
-		if (fd > maxfd)
-			continue;
+		accepted += n;
+		if (n > most_accepted)
+			most_accepted = n;
+	}
 
-		/* find socket type in bound_sockets */
-		socktype = get_bound_socket_type(bound_sockets, fd);
+	report_accepts(accepted, wakeups, most_accepted);
+	poller_destroy(&poller);
+	acl_destroy(&acl);
 
-		destlen = sizeof(dest);	
+	/* close the listening sockets and free the bound_socket list */
+	close_and_free_bound_sockets(bound_sockets);
+	return 0;
+}
 
-		/* for stream sockets we accept a new connection, whereas for
-		 * dgram sockets we use MSG_PEEK to determine the sender */
-		if (socktype == SOCK_STREAM) {
-			ns = accept(fd, (struct sockaddr *)&dest, &destlen);
-			if (ns < 0) {
-				warning("accept failed: %s", strerror(errno));
-				free_bound_sockets(bound_sockets);
-				return -1;
-			}
-		} else {
-			/* this is checked when binding listen sockets */
-			assert(socktype == SOCK_DGRAM);
 
-			err = recvfrom(fd, NULL, 0, MSG_PEEK,
-			               (struct sockaddr *)&dest, &destlen);
-			if (err < 0) {
-				warning("recvfrom failed: %s", strerror(errno));
-				free_bound_sockets(bound_sockets);
-				return -1;
-			}
 
-			ns = dup(fd);
-			if (ns < 0) {
-				warning("dup failed: %s", strerror(errno));
-				free_bound_sockets(bound_sockets);
-				return -1;
-			}
+/* accept a connection on the listening socket fd (or, for datagram sockets,
+ * make one for the sender of the next datagram) and pass it to the callback
+ * if the access list allows it.  Returns one of the ACCEPT_ results, or -1
+ * (having output an error) on failure */
+static int accept_connection(int fd, int socktype, poller_t *poller,
+		const acl_t *acl, const struct addrinfo *hints,
+		listen_callback_t callback, void *cdata)
+{
+	struct sockaddr_storage dest;
+	socklen_t destlen;
+	int ns, err;
+	char name_buf[AI_STR_SIZE];
+	char c_name_buf[AI_STR_SIZE];
+
+	destlen = sizeof(dest);
+
+	/* for stream sockets we accept a new connection, whereas for
+	 * dgram sockets we use MSG_PEEK to determine the sender */
+	if (socktype == SOCK_STREAM) {
+#ifdef HAVE_ACCEPT4
+		/* the relay copes with nonblocking sockets, and setting the
+		 * flags here saves two more system calls per connection */
+		ns = accept4(fd, (struct sockaddr *)&dest, &destlen,
+		             SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		ns = accept(fd, (struct sockaddr *)&dest, &destlen);
+#endif
+		if (ns < 0 && errno == EAGAIN) {
+			/* no connections are left pending */
+			poller_clear(poller, fd, POLLER_READ);
+			return ACCEPT_NONE;
+		}
+		if (ns < 0 && (errno == ECONNABORTED || errno == EINTR)) {
+			/* the pending connection went away before it could
+			 * be accepted */
+			return ACCEPT_NONE;
+		}
+		if (ns < 0) {
+			warning("accept failed: %s", strerror(errno));
+			return -1;
+		}
+	} else {
+		/* this is checked when binding listen sockets */
+		assert(socktype == SOCK_DGRAM);
+
+		err = recvfrom(fd, NULL, 0, MSG_PEEK,
+		               (struct sockaddr *)&dest, &destlen);
+		if (err < 0 && errno == EAGAIN) {
+			/* no datagrams are left pending */
+			poller_clear(poller, fd, POLLER_READ);
+			return ACCEPT_NONE;
+		}
+		if (err < 0) {
+			warning("recvfrom failed: %s", strerror(errno));
+			return -1;
 		}
 
-		/* get names for each end of the connection */
-		if (verbose_mode()) {
-			struct sockaddr_storage src;
-			socklen_t srclen = sizeof(src);
-
-			/* find out what address the connection was to */
-			err = getsockname_ex(ns,
-			                     (struct sockaddr *)&src, &srclen);
-			if (err < 0) {
-				warning("getsockname failed: %s",
-				        strerror(errno));
-				free_bound_sockets(bound_sockets);
-				return -1;
-			}
+		ns = dup(fd);
+		if (ns < 0) {
+			warning("dup failed: %s", strerror(errno));
+			return -1;
+		}
+	}
 
-			/* get the numeric name for this source */
-			xgetnameinfo_ex((struct sockaddr *)&src, srclen,
-			                name_buf, sizeof(name_buf), true);
+	/* get names for each end of the connection */
+	if (verbose_mode()) {
+		struct sockaddr_storage src;
+		socklen_t srclen = sizeof(src);
 
-			/* get the name for this client */
-			xgetnameinfo_ex((struct sockaddr *)&dest, destlen,
-			                c_name_buf, sizeof(c_name_buf),
-			                (hints.ai_flags & AI_NUMERICHOST));
+		/* find out what address the connection was to */
+		err = getsockname_ex(ns, (struct sockaddr *)&src, &srclen);
+		if (err < 0) {
+			warning("getsockname failed: %s", strerror(errno));
+			close(ns);
+			return -1;
 		}
 
-		/* check if connections from this client are allowed */
-		if ((remote_address == NULL && remote_service == NULL) ||
-		    (is_allowed((struct sockaddr *)&dest, destlen, &hints,
-				remote_address, remote_service) == true))
-		{
+		/* get the numeric name for this source */
+		xgetnameinfo_ex((struct sockaddr *)&src, srclen,
+		                name_buf, sizeof(name_buf), true);
 
-			if (socktype == SOCK_DGRAM) {
-				/* connect the socket to ensure we only talk
-				 * with this client */
-				err = connect(ns, (struct sockaddr *)&dest, 
-				              destlen);
-				if (err != 0) {
-					warning(_("connect failed on "
-					        "datagram socket: %s"),
-					        strerror(errno));
-					free_bound_sockets(bound_sockets);
-					return -1;
-				}
-			}
+		/* get the name for this client */
+		xgetnameinfo_ex((struct sockaddr *)&dest, destlen,
+		                c_name_buf, sizeof(c_name_buf),
+		                (hints->ai_flags & AI_NUMERICHOST));
+	}
 
-			if (verbose_mode()) {
-				warning(_("connect to %s from %s"),
-				        name_buf, c_name_buf);
-			}
+	/* check if connections from this client are allowed */
+	if (!acl_allows(acl, (struct sockaddr *)&dest, destlen)) {
+		if (socktype == SOCK_DGRAM) {
+			/* the connection wasn't accepted -
+			 * remove the queued packet */
+			recvfrom(ns, NULL, 0, 0, NULL, 0);
+		}
+		close(ns);
 
-			callback(ns, socktype, cdata);
+		if (verbose_mode()) {
+			warning(_("refused connect to %s from %s"),
+			        name_buf, c_name_buf);
+		}
+		return ACCEPT_REFUSED;
+	}
 
-			if (max_accept > 0 && --max_accept == 0)
-				break;
-		} else {
-			if (socktype == SOCK_DGRAM) {
-				/* the connection wasn't accepted - 
-				 * remove the queued packet */
-				recvfrom(ns, NULL, 0, 0, NULL, 0);
-			}
+	if (socktype == SOCK_DGRAM) {
+		/* connect the socket to ensure we only talk with this
+		 * client */
+		err = connect(ns, (struct sockaddr *)&dest, destlen);
+		if (err != 0) {
+			warning(_("connect failed on datagram socket: %s"),
+			        strerror(errno));
 			close(ns);
-
-			if (verbose_mode()) {
-				warning(_("refused connect to %s from %s"),
-				        name_buf, c_name_buf);
-			}
+			return -1;
 		}
 	}
 
-	/* close the listening sockets */
-	for (i = 0; i <= maxfd; ++i) {
-		if (FD_ISSET(i, &accept_fdset) != 0) close(i);
+	if (verbose_mode())
+		warning(_("connect to %s from %s"), name_buf, c_name_buf);
+
+	callback(ns, socktype, cdata);
+	return ACCEPT_PASSED;
+}
+
+
+
+/* receive a datagram on the socket fd, which is shared by the sessions of
+ * all its senders, and pass it to the callback if the access list allows
+ * the sender.  Returns one of the ACCEPT_ results, or -1 (having output an
+ * error) on failure */
+static int receive_datagram(int fd, poller_t *poller, const acl_t *acl,
+		listen_datagram_t callback, void *cdata)
+{
+	/* the largest datagram that can be received */
+	static uint8_t buf[65536];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	ssize_t rr;
+	char c_name_buf[AI_STR_SIZE];
+
+	fromlen = sizeof(from);
+	rr = recvfrom(fd, buf, sizeof(buf), 0,
+	              (struct sockaddr *)&from, &fromlen);
+	if (rr < 0 && errno == EAGAIN) {
+		/* no datagrams are left pending */
+		poller_clear(poller, fd, POLLER_READ);
+		return ACCEPT_NONE;
+	}
+	if (rr < 0 && errno == EINTR)
+		return ACCEPT_NONE;
+	if (rr < 0) {
+		warning("recvfrom failed: %s", strerror(errno));
+		return -1;
+	}
+
+	/* datagrams from refused senders are just dropped.  Only numeric
+	 * names are given for them, as there may be a great many */
+	if (!acl_allows(acl, (struct sockaddr *)&from, fromlen)) {
+		if (very_verbose_mode()) {
+			xgetnameinfo_ex((struct sockaddr *)&from, fromlen,
+			                c_name_buf, sizeof(c_name_buf), true);
+			warning(_("refused datagram from %s"), c_name_buf);
+		}
+		return ACCEPT_REFUSED;
 	}
 
-	/* free the bound_socket list */
-	free_bound_sockets(bound_sockets);
-	return 0;
+	callback(fd, (struct sockaddr *)&from, fromlen, buf, (size_t)rr,
+	         cdata);
+	return ACCEPT_PASSED;
+}
+
+
+
+/* output how many connections were accepted for each time the listener
+ * woke up, which shows how well batching is keeping up with them */
+static void report_accepts(unsigned long accepted, unsigned long wakeups,
+		int most_accepted)
+{
+	if (!very_verbose_mode() || wakeups == 0)
+		return;
+
+	warning(_("accepted %lu connections in %lu wakeups "
+	          "(%lu.%02lu per wakeup, at most %d)"),
+	        accepted, wakeups, accepted / wakeups,
+	        (accepted % wakeups) * 100 / wakeups, most_accepted);
 }
 
 
@@ -660,61 +1691,48 @@ static struct addrinfo *order_ipv6_first(struct addrinfo *ai)
 
 
 
-/* returns true if sa corresponds to the address/port specified in addr */
-static bool is_allowed(const struct sockaddr *sa, socklen_t salen,
-		const struct addrinfo *hints,
-		const char *address, const char *service)
+/* reorder the list so that the addresses alternate between the family of
+ * the first address and the other families, otherwise keeping their order
+ * (as per RFC 8305) */
+static struct addrinfo *interleave_families(struct addrinfo *ai)
 {
-	struct addrinfo *res = NULL, *ptr;
-	int err;
-	bool ret;
+	struct addrinfo *first = NULL, **first_end = &first;
+	struct addrinfo *other = NULL, **other_end = &other;
+	struct addrinfo *ptr, *next, **end;
+	int family;
 
-	assert(sa != NULL);
-	assert(hints != NULL);
-	assert(address == NULL || strlen(address) > 0);
-	assert(service == NULL || strlen(service) > 0);
+	assert(ai != NULL);
 
-	/* if no address or service is supplied, match everything */
-	if (address == NULL && service == NULL) return true;
-		
-	err = getaddrinfo_ex(address, service, hints, &res);
-	if (err != 0) {
-		/* some errors just indicate that the address wasn't suitable */
-		switch (err) {
-#ifdef HAVE_GETADDRINFO_EAI_NODATA 
-  		case EAI_NODATA:
-#endif
-#ifdef HAVE_GETADDRINFO_EAI_ADDRFAMILY
-  		case EAI_ADDRFAMILY:
-#endif
-  		case EAI_FAMILY:
-		case EAI_SERVICE:
-		case EAI_SOCKTYPE:
-			return false;
-		default:
-			fatal("getaddrinfo error: %s", gai_strerror(err));
+	/* split the list in two */
+	family = ai->ai_family;
+	for (ptr = ai; ptr != NULL; ptr = next) {
+		next = ptr->ai_next;
+		ptr->ai_next = NULL;
+		if (ptr->ai_family == family) {
+			*first_end = ptr;
+			first_end = &(ptr->ai_next);
+		} else {
+			*other_end = ptr;
+			other_end = &(ptr->ai_next);
 		}
 	}
 
-	ret = false;
-	
-	for (ptr = res; ptr != NULL; ptr = ptr->ai_next) {
-
-#ifdef ENABLE_IPV6
-		/* skip IPv4 mapped addresses returned from getaddrinfo */
-		if (is_address_ipv4_mapped(ptr->ai_addr))
-			continue;
-#endif
-
-		if (sockaddr_compare(sa, salen,
-				     ptr->ai_addr, ptr->ai_addrlen) == true)
-		{
-			ret = true;
-			break;
+	/* and take from each in turn */
+	ai = NULL;
+	end = &ai;
+	while (first != NULL || other != NULL) {
+		if (first != NULL) {
+			*end = first;
+			end = &(first->ai_next);
+			first = first->ai_next;
+		}
+		if (other != NULL) {
+			*end = other;
+			end = &(other->ai_next);
+			other = other->ai_next;
 		}
 	}
+	*end = NULL;
 
-	freeaddrinfo_ex(res);
-
-	return ret;
+	return ai;
 }
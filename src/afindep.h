@@ -24,12 +24,24 @@
 
 #include <netdb.h>
 #include <sys/types.h>
+#include "poller.h"
 
 typedef void (*set_sockopt_handler_t)(int sock, void *hdata);
 typedef void (*listen_callback_t)(int fd, int socktype, void *cdata);
+/* called with each datagram received by a listener on a datagram socket
+ * that is shared by all the senders, rather than connected to one */
+typedef void (*listen_datagram_t)(int fd, const struct sockaddr *from,
+		socklen_t fromlen, const uint8_t *data, size_t len,
+		void *cdata);
+/* waits for the fds of a listener's poller, as per poller_wait */
+typedef int (*listen_wait_handler_t)(poller_t *poller,
+		const struct timeval *tv, void *wdata);
 
 
-/* establish a connection and return a new fd and socktype */
+/* establish a connection and return a new fd and socktype.  Returns -1 if
+ * the connection failed, or -2 if trying again can't help (eg. the remote
+ * host doesn't exist, or no socket could be created or bound to the
+ * source) */
 int afindep_connect(struct addrinfo hints,
 		const char *remote_address, const char *remote_service,
 		const char *local_address, const char *local_service,
@@ -37,12 +49,32 @@ int afindep_connect(struct addrinfo hints,
 		time_t timeout, int *socktype);
 
 
-/* listen for connects and issue callbacks */
+/* connect to each of the ports in remote_services (a comma separated list of
+ * services and lo-hi ranges of them) on every address of each of the remote
+ * hosts, without any data transfer, keeping up to concurrency attempts in
+ * flight at once.  Open ports are output as they are found.  Returns the
+ * number of ports found open, or -1 on error */
+int afindep_scan(struct addrinfo hints,
+		const char * const *remote_addresses, int naddresses,
+		const char *remote_services,
+		const char *local_address, const char *local_service,
+		set_sockopt_handler_t set_sockopt_handler, void *hdata,
+		time_t timeout, int concurrency);
+
+
+/* listen for connects and issue callbacks.  If datagram_callback is not
+ * NULL, datagram sockets are not connected to their first sender: each
+ * datagram is passed to datagram_callback instead, to be given to the
+ * session of its sender.  If wait_handler is not NULL, it is used in place
+ * of poller_wait to wait for incoming connections.  backlog is the length
+ * of the queue of connections waiting to be accepted */
 int afindep_listener(struct addrinfo hints,
 		const char *local_address, const char *local_service,
 		const char *remote_address, const char *remote_service,
 		set_sockopt_handler_t set_sockopt_handler, void *hdata,
-		listen_callback_t callback, void *cdata,
-		time_t timeout, int max_accept);
+		listen_callback_t callback, listen_datagram_t datagram_callback,
+		void *cdata,
+		listen_wait_handler_t wait_handler, void *wdata,
+		int backlog, time_t timeout, int max_accept);
 
 #endif/*AFINDEP_H*/
@@ -43,6 +43,14 @@ static const size_t DEFAULT_DGRAM_MTU = 8192;
 static const size_t DEFAULT_NRU = 1;
 /* default datagram NRU is the maximum allowed MTU of 64k */
 static const size_t DEFAULT_DGRAM_NRU = 65536;
+/* a framed buffer only waits for room for the datagrams that arrive */
+static const size_t DEFAULT_FRAMED_DGRAM_NRU = 1;
+/* default number of scan connection attempts in flight is 1024 */
+static const int DEFAULT_SCAN_CONCURRENCY = 1024;
+
+
+static size_t min_buffer_size(const connection_attributes_t *attrs,
+		int socktype);
 
 
 
@@ -57,8 +65,11 @@ void ca_init(connection_attributes_t *attrs)
 	address_init(&(attrs->remote_address));
 	address_init(&(attrs->local_address));
 	attrs->buffer_size = 0;
+	attrs->min_buffer_size = 0;
+	attrs->max_buffer_size = 0;
 	attrs->remote_mtu = 0;
 	attrs->remote_nru = 0;
+	attrs->dgram_batch = 1;
 	attrs->sndbuf_size = 0;
 	attrs->rcvbuf_size = 0;
 	attrs->connect_timeout = -1;
@@ -68,6 +79,12 @@ void ca_init(connection_attributes_t *attrs)
 	attrs->remote_half_close_suppress = true;
 	attrs->local_half_close_suppress = false;
 	attrs->local_exec = NULL;
+	attrs->workers = 0;
+	attrs->scan_hosts = NULL;
+	attrs->scan_nhosts = 0;
+	attrs->scan_concurrency = DEFAULT_SCAN_CONCURRENCY;
+	attrs->listen_backlog = 0;
+	attrs->defer_accept = 0;
 }
 
 
@@ -83,7 +100,6 @@ void ca_destroy(connection_attributes_t *attrs)
 size_t ca_buffer_size(const connection_attributes_t *attrs, int socktype)
 {
 	size_t buffer_size = attrs->buffer_size;
-	size_t remote_nru = ca_remote_NRU(attrs, socktype);
 	if (buffer_size == 0) {
 		switch (socktype) {
 		case SOCK_DGRAM:
@@ -94,11 +110,23 @@ size_t ca_buffer_size(const connection_attributes_t *attrs, int socktype)
 			break;
 		}
 	}
-	/* buffer size can never be smaller than nru or data will never be
-	 * received */
-	if (buffer_size < remote_nru)
-		buffer_size = remote_nru;
-	return buffer_size;
+	return MAX(buffer_size, min_buffer_size(attrs, socktype));
+}
+
+
+
+bool ca_buffer_limits(const connection_attributes_t *attrs, int socktype,
+		size_t *min, size_t *max)
+{
+	assert(min != NULL);
+	assert(max != NULL);
+
+	if (!ca_is_buffer_adaptive(attrs))
+		return false;
+
+	*min = MAX(attrs->min_buffer_size, min_buffer_size(attrs, socktype));
+	*max = MAX(attrs->max_buffer_size, *min);
+	return true;
 }
 
 
@@ -127,7 +155,10 @@ size_t ca_remote_NRU(const connection_attributes_t *attrs, int socktype)
 	if (remote_nru == 0) {
 		switch (socktype) {
 		case SOCK_DGRAM:
-			remote_nru = DEFAULT_DGRAM_NRU;
+			if (ca_is_flag_set(attrs, CA_FRAME_DATAGRAMS))
+				remote_nru = DEFAULT_FRAMED_DGRAM_NRU;
+			else
+				remote_nru = DEFAULT_DGRAM_NRU;
 			break;
 		default:
 			remote_nru = DEFAULT_NRU;
@@ -139,6 +170,22 @@ size_t ca_remote_NRU(const connection_attributes_t *attrs, int socktype)
 
 
 
+/* the smallest buffer that works with the nru (and batch) */
+static size_t min_buffer_size(const connection_attributes_t *attrs,
+		int socktype)
+{
+	size_t remote_nru = ca_remote_NRU(attrs, socktype);
+	/* buffer size can never be smaller than nru or data will never be
+	 * received */
+	size_t size = remote_nru;
+	/* and a batch of datagrams each needs nru */
+	if (socktype == SOCK_DGRAM)
+		size = remote_nru * attrs->dgram_batch;
+	return size;
+}
+
+
+
 void ca_set_local_exec(connection_attributes_t *attrs, const char *exec)
 {
 	if (attrs->local_exec)
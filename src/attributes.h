@@ -43,8 +43,11 @@ typedef struct connection_attributes
 	address_t remote_address;
 	address_t local_address;
 	size_t buffer_size;
+	size_t min_buffer_size;
+	size_t max_buffer_size;
 	size_t remote_mtu;
 	size_t remote_nru;
+	int dgram_batch;
 	size_t sndbuf_size;
 	size_t rcvbuf_size;
 	int connect_timeout;
@@ -54,6 +57,12 @@ typedef struct connection_attributes
 	bool remote_half_close_suppress;
 	bool local_half_close_suppress;
 	char *local_exec;
+	int workers;
+	const char * const *scan_hosts;
+	int scan_nhosts;
+	int scan_concurrency;
+	int listen_backlog;
+	int defer_accept;
 } connection_attributes_t;
 
 /* CA flags */
@@ -64,6 +73,14 @@ typedef struct connection_attributes
 #define CA_SEND_DATA_ONLY	0x000010
 #define CA_DISABLE_NAGLE	0x000020
 #define CA_CONTINUOUS_ACCEPT	0x000040
+#define CA_NO_SPLICE		0x000080
+#define CA_MULTIPLEX		0x000100
+#define CA_STATS		0x000200
+#define CA_CHAIN_BUFFERS	0x000400
+#define CA_FRAME_DATAGRAMS	0x000800
+#define CA_SCAN			0x001000
+#define CA_FASTOPEN		0x002000
+#define CA_RECONNECT		0x004000
 
 void ca_init(connection_attributes_t *attrs);
 void ca_destroy(connection_attributes_t *attrs);
@@ -87,12 +104,46 @@ void ca_destroy(connection_attributes_t *attrs);
 size_t ca_buffer_size(const connection_attributes_t *attrs, int socktype);
 #define ca_set_buffer_size(CA, SZ)	((CA)->buffer_size = (SZ))
 
+/* the bounds for adaptive buffer sizing, adjusted as for ca_buffer_size.
+ * Returns false if the buffer size is fixed */
+bool ca_buffer_limits(const connection_attributes_t *attrs, int socktype,
+		size_t *min, size_t *max);
+#define ca_set_buffer_limits(CA, MIN, MAX)	\
+	((CA)->min_buffer_size = (MIN), (CA)->max_buffer_size = (MAX))
+#define ca_is_buffer_adaptive(CA)	((CA)->max_buffer_size > 0)
+
 size_t ca_remote_MTU(const connection_attributes_t *attrs, int socktype);
 #define ca_set_remote_MTU(CA, MTU)	((CA)->remote_mtu = (MTU))
 
 size_t ca_remote_NRU(const connection_attributes_t *attrs, int socktype);
 #define ca_set_remote_NRU(CA, NRU)	((CA)->remote_nru = (NRU))
 
+#define ca_dgram_batch(CA)		((CA)->dgram_batch)
+#define ca_set_dgram_batch(CA, N)	((CA)->dgram_batch = (N))
+
+#define ca_workers(CA)			((CA)->workers)
+#define ca_set_workers(CA, N)		((CA)->workers = (N))
+
+/* the remote hosts to scan (the first of which is also the nodename of
+ * the remote address) */
+#define ca_scan_hosts(CA)		((CA)->scan_hosts)
+#define ca_scan_nhosts(CA)		((CA)->scan_nhosts)
+#define ca_set_scan_hosts(CA, HOSTS, N)	\
+	((CA)->scan_hosts = (HOSTS), (CA)->scan_nhosts = (N))
+
+#define ca_scan_concurrency(CA)		((CA)->scan_concurrency)
+#define ca_set_scan_concurrency(CA, N)	((CA)->scan_concurrency = (N))
+
+/* the length of the queue of connections waiting to be accepted, or 0 for
+ * the system default */
+#define ca_listen_backlog(CA)		((CA)->listen_backlog)
+#define ca_set_listen_backlog(CA, N)	((CA)->listen_backlog = (N))
+
+/* how many seconds the kernel holds a connection until its first data
+ * arrives before it can be accepted, or 0 to not wait for data */
+#define ca_defer_accept(CA)		((CA)->defer_accept)
+#define ca_set_defer_accept(CA, T)	((CA)->defer_accept = (T))
+
 #define ca_sndbuf_size(CA)		((CA)->sndbuf_size)
 #define ca_set_sndbuf_size(CA, SZ)	((CA)->sndbuf_size = (SZ))
 
@@ -23,6 +23,7 @@
 #include "bluez.h"
 #include "misc.h"
 #include "netsupport.h"
+#include "poller.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -120,9 +121,11 @@ int bluez_listener(struct addrinfo hints,
 		const char *remote_address, const char *remote_service,
 		set_sockopt_handler_t set_sockopt_handler, void *hdata,
 		listen_callback_t callback, void *cdata,
-		time_t timeout, int max_accept)
+		listen_wait_handler_t wait_handler, void *wdata,
+		int backlog, time_t timeout, int max_accept)
 {
 	int fd = -1;
+	poller_t poller;
 	struct sockaddr_storage ss;
 	socklen_t salen = 0;
 	char name_buf[BA_STR_SIZE];
@@ -168,26 +171,28 @@ int bluez_listener(struct addrinfo hints,
 		return -1;
 	}
 
-	if (listen(fd, SOMAXCONN) != 0) {
+	if (listen(fd, backlog) != 0) {
 		warning(_("cannot listen on %s: %s"),
 		        name_buf, strerror(errno));
 	}
 
 	if (verbose_mode())
 		warning(_("listening on %s ..."), name_buf);
+
+	/* watch the socket for incoming connections */
+	poller_init(&poller);
+	if (poller_edge_triggered(&poller))
+		nonblock(fd);
+	poller_set(&poller, fd, POLLER_READ);
 	
 	/* enter into the accept loop */
  	for (;;) {
-		fd_set accept_fdset;
 		struct timeval tv, *tvp = NULL;
 		struct sockaddr_storage dest;
 		socklen_t destlen;
 		int ns, err;
 		char c_name_buf[BA_STR_SIZE];
 
-		FD_ZERO(&accept_fdset);
-		FD_SET(fd, &accept_fdset);
-
 		/* setup timeout */
 		if (timeout > 0) {
 			tv.tv_sec = timeout;
@@ -196,7 +201,10 @@ int bluez_listener(struct addrinfo hints,
 		}
 
 		/* wait for an incoming connection */
-		err = select(fd + 1, &accept_fdset, NULL, NULL, tvp);
+		if (wait_handler != NULL)
+			err = wait_handler(&poller, tvp, wdata);
+		else
+			err = poller_wait(&poller, tvp);
 
 		if (err <= 0) {
 			if (err < 0 && errno == EINTR)
@@ -204,18 +212,26 @@ int bluez_listener(struct addrinfo hints,
 			if (err == 0)
 				warning(_("connection timed out"));
 			else
-				warning("select error: %s", strerror(errno));
+				warning("%s error: %s", poller_name(&poller),
+				        strerror(errno));
+			poller_destroy(&poller);
 			return -1;
 		}
 
-		/* double check that the fd is actually set */
-		if (!FD_ISSET(fd, &accept_fdset))
+		/* double check that the fd is actually ready */
+		if (!(poller_revents(&poller, fd) & POLLER_READ))
 			continue;
 
 		destlen = sizeof(dest);	
 		ns = accept(fd, (struct sockaddr *)&dest, &destlen);
+		if (ns < 0 && errno == EAGAIN) {
+			/* no connections are left pending */
+			poller_clear(&poller, fd, POLLER_READ);
+			continue;
+		}
 		if (ns < 0) {
 			warning("accept failed: %s", strerror(errno));
+			poller_destroy(&poller);
 			return -1;
 		}
 
@@ -249,6 +265,8 @@ int bluez_listener(struct addrinfo hints,
 	}
 
 	/* close the listening socket */
+	poller_del(&poller, fd);
+	poller_destroy(&poller);
 	close(fd);
 
 	return 0;
@@ -36,6 +36,7 @@ int bluez_listener(struct addrinfo hints,
 		const char *remote_address, const char *remote_service,
 		set_sockopt_handler_t set_sockopt_handler, void *hdata,
 		listen_callback_t callback, void *cdata,
-		time_t timeout, int max_accept);
+		listen_wait_handler_t wait_handler, void *wdata,
+		int backlog, time_t timeout, int max_accept);
 
 #endif/*BLUEZ_H*/
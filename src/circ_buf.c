@@ -25,18 +25,118 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+
+#ifdef HAVE_SENDFILE
+/* amount of a file that is made available for sending at a time */
+static const size_t SENDFILE_WINDOW = 1048576;
+#endif
+
+#ifdef HAVE_SPLICE
+/* splice pipes are made at least this large (if the system allows it), as
+ * a pipe only as large as a small buffer costs more in syscalls than the
+ * copies it saves */
+static const size_t SPLICE_PIPE_MIN = 262144;
+#endif
+
+
+/* new page multiple buffers at least this large are mirrored, unless it
+ * is 0 */
+static size_t mirror_threshold = CB_MIRROR_THRESHOLD;
+/* whether the memory of a buffer of size bytes should be mirrored */
+#define cb_should_mirror(CB, SIZE) \
+	(mirror_threshold > 0 && \
+	 ((SIZE) >= mirror_threshold || (CB)->mirror_wanted))
+
+/* new buffers at least this large are given huge pages, unless it is 0 */
+static size_t huge_threshold = CB_HUGE_THRESHOLD;
+#ifdef HAVE_SYS_MMAN_H
+/* the huge page size assumed if the system doesn't say */
+static const size_t DEFAULT_HUGE_PAGE_SIZE = 2097152;
+#endif
+
+/* adaptive sizing looks at the occupancy over windows of this many
+ * transfers.  A buffer that is full this many times in a window is grown,
+ * and one whose occupancy stays at or below a quarter of its size for this
+ * many windows in a row is shrunk.  As the size doubles or halves, and a
+ * halved buffer is still only half full at worst, each copy is paid for by
+ * at least a window of transfers */
+static const unsigned int ADAPT_WINDOW = 64;
+static const unsigned int ADAPT_GROW_FILLS = 4;
+static const unsigned int ADAPT_SHRINK_WINDOWS = 4;
+
+
+/* segments are added to a chain this far ahead of the data when reading as
+ * much as possible (enough for any datagram) */
+static const size_t CHAIN_READAHEAD = 65536;
+/* the pool allocates segments this many at a time */
+static const int POOL_SLAB_SEGMENTS = 16;
+
+/* the segments that aren't in use by any chain */
+static cb_segment_t *pool = NULL;
+
+
+static void cb_alloc_mem(circ_buf_t *cb, size_t size);
+static void cb_free_mem(circ_buf_t *cb);
+static void cb_chain_reserve(circ_buf_t *cb, size_t nbytes);
+static void cb_chain_release(circ_buf_t *cb);
+static void cb_chain_produce(circ_buf_t *cb, size_t len);
+static void cb_chain_consume(circ_buf_t *cb, size_t len);
+static int cb_chain_iov(cb_segment_t *seg, size_t off, size_t nbytes,
+		struct iovec *iov);
+static cb_segment_t *segment_get(void);
+static void segment_put(cb_segment_t *seg);
+static void cb_push_frame(circ_buf_t *cb, size_t len);
+static void cb_pop_frames(circ_buf_t *cb, size_t len);
+static void cb_trim_frames(circ_buf_t *cb);
+#ifdef HAVE_SYS_MMAN_H
+static bool cb_huge_map(circ_buf_t *cb, size_t size);
+static uint8_t *cb_reserve(size_t len, size_t align);
+static size_t huge_page_size(void);
+static bool thp_enabled(void);
+#endif
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+static uint8_t *cb_mirror_map(size_t size, size_t page, unsigned int flags);
+#endif
+#ifdef HAVE_SPLICE
+static ssize_t cb_splice_read(circ_buf_t *cb, int fd, size_t nbytes);
+static ssize_t cb_splice_write(circ_buf_t *cb, int fd, size_t nbytes);
+#endif
+#ifdef HAVE_SENDFILE
+static ssize_t cb_file_read(circ_buf_t *cb, int fd, size_t nbytes);
+static ssize_t cb_file_write(circ_buf_t *cb, int fd, size_t nbytes);
+#endif
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+static uint8_t *cb_wrap(const circ_buf_t *cb, uint8_t *p, size_t off);
+static int cb_region_iov(const circ_buf_t *cb, uint8_t *start, size_t len,
+		struct iovec *iov);
+#endif
+#ifdef HAVE_RECVMMSG
+static void cb_space_move(circ_buf_t *cb, size_t dst, size_t src, size_t len);
+#endif
+
 
 
 #ifndef NDEBUG
 static void cb_assert(const circ_buf_t *cb)
 {
 	if (cb == NULL ||
-	    cb->buf == NULL ||
-	    cb->ptr == NULL ||
+	    ((cb->buf == NULL || cb->ptr == NULL) && !cb_is_chained(cb) &&
+	     !cb_is_spliced(cb) && !cb_is_file_backed(cb)) ||
+	    (cb_is_chained(cb) && cb->data_size > 0 && cb->head == NULL) ||
 	    cb->buf_size < cb->data_size) 
 	{
 		fatal_internal("circular buffer assertion failed");
@@ -55,10 +155,11 @@ void cb_init(circ_buf_t *cb, size_t size)
 	
 	memset(cb, 0, sizeof(circ_buf_t));
 	
-	cb->buf = (uint8_t *)xmalloc(size);
+	cb_alloc_mem(cb, size);
 	cb->ptr = cb->buf;
 	cb->data_size = 0;
-	cb->buf_size  = size;
+	cb->pipe_fds[0] = cb->pipe_fds[1] = -1;
+	cb->file_fd = -1;
 
 	cb_assert(cb);
 }
@@ -69,32 +170,562 @@ void cb_destroy(circ_buf_t *cb)
 {
 	cb_assert(cb);
 
-	free(cb->buf);
-	cb->buf = NULL;
+	if (cb_is_spliced(cb)) {
+		close(cb->pipe_fds[0]);
+		close(cb->pipe_fds[1]);
+		cb->pipe_fds[0] = cb->pipe_fds[1] = -1;
+	}
+	if (cb_is_file_backed(cb)) {
+		close(cb->file_fd);
+		cb->file_fd = -1;
+	}
+	if (cb_is_chained(cb)) {
+		cb_chain_release(cb);
+		cb->chained = false;
+	}
+	free(cb->frames);
+	cb->frames = NULL;
+	cb->framed = false;
+
+	cb_free_mem(cb);
 }
 
 
 
 void cb_resize(circ_buf_t *cb, size_t size)
 {
-	uint8_t *new_buf;
+	circ_buf_t old;
+	struct iovec iov[2];
+	size_t done;
+	int i, count;
 
 	cb_assert(cb);
 	assert(size > 0);
 
-	/* create a new buffer and copy the existing data into it */
-	new_buf = (uint8_t *)xmalloc(size);
-	cb_extract(cb, new_buf, size);
+	/* the capacity of a pipe isn't ours to choose */
+	if (cb_is_spliced(cb))
+		cb_unsplice(cb);
+	if (cb_is_file_backed(cb))
+		cb_unsendfile(cb);
+
+	/* a chain just grows or shrinks as it is used */
+	if (cb_is_chained(cb)) {
+		cb->buf_size = size;
+		if (cb->data_size > size) {
+			/* drop the end of the data */
+			cb->data_size = size;
+			cb->fill = cb->head;
+			cb->fill_off = (cb->ptr - cb->head->data) + size;
+			cb_chain_produce(cb, 0);
+			cb_trim_frames(cb);
+		}
+		return;
+	}
 
-	/* replace buffer */
-	free(cb->buf);
-	cb->buf = new_buf;
+	/* create a new buffer and copy the existing data into it */
+	old = *cb;
+	cb_alloc_mem(cb, size);
+	count = cb_data_iov(&old, size, iov);
+	for (i = 0, done = 0; i < count; ++i) {
+		memcpy(cb->buf + done, iov[i].iov_base, iov[i].iov_len);
+		done += iov[i].iov_len;
+	}
+	cb_free_mem(&old);
 
 	/* adjust pointers and sizes */
 	cb->ptr = cb->buf;
-	cb->buf_size = size;
-	if (cb->data_size > size)
+	if (cb->data_size > size) {
 		cb->data_size = size;
+		cb_trim_frames(cb);
+	}
+}
+
+
+
+void cb_set_mirroring(size_t threshold)
+{
+	mirror_threshold = threshold;
+}
+
+
+
+int cb_mirror(circ_buf_t *cb)
+{
+	cb_assert(cb);
+
+	if (cb_is_mirrored(cb))
+		return 0;
+	/* pipes, files and chains have no memory of their own to map */
+	if (cb_is_spliced(cb) || cb_is_file_backed(cb) || cb_is_chained(cb))
+		return -1;
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+	if (mirror_threshold == 0 || cb->buf_size % sysconf(_SC_PAGESIZE) != 0)
+		return -1;
+
+	/* reallocate it at the same size, which copies the data */
+	cb->mirror_wanted = true;
+	cb_resize(cb, cb->buf_size);
+	return cb_is_mirrored(cb)? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+
+
+void cb_set_huge_pages(size_t threshold)
+{
+	huge_threshold = threshold;
+}
+
+
+
+size_t cb_huge_threshold(void)
+{
+	return huge_threshold;
+}
+
+
+
+const char *cb_memory_name(const circ_buf_t *cb)
+{
+	cb_assert(cb);
+
+	if (cb_is_spliced(cb))
+		return "a pipe";
+	if (cb_is_file_backed(cb))
+		return "the file";
+	if (cb_is_chained(cb))
+		return "a chain of segments";
+
+	switch (cb->backing) {
+	case CB_MIRRORED:
+		return "mirrored normal pages";
+	case CB_MIRRORED_HUGETLB:
+		return "mirrored huge pages";
+	case CB_HUGETLB:
+		return "huge pages";
+	case CB_THP:
+		return "transparent huge pages";
+	default:
+		return "normal pages";
+	}
+}
+
+
+
+void cb_set_adaptive(circ_buf_t *cb, size_t min, size_t max)
+{
+	cb_assert(cb);
+	assert(max == 0 || (min > 0 && min <= max));
+
+	cb->min_size = min;
+	cb->max_size = max;
+	cb->adapt_samples = cb->adapt_fills = cb->adapt_idle = 0;
+	cb->adapt_peak = 0;
+}
+
+
+
+void cb_adapt(circ_buf_t *cb)
+{
+	size_t size;
+
+	cb_assert(cb);
+	assert(cb_is_adaptive(cb));
+
+	/* the capacity of a pipe isn't ours to choose, and a file doesn't
+	 * use memory */
+	if (cb_is_spliced(cb) || cb_is_file_backed(cb))
+		return;
+
+	if (cb->data_size > cb->adapt_peak)
+		cb->adapt_peak = cb->data_size;
+	if (cb_is_full(cb))
+		cb->adapt_fills++;
+
+	/* the buffer keeps filling before it can be drained */
+	if (cb->adapt_fills >= ADAPT_GROW_FILLS &&
+	    cb->buf_size < cb->max_size)
+	{
+		size = MIN(cb->buf_size * 2, cb->max_size);
+		cb_resize(cb, size);
+		cb->resizes++;
+		cb->adapt_samples = cb->adapt_fills = cb->adapt_idle = 0;
+		cb->adapt_peak = cb->data_size;
+		return;
+	}
+
+	if (++cb->adapt_samples < ADAPT_WINDOW)
+		return;
+
+	/* end of the window */
+	if (cb->adapt_fills == 0 && cb->adapt_peak <= cb->buf_size / 4)
+		cb->adapt_idle++;
+	else
+		cb->adapt_idle = 0;
+
+	if (cb->adapt_idle >= ADAPT_SHRINK_WINDOWS &&
+	    cb->buf_size > cb->min_size)
+	{
+		size = MAX(cb->buf_size / 2, cb->min_size);
+		if (cb->data_size <= size) {
+			cb_resize(cb, size);
+			cb->resizes++;
+		}
+		cb->adapt_idle = 0;
+	}
+
+	cb->adapt_samples = cb->adapt_fills = 0;
+	cb->adapt_peak = cb->data_size;
+}
+
+
+
+int cb_splice(circ_buf_t *cb)
+{
+#ifdef HAVE_SPLICE
+	int fds[2];
+	int size;
+
+	cb_assert(cb);
+	assert(!cb_is_spliced(cb));
+	assert(!cb_is_file_backed(cb));
+
+	/* only an empty buffer in memory can be switched */
+	if (!cb_is_empty(cb) || cb_is_chained(cb) || cb_is_framed(cb))
+		return -1;
+
+	if (pipe(fds) != 0)
+		return -1;
+	nonblock(fds[0]);
+	nonblock(fds[1]);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	/* try to make the pipe as large as the buffer was, or the minimum
+	 * that pays off - this may be refused (eg. above the system limit,
+	 * or the limit for the user's pipes), so find out what we got */
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	if (fcntl(fds[1], F_SETPIPE_SZ,
+	          (int)MAX(cb->buf_size, SPLICE_PIPE_MIN)) < 0)
+		fcntl(fds[1], F_SETPIPE_SZ, (int)cb->buf_size);
+	size = fcntl(fds[1], F_GETPIPE_SZ);
+#else
+	size = -1;
+#endif
+	if (size <= 0)
+		size = 65536;  /* the historic linux pipe capacity */
+
+	cb->unspliced_size = cb->buf_size;
+	cb_free_mem(cb);
+	cb->ptr = NULL;
+	cb->pipe_fds[0] = fds[0];
+	cb->pipe_fds[1] = fds[1];
+	cb->pipe_size = size;
+	cb->buf_size = size;
+
+	cb_assert(cb);
+	return 0;
+#else
+	cb_assert(cb);
+	return -1;
+#endif
+}
+
+
+
+void cb_unsplice(circ_buf_t *cb)
+{
+	ssize_t rr;
+	size_t done;
+
+	cb_assert(cb);
+	assert(cb_is_spliced(cb));
+
+	/* the pipe may be much larger than the buffer was (see
+	 * SPLICE_PIPE_MIN), so go back to that size unless the data needs
+	 * more */
+	cb_alloc_mem(cb, MAX(cb->unspliced_size, cb->data_size));
+	cb->ptr = cb->buf;
+
+	/* all data accounted for is in the pipe, so this can't block */
+	for (done = 0; done < cb->data_size; done += rr) {
+		do {
+			errno = 0;
+			rr = read(cb->pipe_fds[0], cb->buf + done,
+			          cb->data_size - done);
+		} while (errno == EINTR);
+		if (rr <= 0)
+			fatal_internal("lost data in splice pipe: %s",
+			               strerror(errno));
+	}
+
+	close(cb->pipe_fds[0]);
+	close(cb->pipe_fds[1]);
+	cb->pipe_fds[0] = cb->pipe_fds[1] = -1;
+
+	cb_assert(cb);
+}
+
+
+int cb_chain(circ_buf_t *cb)
+{
+	cb_assert(cb);
+	assert(!cb_is_spliced(cb));
+	assert(!cb_is_file_backed(cb));
+
+	if (cb_is_chained(cb))
+		return 0;
+	/* only an empty buffer can be switched */
+	if (!cb_is_empty(cb))
+		return -1;
+
+	cb_free_mem(cb);
+	cb->ptr = NULL;
+	cb->chained = true;
+	cb->head = cb->tail = cb->fill = NULL;
+	cb->fill_off = 0;
+	cb->reserved = 0;
+
+	cb_assert(cb);
+	return 0;
+}
+
+
+
+int cb_frame(circ_buf_t *cb)
+{
+	cb_assert(cb);
+	assert(!cb_is_spliced(cb));
+	assert(!cb_is_file_backed(cb));
+
+	if (cb_is_framed(cb))
+		return 0;
+	/* only an empty buffer can be switched */
+	if (!cb_is_empty(cb))
+		return -1;
+
+	cb->framed = true;
+	cb->frame_first = cb->frame_count = 0;
+	cb->frame_wanted = 0;
+	return 0;
+}
+
+
+
+int cb_sendfile(circ_buf_t *cb, int fd)
+{
+#ifdef HAVE_SENDFILE
+	struct stat st;
+	off_t pos;
+	int file_fd;
+
+	cb_assert(cb);
+	assert(fd >= 0);
+	assert(!cb_is_spliced(cb));
+	assert(!cb_is_file_backed(cb));
+
+	/* only an empty buffer in memory can be switched */
+	if (!cb_is_empty(cb) || cb_is_chained(cb) || cb_is_framed(cb))
+		return -1;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
+	if ((pos = lseek(fd, 0, SEEK_CUR)) < 0)
+		return -1;
+
+	/* the buffer keeps its own descriptor, so that unsent data can
+	 * still be sent after the reader has closed fd.  It shares the file
+	 * offset, which is kept at the start of the data not yet sent */
+	if ((file_fd = dup(fd)) < 0)
+		return -1;
+	fcntl(file_fd, F_SETFD, FD_CLOEXEC);
+
+	cb_free_mem(cb);
+	cb->ptr = NULL;
+	cb->file_fd = file_fd;
+	cb->file_pos = pos;
+	cb->file_size = st.st_size;
+	cb->buf_size = MAX(cb->buf_size, SENDFILE_WINDOW);
+
+	cb_assert(cb);
+	return 0;
+#else
+	cb_assert(cb);
+	return -1;
+#endif
+}
+
+
+
+void cb_unsendfile(circ_buf_t *cb)
+{
+	ssize_t rr;
+	size_t done;
+
+	cb_assert(cb);
+	assert(cb_is_file_backed(cb));
+
+	cb_alloc_mem(cb, cb->buf_size);
+	cb->ptr = cb->buf;
+
+	/* the file offset is at the start of the data not yet sent */
+	for (done = 0; done < cb->data_size; done += rr) {
+		do {
+			errno = 0;
+			rr = read(cb->file_fd, cb->buf + done,
+			          cb->data_size - done);
+		} while (errno == EINTR);
+		if (rr < 0)
+			fatal(_("error reading file: %s"), strerror(errno));
+		/* the file has been truncated */
+		if (rr == 0)
+			break;
+	}
+	cb->data_size = done;
+
+	close(cb->file_fd);
+	cb->file_fd = -1;
+
+	cb_assert(cb);
+}
+
+
+
+int cb_space_iov(const circ_buf_t *cb, size_t nbytes, struct iovec *iov)
+{
+	uint8_t *start;
+	size_t len;
+
+	cb_assert(cb);
+	assert(iov != NULL);
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_space(cb))
+		nbytes = cb_space(cb);
+
+	if (cb_is_chained(cb)) {
+		/* only the segments in the chain can be used */
+		len = (cb->head == NULL)? 0 :
+			cb->reserved - (cb->ptr - cb->head->data) -
+			cb->data_size;
+		if (nbytes > len)
+			nbytes = len;
+		if (nbytes == 0)
+			return 0;
+		return cb_chain_iov(cb->fill, cb->fill_off, nbytes, iov);
+	}
+
+	assert(cb->buf != NULL);
+	if (nbytes == 0)
+		return 0;
+
+	/* the free space starts after the data, wrapping at the end
+	 * unless it can run on into the mirror */
+	start = cb->ptr + cb->data_size;
+	if (cb->mirrored) {
+		iov[0].iov_base = start;
+		iov[0].iov_len = nbytes;
+		return 1;
+	}
+	if (start >= cb->buf + cb->buf_size)
+		start -= cb->buf_size;
+	len = (cb->buf + cb->buf_size) - start;
+
+	iov[0].iov_base = start;
+	if (len >= nbytes) {
+		/* the space up to the end of buf provides enough */
+		iov[0].iov_len = nbytes;
+		return 1;
+	}
+
+	/* need to use the space at the beginning of buf as well */
+	iov[0].iov_len  = len;
+	iov[1].iov_base = cb->buf;
+	iov[1].iov_len  = nbytes - len;
+	return 2;
+}
+
+
+
+int cb_data_iov(const circ_buf_t *cb, size_t nbytes, struct iovec *iov)
+{
+	size_t len;
+
+	cb_assert(cb);
+	assert(iov != NULL);
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_used(cb))
+		nbytes = cb_used(cb);
+	if (nbytes == 0)
+		return 0;
+
+	if (cb_is_chained(cb))
+		return cb_chain_iov(cb->head, cb->ptr - cb->head->data,
+		                    nbytes, iov);
+
+	assert(cb->buf != NULL);
+
+	iov[0].iov_base = cb->ptr;
+	if (cb->mirrored) {
+		/* the data runs on into the mirror */
+		iov[0].iov_len = nbytes;
+		return 1;
+	}
+
+	len = (cb->buf + cb->buf_size) - cb->ptr;
+	if (len >= nbytes) {
+		/* data after ptr is enough */
+		iov[0].iov_len = nbytes;
+		return 1;
+	}
+
+	/* data after ptr and at beginning of buffer */
+	iov[0].iov_len  = len;
+	iov[1].iov_base = cb->buf;
+	iov[1].iov_len  = nbytes - len;
+	return 2;
+}
+
+
+
+void cb_produce(circ_buf_t *cb, size_t len)
+{
+	cb_assert(cb);
+	assert(len <= cb_space(cb));
+
+	if (cb_is_chained(cb))
+		cb_chain_produce(cb, len);
+	if (cb_is_framed(cb) && len > 0)
+		cb_push_frame(cb, len);
+	cb->data_size += len;
+}
+
+
+
+void cb_consume(circ_buf_t *cb, size_t len)
+{
+	cb_assert(cb);
+	assert(len <= cb->data_size);
+
+	if (cb_is_framed(cb))
+		cb_pop_frames(cb, len);
+	if (cb_is_chained(cb)) {
+		cb_chain_consume(cb, len);
+		return;
+	}
+
+	cb->data_size -= len;
+
+	/* update value of cb->ptr */
+	cb->ptr += len;
+	if (cb->ptr >= cb->buf + cb->buf_size) 
+		cb->ptr -= cb->buf_size;
+
+	/* sanity check */
+	cb_assert(cb);
 }
 
 
@@ -103,8 +734,7 @@ ssize_t cb_read(circ_buf_t *cb, int fd, size_t nbytes)
 {
 	ssize_t rr;
 	int count;
-	struct iovec iov[2];
-	size_t len;
+	struct iovec iov[CB_MAX_IOV];
 
 	cb_assert(cb);
 	assert(fd >= 0);
@@ -112,38 +742,24 @@ ssize_t cb_read(circ_buf_t *cb, int fd, size_t nbytes)
 	/* buffer is full, return an error condition */
 	if (cb_is_full(cb)) return -1;
 
-	/* set nbytes appropriately */
-	if (nbytes == 0 || (size_t)nbytes > cb_space(cb))
-		nbytes = cb_space(cb);
-	
+#ifdef HAVE_SENDFILE
+	if (cb_is_file_backed(cb))
+		return cb_file_read(cb, fd, nbytes);
+#endif
+#ifdef HAVE_SPLICE
+	if (cb_is_spliced(cb)) {
+		rr = cb_splice_read(cb, fd, nbytes);
+		/* fall back to copying if fd doesn't support splicing */
+		if (rr >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return rr;
+		cb_unsplice(cb);
+	}
+#endif
+
 	/* prepare for writing to buffer */
-	if (cb->ptr == cb->buf) {
-		/* space only at end of buf */
-		iov->iov_base = cb->ptr + cb->data_size;
-		iov->iov_len  = nbytes;
-		count = 1;
-	} else if (cb->ptr + cb->data_size >= cb->buf + cb->buf_size) {
-		/* space only before cb->ptr */
-		iov->iov_base = cb->ptr + cb->data_size - cb->buf_size;
-		iov->iov_len  = nbytes;
-		count = 1;
-	} else {
-		/* space at end and begining of buf */
-		iov[0].iov_base = cb->ptr + cb->data_size;
-		len = (cb->buf_size - cb->data_size) - (cb->ptr - cb->buf);
-
-		if (len >= nbytes) {
-			/* first space provides enough */
-			iov[0].iov_len = nbytes;
-			count = 1;
-		} else {
-			/* need to use both free spaces */
-			iov[0].iov_len = len;
-			iov[1].iov_base = cb->buf;
-			iov[1].iov_len = nbytes - len;
-			count = 2;
-		}
-	}		
+	if (cb_is_chained(cb))
+		cb_chain_reserve(cb, nbytes);
+	count = cb_space_iov(cb, nbytes, iov);
 
 	/* do the actual read */
 	do { 
@@ -154,12 +770,8 @@ ssize_t cb_read(circ_buf_t *cb, int fd, size_t nbytes)
 	/* if rr < 0 an error has occured, 
 	 * if rr = 0 nothing needs to be changed.
 	 * update internal stuff only if rr > 0 */
-	if (rr > 0) {
-		cb->data_size += rr;
-		
-		/* sanity check */
-		cb_assert(cb);
-	}
+	if (rr > 0)
+		cb_produce(cb, rr);
 
 	return rr;
 }
@@ -170,56 +782,56 @@ ssize_t cb_recv(circ_buf_t *cb, int fd, size_t nbytes,
                 struct sockaddr *from, size_t *fromlen)
 {
 	ssize_t rr;
-	int count;
-	struct iovec iov[2];
+	struct iovec iov[CB_MAX_IOV];
 	struct msghdr msg;
-	size_t len;
 
 	cb_assert(cb);
 	assert(fd >= 0);
+	/* datagrams can't be spliced without losing their boundaries */
+	assert(!cb_is_spliced(cb) && !cb_is_file_backed(cb));
 
 	/* buffer is full, return an error condition */
 	if (cb_is_full(cb)) return -1;
 
-	/* set nbytes appropriately */
-	if (nbytes == 0 || nbytes > cb_space(cb))
-		nbytes = cb_space(cb);
-	
-	/* prepare for writing to buffer */
-	if (cb->ptr == cb->buf) {
-		/* space only at end of buf */
-		iov->iov_base = cb->ptr + cb->data_size;
-		iov->iov_len  = nbytes;
-		count = 1;
-	} else if (cb->ptr + cb->data_size >= cb->buf + cb->buf_size) {
-		/* space only before cb->ptr */
-		iov->iov_base = cb->ptr + cb->data_size - cb->buf_size;
-		iov->iov_len  = nbytes;
-		count = 1;
-	} else {
-		/* space at end and begining of buf */
-		iov[0].iov_base = cb->ptr + cb->data_size;
-		len = (cb->buf_size - cb->data_size) - (cb->ptr - cb->buf);
-
-		if (len >= nbytes) {
-			/* first space provides enough */
-			iov[0].iov_len = nbytes;
-			count = 1;
-		} else {
-			/* need to use both free spaces */
-			iov[0].iov_len = len;
-			iov[1].iov_base = cb->buf;
-			iov[1].iov_len = nbytes - len;
-			count = 2;
+#if defined(MSG_TRUNC) && defined(MSG_DONTWAIT)
+	/* find out if the next datagram fits, unless there is room for any.
+	 * The fd may be blocking (eg. a datagram stdin), and there may be
+	 * no datagram after one that was dropped */
+	cb->frame_wanted = 0;
+	if (cb_is_framed(cb) && cb_space(cb) < CB_MAX_DATAGRAM) {
+		do {
+			errno = 0;
+			rr = recv(fd, NULL, 0,
+			          MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		} while (errno == EINTR);
+		if (rr < 0)
+			return rr;
+		if ((size_t)rr > cb_space(cb)) {
+			/* wait for the buffer to drain, if that will ever
+			 * help, or else drop the datagram rather than pass
+			 * on part of it */
+			if ((size_t)rr <= cb_size(cb)) {
+				cb->frame_wanted = rr;
+			} else {
+				do {
+					errno = 0;
+					recv(fd, NULL, 0, MSG_DONTWAIT);
+				} while (errno == EINTR);
+			}
+			errno = EMSGSIZE;
+			return -1;
 		}
-	}		
+	}
+#endif
 
 	/* setup msg structure */
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name    = (void *)from;
 	msg.msg_namelen = (from != NULL && fromlen != 0)? *fromlen : 0;
 	msg.msg_iov     = iov;
-	msg.msg_iovlen  = count;
+	if (cb_is_chained(cb))
+		cb_chain_reserve(cb, nbytes);
+	msg.msg_iovlen  = cb_space_iov(cb, nbytes, iov);
 
 	/* do the actual recv */
 	do {
@@ -234,27 +846,101 @@ ssize_t cb_recv(circ_buf_t *cb, int fd, size_t nbytes,
 	/* if rr < 0 an error has occured,
 	 * if rr = 0 nothing needs to be changed.
 	 * update internal stuff only if rr > 0 */
-	if (rr > 0) {
-		cb->data_size += rr;
-		
-		/* sanity check */
-		cb_assert(cb);
-	}
+	if (rr > 0)
+		cb_produce(cb, rr);
 
 	return rr;
 }
 
 
 
-ssize_t cb_append(circ_buf_t *cb, const uint8_t *buf, size_t len)
+ssize_t cb_recv_batch(circ_buf_t *cb, int fd, size_t nbytes, int count)
 {
-	ssize_t rr;
-	int i, count;
-	struct iovec iov[2];
-	const uint8_t *tmp;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[CB_MAX_BATCH];
+	struct iovec iovs[CB_MAX_BATCH][2];
+	uint8_t *space;
+	size_t total;
+	int i, rr;
+
+	cb_assert(cb);
+	assert(fd >= 0);
+	assert(nbytes > 0);
+	assert(count > 0);
+	/* datagrams can't be spliced without losing their boundaries */
+	assert(!cb_is_spliced(cb) && !cb_is_file_backed(cb));
+
+	/* buffer is full, return an error condition */
+	if (cb_is_full(cb)) return -1;
+
+	/* the slots have to be laid out in one piece of memory */
+	if (cb_is_chained(cb))
+		return cb_recv(cb, fd, 0, NULL, 0);
+
+	/* a framed buffer has to have room for any datagram in each slot */
+	if (cb_is_framed(cb))
+		nbytes = MAX(nbytes, CB_MAX_DATAGRAM);
+
+	/* each datagram gets a slot of nbytes, as many as fit */
+	if (count > CB_MAX_BATCH)
+		count = CB_MAX_BATCH;
+	if ((size_t)count > cb_space(cb) / nbytes)
+		count = cb_space(cb) / nbytes;
+	if (count <= 1)
+		return cb_recv(cb, fd, 0, NULL, 0);
+
+	space = cb_wrap(cb, cb->ptr, cb->data_size);
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (i = 0; i < count; ++i) {
+		msgs[i].msg_hdr.msg_iov = iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = cb_region_iov(cb,
+			cb_wrap(cb, space, i * nbytes), nbytes, iovs[i]);
+	}
+
+	/* only wait for the first datagram */
+	do {
+		errno = 0;
+		rr = recvmmsg(fd, msgs, count, MSG_WAITFORONE, NULL);
+	} while (errno == EINTR);
+
+	if (rr <= 0)
+		return rr;
+
+	/* close up the gaps left at the end of each slot */
+	total = msgs[0].msg_len;
+	for (i = 1; i < rr; ++i) {
+		cb_space_move(cb, total, i * nbytes, msgs[i].msg_len);
+		total += msgs[i].msg_len;
+	}
+
+	/* produce each datagram in turn, so that a framed buffer records
+	 * them separately */
+	for (i = 0; i < rr; ++i)
+		cb_produce(cb, msgs[i].msg_len);
+
+	return total;
+#else
+	(void)nbytes;
+	(void)count;
+	return cb_recv(cb, fd, 0, NULL, 0);
+#endif
+}
+
+
+
+ssize_t cb_append(circ_buf_t *cb, const uint8_t *buf, size_t len)
+{
+	ssize_t rr;
+	int i, count;
+	struct iovec iov[CB_MAX_IOV];
 
 	cb_assert(cb);
 	assert(buf != NULL);
+
+	if (cb_is_spliced(cb))
+		cb_unsplice(cb);
+	if (cb_is_file_backed(cb))
+		cb_unsendfile(cb);
 	
 	/* buffer is full, return an error condition */
 	if (cb_is_full(cb)) return -1;
@@ -262,50 +948,17 @@ ssize_t cb_append(circ_buf_t *cb, const uint8_t *buf, size_t len)
 	/* return if len is zero */
 	if (len == 0) return 0;
 	
-	/* setup initial values for tmp and rr */
-	tmp = (const uint8_t *)buf;
-	rr  = 0;
-	
 	/* prepare for writing to buffer */
-	if (cb->ptr == cb->buf) {
-		/* space only at end of buf */
-		iov->iov_base = cb->ptr + cb->data_size;
-		iov->iov_len  = cb->buf_size - cb->data_size;
-		count = 1;
-	} else if (cb->ptr + cb->data_size >= cb->buf + cb->buf_size) {
-		/* space only before cb->ptr */
-		iov->iov_base = cb->ptr + cb->data_size - cb->buf_size;
-		iov->iov_len  = cb->buf_size - cb->data_size;
-		count = 1;
-	} else {
-		/* space at end and begining of buf */
-		iov[0].iov_base = cb->ptr + cb->data_size;
-		iov[0].iov_len  = (cb->buf_size - cb->data_size) 
-		                - (cb->ptr - cb->buf);
-		iov[1].iov_base = cb->buf;
-		iov[1].iov_len  = cb->ptr - cb->buf;
-		count = 2;
-	}		
+	if (cb_is_chained(cb))
+		cb_chain_reserve(cb, len);
+	count = cb_space_iov(cb, len, iov);
 
 	/* do the actual copy */
-	for (i = 0; i < count; ++i) {
-		size_t chunk_size;
-		
-		chunk_size = MIN((size_t)iov[i].iov_len, len);
-		assert(chunk_size > 0);
-		
-		memcpy((void *)iov[i].iov_base, (const void *)tmp, chunk_size);
-
-		tmp = tmp + chunk_size;
-		len -= chunk_size;
-		cb->data_size += chunk_size;
-		rr += chunk_size;
-
-		/* sanity check */
-		cb_assert(cb);
-		
-		if (len == 0) break;
+	for (i = 0, rr = 0; i < count; ++i) {
+		memcpy(iov[i].iov_base, buf + rr, iov[i].iov_len);
+		rr += iov[i].iov_len;
 	}
+	cb_produce(cb, rr);
 
 	return rr;
 }
@@ -316,41 +969,35 @@ ssize_t cb_write(circ_buf_t *cb, int fd, size_t nbytes)
 {
 	ssize_t rr;
 	int count;
-	struct iovec iov[2];
-	size_t len;
+	struct iovec iov[CB_MAX_IOV];
 	
 	cb_assert(cb);
 	assert(fd >= 0);
 	
 	/* buffer is empty, return immediately */
 	if (cb_is_empty(cb)) return 0;
-	
-	/* set nbytes appropriately */
-	if (nbytes == 0 || nbytes > cb_used(cb))
-		nbytes = cb_used(cb);
 
+#ifdef HAVE_SENDFILE
+	if (cb_is_file_backed(cb)) {
+		rr = cb_file_write(cb, fd, nbytes);
+		/* fall back to copying if fd doesn't support sendfile */
+		if (rr >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return rr;
+		cb_unsendfile(cb);
+	}
+#endif
+#ifdef HAVE_SPLICE
+	if (cb_is_spliced(cb)) {
+		rr = cb_splice_write(cb, fd, nbytes);
+		/* fall back to copying if fd doesn't support splicing */
+		if (rr >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return rr;
+		cb_unsplice(cb);
+	}
+#endif
+	
 	/* prepare for reading from buffer */
-	if (cb->ptr + cb->data_size > cb->buf + cb->buf_size) {
-		/* data after ptr and at beginning of buffer */
-		iov[0].iov_base = cb->ptr;
-		len = cb->buf_size - (cb->ptr - cb->buf);
-
-		if (len >= nbytes) {
-			/* data after ptr is enough */
-			iov[0].iov_len = nbytes;
-			count = 1;
-		} else {
-			iov[0].iov_len  = len;
-			iov[1].iov_base = cb->buf;
-			iov[1].iov_len  = nbytes - len;
-			count = 2;
-		}
-	} else {
-		/* data only after ptr */
-		iov[0].iov_base = cb->ptr;
-		iov[0].iov_len  = nbytes;
-		count = 1;
-	}		
+	count = cb_data_iov(cb, nbytes, iov);
 
 	/* do the actual write */
 	do { 
@@ -361,18 +1008,8 @@ ssize_t cb_write(circ_buf_t *cb, int fd, size_t nbytes)
 	/* if rr < 0 an error has occured, 
 	 * if rr = 0 nothing needs to be changed.
 	 * update internal stuff only if rr > 0 */
-	if (rr > 0) {
-		assert((size_t)rr <= cb->data_size);
-		cb->data_size -= rr;
-		
-		/* update value of cb->ptr */
-		cb->ptr += rr;
-		if (cb->ptr >= cb->buf + cb->buf_size) 
-			cb->ptr -= cb->buf_size;
-		
-		/* sanity check */
-		cb_assert(cb);
-	}
+	if (rr > 0)
+		cb_consume(cb, rr);
 
 	return rr;
 }
@@ -383,50 +1020,27 @@ ssize_t cb_send(circ_buf_t *cb, int fd, size_t nbytes,
                 struct sockaddr *dest, size_t destlen)
 {
 	ssize_t rr;
-	int count;
-	struct iovec iov[2];
+	struct iovec iov[CB_MAX_IOV];
 	struct msghdr msg;
-	size_t len;
 	
 	cb_assert(cb);
 	assert(fd >= 0);
+	/* datagrams can't be spliced without losing their boundaries */
+	assert(!cb_is_spliced(cb) && !cb_is_file_backed(cb));
 	
 	/* buffer is empty, return immediately */
 	if (cb_is_empty(cb)) return 0;
-	
-	/* set nbytes appropriately */
-	if (nbytes == 0 || nbytes > cb_used(cb))
-		nbytes = cb_used(cb);
-	
-	/* prepare for reading from buffer */
-	if (cb->ptr + cb->data_size > cb->buf + cb->buf_size) {
-		/* data after ptr and at beginning of buffer */
-		iov[0].iov_base = cb->ptr;
-		len = cb->buf_size - (cb->ptr - cb->buf);
-
-		if (len >= nbytes) {
-			/* data after ptr is enough */
-			iov[0].iov_len = nbytes;
-			count = 1;
-		} else {
-			iov[0].iov_len  = len;
-			iov[1].iov_base = cb->buf;
-			iov[1].iov_len  = nbytes - len;
-			count = 2;
-		}
-	} else {
-		/* data only after ptr */
-		iov[0].iov_base = cb->ptr;
-		iov[0].iov_len  = nbytes;
-		count = 1;
-	}		
+
+	/* send the next datagram whole */
+	if (cb_is_framed(cb))
+		nbytes = cb->frames[cb->frame_first];
 	
 	/* setup msg structure */
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name    = (void *)dest;
 	msg.msg_namelen = destlen;
 	msg.msg_iov     = iov;
-	msg.msg_iovlen  = count;
+	msg.msg_iovlen  = cb_data_iov(cb, nbytes, iov);
 
 	/* do the actual send */
 	do { 
@@ -437,32 +1051,93 @@ ssize_t cb_send(circ_buf_t *cb, int fd, size_t nbytes,
 	/* if rr < 0 an error has occured, 
 	 * if rr = 0 nothing needs to be changed.
 	 * update internal stuff only if rr > 0 */
-	if (rr > 0) {
-		assert((size_t)rr <= cb->data_size);
-		cb->data_size -= rr;
-		
-		/* update value of cb->ptr */
-		cb->ptr += rr;
-		if (cb->ptr >= cb->buf + cb->buf_size) 
-			cb->ptr -= cb->buf_size;
-		
-		/* sanity check */
-		cb_assert(cb);
-	}
+	if (rr > 0)
+		cb_consume(cb, rr);
 
 	return rr;
 }
 
 
 
+ssize_t cb_send_batch(circ_buf_t *cb, int fd, size_t nbytes, int count)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[CB_MAX_BATCH];
+	struct iovec iovs[CB_MAX_BATCH][2];
+	uint8_t *ptr;
+	size_t left, len, total;
+	int i, n, rr;
+
+	cb_assert(cb);
+	assert(fd >= 0);
+	assert(count > 0);
+	/* datagrams can't be spliced without losing their boundaries */
+	assert(!cb_is_spliced(cb) && !cb_is_file_backed(cb));
+
+	/* buffer is empty, return immediately */
+	if (cb_is_empty(cb)) return 0;
+
+	if (count > CB_MAX_BATCH)
+		count = CB_MAX_BATCH;
+	if ((nbytes == 0 && !cb_is_framed(cb)) || count == 1 ||
+	    cb_is_chained(cb))
+		return cb_send(cb, fd, nbytes, NULL, 0);
+
+	/* cut the data into datagrams of (up to) nbytes, or as they were
+	 * received */
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	ptr = cb->ptr;
+	left = cb->data_size;
+	for (n = 0; n < count && left > 0; ++n) {
+		if (cb_is_framed(cb))
+			len = cb->frames[(cb->frame_first + n) %
+			                 cb->frames_size];
+		else
+			len = (left < nbytes)? left : nbytes;
+		msgs[n].msg_hdr.msg_iov = iovs[n];
+		msgs[n].msg_hdr.msg_iovlen = cb_region_iov(cb, ptr, len,
+			iovs[n]);
+		ptr = cb_wrap(cb, ptr, len);
+		left -= len;
+	}
+
+	/* do the actual send */
+	do {
+		errno = 0;
+		rr = sendmmsg(fd, msgs, n, 0);
+	} while (errno == EINTR);
+
+	if (rr <= 0)
+		return rr;
+
+	total = 0;
+	for (i = 0; i < rr; ++i)
+		total += msgs[i].msg_len;
+
+	cb_consume(cb, total);
+
+	return total;
+#else
+	(void)count;
+	return cb_send(cb, fd, nbytes, NULL, 0);
+#endif
+}
+
+
+
 ssize_t cb_extract(circ_buf_t *cb, uint8_t *buf, size_t len)
 {
 	ssize_t rr;
 	int i, count;
-	struct iovec iov[2];
+	struct iovec iov[CB_MAX_IOV];
 
 	cb_assert(cb);
 	assert(buf != NULL);
+
+	if (cb_is_spliced(cb))
+		cb_unsplice(cb);
+	if (cb_is_file_backed(cb))
+		cb_unsendfile(cb);
 	
 	/* buffer is empty, return immediately */
 	if (cb_is_empty(cb)) return 0;
@@ -470,65 +1145,690 @@ ssize_t cb_extract(circ_buf_t *cb, uint8_t *buf, size_t len)
 	/* return if len is zero */
 	if (len == 0) return 0;
 
-	/* setup initial value for rr */
-	rr = 0;
-	
 	/* prepare for reading from buffer */
-	if (cb->ptr + cb->data_size > cb->buf + cb->buf_size) {
-		iov[0].iov_base = cb->ptr;
-		iov[0].iov_len  = cb->buf_size - (cb->ptr - cb->buf);
-		iov[1].iov_base = cb->buf;
-		iov[1].iov_len  = cb->data_size - iov[0].iov_len;
-		count = 2;
-	} else {
-		iov[0].iov_base = cb->ptr;
-		iov[0].iov_len  = cb->data_size;
-		count = 1;
-	}		
+	count = cb_data_iov(cb, len, iov);
 
 	/* do the actual copy */
-	for (i = 0; i < count; ++i) {
-		size_t chunk_size;
+	for (i = 0, rr = 0; i < count; ++i) {
+		memcpy(buf + rr, iov[i].iov_base, iov[i].iov_len);
+		rr += iov[i].iov_len;
+	}
+	cb_consume(cb, rr);
 
-		chunk_size = MIN((size_t)iov[i].iov_len, len);
-		assert(chunk_size > 0);
+	return rr;
+}
 
-		memcpy((void *)buf, (const void *)iov[i].iov_base, chunk_size);
 
-		buf = buf + chunk_size;
-		len -= chunk_size;
-		rr += chunk_size;
 
-		/* sanity check */
-		cb_assert(cb);
+void cb_clear(circ_buf_t *cb)
+{
+	cb_assert(cb);
 
-		if (len == 0) break;
+	if (cb_is_spliced(cb))
+		cb_unsplice(cb);
+	if (cb_is_file_backed(cb))
+		cb_unsendfile(cb);
+	if (cb_is_chained(cb))
+		cb_chain_release(cb);
+	
+	cb->ptr = cb->buf;
+	cb->data_size = 0;
+	cb->frame_first = cb->frame_count = 0;
+}
+
+
+
+#ifdef HAVE_SPLICE
+static ssize_t cb_splice_read(circ_buf_t *cb, int fd, size_t nbytes)
+{
+	ssize_t rr;
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_space(cb))
+		nbytes = cb_space(cb);
+
+	/* move data from fd into the pipe */
+	do {
+		errno = 0;
+		rr = splice(fd, NULL, cb->pipe_fds[1], NULL, nbytes,
+		            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (errno == EINTR);
+
+	if (rr > 0) {
+		cb->data_size += rr;
+		cb_assert(cb);
+	} else if (rr < 0 && errno == EAGAIN && !cb_is_empty(cb)) {
+		/* the pipe capacity is counted in pages rather than bytes,
+		 * so it can fill up before data_size reaches pipe_size -
+		 * report the buffer as full until it is drained */
+		cb->buf_size = cb->data_size;
+		cb_assert(cb);
 	}
 
-	/* if rr = 0 nothing needs to be changed,
-	 * update internal stuff only if rr > 0 */
+	return rr;
+}
+
+
+
+static ssize_t cb_splice_write(circ_buf_t *cb, int fd, size_t nbytes)
+{
+	ssize_t rr;
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_used(cb))
+		nbytes = cb_used(cb);
+
+	/* move data from the pipe to fd */
+	do {
+		errno = 0;
+		rr = splice(cb->pipe_fds[0], NULL, fd, NULL, nbytes,
+		            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (errno == EINTR);
+
 	if (rr > 0) {
 		assert((size_t)rr <= cb->data_size);
 		cb->data_size -= rr;
+		/* there is room in the pipe again */
+		cb->buf_size = cb->pipe_size;
+		cb_assert(cb);
+	}
+
+	return rr;
+}
+#endif
+
 
-		/* update value of cb->ptr */
-		cb->ptr += rr;
-		if (cb->ptr >= cb->buf + cb->buf_size)
-			cb->ptr -= cb->buf_size;
 
-		/* sanity check */
+#ifdef HAVE_SENDFILE
+static ssize_t cb_file_read(circ_buf_t *cb, int fd, size_t nbytes)
+{
+	struct stat st;
+	size_t avail;
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_space(cb))
+		nbytes = cb_space(cb);
+
+	/* check if the file has grown before reporting eof */
+	if (cb->file_pos >= cb->file_size) {
+		if (fstat(fd, &st) != 0)
+			return -1;
+		cb->file_size = st.st_size;
+		if (cb->file_pos >= cb->file_size)
+			return 0;
+	}
+
+	/* the data is left in the file until it is sent */
+	avail = (size_t)(cb->file_size - cb->file_pos);
+	if (nbytes > avail)
+		nbytes = avail;
+
+	cb->file_pos += nbytes;
+	cb->data_size += nbytes;
+
+	cb_assert(cb);
+	return nbytes;
+}
+
+
+
+static ssize_t cb_file_write(circ_buf_t *cb, int fd, size_t nbytes)
+{
+	ssize_t rr;
+
+	/* set nbytes appropriately */
+	if (nbytes == 0 || nbytes > cb_used(cb))
+		nbytes = cb_used(cb);
+
+	/* send from the current file offset, which sendfile advances */
+	do {
+		errno = 0;
+		rr = sendfile(fd, cb->file_fd, NULL, nbytes);
+	} while (errno == EINTR);
+
+	if (rr == 0) {
+		/* the file was truncated after it was read */
+		errno = EIO;
+		return -1;
+	}
+
+	if (rr > 0) {
+		assert((size_t)rr <= cb->data_size);
+		cb->data_size -= rr;
 		cb_assert(cb);
 	}
 
 	return rr;
 }
+#endif
 
 
 
-void cb_clear(circ_buf_t *cb)
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+/* returns the position off bytes after p, wrapping at the end of buf */
+static uint8_t *cb_wrap(const circ_buf_t *cb, uint8_t *p, size_t off)
+{
+	assert(off <= cb->buf_size);
+
+	p += off;
+	if (p >= cb->buf + cb->buf_size)
+		p -= cb->buf_size;
+	return p;
+}
+
+
+
+/* describe len bytes starting at start with at most 2 iovecs */
+static int cb_region_iov(const circ_buf_t *cb, uint8_t *start, size_t len,
+		struct iovec *iov)
+{
+	size_t end = (cb->buf + cb->buf_size) - start;
+
+	iov[0].iov_base = start;
+	if (cb->mirrored || end >= len) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len  = end;
+	iov[1].iov_base = cb->buf;
+	iov[1].iov_len  = len - end;
+	return 2;
+}
+#endif
+
+
+
+#ifdef HAVE_RECVMMSG
+/* move len bytes within the free space, from offset src to the lower
+ * offset dst (both relative to the end of the data) */
+static void cb_space_move(circ_buf_t *cb, size_t dst, size_t src, size_t len)
+{
+	uint8_t *space, *d, *s, *end;
+	size_t n;
+
+	assert(dst <= src);
+
+	space = cb_wrap(cb, cb->ptr, cb->data_size);
+	if (cb->mirrored) {
+		/* the free space is contiguous */
+		memmove(space + dst, space + src, len);
+		return;
+	}
+	d = cb_wrap(cb, space, dst);
+	s = cb_wrap(cb, space, src);
+	end = cb->buf + cb->buf_size;
+
+	/* copy in pieces that don't cross the end of buf.  As dst is below
+	 * src, copying upwards never overwrites data still to be moved */
+	while (len > 0) {
+		n = len;
+		if (n > (size_t)(end - d))
+			n = end - d;
+		if (n > (size_t)(end - s))
+			n = end - s;
+		memmove(d, s, n);
+		d = cb_wrap(cb, d, n);
+		s = cb_wrap(cb, s, n);
+		len -= n;
+	}
+}
+#endif
+
+
+
+void cb_record_used(circ_buf_t *cb)
 {
 	cb_assert(cb);
-	
-	cb->ptr = cb->buf;
-	cb->data_size = 0;
+
+	if (cb->data_size > cb->peak_used)
+		cb->peak_used = cb->data_size;
+	cb->used_total += cb->data_size;
+	cb->used_samples++;
+}
+
+
+
+double cb_mean_used(const circ_buf_t *cb)
+{
+	cb_assert(cb);
+
+	if (cb->used_samples == 0)
+		return 0.0;
+	return (double)cb->used_total / cb->used_samples;
+}
+
+
+
+/* allocate the memory for a buffer of size bytes, mirroring it if possible
+ * and it is large enough (or is wanted mirrored) */
+static void cb_alloc_mem(circ_buf_t *cb, size_t size)
+{
+	cb->buf_size = size;
+	cb->mirrored = false;
+	cb->backing = CB_HEAP;
+	cb->map_size = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (huge_threshold > 0 && size >= huge_threshold &&
+	    cb_huge_map(cb, size))
+		return;
+#endif
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+	if (cb_should_mirror(cb, size) && (cb->buf = cb_mirror_map(size,
+	                            sysconf(_SC_PAGESIZE), 0)) != NULL) {
+		cb->mirrored = true;
+		cb->backing = CB_MIRRORED;
+		return;
+	}
+#endif
+	cb->buf = (uint8_t *)xmalloc(size);
+}
+
+
+
+static void cb_free_mem(circ_buf_t *cb)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (cb->mirrored || cb->map_size > 0) {
+		munmap(cb->buf, cb->mirrored? 2 * cb->buf_size :
+		                cb->map_size);
+		cb->buf = NULL;
+		cb->mirrored = false;
+		cb->backing = CB_HEAP;
+		cb->map_size = 0;
+		return;
+	}
+#endif
+	free(cb->buf);
+	cb->buf = NULL;
+}
+
+
+
+#ifdef HAVE_SYS_MMAN_H
+/* try to give the buffer huge pages, in order of preference.  Returns false
+ * if none could be had */
+static bool cb_huge_map(circ_buf_t *cb, size_t size)
+{
+	size_t huge = huge_page_size();
+	size_t len = (size + huge - 1) / huge * huge;
+	void *addr;
+
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_HUGETLB)
+	if (cb_should_mirror(cb, size) &&
+	    (cb->buf = cb_mirror_map(size, huge, MFD_HUGETLB)) != NULL) {
+		cb->mirrored = true;
+		cb->backing = CB_MIRRORED_HUGETLB;
+		return true;
+	}
+#endif
+#ifdef MAP_HUGETLB
+	/* this fails unless enough huge pages have been set aside */
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED) {
+		cb->buf = (uint8_t *)addr;
+		cb->map_size = len;
+		cb->backing = CB_HUGETLB;
+		return true;
+	}
+#endif
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	/* aligned to the huge page size, so that all of it can be backed
+	 * by huge pages once it is touched */
+	if (thp_enabled() && (addr = cb_reserve(len, huge)) != NULL) {
+		if (mprotect(addr, len, PROT_READ | PROT_WRITE) == 0 &&
+		    madvise(addr, len, MADV_HUGEPAGE) == 0)
+		{
+			cb->buf = (uint8_t *)addr;
+			cb->map_size = len;
+			cb->backing = CB_THP;
+			return true;
+		}
+		munmap(addr, len);
+	}
+#endif
+	/* suppress unused variable warnings */
+	while (0&&addr&&len);
+	return false;
+}
+
+
+
+/* reserve len bytes of address space aligned to align bytes, without
+ * access.  Returns NULL on failure */
+static uint8_t *cb_reserve(size_t len, size_t align)
+{
+	uint8_t *base, *start;
+	void *addr;
+
+	addr = mmap(NULL, len + align, PROT_NONE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	base = (uint8_t *)addr;
+
+	/* trim the excess off either end */
+	start = base + (align - (uintptr_t)base % align) % align;
+	if (start > base)
+		munmap(base, start - base);
+	if (start + len < base + len + align)
+		munmap(start + len, (base + len + align) - (start + len));
+	return start;
+}
+
+
+
+/* the size of a huge page, as reported by the kernel */
+static size_t huge_page_size(void)
+{
+	static size_t size = 0;
+	unsigned long kb;
+	char line[128];
+	FILE *fp;
+
+	if (size > 0)
+		return size;
+
+	size = DEFAULT_HUGE_PAGE_SIZE;
+	if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+		return size;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 &&
+		    kb > 0)
+		{
+			size = kb * 1024;
+			break;
+		}
+	}
+	fclose(fp);
+	return size;
+}
+
+
+
+/* returns false if transparent huge pages are known to be turned off */
+static bool thp_enabled(void)
+{
+	static int enabled = -1;
+	char line[128];
+	FILE *fp;
+
+	if (enabled >= 0)
+		return enabled;
+
+	enabled = 0;
+	fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (fp == NULL)
+		return enabled;
+	if (fgets(line, sizeof(line), fp) != NULL)
+		enabled = (strstr(line, "[never]") == NULL);
+	fclose(fp);
+	return enabled;
+}
+#endif
+
+
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+/* map a memory file of size bytes twice, back to back, created with the
+ * memfd_create flags given and made of pages of page bytes.  Returns NULL
+ * if size isn't a multiple of the page size or the mapping fails, in which
+ * case the caller falls back to other memory */
+static uint8_t *cb_mirror_map(size_t size, size_t page, unsigned int flags)
+{
+	uint8_t *base = NULL;
+	int fd;
+
+	if (page == 0 || size % page != 0)
+		return NULL;
+
+	if ((fd = memfd_create("nc6-circ_buf", MFD_CLOEXEC | flags)) < 0)
+		return NULL;
+	if (ftruncate(fd, size) != 0)
+		goto done;
+
+	/* reserve the address space for both halves, then map the file
+	 * over each of them */
+	if ((base = cb_reserve(2 * size, page)) == NULL)
+		goto done;
+
+	if (mmap(base, size, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + size, size, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		munmap(base, 2 * size);
+		base = NULL;
+	}
+
+done:
+	/* the mappings keep the file alive */
+	close(fd);
+	return base;
+}
+#endif
+
+
+
+/* add segments to the end of a chain, until there is space for nbytes (or
+ * CHAIN_READAHEAD bytes if nbytes is 0) or no more is allowed */
+static void cb_chain_reserve(circ_buf_t *cb, size_t nbytes)
+{
+	cb_segment_t *seg;
+	size_t avail;
+
+	if (nbytes == 0)
+		nbytes = CHAIN_READAHEAD;
+	if (nbytes > cb_space(cb))
+		nbytes = cb_space(cb);
+
+	avail = (cb->head == NULL)? 0 :
+		cb->reserved - (cb->ptr - cb->head->data) - cb->data_size;
+	while (avail < nbytes) {
+		seg = segment_get();
+		if (cb->head == NULL) {
+			cb->head = cb->fill = seg;
+			cb->ptr = seg->data;
+			cb->fill_off = 0;
+		} else {
+			cb->tail->next = seg;
+		}
+		cb->tail = seg;
+		cb->reserved += CB_SEGMENT_SIZE;
+		avail += CB_SEGMENT_SIZE;
+	}
+}
+
+
+
+/* return all the segments of a chain to the pool */
+static void cb_chain_release(circ_buf_t *cb)
+{
+	cb_segment_t *seg;
+
+	while ((seg = cb->head) != NULL) {
+		cb->head = seg->next;
+		segment_put(seg);
+	}
+	cb->tail = cb->fill = NULL;
+	cb->fill_off = 0;
+	cb->reserved = 0;
+	cb->ptr = NULL;
+}
+
+
+
+/* move the end of the data len bytes further along the chain */
+static void cb_chain_produce(circ_buf_t *cb, size_t len)
+{
+	assert(cb->fill != NULL || len == 0);
+
+	if (cb->fill == NULL)
+		return;
+	cb->fill_off += len;
+	while (cb->fill_off >= CB_SEGMENT_SIZE && cb->fill->next != NULL) {
+		cb->fill = cb->fill->next;
+		cb->fill_off -= CB_SEGMENT_SIZE;
+	}
+	assert(cb->fill_off <= CB_SEGMENT_SIZE);
+}
+
+
+
+/* remove len bytes from the start of the data, returning the segments that
+ * are emptied to the pool */
+static void cb_chain_consume(circ_buf_t *cb, size_t len)
+{
+	cb_segment_t *seg;
+	size_t off;
+
+	cb->data_size -= len;
+
+	/* a drained buffer holds no memory */
+	if (cb->data_size == 0) {
+		cb_chain_release(cb);
+		return;
+	}
+
+	off = (cb->ptr - cb->head->data) + len;
+	while (off >= CB_SEGMENT_SIZE) {
+		seg = cb->head;
+		cb->head = seg->next;
+		segment_put(seg);
+		cb->reserved -= CB_SEGMENT_SIZE;
+		off -= CB_SEGMENT_SIZE;
+	}
+	assert(cb->head != NULL);
+	cb->ptr = cb->head->data + off;
+}
+
+
+
+/* describe nbytes of the chain starting at offset off in seg, with at most
+ * CB_MAX_IOV iovecs */
+static int cb_chain_iov(cb_segment_t *seg, size_t off, size_t nbytes,
+		struct iovec *iov)
+{
+	size_t len;
+	int count;
+
+	/* the position may be at the very end of a segment */
+	if (off == CB_SEGMENT_SIZE) {
+		seg = seg->next;
+		off = 0;
+	}
+
+	for (count = 0; nbytes > 0 && count < CB_MAX_IOV; ++count) {
+		assert(seg != NULL);
+		len = MIN(CB_SEGMENT_SIZE - off, nbytes);
+		iov[count].iov_base = seg->data + off;
+		iov[count].iov_len = len;
+		nbytes -= len;
+		seg = seg->next;
+		off = 0;
+	}
+
+	return count;
+}
+
+
+
+/* take a segment from the pool, which grows a slab at a time.  The pool
+ * keeps the segments returned to it for reuse by any buffer */
+static cb_segment_t *segment_get(void)
+{
+	cb_segment_t *seg;
+	int i;
+
+	if (pool == NULL) {
+		seg = (cb_segment_t *)xmalloc(POOL_SLAB_SEGMENTS *
+		                              sizeof(cb_segment_t));
+		for (i = 0; i < POOL_SLAB_SEGMENTS; ++i)
+			segment_put(&(seg[i]));
+	}
+
+	seg = pool;
+	pool = seg->next;
+	seg->next = NULL;
+	return seg;
+}
+
+
+
+static void segment_put(cb_segment_t *seg)
+{
+	seg->next = pool;
+	pool = seg;
+}
+
+
+
+/* record a datagram of len bytes at the end of the data */
+static void cb_push_frame(circ_buf_t *cb, size_t len)
+{
+	uint32_t *frames;
+	size_t i, size;
+
+	/* grow the ring, unwrapping it */
+	if (cb->frame_count == cb->frames_size) {
+		size = (cb->frames_size > 0)? cb->frames_size * 2 : 64;
+		frames = (uint32_t *)xmalloc(size * sizeof(uint32_t));
+		for (i = 0; i < cb->frame_count; ++i)
+			frames[i] = cb->frames[(cb->frame_first + i) %
+			                       cb->frames_size];
+		free(cb->frames);
+		cb->frames = frames;
+		cb->frames_size = size;
+		cb->frame_first = 0;
+	}
+
+	cb->frames[(cb->frame_first + cb->frame_count) % cb->frames_size] =
+		(uint32_t)len;
+	cb->frame_count++;
+}
+
+
+
+/* forget the datagrams (or the part of the first one) in the first len bytes
+ * of the data */
+static void cb_pop_frames(circ_buf_t *cb, size_t len)
+{
+	uint32_t *first;
+
+	while (len > 0) {
+		assert(cb->frame_count > 0);
+		first = &(cb->frames[cb->frame_first]);
+		if (*first > len) {
+			*first -= len;
+			return;
+		}
+		len -= *first;
+		cb->frame_first = (cb->frame_first + 1) % cb->frames_size;
+		cb->frame_count--;
+	}
+}
+
+
+
+/* drop the datagrams (or the part of the last one) beyond the end of the
+ * data, after it has been cut short */
+static void cb_trim_frames(circ_buf_t *cb)
+{
+	uint32_t *frame;
+	size_t i, total = 0;
+
+	if (!cb_is_framed(cb))
+		return;
+
+	for (i = 0; i < cb->frame_count; ++i) {
+		frame = &(cb->frames[(cb->frame_first + i) % cb->frames_size]);
+		if (total + *frame >= cb->data_size) {
+			*frame = cb->data_size - total;
+			cb->frame_count = (*frame > 0)? i + 1 : i;
+			return;
+		}
+		total += *frame;
+	}
 }
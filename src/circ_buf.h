@@ -25,16 +25,72 @@
 #include "misc.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
 
+/* the size of the segments that chained buffers are built from */
+#define CB_SEGMENT_SIZE	16384
+
+typedef struct cb_segment {
+	struct cb_segment *next;
+	uint8_t data[CB_SEGMENT_SIZE];
+} cb_segment_t;
+
+/* where the memory of a buffer comes from */
+typedef enum cb_backing {
+	CB_HEAP,             /* normal pages from the heap */
+	CB_MIRRORED,         /* a memory file of normal pages, mapped twice */
+	CB_MIRRORED_HUGETLB, /* a memory file of huge pages, mapped twice */
+	CB_HUGETLB,          /* reserved huge pages (MAP_HUGETLB) */
+	CB_THP               /* memory advised to use transparent huge pages */
+} cb_backing_t;
+
 typedef struct circ_buf {
 	uint8_t *buf;      /* pointer to the buffer */
 	uint8_t *ptr;      /* pointer to the beginning of written data */
 	size_t data_size;  /* number of bytes that have been written 
 	                    * into the buffer */
 	size_t buf_size;   /* size of the buffer */
+	bool mirrored;     /* buf is mapped a second time right after
+	                    * itself, so no region of it ever wraps */
+	bool mirror_wanted; /* mirror buf whatever its size (see cb_mirror) */
+	cb_backing_t backing;      /* where the memory of buf comes from */
+	size_t map_size;   /* length of the mapping of buf, if it isn't
+	                    * from the heap or mirrored */
+	int pipe_fds[2];   /* pipe holding the data when splicing, or -1 */
+	size_t pipe_size;  /* capacity of the pipe */
+	size_t unspliced_size; /* size of the buffer before it was spliced */
+	int file_fd;       /* file the data is sent from, or -1 */
+	off_t file_pos;    /* file offset of the end of the data */
+	off_t file_size;   /* last known size of the file */
+	bool chained;      /* the data is held in a chain of segments */
+	cb_segment_t *head, *tail; /* the segments of the chain */
+	cb_segment_t *fill;        /* the segment holding the end of the data */
+	size_t fill_off;           /* offset of the end of the data in fill */
+	size_t reserved;           /* bytes in the segments of the chain */
+	bool framed;       /* the lengths of the datagrams are recorded */
+	uint32_t *frames;  /* ring of the lengths of the datagrams held */
+	size_t frames_size;        /* capacity of the ring */
+	size_t frame_first;        /* index of the oldest datagram */
+	size_t frame_count;        /* number of datagrams held */
+	size_t frame_wanted;       /* size of a datagram that didn't fit */
+
+	/* occupancy statistics, only gathered if tracking is enabled */
+	bool track_used;   /* sample data_size after each transfer */
+	size_t peak_used;  /* largest data_size sampled */
+	unsigned long long used_total; /* sum of the data_size samples */
+	unsigned long used_samples;    /* number of samples */
+
+	/* adaptive sizing, only done if max_size is set */
+	size_t min_size;   /* smallest size to shrink to */
+	size_t max_size;   /* largest size to grow to, or 0 */
+	unsigned int adapt_samples; /* samples in the current window */
+	unsigned int adapt_fills;   /* times it was full in the window */
+	size_t adapt_peak;          /* largest data_size in the window */
+	unsigned int adapt_idle;    /* consecutive windows of low use */
+	unsigned long resizes;      /* number of times it was resized */
 } circ_buf_t;
 
 
@@ -43,6 +99,98 @@ void cb_destroy(circ_buf_t *cb);
 
 void cb_resize(circ_buf_t *cb, size_t size);
 
+/* buffers of at least CB_MIRROR_THRESHOLD bytes whose size is a multiple of
+ * the page size are mirrored where possible: the memory is mapped twice,
+ * back to back, so that the data and the free space are always contiguous.
+ * Each mirror costs a memory file, three mappings and two entries in the
+ * process's map count, which smaller buffers (of which there may be
+ * thousands) don't make up for.  This changes the threshold for buffers
+ * allocated afterwards (0 disables mirroring, even with cb_mirror) */
+#define CB_MIRROR_THRESHOLD	262144
+void cb_set_mirroring(size_t threshold);
+
+/* mirror a buffer in memory whatever its size, for users that need its
+ * regions contiguous, keeping the data it holds (and keeping it mirrored as
+ * it is resized).  Returns 0 on success, or -1 if it can't be mirrored */
+int cb_mirror(circ_buf_t *cb);
+
+/* buffers of at least CB_HUGE_THRESHOLD bytes are given huge pages where
+ * possible, to spare the TLB while copying through them: reserved huge pages
+ * if the system has any free (mirrored, if the size is a multiple of the huge
+ * page size), or else memory that the kernel is advised to back with
+ * transparent huge pages.  Otherwise they fall back to normal pages.  This
+ * changes the threshold for buffers allocated afterwards (0 disables huge
+ * pages) */
+#define CB_HUGE_THRESHOLD	4194304
+void cb_set_huge_pages(size_t threshold);
+size_t cb_huge_threshold(void);
+#define cb_is_huge(CB)	\
+	((CB)->backing == CB_MIRRORED_HUGETLB || \
+	 (CB)->backing == CB_HUGETLB || (CB)->backing == CB_THP)
+/* a description of where the data of the buffer is held */
+const char *cb_memory_name(const circ_buf_t *cb);
+
+/* let the buffer size adapt to its use, between min and max bytes (a max of
+ * 0 disables adapting).  Once enabled, cb_adapt_size should be called after
+ * each transfer into or out of the buffer: the size is doubled when the
+ * buffer keeps filling up, and halved after sustained low occupancy.  The
+ * memory of the buffer moves when it is resized */
+void cb_set_adaptive(circ_buf_t *cb, size_t min, size_t max);
+#define cb_adapt_size(CB)	\
+	do { if ((CB)->max_size > 0) cb_adapt(CB); } while (0)
+void cb_adapt(circ_buf_t *cb);
+#define cb_is_adaptive(CB)	((CB)->max_size > 0)
+#define cb_resizes(CB)		((CB)->resizes)
+#define cb_is_mirrored(CB)	((CB)->mirrored)
+/* the extent of the memory addressed through buf, including the mirror */
+#define cb_mapped_size(CB)	\
+	((CB)->mirrored? 2 * (CB)->buf_size : (CB)->buf_size)
+
+/* switch an empty buffer to holding its data in a pipe, so that cb_read and
+ * cb_write move it with splice(2) rather than copying it through memory.
+ * Returns 0 on success, or -1 if splicing isn't supported */
+int cb_splice(circ_buf_t *cb);
+/* move any data in the pipe back into memory and stop splicing */
+void cb_unsplice(circ_buf_t *cb);
+#define cb_is_spliced(CB)	((CB)->pipe_fds[0] >= 0)
+
+/* switch an empty buffer to holding its data in a chain of fixed size
+ * segments, taken from a pool shared by all buffers as they are needed and
+ * returned to it when the buffer drains.  The size of the buffer then only
+ * limits how much data it may hold, and resizing it never copies.  Chained
+ * buffers can't be spliced or file-backed.  Returns 0 on success, or -1 if
+ * the buffer isn't empty */
+int cb_chain(circ_buf_t *cb);
+#define cb_is_chained(CB)	((CB)->chained)
+
+/* the largest datagram that can be received */
+#define CB_MAX_DATAGRAM	65536
+
+/* switch an empty buffer held in memory to recording the length of each
+ * datagram (or each read or append) stored in it, so that cb_send and
+ * cb_send_batch send the data in the same datagrams it arrived in,
+ * regardless of nbytes.  A framed buffer doesn't need room for the largest
+ * possible datagram before receiving: if the next datagram won't fit, cb_recv
+ * fails with EMSGSIZE (where the size can be found out without receiving it)
+ * and cb_frame_wanted gives its size until the next cb_recv.  If it never
+ * would fit, as it is larger than the buffer, it is dropped and
+ * cb_frame_wanted is 0.  Returns 0 on success, or -1 if the buffer isn't
+ * empty */
+int cb_frame(circ_buf_t *cb);
+#define cb_is_framed(CB)	((CB)->framed)
+#define cb_frame_wanted(CB)	((CB)->frame_wanted)
+/* the number of datagrams held */
+#define cb_frames(CB)		((CB)->frame_count)
+
+/* switch an empty buffer to reading from the regular file fd, which is then
+ * sent with sendfile(2) by cb_write.  Reads from the file become simple
+ * accounting, as the data stays in the page cache until it is sent.
+ * Returns 0 on success, or -1 if fd can't be used */
+int cb_sendfile(circ_buf_t *cb, int fd);
+/* read any data not yet sent into memory and stop using sendfile */
+void cb_unsendfile(circ_buf_t *cb);
+#define cb_is_file_backed(CB)	((CB)->file_fd >= 0)
+
 #define cb_size(CB)	((CB)->buf_size)
 #define cb_used(CB)	((CB)->data_size)
 #define cb_space(CB)	((CB)->buf_size - (CB)->data_size)
@@ -50,6 +198,21 @@ void cb_resize(circ_buf_t *cb, size_t size);
 #define cb_is_empty(CB)	(cb_used(CB) == 0)
 #define cb_is_full(CB)	(cb_space(CB) == 0)
 
+/* the most iovecs that describe a region of a buffer */
+#define CB_MAX_IOV	16
+
+/* describe the free space (or the data) in the buffer, up to nbytes (or all
+ * of it if nbytes is 0), with at most 2 iovecs (always 1 if the buffer is
+ * mirrored), or up to CB_MAX_IOV if it is chained.  Only the free space in
+ * the segments already in a chain is described.  Returns the number of
+ * iovecs used.  Only valid for buffers held in memory */
+int cb_space_iov(const circ_buf_t *cb, size_t nbytes, struct iovec *iov);
+int cb_data_iov(const circ_buf_t *cb, size_t nbytes, struct iovec *iov);
+/* record that len bytes were stored into the free space (or removed from
+ * the start of the data) described by the iovecs */
+void cb_produce(circ_buf_t *cb, size_t len);
+void cb_consume(circ_buf_t *cb, size_t len);
+
 ssize_t cb_read(circ_buf_t *cb, int fd, size_t nbytes);
 ssize_t cb_recv(circ_buf_t *cb, int fd, size_t nbytes,
                 struct sockaddr *from, size_t *fromlen);
@@ -58,9 +221,31 @@ ssize_t cb_write(circ_buf_t *cb, int fd, size_t nbytes);
 ssize_t cb_send(circ_buf_t *cb, int fd, size_t nbytes,
                 struct sockaddr *dest, size_t destlen);
 
+/* the most datagrams handled by one call to cb_recv_batch/cb_send_batch */
+#define CB_MAX_BATCH	256
+
+/* receive up to count datagrams of at most nbytes each with a single
+ * system call (where recvmmsg(2) is available).  The datagrams are stored
+ * back to back, as with repeated calls to cb_recv.  If there is only space
+ * for one, a single datagram is received into all of the space */
+ssize_t cb_recv_batch(circ_buf_t *cb, int fd, size_t nbytes, int count);
+/* send up to count datagrams of at most nbytes each with a single system
+ * call (where sendmmsg(2) is available) */
+ssize_t cb_send_batch(circ_buf_t *cb, int fd, size_t nbytes, int count);
+
 ssize_t cb_append(circ_buf_t *cb, const uint8_t *buf, size_t len);
 ssize_t cb_extract(circ_buf_t *cb, uint8_t *buf, size_t len);
 
 void cb_clear(circ_buf_t *cb);
 
+/* occupancy statistics.  Once tracking is enabled, cb_sample_used should be
+ * called after each transfer into or out of the buffer */
+#define cb_track_used(CB)	((CB)->track_used = true)
+#define cb_sample_used(CB)	\
+	do { if ((CB)->track_used) cb_record_used(CB); } while (0)
+void cb_record_used(circ_buf_t *cb);
+#define cb_peak_used(CB)	((CB)->peak_used)
+/* mean of the sampled data sizes, or 0 if there are no samples */
+double cb_mean_used(const circ_buf_t *cb);
+
 #endif/*CIRC_BUF_H*/
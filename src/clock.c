@@ -0,0 +1,95 @@
+/*
+ *  clock.c - cached monotonic clock - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "clock.h"
+
+#include <errno.h>
+#include <time.h>
+
+struct timeval _clock_now = { 0, 0 };
+unsigned long _clock_reads = 0;
+
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+/* the clocks to try, in order of preference.  The coarse clock is cheaper
+ * to read and its resolution (a scheduler tick) is ample for timeouts that
+ * are set in seconds */
+static const struct {
+	clockid_t id;
+	const char *name;
+} clocks[] = {
+#ifdef CLOCK_MONOTONIC_COARSE
+	{ CLOCK_MONOTONIC_COARSE, "monotonic-coarse" },
+#endif
+	{ CLOCK_MONOTONIC,        "monotonic" },
+};
+#define NCLOCKS		(int)(sizeof(clocks) / sizeof(clocks[0]))
+
+/* index of the clock in use, or NCLOCKS if there is none */
+static int clock_index = 0;
+#endif
+
+
+
+void clock_update(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	int err;
+
+	_clock_reads++;
+
+	if (clock_index < NCLOCKS &&
+	    clock_gettime(clocks[clock_index].id, &ts) == 0) {
+		_clock_now.tv_sec = ts.tv_sec;
+		_clock_now.tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+
+	/* fall back to the next clock if the kernel doesn't support one,
+	 * leaving errno as the caller had it */
+	err = errno;
+	for (++clock_index; clock_index < NCLOCKS; ++clock_index) {
+		if (clock_gettime(clocks[clock_index].id, &ts) == 0) {
+			_clock_now.tv_sec = ts.tv_sec;
+			_clock_now.tv_usec = ts.tv_nsec / 1000;
+			errno = err;
+			return;
+		}
+	}
+	errno = err;
+#else
+	_clock_reads++;
+#endif
+	gettimeofday(&_clock_now, NULL);
+}
+
+
+
+const char *clock_name(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_index < NCLOCKS)
+		return clocks[clock_index].name;
+#endif
+	return "gettimeofday";
+}
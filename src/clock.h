@@ -0,0 +1,47 @@
+/*
+ *  clock.h - cached monotonic clock - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <sys/time.h>
+
+/* the time used for timeouts is read from a monotonic clock (so that it
+ * isn't affected by changes to the system time), and is cached so that all
+ * the streams serviced in an iteration of an event loop share a single
+ * read of the clock.  Only intervals between two readings are meaningful */
+
+/* read the clock into the cache.  poller_wait does this each time it
+ * returns, so event loops using it needn't */
+void clock_update(void);
+
+/* the time as of the last clock_update */
+extern struct timeval _clock_now;
+#define clock_now()		((const struct timeval *)&_clock_now)
+
+/* number of times the clock has been read */
+extern unsigned long _clock_reads;
+#define clock_reads()		(_clock_reads)
+
+/* name of the clock in use, eg. for benchmarks */
+const char *clock_name(void);
+
+#endif/*CLOCK_H*/
@@ -31,6 +31,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -41,18 +43,40 @@
 typedef struct established_cdata {
 	const connection_attributes_t *attrs;
 	established_callback_t delegate_callback;
+	established_datagram_t delegate_datagram;
 	void *callback_cdata;
 } established_cdata_t;
 
+/* scan attempts time out after 5 seconds unless a timeout is given */
+static const time_t DEFAULT_SCAN_TIMEOUT = 5;
+#if defined(TCP_FASTOPEN) && defined(TCP_FASTOPEN_CONNECT)
+/* fast open SYNs carrying data that can wait to be accepted, unless a
+ * listen backlog is given (which is then used for them too) */
+static const int FASTOPEN_QUEUE_LENGTH = SOMAXCONN;
+#endif
+/* with --reconnect, the delay before connecting again starts at 200ms and
+ * doubles after each failed attempt, up to 30 seconds */
+static const long RECONNECT_MIN_DELAY = 200;
+static const long RECONNECT_MAX_DELAY = 30000;
+
 
 
 static int net_connect(const connection_attributes_t *attrs,
 		const struct addrinfo *hints,
 		established_cdata_t established_cdata);
+static int connect_remote(const connection_attributes_t *attrs,
+		const struct addrinfo *hints, int *socktype);
+static int retry_connect(const connection_attributes_t *attrs,
+		const struct addrinfo *hints, int *socktype, bool first);
+static void backoff_sleep(long delay, bool failed);
 static int net_listen(const connection_attributes_t *attrs,
 		const struct addrinfo *hints,
-		established_cdata_t established_cdata);
+		established_cdata_t established_cdata,
+		listen_wait_handler_t wait_handler, void *wdata);
 static void established_calback(int fd, int socktype, void *cdata);
+static void established_datagram(int fd, const struct sockaddr *from,
+		socklen_t fromlen, const uint8_t *data, size_t len,
+		void *cdata);
 static void set_sockopt_handler(int sock, void *hdata);
 static void warn_socket_details(const connection_attributes_t *attrs,
 		int sock, int socktype);
@@ -60,7 +84,9 @@ static void warn_socket_details(const connection_attributes_t *attrs,
 
 
 int establish_connections(const connection_attributes_t *attrs,
-		established_callback_t callback, void *cdata)
+		established_callback_t callback,
+		established_datagram_t datagram_callback, void *cdata,
+		listen_wait_handler_t wait_handler, void *wdata)
 {
 	established_cdata_t callback_data;
 	struct addrinfo hints;
@@ -70,6 +96,7 @@ int establish_connections(const connection_attributes_t *attrs,
 	/* store connection attributes and original callback plus cdata */
 	callback_data.attrs = attrs;
 	callback_data.delegate_callback = callback;
+	callback_data.delegate_datagram = datagram_callback;
 	callback_data.callback_cdata = cdata;
 
 	/* setup getaddrinfo hints */
@@ -78,7 +105,8 @@ int establish_connections(const connection_attributes_t *attrs,
 
 	/* establish connections */
 	if (ca_is_flag_set(attrs, CA_PASSIVE)) {
-		return net_listen(attrs, &hints, callback_data);
+		return net_listen(attrs, &hints, callback_data,
+		                  wait_handler, wdata);
 	} else {
 		return net_connect(attrs, &hints, callback_data);
 	} 
@@ -89,13 +117,18 @@ int establish_connections(const connection_attributes_t *attrs,
 
 
 
-static int net_connect(const connection_attributes_t *attrs,
-		const struct addrinfo *hints,
-		established_cdata_t established_cdata)
+int scan_connections(const connection_attributes_t *attrs)
 {
+	struct addrinfo hints;
 	const address_t *remote, *local;
 	time_t timeout;
-	int fd, socktype;
+
+	assert(attrs != NULL);
+	assert(ca_is_flag_set(attrs, CA_SCAN));
+
+	/* setup getaddrinfo hints */
+	memset(&hints, 0, sizeof(hints));
+	ca_to_addrinfo(&hints, attrs);
 
 	/* get addresses */
 	remote = ca_remote_address(attrs);
@@ -103,25 +136,54 @@ static int net_connect(const connection_attributes_t *attrs,
 
 	/* get timeout */
 	timeout = ca_connect_timeout(attrs);
+	if (timeout <= 0)
+		timeout = DEFAULT_SCAN_TIMEOUT;
+
+	return afindep_scan(hints,
+			ca_scan_hosts(attrs), ca_scan_nhosts(attrs),
+			remote->service,
+			local->nodename, local->service,
+			set_sockopt_handler, &attrs,
+			timeout, ca_scan_concurrency(attrs));
+}
+
 
-	/* invoke the appropriate connector for the protocol family */
-	switch (ca_family(attrs)) {
-#ifdef ENABLE_BLUEZ
-	case PF_BLUETOOTH:
-		fd = bluez_connect(*hints,
-				remote->nodename, remote->service,
-				set_sockopt_handler, &attrs,
-				timeout, &socktype);
-		break;
-#endif/*ENABLE_BLUEZ*/
-	default:
-		fd = afindep_connect(*hints,
-				remote->nodename, remote->service,
-				local->nodename, local->service,
-				set_sockopt_handler, &attrs,
-				timeout, &socktype);
-		break;
-	}
+
+int reconnect_remote(const connection_attributes_t *attrs, int *socktype)
+{
+	struct addrinfo hints;
+	int fd;
+
+	assert(attrs != NULL);
+	assert(socktype != NULL);
+	assert(ca_is_flag_set(attrs, CA_RECONNECT));
+
+	/* setup getaddrinfo hints */
+	memset(&hints, 0, sizeof(hints));
+	ca_to_addrinfo(&hints, attrs);
+
+	fd = retry_connect(attrs, &hints, socktype, false);
+
+	if (verbose_mode())
+		warn_socket_details(attrs, fd, *socktype);
+
+	return fd;
+}
+
+
+
+static int net_connect(const connection_attributes_t *attrs,
+		const struct addrinfo *hints,
+		established_cdata_t established_cdata)
+{
+	int fd, socktype;
+
+	fd = connect_remote(attrs, hints, &socktype);
+
+	/* keep trying if the remote isn't available yet, but not if it
+	 * never will be */
+	if (fd == -1 && ca_is_flag_set(attrs, CA_RECONNECT))
+		fd = retry_connect(attrs, hints, &socktype, true);
 
 	/* return errors immediately */
 	if (fd < 0)
@@ -136,11 +198,12 @@ static int net_connect(const connection_attributes_t *attrs,
 
 static int net_listen(const connection_attributes_t *attrs,
 		const struct addrinfo *hints,
-		established_cdata_t established_cdata)
+		established_cdata_t established_cdata,
+		listen_wait_handler_t wait_handler, void *wdata)
 {
 	const address_t *remote, *local;
 	time_t timeout;
-	int max_accept;
+	int backlog, max_accept;
 
 	/* get addresses */
 	remote = ca_remote_address(attrs);
@@ -149,6 +212,11 @@ static int net_listen(const connection_attributes_t *attrs,
 	/* get timeout */
 	timeout = ca_connect_timeout(attrs);
 
+	/* get the length of the accept queue */
+	backlog = ca_listen_backlog(attrs);
+	if (backlog <= 0)
+		backlog = SOMAXCONN;
+
 	/* get maximum accepted connection (currently either 1 or infinite) */
 	max_accept = ca_is_flag_set(attrs, CA_CONTINUOUS_ACCEPT)? -1 : 1;
 
@@ -161,15 +229,20 @@ static int net_listen(const connection_attributes_t *attrs,
 				remote->nodename, remote->service,
 				set_sockopt_handler, &attrs,
 				established_calback, &established_cdata,
-				timeout, max_accept);
+				wait_handler, wdata,
+				backlog, timeout, max_accept);
 #endif/*ENABLE_BLUEZ*/
 	default:
 		return afindep_listener(*hints,
 				local->nodename, local->service,
 				remote->nodename, remote->service,
 				set_sockopt_handler, &attrs,
-				established_calback, &established_cdata,
-				timeout, max_accept);
+				established_calback,
+				(established_cdata.delegate_datagram != NULL)?
+				established_datagram : NULL,
+				&established_cdata,
+				wait_handler, wdata,
+				backlog, timeout, max_accept);
 	}
 
 	/* never reached */
@@ -178,6 +251,93 @@ static int net_listen(const connection_attributes_t *attrs,
 
 
 
+/* connect to the remote endpoint once.  Returns the socket, with its type
+ * in *socktype, -1 on failure, or -2 if trying again can't help */
+static int connect_remote(const connection_attributes_t *attrs,
+		const struct addrinfo *hints, int *socktype)
+{
+	const address_t *remote, *local;
+	time_t timeout;
+
+	/* get addresses */
+	remote = ca_remote_address(attrs);
+	local = ca_local_address(attrs);
+
+	/* get timeout */
+	timeout = ca_connect_timeout(attrs);
+
+	/* invoke the appropriate connector for the protocol family */
+	switch (ca_family(attrs)) {
+#ifdef ENABLE_BLUEZ
+	case PF_BLUETOOTH:
+		return bluez_connect(*hints,
+				remote->nodename, remote->service,
+				set_sockopt_handler, &attrs,
+				timeout, socktype);
+#endif/*ENABLE_BLUEZ*/
+	default:
+		return afindep_connect(*hints,
+				remote->nodename, remote->service,
+				local->nodename, local->service,
+				set_sockopt_handler, &attrs,
+				timeout, socktype);
+	}
+}
+
+
+
+/* connect to the remote endpoint, waiting before each attempt with a
+ * jittered exponential backoff and retrying until one succeeds.  first is
+ * set when the first connect has just failed: until there has been a
+ * connection, a failure that trying again can't help is returned (once
+ * there has been one, the remote host may just be changing address) */
+static int retry_connect(const connection_attributes_t *attrs,
+		const struct addrinfo *hints, int *socktype, bool first)
+{
+	long delay = RECONNECT_MIN_DELAY;
+	bool failed = first;
+	int fd;
+
+	for (;;) {
+		backoff_sleep(delay, failed);
+
+		fd = connect_remote(attrs, hints, socktype);
+		if (fd >= 0 || (fd == -2 && first))
+			return fd;
+
+		failed = true;
+		delay = MIN(delay * 2, RECONNECT_MAX_DELAY);
+	}
+}
+
+
+
+/* sleep for a random time between half of delay and delay milliseconds, so
+ * that clients that lost the same server don't all return at once.  The
+ * wait is reported if the last attempt failed, or in verbose mode */
+static void backoff_sleep(long delay, bool failed)
+{
+	static bool seeded = false;
+	struct timespec ts;
+
+	if (!seeded) {
+		srandom((unsigned int)(time(NULL) ^ getpid()));
+		seeded = true;
+	}
+
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	if (failed || verbose_mode())
+		warning(_("reconnecting in %ld.%03ld seconds"),
+		        delay / 1000, delay % 1000);
+
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+
+
 /* callback when connection is established */
 static void established_calback(int fd, int socktype, void *cdata)
 {
@@ -201,6 +361,23 @@ static void established_calback(int fd, int socktype, void *cdata)
 
 
 
+/* callback for each datagram received on a shared datagram socket */
+static void established_datagram(int fd, const struct sockaddr *from,
+		socklen_t fromlen, const uint8_t *data, size_t len,
+		void *cdata)
+{
+	established_cdata_t *established_cdata = (established_cdata_t *)cdata;
+
+	assert(established_cdata != NULL);
+	assert(established_cdata->delegate_datagram != NULL);
+
+	established_cdata->delegate_datagram(established_cdata->attrs,
+			fd, from, fromlen, data, len,
+			established_cdata->callback_cdata);
+}
+
+
+
 /* handler function to set socket options on newly created sockets */
 static void set_sockopt_handler(int sock, void *hdata)
 {
@@ -223,6 +400,20 @@ static void set_sockopt_handler(int sock, void *hdata)
 			    strerror(errno));
 	}
 
+#ifdef SO_REUSEPORT
+	/* let each worker bind its own listening socket to the address, so
+	 * that the kernel balances the incoming connections between them */
+	if (ca_workers(attrs) > 0) {
+		on = 1;
+		/* without it, the bind of all but one worker will fail */
+		err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+				&on, sizeof(on));
+		if (err < 0)
+			warning("error with setsockopt SO_REUSEPORT: %s",
+			    strerror(errno));
+	}
+#endif
+
 	/* disable the nagle option for TCP sockets */
 	if (ca_is_flag_set(attrs, CA_DISABLE_NAGLE)) {
 		on = 1;
@@ -236,6 +427,53 @@ static void set_sockopt_handler(int sock, void *hdata)
 		}
 	}
 
+#if defined(TCP_FASTOPEN) && defined(TCP_FASTOPEN_CONNECT)
+	/* enable TCP fast open: listening sockets accept data in the SYN
+	 * from clients holding a cookie, and connecting sockets defer the
+	 * SYN until the first write so the data can go with it (the kernel
+	 * falls back to a normal handshake when there is no cookie).  A
+	 * connection that never writes would never send its SYN, so those
+	 * connect normally, as do the attempts afindep_connect races
+	 * against each other */
+	if (ca_is_flag_set(attrs, CA_FASTOPEN) &&
+	    (ca_is_flag_set(attrs, CA_PASSIVE) ||
+	     !ca_is_flag_set(attrs, CA_RECV_DATA_ONLY)))
+	{
+		if (ca_is_flag_set(attrs, CA_PASSIVE)) {
+			on = ca_listen_backlog(attrs);
+			if (on <= 0)
+				on = FASTOPEN_QUEUE_LENGTH;
+			err = setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+					&on, sizeof(on));
+		} else {
+			on = 1;
+			err = setsockopt(sock, IPPROTO_TCP,
+					TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+		}
+		/* ignore error if this socket does not use TCP */
+		if (err < 0 && errno != ENOPROTOOPT) {
+			warning("error with setsockopt TCP_FASTOPEN: %s",
+			    strerror(errno));
+		}
+	}
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+	/* only wake the listener for connections once they have sent some
+	 * data, so idle clients don't hold a process or relay slot */
+	if (ca_is_flag_set(attrs, CA_PASSIVE) &&
+	    (on = ca_defer_accept(attrs)) > 0)
+	{
+		err = setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				&on, sizeof(on));
+		/* ignore error if this socket does not use TCP */
+		if (err < 0 && errno != ENOPROTOOPT) {
+			warning("error with setsockopt TCP_DEFER_ACCEPT: %s",
+			    strerror(errno));
+		}
+	}
+#endif
+
 	/* setup the kernel sndbuf size */
 	if ((on = ca_sndbuf_size(attrs)) > 0) {
 		/* in case of error, we will go on anyway... */
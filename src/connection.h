@@ -23,12 +23,33 @@
 #define CONNECTION_H
 
 #include "attributes.h"
+#include "afindep.h"
 
 typedef void (*established_callback_t)(const connection_attributes_t *attrs,
 		int fd, int socktype, void *cdata);
+/* called with each datagram received on a listening datagram socket that
+ * is shared by all the senders, for the session of the sender */
+typedef void (*established_datagram_t)(const connection_attributes_t *attrs,
+		int fd, const struct sockaddr *from, socklen_t fromlen,
+		const uint8_t *data, size_t len, void *cdata);
 
-/* establish connections and issue callbacks */
+/* establish connections and issue callbacks.  When listening, datagram
+ * sockets are shared by all their senders if datagram_callback is not NULL
+ * (otherwise each is connected to its first sender), and wait_handler (if
+ * not NULL) is used to wait for incoming connections */
 int establish_connections(const connection_attributes_t *attrs,
-		established_callback_t callback, void *cdata);
+		established_callback_t callback,
+		established_datagram_t datagram_callback, void *cdata,
+		listen_wait_handler_t wait_handler, void *wdata);
+
+/* with --reconnect, connect to the remote endpoint again after the last
+ * connection closed, backing off between attempts until one succeeds.
+ * Returns the socket, with its type in *socktype */
+int reconnect_remote(const connection_attributes_t *attrs, int *socktype);
+
+/* connect to each of the remote hosts and services, reporting which are
+ * open without relaying any data.  Returns the number found open, or -1 on
+ * error */
+int scan_connections(const connection_attributes_t *attrs);
 
 #endif/*CONNECTION_H*/
@@ -21,6 +21,7 @@
  */  
 #include "system.h"
 #include "io_stream.h"
+#include "clock.h"
 #include "misc.h"
 
 #include <assert.h>
@@ -29,6 +30,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 
@@ -48,6 +50,10 @@ static void ios_assert(const io_stream_t *ios)
 #endif
 
 
+static void ios_close_fd(io_stream_t *ios, int fd);
+static bool can_splice(int fd);
+
+
 
 void ios_init_socket(io_stream_t *ios, const char *name, int fd, int socktype,
 		circ_buf_t *inbuf, circ_buf_t *outbuf)
@@ -112,18 +118,50 @@ void ios_init(io_stream_t *ios, const char *name,
 
 	ios->mtu = 0; /* unlimited */
 	ios->nru = 1; /* at least 1 byte space before reading */
+	ios->batch = 1; /* one datagram per system call */
 
 	ios->half_close_suppress = false;
 
 	ios->idle_timeout = -1;  /* infinite  */
-	gettimeofday(&(ios->last_active), NULL);
+	clock_update();
+	ios->last_active = *clock_now();
+	ios->started = *clock_now();
 
 	ios->hold_time = -1;     /* infinite */
 	timerclear(&(ios->read_eof));
 
+	ios->poller = NULL;
+
+	ios->peer_len = 0;
+
 	ios->name = xstrdup(name);
 	ios->rcvd = 0;
 	ios->sent = 0;
+
+	ios->reads = 0;
+	ios->writes = 0;
+	ios->eagains = 0;
+	ios->short_writes = 0;
+	ios->wakeups = 0;
+}
+
+
+
+void ios_init_peer(io_stream_t *ios, const char *name, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peer_len,
+		circ_buf_t *inbuf, circ_buf_t *outbuf)
+{
+	/* check arguments */
+	assert(peer != NULL);
+	assert(peer_len > 0 && peer_len <= sizeof(ios->peer));
+
+	ios_init(ios, name, fd, fd, socktype, inbuf, outbuf);
+
+	/* with no fd_in, the socket is never shutdown for reading, and it is
+	 * just the stream's own fd_out that is closed for writing */
+	ios->fd_in = -1;
+	memcpy(&(ios->peer), peer, peer_len);
+	ios->peer_len = peer_len;
 }
 
 
@@ -139,18 +177,58 @@ void io_stream_destroy(io_stream_t *ios)
 
 
 
+bool ios_splice(io_stream_t *ios_in, io_stream_t *ios_out)
+{
+	/* check arguments */
+	ios_assert(ios_in);
+	ios_assert(ios_out);
+	assert(ios_in->buf_in == ios_out->buf_out);
+
+	if (ios_in->fd_in < 0 || ios_out->fd_out < 0 ||
+	    !can_splice(ios_in->fd_in) || !can_splice(ios_out->fd_out))
+		return false;
+
+	return (cb_splice(ios_in->buf_in) == 0);
+}
+
+
+
+bool ios_sendfile(io_stream_t *ios_in, io_stream_t *ios_out)
+{
+	/* check arguments */
+	ios_assert(ios_in);
+	ios_assert(ios_out);
+	assert(ios_in->buf_in == ios_out->buf_out);
+
+	/* datagrams are written with cb_send, which must keep boundaries */
+	if (ios_in->fd_in < 0 || ios_out->fd_out < 0 ||
+	    ios_out->socktype != SOCK_STREAM)
+		return false;
+
+	return (cb_sendfile(ios_in->buf_in, ios_in->fd_in) == 0);
+}
+
+
+
 int ios_schedule_read(io_stream_t *ios)
 {
-	size_t space;
+	size_t space, need;
 
 	/* check argument */
 	ios_assert(ios);
 	
 	space = cb_space(ios->buf_in);
+
+	/* a datagram that didn't fit needs room for all of it, unless the
+	 * buffer has since shrunk too small for it (and the next read will
+	 * drop it) */
+	need = ios->nru;
+	if (cb_frame_wanted(ios->buf_in) <= cb_size(ios->buf_in))
+		need = MAX(need, cb_frame_wanted(ios->buf_in));
 	
 	/* if closed, the buffer is full or there isn't enough free space in
 	 * the buffer to satisfy the nru, then we can't read */
-	if ((ios->fd_in < 0) || space == 0 || space < ios->nru)
+	if ((ios->fd_in < 0) || space == 0 || space < need)
 		return -1;
 	
 	/* schedule a read from fdin */
@@ -176,7 +254,7 @@ int ios_schedule_write(io_stream_t *ios)
 
 struct timeval *ios_next_timeout(io_stream_t *ios, struct timeval *tv)
 {
-	struct timeval now;
+	const struct timeval *now = clock_now();
 	struct timeval *tvp = NULL;
 
 	/* check arguments */
@@ -185,11 +263,8 @@ struct timeval *ios_next_timeout(io_stream_t *ios, struct timeval *tv)
 
 	/* no idle timeout if idle_timeout is infinite */
 	if (ios->idle_timeout > 0) {
-		/* check if the idle timeout has been triggered */
-		gettimeofday(&now, NULL);
-
 		/* calculate the offset from now until the expiry */
-		timersub(&(ios->last_active), &now, tv);
+		timersub(&(ios->last_active), now, tv);
 		tv->tv_sec += ios->idle_timeout;
 		tvp = tv;
 
@@ -214,10 +289,7 @@ struct timeval *ios_next_timeout(io_stream_t *ios, struct timeval *tv)
 			timerclear(&hold_tv);
 		} else {
 			/* calculate the offset from now until expiry */
-			/* now may already be set from calculating idle above */
-			if (tvp == NULL)
-				gettimeofday(&now, NULL);
-			timersub(&(ios->read_eof), &now, &hold_tv);
+			timersub(&(ios->read_eof), now, &hold_tv);
 			hold_tv.tv_sec += ios->hold_time;
 		}
 
@@ -260,10 +332,42 @@ ssize_t ios_read(io_stream_t *ios)
 	assert(cb_space(ios->buf_in) >= ios->nru);
 
 	/* read as much as possible */
-	if (ios->socktype == SOCK_DGRAM)
-		rr = cb_recv(ios->buf_in, ios->fd_in, 0, NULL, 0);
-	else
+	if (ios->socktype != SOCK_DGRAM) {
 		rr = cb_read(ios->buf_in, ios->fd_in, 0);
+		return ios_read_complete(ios, rr);
+	}
+
+	/* a datagram larger than the buffer is dropped, so go on to the
+	 * next (stopping would leave an edge triggered poller waiting).
+	 * cb_recv doesn't block for it, so this ends with EAGAIN */
+	for (;;) {
+		if (ios->batch > 1)
+			rr = cb_recv_batch(ios->buf_in, ios->fd_in, ios->nru,
+			                   ios->batch);
+		else
+			rr = cb_recv(ios->buf_in, ios->fd_in, 0, NULL, 0);
+		if (rr >= 0 || errno != EMSGSIZE ||
+		    !cb_is_framed(ios->buf_in) ||
+		    cb_frame_wanted(ios->buf_in) > 0)
+			break;
+		if (very_verbose_mode())
+			warning(_("dropped a datagram from %s larger than "
+			          "its buffer"), ios->name);
+	}
+
+	return ios_read_complete(ios, rr);
+}
+
+
+
+ssize_t ios_read_complete(io_stream_t *ios, ssize_t rr)
+{
+	/* check argument */
+	ios_assert(ios);
+
+	ios->reads++;
+	cb_sample_used(ios->buf_in);
+	cb_adapt_size(ios->buf_in);
 
 	if (rr > 0) {
 		ios->rcvd += rr;
@@ -272,7 +376,7 @@ ssize_t ios_read(io_stream_t *ios)
 			warning("read %d bytes from %s", rr, ios->name);
 #endif
 		/* record that the ios was active */
-		gettimeofday(&(ios->last_active), NULL);
+		ios->last_active = *clock_now();
 
 		return rr;
 	} else if (rr == 0) {
@@ -281,7 +385,7 @@ ssize_t ios_read(io_stream_t *ios)
 			warning(_("read eof from %s"), ios->name);
 
 		/* record the time eof was received */
-		gettimeofday(&(ios->read_eof), NULL);
+		ios->read_eof = *clock_now();
 
 		/* set the eof flag */
 		ios->flags |= IOS_INPUT_EOF;
@@ -292,6 +396,11 @@ ssize_t ios_read(io_stream_t *ios)
 		return IOS_EOF;
 	} else if (errno == EAGAIN) {
 		/* not ready? */
+		ios->eagains++;
+		return 0;
+	} else if (errno == EMSGSIZE && cb_is_framed(ios->buf_in)) {
+		/* the next datagram doesn't fit - wait for the buffer to
+		 * drain until it does (see ios_schedule_read) */
 		return 0;
 	} else {
 		/* weird error */
@@ -315,12 +424,32 @@ ssize_t ios_write(io_stream_t *ios)
 	assert(ios->fd_out >= 0);
 	assert(!cb_is_empty(ios->buf_out));
 
-	/* write as much as the mtu allows */
-	if (ios->socktype == SOCK_DGRAM)
-		rr = cb_send(ios->buf_out, ios->fd_out, ios->mtu, NULL, 0);
+	/* write as much as the mtu allows (batches can only be sent to a
+	 * connected socket) */
+	if (ios->socktype == SOCK_DGRAM && ios->batch > 1 &&
+	    ios->peer_len == 0)
+		rr = cb_send_batch(ios->buf_out, ios->fd_out, ios->mtu,
+		                   ios->batch);
+	else if (ios->socktype == SOCK_DGRAM)
+		rr = cb_send(ios->buf_out, ios->fd_out, ios->mtu,
+		             ios_peer(ios), ios->peer_len);
 	else
 		rr = cb_write(ios->buf_out, ios->fd_out, ios->mtu);
 
+	return ios_write_complete(ios, rr);
+}
+
+
+
+ssize_t ios_write_complete(io_stream_t *ios, ssize_t rr)
+{
+	/* check argument */
+	ios_assert(ios);
+
+	ios->writes++;
+	cb_sample_used(ios->buf_out);
+	cb_adapt_size(ios->buf_out);
+
 	if (rr > 0) {
 		ios->sent += rr;
 #ifndef NDEBUG
@@ -328,7 +457,13 @@ ssize_t ios_write(io_stream_t *ios)
 			warning("wrote %d bytes to %s", rr, ios->name);
 #endif
 		/* record that the ios was active */
-		gettimeofday(&(ios->last_active), NULL);
+		ios->last_active = *clock_now();
+
+		/* the kernel didn't take all that it was offered (datagrams
+		 * are always sent whole) */
+		if (ios->socktype != SOCK_DGRAM && !cb_is_empty(ios->buf_out) &&
+		    (ios->mtu == 0 || (size_t)rr < ios->mtu))
+			ios->short_writes++;
 
 		/* shutdown the write if buf_out is empty and out eof is set */
 		if ((ios->flags & IOS_OUTPUT_EOF) && cb_is_empty(ios->buf_out))
@@ -340,6 +475,7 @@ ssize_t ios_write(io_stream_t *ios)
 		return 0;
 	} else if (errno == EAGAIN) {
 		/* not ready? */
+		ios->eagains++;
 		return 0;
 	} else {
 		if (very_verbose_mode()) {
@@ -368,6 +504,48 @@ void ios_write_eof(io_stream_t *ios)
 
 
 
+void ios_report_stats(const io_stream_t *ios)
+{
+	struct timeval elapsed;
+	unsigned long calls;
+	double secs;
+
+	/* check argument */
+	ios_assert(ios);
+
+	clock_update();
+	timersub(clock_now(), &(ios->started), &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+
+	warning(_("%s: sent %lu bytes, received %lu bytes in %.3f seconds "
+	          "(%.1f KB/s)"), ios->name,
+	        (unsigned long)ios->sent, (unsigned long)ios->rcvd, secs,
+	        (secs > 0)? (ios->sent + ios->rcvd) / secs / 1024 : 0.0);
+
+	calls = ios->reads + ios->writes;
+	warning(_("%s: %lu reads, %lu writes, %.1f bytes per call, "
+	          "%lu would block, %lu short writes, %lu wakeups"),
+	        ios->name, ios->reads, ios->writes,
+	        (calls > 0)? (double)(ios->sent + ios->rcvd) / calls : 0.0,
+	        ios->eagains, ios->short_writes, ios->wakeups);
+
+	if (ios->buf_in->track_used && cb_is_adaptive(ios->buf_in)) {
+		warning(_("%s: input buffer peak %lu, mean %.1f of %lu bytes "
+		          "(resized %lu times)"),
+		        ios->name, (unsigned long)cb_peak_used(ios->buf_in),
+		        cb_mean_used(ios->buf_in),
+		        (unsigned long)cb_size(ios->buf_in),
+		        cb_resizes(ios->buf_in));
+	} else if (ios->buf_in->track_used) {
+		warning(_("%s: input buffer peak %lu, mean %.1f of %lu bytes"),
+		        ios->name, (unsigned long)cb_peak_used(ios->buf_in),
+		        cb_mean_used(ios->buf_in),
+		        (unsigned long)cb_size(ios->buf_in));
+	}
+}
+
+
+
 void ios_shutdown(io_stream_t *ios, int how)
 {
 	/* check argument */
@@ -379,10 +557,10 @@ void ios_shutdown(io_stream_t *ios, int how)
 			return;
 
 		if (ios->fd_in >= 0)
-			close(ios->fd_in);
+			ios_close_fd(ios, ios->fd_in);
 		/* if the same fd is input and output, don't close twice */
 		if (ios->fd_out >= 0 && ios->fd_out != ios->fd_in)
-			close(ios->fd_out);
+			ios_close_fd(ios, ios->fd_out);
 		if (very_verbose_mode())
 			warning(_("closed %s"), ios->name);
 		ios->fd_in = ios->fd_out = -1;
@@ -400,7 +578,7 @@ void ios_shutdown(io_stream_t *ios, int how)
 					     ios->name);
 			}
 		} else {
-			close(ios->fd_in);
+			ios_close_fd(ios, ios->fd_in);
 			if (very_verbose_mode())
 				warning(_("closed %s for read"), ios->name);
 		}
@@ -421,10 +599,45 @@ void ios_shutdown(io_stream_t *ios, int how)
 					     ios->name);
 			}
 		} else {
-			close(ios->fd_out);
+			ios_close_fd(ios, ios->fd_out);
 			if (very_verbose_mode())
 				warning(_("closed %s for write"), ios->name);
 		}
 		ios->fd_out = -1;
 	}
 }
+
+
+
+/* close an fd of the stream, dropping it from the poller first */
+static void ios_close_fd(io_stream_t *ios, int fd)
+{
+	assert(fd >= 0);
+
+	if (ios->poller != NULL)
+		poller_del(ios->poller, fd);
+	close(fd);
+}
+
+
+
+/* returns true if fd is something that splice(2) can move data to or from */
+static bool can_splice(int fd)
+{
+	struct stat st;
+	int type;
+	socklen_t len = sizeof(type);
+
+	if (fstat(fd, &st) != 0)
+		return false;
+
+	if (S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode))
+		return true;
+
+	/* splicing would lose datagram boundaries */
+	if (S_ISSOCK(st.st_mode) &&
+	    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+		return (type == SOCK_STREAM);
+
+	return false;
+}
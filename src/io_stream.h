@@ -23,7 +23,9 @@
 #define IO_STREAM_H
 
 #include "circ_buf.h"
+#include "poller.h"
 #include <sys/time.h>
+#include <sys/socket.h>
 
 typedef struct io_stream
 {
@@ -38,6 +40,7 @@ typedef struct io_stream
 
 	size_t mtu;        /* Maximum Transmition Unit */
 	size_t nru;        /* miNimum Receive Unit */
+	int batch;         /* datagrams to receive or send per system call */
 
 	bool half_close_suppress; /* true if half-closes should be suppressed */
 
@@ -48,9 +51,24 @@ typedef struct io_stream
 	                    * -1 means hold indefinately */
 	struct timeval read_eof;    /* the time that eof was read */
 	
+	poller_t *poller;  /* poller watching the fds, if any */
+
+	/* where datagrams are sent when fd_out is shared by several peers
+	 * (see ios_init_peer), otherwise peer_len is 0 */
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+
 	char *name;        /* the name of this io stream (for logging) */
 	size_t rcvd;       /* bytes received */
 	size_t sent;       /* bytes sent */
+
+	/* statistics (see --stats) */
+	struct timeval started;     /* the time the stream was initialised */
+	unsigned long reads;        /* read system calls */
+	unsigned long writes;       /* write system calls */
+	unsigned long eagains;      /* reads and writes that would block */
+	unsigned long short_writes; /* writes that left data they could send */
+	unsigned long wakeups;      /* event notifications for the stream */
 } io_stream_t;
 
 /* status flags */
@@ -68,6 +86,14 @@ void ios_init_stdio(io_stream_t *ios, const char *name,
 void ios_init(io_stream_t *ios, const char *name,
 		int fd_in, int fd_out, int socktype,
 		circ_buf_t *inbuf, circ_buf_t *outbuf);
+/* a stream with one of the peers of an unconnected datagram socket, which
+ * writes by sending to the peer over fd.  The socket is shared with the
+ * other peers, so the stream has no fd to read from: the datagrams from
+ * the peer are received by the caller, who stores them in inbuf and
+ * accounts for them with ios_read_complete */
+void ios_init_peer(io_stream_t *ios, const char *name, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peer_len,
+		circ_buf_t *inbuf, circ_buf_t *outbuf);
 
 void io_stream_destroy(io_stream_t *ios);
 
@@ -78,6 +104,9 @@ void io_stream_destroy(io_stream_t *ios);
  * this is the minimum amount of data that can be handled in any read */
 #define ios_set_nru(IOS, U)	((IOS)->nru = (U))
 
+/* sets the number of datagrams handled by each read or write */
+#define ios_set_batch(IOS, N)	((IOS)->batch = (N))
+
 /* sets half closes suppression */
 #define ios_suppress_half_close(IOS, B)	((IOS)->half_close_suppress = (B))
 
@@ -87,6 +116,20 @@ void io_stream_destroy(io_stream_t *ios);
 /* sets the time (in sec) after read is shutdown that timeout occurs */
 #define ios_set_hold_timeout(IOS, T)	((IOS)->hold_time = (T))
 
+/* sets the poller that the stream fds are registered with.  The fds are
+ * removed from the poller before they are closed */
+#define ios_set_poller(IOS, P)		((IOS)->poller = (P))
+
+
+/* moves data from the input of ios_in to the output of ios_out with
+ * splice(2), if both fds support it.  The streams must share the buffer.
+ * Returns true if splicing was enabled */
+bool ios_splice(io_stream_t *ios_in, io_stream_t *ios_out);
+/* sends the input of ios_in to the output of ios_out with sendfile(2), if
+ * the input is a regular file and the output a stream.  The streams must
+ * share the buffer.  Returns true if sendfile was enabled */
+bool ios_sendfile(io_stream_t *ios_in, io_stream_t *ios_out);
+
 
 /* returns an fd if the stream should be scheduled for read, -1 otherwise */
 int ios_schedule_read(io_stream_t *ios);
@@ -111,6 +154,13 @@ ssize_t ios_read(io_stream_t *ios);
  * returns the total bytes read, or a negative error code */
 ssize_t ios_write(io_stream_t *ios);
 
+/* account for the result of a read or write that was done on the stream's
+ * buffer by other means (eg. asynchronously).  rr is the return value of the
+ * read or write (with errno set if it is negative), and the return value is
+ * as for ios_read/ios_write */
+ssize_t ios_read_complete(io_stream_t *ios, ssize_t rr);
+ssize_t ios_write_complete(io_stream_t *ios, ssize_t rr);
+
 /* error return values from ios_read/ios_write */
 #define IOS_FAILED	-1
 #define IOS_EOF		-2
@@ -128,11 +178,21 @@ void ios_write_eof(io_stream_t *ios);
 void ios_shutdown(io_stream_t *ios, int how);
 
 
+/* the peer of a stream from ios_init_peer, or NULL */
+#define ios_peer(IOS)		\
+	(((IOS)->peer_len > 0)? (struct sockaddr *)&((IOS)->peer) : NULL)
+#define ios_peer_len(IOS)	((IOS)->peer_len)
+
 #define ios_bytes_received(IOS)	((IOS)->rcvd)
 #define ios_bytes_sent(IOS)	((IOS)->sent)
 
 /* set the name of the io_stream */
 #define ios_name(IOS)		((IOS)->name)
 
+/* gather occupancy statistics for the input buffer */
+#define ios_track_buffer(IOS)	cb_track_used((IOS)->buf_in)
+/* print the statistics of the stream (as warnings) */
+void ios_report_stats(const io_stream_t *ios);
+
 
 #endif/*IO_STREAM_H*/
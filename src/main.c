@@ -24,7 +24,11 @@
 #include "attributes.h"
 #include "connection.h"
 #include "readwrite.h"
+#include "mplex.h"
+#include "workers.h"
 #include "io_stream.h"
+#include "sessions.h"
+#include "netsupport.h"
 #include "misc.h"
 
 #include <unistd.h>
@@ -34,6 +38,9 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <assert.h>
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
@@ -43,20 +50,62 @@
 /* program name */
 static char *program_name  = NULL;
 
+/* the state of a connection */
+typedef struct connection {
+	const connection_attributes_t *attrs;
+	circ_buf_t remote_buffer, local_buffer;
+	io_stream_t remote_stream, local_stream;
+	mplex_conn_t *relay;      /* the relay, when multiplexed */
+	bool session;             /* the remote is a peer of a shared datagram
+	                           * socket (see session_datagram) */
+	unsigned long dropped;    /* datagrams from the peer that didn't fit in
+	                           * the buffer */
+} connection_t;
+
+/* count of connections relayed in multiplexed mode, for naming streams */
+static int connection_count = 0;
+
+/* the sessions with the peers of shared datagram sockets, when
+ * multiplexing, keyed by the address of the peer */
+static session_table_t sessions;
+static bool sessions_ready = false;
+
+/* a session ends once no datagrams have been sent or received for a
+ * minute, unless an idle timeout is given */
+static const int DEFAULT_SESSION_IDLE_TIMEOUT = 60;
+
 
 /* function prototypes */
 static void established_callback(const connection_attributes_t *attrs,
 		int fd, int socktype, void *cdata);
+static void session_datagram(const connection_attributes_t *attrs,
+		int fd, const struct sockaddr *from, socklen_t fromlen,
+		const uint8_t *data, size_t len, void *cdata);
+static connection_t *session_start(const connection_attributes_t *attrs,
+		int fd, const struct sockaddr *peer, socklen_t peerlen);
+static connection_t *multiplex_connection(
+		const connection_attributes_t *attrs, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peerlen);
+static void multiplex_done(int result, void *ddata);
 static int connection_main(const connection_attributes_t *attrs,
 		int fd, int socktype);
-static void setup_local_stream(const connection_attributes_t *attrs,
-                io_stream_t *local, circ_buf_t *remote_buffer,
-                circ_buf_t *local_buffer);
+static int connection_setup(const connection_attributes_t *attrs,
+		connection_t *conn, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peerlen, int id);
+static void connection_destroy(connection_t *conn);
+static int relay_reconnecting(connection_t *conn);
+static int setup_local_stream(const connection_attributes_t *attrs,
+                io_stream_t *local, const char *name,
+                circ_buf_t *remote_buffer, circ_buf_t *local_buffer);
 static void setup_remote_stream(const connection_attributes_t *attrs,
-                int fd, int socktype, io_stream_t *remote,
+                int fd, int socktype, const struct sockaddr *peer,
+                socklen_t peerlen, io_stream_t *remote, const char *name,
                 circ_buf_t *remote_buffer, circ_buf_t *local_buffer);
-static int run_transfer(const connection_attributes_t *attrs,
+static void setup_transfer(const connection_attributes_t *attrs,
                 io_stream_t *remote_stream, io_stream_t *local_stream);
+static void transfer_finished(connection_t *conn, int retval);
+static bool is_dgram_socket(int fd);
+static void set_child_name(void);
 static void i18n_init(void);
 static void sigchld_handler(int signum);
 
@@ -65,6 +114,8 @@ static void sigchld_handler(int signum);
 int main(int argc, char **argv)
 {
 	connection_attributes_t connection_attrs;
+	listen_wait_handler_t wait_handler = NULL;
+	established_datagram_t datagram_callback = NULL;
 	char *ptr;
 	int retval, result;
 
@@ -90,15 +141,48 @@ int main(int argc, char **argv)
 	/* set flags and fill out the addresses and connection attributes */
 	parse_arguments(argc, argv, &connection_attrs);
 
+	/* in zero-I/O mode, just report which remote ports are open */
+	if (ca_is_flag_set(&connection_attrs, CA_SCAN)) {
+		retval = scan_connections(&connection_attrs);
+		ca_destroy(&connection_attrs);
+		return (retval > 0)? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* accept connections in a pool of worker processes, leaving this
+	 * process to supervise them */
+	if (ca_workers(&connection_attrs) > 0) {
+		retval = workers_run(ca_workers(&connection_attrs));
+		if (retval != 0) {
+			ca_destroy(&connection_attrs);
+			return (retval < 0)? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+		set_child_name();
+	}
+
+	/* relay the accepted connections while waiting for more, with a
+	 * session for each peer sending to a datagram socket */
+	if (ca_is_flag_set(&connection_attrs, CA_MULTIPLEX)) {
+		wait_handler = mplex_wait;
+		datagram_callback = session_datagram;
+	}
+
 	/* establish connections and callback when connected */
 	retval = establish_connections(&connection_attrs,
-	                               established_callback, &result);
+	                               established_callback,
+	                               datagram_callback, &result,
+	                               wait_handler, NULL);
 
 	/* if only a single connection was established, result will
 	 * contain any error code from that connection handler */
 	if (retval == 0)
 		retval = result;
 
+	/* finish relaying any multiplexed connections */
+	if (ca_is_flag_set(&connection_attrs, CA_MULTIPLEX))
+		mplex_finish();
+	if (sessions_ready)
+		sessions_destroy(&sessions);
+
 	/* cleanup */
 	ca_destroy(&connection_attrs);
 
@@ -114,14 +198,18 @@ static void established_callback(const connection_attributes_t *attrs,
 	bool was_forked = false;
 	int result;
 
+	/* relay the connection from the event loop of this process */
+	if (ca_is_flag_set(attrs, CA_MULTIPLEX)) {
+		multiplex_connection(attrs, fd, socktype, NULL, 0);
+		return;
+	}
+
 	/* check if multiple connections will be established,
 	 * in which case a child should be forked to handle this connection */
 	if (ca_is_flag_set(attrs, CA_CONTINUOUS_ACCEPT))
 	{
 		/* fork and let the parent return immediately */
 		int pid;
-		int size;
-		char *new_name;
 
 		pid = fork();
 		if (pid < 0) {
@@ -132,12 +220,7 @@ static void established_callback(const connection_attributes_t *attrs,
 		}
 
 		was_forked = true;
-
-		/* setup program_name */
-		size = strlen(program_name) + 10;
-		new_name = (char *) xmalloc(size * sizeof(char));
-		snprintf(new_name, size, "%s[%d]", program_name, (int)getpid());
-		program_name = new_name;
+		set_child_name();
 	}
 
 	/* invoke main connection handler */
@@ -153,71 +236,376 @@ static void established_callback(const connection_attributes_t *attrs,
 
 
 
+/* give a datagram received on the shared socket fd to the session of its
+ * sender, starting one if there is none */
+static void session_datagram(const connection_attributes_t *attrs,
+		int fd, const struct sockaddr *from, socklen_t fromlen,
+		const uint8_t *data, size_t len, void *cdata)
+{
+	connection_t *conn;
+
+	/* suppress unused cdata warning */
+	while (0&&cdata);
+	assert(attrs != NULL);
+	assert(from != NULL);
+
+	if (!sessions_ready) {
+		sessions_init(&sessions);
+		sessions_ready = true;
+	}
+
+	conn = (connection_t *)sessions_find(&sessions, from, fromlen);
+	if (conn == NULL) {
+		conn = session_start(attrs, fd, from, fromlen);
+		if (conn == NULL)
+			return;
+	}
+
+	/* nothing is passed on once the local stream stops taking it */
+	if (len == 0 || ca_is_flag_set(attrs, CA_SEND_DATA_ONLY) ||
+	    !is_write_open(&(conn->local_stream)))
+		return;
+
+	/* a datagram that doesn't fit is dropped, just as the kernel would
+	 * drop it if the session had a socket of its own */
+	if (cb_space(&(conn->remote_buffer)) < len) {
+		conn->dropped++;
+		return;
+	}
+
+	cb_append(&(conn->remote_buffer), data, len);
+	ios_read_complete(&(conn->remote_stream), (ssize_t)len);
+	mplex_update(conn->relay);
+}
+
+
+
+/* start a session with a new peer of the shared socket fd, which sends to
+ * the peer over its own duplicate of the socket.  Returns NULL if the
+ * session couldn't be started */
+static connection_t *session_start(const connection_attributes_t *attrs,
+		int fd, const struct sockaddr *peer, socklen_t peerlen)
+{
+	connection_t *conn;
+	char name_buf[AI_STR_SIZE];
+	int ns;
+
+	ns = dup(fd);
+	if (ns < 0) {
+		warning("dup failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	if (verbose_mode()) {
+		xgetnameinfo_ex(peer, peerlen, name_buf, sizeof(name_buf),
+		                ca_is_flag_set(attrs, CA_NUMERICHOST));
+		warning(_("session with %s started"), name_buf);
+	}
+
+	conn = multiplex_connection(attrs, ns, SOCK_DGRAM, peer, peerlen);
+	if (conn != NULL)
+		sessions_add(&sessions, peer, peerlen, conn);
+
+	return conn;
+}
+
+
+
+/* relay a connection from the shared event loop.  peer is the peer of a
+ * session, or NULL if fd is connected.  Returns the connection, or NULL if
+ * it has already finished */
+static connection_t *multiplex_connection(
+		const connection_attributes_t *attrs, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peerlen)
+{
+	connection_t *conn;
+	mplex_conn_t *relay;
+
+	/* the programs executed for other connections must not inherit
+	 * the socket, or they would hold it open after it is closed here */
+	cloexec(fd);
+
+	conn = (connection_t *)xmalloc(sizeof(connection_t));
+	if (connection_setup(attrs, conn, fd, socktype, peer, peerlen,
+	                     ++connection_count) < 0) {
+		free(conn);
+		return NULL;
+	}
+
+	if (conn->local_stream.fd_in >= 0)
+		cloexec(conn->local_stream.fd_in);
+	if (conn->local_stream.fd_out >= 0)
+		cloexec(conn->local_stream.fd_out);
+
+	/* if the relay finishes straight away, conn has been freed */
+	relay = mplex_add(&(conn->remote_stream), &(conn->local_stream),
+	                  multiplex_done, conn);
+	if (relay == NULL)
+		return NULL;
+	conn->relay = relay;
+	return conn;
+}
+
+
+
+static void multiplex_done(int result, void *ddata)
+{
+	connection_t *conn = (connection_t *)ddata;
+	char name_buf[AI_STR_SIZE];
+
+	assert(conn != NULL);
+
+	/* a session usually ends by idling out, which isn't a failure */
+	if (conn->session) {
+		sessions_remove(&sessions, ios_peer(&(conn->remote_stream)),
+		                ios_peer_len(&(conn->remote_stream)));
+		if (verbose_mode()) {
+			xgetnameinfo_ex(ios_peer(&(conn->remote_stream)),
+			                ios_peer_len(&(conn->remote_stream)),
+			                name_buf, sizeof(name_buf),
+			                ca_is_flag_set(conn->attrs,
+			                               CA_NUMERICHOST));
+			warning(_("session with %s ended (%lu datagrams "
+			          "dropped)"), name_buf, conn->dropped);
+		}
+	}
+
+	transfer_finished(conn, result);
+	connection_destroy(conn);
+	free(conn);
+}
+
+
+
 static int connection_main(const connection_attributes_t *attrs,
 		int fd, int socktype)
 {
-	circ_buf_t remote_buffer, local_buffer;
-	io_stream_t remote_stream, local_stream;
+	connection_t conn;
 	int retval;
 
 	assert(attrs != NULL);
 	assert(fd >= 0);
 	assert(socktype >= 0);
 
-	/* initialise buffers */
-	cb_init(&remote_buffer, ca_buffer_size(attrs, socktype));
-	cb_init(&local_buffer, ca_buffer_size(attrs, socktype));
+	if (connection_setup(attrs, &conn, fd, socktype, NULL, 0, 0) < 0)
+		exit(EXIT_FAILURE);
 
-	setup_remote_stream(attrs, fd, socktype, &remote_stream,
-	                    &remote_buffer, &local_buffer);
+	/* transfer data between endpoints */
+	if (ca_is_flag_set(attrs, CA_RECONNECT))
+		retval = relay_reconnecting(&conn);
+	else
+		retval = readwrite(&(conn.remote_stream), &(conn.local_stream));
+	transfer_finished(&conn, retval);
 
-	setup_local_stream(attrs, &local_stream, &remote_buffer, &local_buffer);
-	
-	/* set remote mtu & nru */
-	ios_set_mtu(&remote_stream, ca_remote_MTU(attrs, socktype));
-	ios_set_nru(&remote_stream, ca_remote_NRU(attrs, socktype));
+	/* cleanup */
+	connection_destroy(&conn);
 
-	/* set idle timeouts - only on remote ios */
-	ios_set_idle_timeout(&remote_stream, ca_idle_timeout(attrs));
+	return retval;
+}
 
-	/* set stream hold timeouts */
-	ios_set_hold_timeout(&remote_stream, ca_remote_hold_timeout(attrs));
-	ios_set_hold_timeout(&local_stream, ca_local_hold_timeout(attrs));
 
-	/* set stream half close suppression */
-	ios_suppress_half_close(&remote_stream,
-		ca_remote_half_close_suppress(attrs));
-	ios_suppress_half_close(&local_stream,
+
+/* setup the buffers and streams of a connection.  If peer is not NULL, the
+ * connection is a session with that peer of the datagram socket fd (see
+ * ios_init_peer).  If id is not zero, it is used to name the streams.
+ * Returns 0 on success, or -1 if the local stream could not be setup (in
+ * which case the socket is closed) */
+static int connection_setup(const connection_attributes_t *attrs,
+		connection_t *conn, int fd, int socktype,
+		const struct sockaddr *peer, socklen_t peerlen, int id)
+{
+	char remote_name[32], local_name[32];
+	size_t min_size, max_size;
+
+	assert(attrs != NULL);
+	assert(conn != NULL);
+	assert(fd >= 0);
+	assert(socktype >= 0);
+
+	if (id > 0) {
+		snprintf(remote_name, sizeof(remote_name), "remote[%d]", id);
+		snprintf(local_name, sizeof(local_name), "local[%d]", id);
+	} else {
+		strcpy(remote_name, "remote");
+		strcpy(local_name, "local");
+	}
+
+	conn->attrs = attrs;
+	conn->relay = NULL;
+	conn->session = (peer != NULL);
+	conn->dropped = 0;
+
+	/* initialise buffers - adaptive buffers start small, so that idle
+	 * connections don't hold on to much memory */
+	if (ca_buffer_limits(attrs, socktype, &min_size, &max_size)) {
+		cb_init(&(conn->remote_buffer), min_size);
+		cb_init(&(conn->local_buffer), min_size);
+		cb_set_adaptive(&(conn->remote_buffer), min_size, max_size);
+		cb_set_adaptive(&(conn->local_buffer), min_size, max_size);
+	} else {
+		cb_init(&(conn->remote_buffer), ca_buffer_size(attrs, socktype));
+		cb_init(&(conn->local_buffer), ca_buffer_size(attrs, socktype));
+	}
+
+	/* chained buffers only take memory for the data they hold */
+	if (ca_is_flag_set(attrs, CA_CHAIN_BUFFERS)) {
+		cb_chain(&(conn->remote_buffer));
+		cb_chain(&(conn->local_buffer));
+	}
+
+	setup_remote_stream(attrs, fd, socktype, peer, peerlen,
+	                    &(conn->remote_stream), remote_name,
+	                    &(conn->remote_buffer), &(conn->local_buffer));
+
+	if (setup_local_stream(attrs, &(conn->local_stream), local_name,
+	                       &(conn->remote_buffer),
+	                       &(conn->local_buffer)) < 0) {
+		io_stream_destroy(&(conn->remote_stream));
+		cb_destroy(&(conn->local_buffer));
+		cb_destroy(&(conn->remote_buffer));
+		return -1;
+	}
+
+	/* keep the datagrams received apart, so that they are sent on as
+	 * they arrived (from a mirrored buffer, so that none is split at
+	 * the wrap) */
+	if (ca_is_flag_set(attrs, CA_FRAME_DATAGRAMS)) {
+		if (socktype == SOCK_DGRAM) {
+			cb_frame(&(conn->remote_buffer));
+			cb_mirror(&(conn->remote_buffer));
+		}
+		if (conn->local_stream.socktype == SOCK_DGRAM) {
+			cb_frame(&(conn->local_buffer));
+			cb_mirror(&(conn->local_buffer));
+		}
+	}
+
+	/* move data without copying it into the buffers, where possible */
+	if (!ca_is_flag_set(attrs, CA_NO_SPLICE)) {
+		if (ios_splice(&(conn->remote_stream), &(conn->local_stream)) &&
+		    very_verbose_mode())
+			warning(_("splicing from remote to local"));
+		if (ios_sendfile(&(conn->local_stream),
+		                 &(conn->remote_stream))) {
+			if (very_verbose_mode())
+				warning(_("sending local file to remote"));
+		} else if (ios_splice(&(conn->local_stream),
+		                      &(conn->remote_stream)) &&
+		           very_verbose_mode()) {
+			warning(_("splicing from local to remote"));
+		}
+	}
+	
+	/* set local stream hold timeout and half close suppression (those
+	 * of the remote stream are set with the rest of its setup) */
+	ios_set_hold_timeout(&(conn->local_stream),
+		ca_local_hold_timeout(attrs));
+	ios_suppress_half_close(&(conn->local_stream),
 		ca_local_half_close_suppress(attrs));
 
 	/* give information about the connection in very verbose mode */
 	if (very_verbose_mode()) {
-		warning(_("using buffer size of %d"), remote_buffer.buf_size);
-		if (remote_stream.nru > 0)
+		if (cb_is_adaptive(&(conn->remote_buffer)))
+			warning(_("using adaptive buffer size of %lu to %lu"),
+			     (unsigned long)conn->remote_buffer.min_size,
+			     (unsigned long)conn->remote_buffer.max_size);
+		else
+			warning(_("using buffer size of %d"),
+			     conn->remote_buffer.buf_size);
+		if (conn->remote_stream.nru > 0)
 			warning(_("using remote receive nru of %d"),
-			     remote_stream.nru);
-		if (remote_stream.mtu > 0)
+			     conn->remote_stream.nru);
+		if (conn->remote_stream.mtu > 0)
 			warning(_("using remote send mtu of %d"),
-			     remote_stream.mtu);
+			     conn->remote_stream.mtu);
+		if (socktype == SOCK_DGRAM && conn->remote_stream.batch > 1)
+			warning(_("using datagram batches of %d"),
+			     conn->remote_stream.batch);
 	}
 
-	/* transfer data between endpoints */
-	retval = run_transfer(attrs, &remote_stream, &local_stream);
+	/* report the memory obtained for buffers large enough for huge
+	 * pages to have been tried */
+	if (very_verbose_mode() ||
+	    (verbose_mode() && cb_huge_threshold() > 0 &&
+	     MAX(cb_size(&(conn->remote_buffer)),
+	         cb_size(&(conn->local_buffer))) >= cb_huge_threshold()))
+	{
+		warning(_("remote buffer uses %s"),
+		     cb_memory_name(&(conn->remote_buffer)));
+		warning(_("local buffer uses %s"),
+		     cb_memory_name(&(conn->local_buffer)));
+	}
 
-	/* cleanup */
-	io_stream_destroy(&local_stream);
-	io_stream_destroy(&remote_stream);
-	cb_destroy(&local_buffer);
-	cb_destroy(&remote_buffer);
+	/* gather buffer occupancy for the statistics */
+	if (ca_is_flag_set(attrs, CA_STATS)) {
+		ios_track_buffer(&(conn->remote_stream));
+		ios_track_buffer(&(conn->local_stream));
+	}
 
-	return retval;
+	setup_transfer(attrs, &(conn->remote_stream), &(conn->local_stream));
+
+	return 0;
+}
+
+
+
+/* relay the connection, connecting the remote stream again whenever it
+ * closes until the local stream is finished.  The buffers are kept, so
+ * that data not yet sent to the remote is sent after reconnecting */
+static int relay_reconnecting(connection_t *conn)
+{
+	const connection_attributes_t *attrs;
+	int retval, fd, socktype;
+
+	assert(conn != NULL);
+
+	attrs = conn->attrs;
+
+	for (;;) {
+		retval = readwrite_resumable(&(conn->remote_stream),
+		                             &(conn->local_stream));
+		if (retval != READWRITE_REMOTE_CLOSED)
+			return retval;
+
+		if (verbose_mode())
+			warning(_("connection to remote lost (sent %lu, rcvd "
+			          "%lu), %lu bytes waiting to be sent"),
+			        (unsigned long)
+			        ios_bytes_sent(&(conn->remote_stream)),
+			        (unsigned long)
+			        ios_bytes_received(&(conn->remote_stream)),
+			        (unsigned long)cb_used(&(conn->local_buffer)));
+		io_stream_destroy(&(conn->remote_stream));
+
+		fd = reconnect_remote(attrs, &socktype);
+		setup_remote_stream(attrs, fd, socktype, NULL, 0,
+		                    &(conn->remote_stream),
+		                    "remote", &(conn->remote_buffer),
+		                    &(conn->local_buffer));
+		if (ca_is_flag_set(attrs, CA_STATS))
+			ios_track_buffer(&(conn->remote_stream));
+		setup_transfer(attrs, &(conn->remote_stream),
+		               &(conn->local_stream));
+	}
 }
 
 
 
-static void setup_local_stream(const connection_attributes_t *attrs,
-		io_stream_t *stream, circ_buf_t *remote_buffer,
-		circ_buf_t *local_buffer)
+static void connection_destroy(connection_t *conn)
+{
+	assert(conn != NULL);
+
+	io_stream_destroy(&(conn->local_stream));
+	io_stream_destroy(&(conn->remote_stream));
+	cb_destroy(&(conn->local_buffer));
+	cb_destroy(&(conn->remote_buffer));
+}
+
+
+
+static int setup_local_stream(const connection_attributes_t *attrs,
+		io_stream_t *stream, const char *name,
+		circ_buf_t *remote_buffer, circ_buf_t *local_buffer)
 {
 	const char *cmd;
 	assert(attrs != NULL);
@@ -229,41 +617,78 @@ static void setup_local_stream(const connection_attributes_t *attrs,
 		if (very_verbose_mode())
 			warning(_("executing '%s'"), cmd);
 		if (open3(cmd, &in, &out, NULL) < 0) {
-			fatal(_("failed to exec '%s': %s"),
-			      cmd, strerror(errno));
+			warning(_("failed to exec '%s': %s"),
+			        cmd, strerror(errno));
+			return -1;
 		}
-		ios_init(stream, "local", out, in, SOCK_STREAM,
+		ios_init(stream, name, out, in, SOCK_STREAM,
 		         local_buffer, remote_buffer);
 	}
 	else {
-		ios_init_stdio(stream, "local", local_buffer, remote_buffer);
+		ios_init_stdio(stream, name, local_buffer, remote_buffer);
+		/* stdio may be a datagram socket (eg. from inetd), whose
+		 * datagrams can be relayed whole */
+		if (ca_is_flag_set(attrs, CA_FRAME_DATAGRAMS) &&
+		    is_dgram_socket(STDIN_FILENO) &&
+		    is_dgram_socket(STDOUT_FILENO))
+			stream->socktype = SOCK_DGRAM;
 	}
+
+	return 0;
+}
+
+
+
+static bool is_dgram_socket(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0)
+		return false;
+	return (type == SOCK_DGRAM);
 }
 
 
 
 static void setup_remote_stream(const connection_attributes_t *attrs,
-		int fd, int socktype, io_stream_t *stream,
+		int fd, int socktype, const struct sockaddr *peer,
+		socklen_t peerlen, io_stream_t *stream, const char *name,
 		circ_buf_t *remote_buffer, circ_buf_t *local_buffer)
 {
-	/* suppress unused attrs warning */
-	while (0&&attrs);
 	assert(attrs != NULL);
 	assert(fd >= 0);
 	assert(socktype >= 0);
 	assert(stream != NULL);
 
-	ios_init_socket(stream, "remote", fd, socktype,
-	                remote_buffer, local_buffer);
+	if (peer != NULL)
+		ios_init_peer(stream, name, fd, socktype, peer, peerlen,
+		              remote_buffer, local_buffer);
+	else
+		ios_init_socket(stream, name, fd, socktype,
+		                remote_buffer, local_buffer);
+
+	/* set remote mtu & nru */
+	ios_set_mtu(stream, ca_remote_MTU(attrs, socktype));
+	ios_set_nru(stream, ca_remote_NRU(attrs, socktype));
+	ios_set_batch(stream, ca_dgram_batch(attrs));
+
+	/* set idle timeouts - only on remote ios.  A session never sees the
+	 * end of its peer's datagrams, so it always has one */
+	ios_set_idle_timeout(stream, ca_idle_timeout(attrs));
+	if (peer != NULL && ca_idle_timeout(attrs) <= 0)
+		ios_set_idle_timeout(stream, DEFAULT_SESSION_IDLE_TIMEOUT);
+
+	/* set stream hold timeout and half close suppression */
+	ios_set_hold_timeout(stream, ca_remote_hold_timeout(attrs));
+	ios_suppress_half_close(stream, ca_remote_half_close_suppress(attrs));
 }
 
 
 
-static int run_transfer(const connection_attributes_t *attrs,
+static void setup_transfer(const connection_attributes_t *attrs,
 		io_stream_t *remote_stream, io_stream_t *local_stream)
 {
-	int retval;
-
 	assert(remote_stream != NULL);
 	assert(local_stream != NULL);
 
@@ -302,20 +727,36 @@ static int run_transfer(const connection_attributes_t *attrs,
 			warning(_("transmitting to remote only, "
 			     "receive disabled"));
 	}
+}
+
 
-	/* run the main read/write loop */
-	retval = readwrite(remote_stream, local_stream);
+
+static void transfer_finished(connection_t *conn, int retval)
+{
+	struct rusage usage;
+
+	assert(conn != NULL);
 
 	if (very_verbose_mode())
 		warning(_("connection closed (sent %d, rcvd %d)"),
-		     ios_bytes_sent(remote_stream),
-		     ios_bytes_received(remote_stream));
+		     ios_bytes_sent(&(conn->remote_stream)),
+		     ios_bytes_received(&(conn->remote_stream)));
+
+	if (ca_is_flag_set(conn->attrs, CA_STATS)) {
+		ios_report_stats(&(conn->remote_stream));
+		ios_report_stats(&(conn->local_stream));
+		if (getrusage(RUSAGE_SELF, &usage) == 0)
+			warning(_("cpu time: %ld.%03ld user, "
+			          "%ld.%03ld system seconds"),
+			        (long)usage.ru_utime.tv_sec,
+			        (long)usage.ru_utime.tv_usec / 1000,
+			        (long)usage.ru_stime.tv_sec,
+			        (long)usage.ru_stime.tv_usec / 1000);
+	}
 #ifndef NDEBUG
 	if (very_verbose_mode())
 		warning("readwrite returned %d", retval);
 #endif
-
-	return retval;
 }
 
 
@@ -327,6 +768,20 @@ const char *get_program_name(void)
 
 
 
+/* setup program_name in a forked process */
+static void set_child_name(void)
+{
+	int size;
+	char *new_name;
+
+	size = strlen(program_name) + 10;
+	new_name = (char *) xmalloc(size * sizeof(char));
+	snprintf(new_name, size, "%s[%d]", program_name, (int)getpid());
+	program_name = new_name;
+}
+
+
+
 static void i18n_init(void)
 {
 #ifdef ENABLE_NLS
@@ -119,6 +119,18 @@ void *xmalloc(size_t size)
 
 
 
+/* same as `realloc' but report error if no memory available */
+void *xrealloc(void *ptr, size_t size)
+{
+	register void *value = realloc(ptr, size);
+	
+	if (value == NULL) fatal(_("virtual memory exhausted"));
+
+	return value;
+}
+
+
+
 char *xstrdup(const char *str)
 {
 	register char *nstr = (char *)xmalloc(strlen(str)+1);
@@ -172,6 +184,22 @@ void nonblock(int fd)
 
 
 
+void cloexec(int fd)
+{
+	int arg;
+	if ((arg = fcntl(fd, F_GETFD, 0)) < 0)
+		fatal("error reading file descriptor flags: %s",
+		      strerror(errno));
+
+	arg |= FD_CLOEXEC;
+
+	if (fcntl(fd, F_SETFD, arg) < 0)
+		fatal("error setting flag FD_CLOEXEC on file descriptor: %s",
+		      strerror(errno));
+}
+
+
+
 int open3(const char *cmd, int *in, int *out, int *err)
 {
 	int inpipe[2];
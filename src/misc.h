@@ -37,6 +37,7 @@ void fatal(const char *template, ...);
 void warning(const char *template, ...);
 
 void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
 char *xstrdup(const char *str);
 
 /* version of strlcpy that can handle a non-NULL terminated src  */
@@ -47,6 +48,7 @@ size_t strnlen(const char *str, size_t maxlen);
 const char *non_empty_string(const char *str);
 
 void nonblock(int fd);
+void cloexec(int fd);
 
 int open3(const char *cmd, int *in, int *out, int *err);
 
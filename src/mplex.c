@@ -0,0 +1,430 @@
+/*
+ *  mplex.c - multiplexed relaying of connections - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "mplex.h"
+#include "readwrite.h"
+#include "clock.h"
+#include "misc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+
+/* the state of each connection being relayed */
+typedef struct mplex_conn {
+	relay_t relay;
+	int fds[4];               /* the fds of the streams when added */
+	int nfds;
+	struct timeval deadline;  /* when the next timeout expires */
+	int timer_slot;           /* index into timers, -1 if no timeout */
+	unsigned long serviced;   /* the last wait it was serviced after */
+	mplex_done_t done;
+	void *ddata;
+	struct mplex_conn *prev, *next;
+	struct mplex_conn *next_ready;
+} mplex_conn_t;
+
+/* the poller shared by all the connections */
+static poller_t poller;
+static bool poller_ready = false;
+
+/* the connections being relayed */
+static mplex_conn_t *connections = NULL;
+
+/* the connection owning each fd, indexed by fd */
+static mplex_conn_t **owners = NULL;
+static int owners_size = 0;
+
+/* the connections with a pending timeout, as a binary heap ordered by
+ * deadline, so that the next to expire is always at the top */
+static mplex_conn_t **timers = NULL;
+static int ntimers = 0;
+static int timers_size = 0;
+
+/* count of waits, to service each connection once per wait */
+static unsigned long waits = 0;
+
+
+static void own_fd(mplex_conn_t *conn, int fd);
+static bool update(mplex_conn_t *conn);
+static void finish(mplex_conn_t *conn, int result);
+static int run(poller_t *listener, const struct timeval *tv);
+static void set_timer(mplex_conn_t *conn);
+static void remove_timer(mplex_conn_t *conn);
+static void fix_timer(int slot);
+
+
+
+mplex_conn_t *mplex_add(io_stream_t *ios1, io_stream_t *ios2,
+		mplex_done_t done, void *ddata)
+{
+	mplex_conn_t *conn;
+
+	assert(ios1 != NULL);
+	assert(ios2 != NULL);
+	assert(done != NULL);
+
+	if (!poller_ready) {
+		poller_init(&poller);
+		poller_ready = true;
+	}
+
+	conn = (mplex_conn_t *)xmalloc(sizeof(mplex_conn_t));
+	memset(conn, 0, sizeof(mplex_conn_t));
+	conn->timer_slot = -1;
+	conn->done = done;
+	conn->ddata = ddata;
+
+	/* a blocking operation would stall every other connection */
+	relay_init(&(conn->relay), ios1, ios2, &poller, true);
+
+	if (ios1->fd_in >= 0)
+		own_fd(conn, ios1->fd_in);
+	if (ios1->fd_out >= 0)
+		own_fd(conn, ios1->fd_out);
+	if (ios2->fd_in >= 0)
+		own_fd(conn, ios2->fd_in);
+	if (ios2->fd_out >= 0)
+		own_fd(conn, ios2->fd_out);
+
+	/* add to the head of the list */
+	conn->next = connections;
+	if (connections != NULL)
+		connections->prev = conn;
+	connections = conn;
+
+	/* register the streams */
+	if (!update(conn))
+		return NULL;
+	return conn;
+}
+
+
+
+void mplex_update(mplex_conn_t *conn)
+{
+	assert(conn != NULL);
+
+	update(conn);
+}
+
+
+
+int mplex_wait(poller_t *listener, const struct timeval *tv, void *wdata)
+{
+	/* suppress unused wdata warning */
+	while (0&&wdata);
+	assert(listener != NULL);
+
+	if (!poller_ready) {
+		poller_init(&poller);
+		poller_ready = true;
+	}
+
+	/* have the listener fds watched by the shared poller from now on.
+	 * They are dropped from it when the listener destroys its poller,
+	 * before it closes them */
+	if (listener->parent == NULL)
+		poller_attach(listener, &poller);
+	assert(listener->parent == &poller);
+
+	return run(listener, tv);
+}
+
+
+
+void mplex_finish(void)
+{
+	if (run(NULL, NULL) < 0)
+		fatal("%s error: %s", poller_name(&poller), strerror(errno));
+
+	if (poller_ready) {
+		poller_destroy(&poller);
+		poller_ready = false;
+	}
+	free(owners);
+	owners = NULL;
+	owners_size = 0;
+	free(timers);
+	timers = NULL;
+	timers_size = 0;
+}
+
+
+
+/* relay the connections until a listener fd is ready or the timeout
+ * expires (returning as poller_wait on the listener), or until all the
+ * connections have finished if there is no listener */
+static int run(poller_t *listener, const struct timeval *tv)
+{
+	struct timeval now, deadline, timeout, *tvp;
+	struct timeval left;
+	mplex_conn_t *conn, *next, *ready, *expired;
+	bool listener_ready;
+	int i, fd, rr;
+
+	clock_update();
+	if (tv != NULL)
+		timeradd(clock_now(), tv, &deadline);
+
+	for (;;) {
+		if (listener == NULL && connections == NULL)
+			return 0;
+
+		/* handle expired timeouts and find the next one (the clock
+		 * was last updated by poller_wait) */
+		now = *clock_now();
+		tvp = NULL;
+		if (tv != NULL) {
+			if (!timercmp(&deadline, &now, >))
+				return 0;
+			timersub(&deadline, &now, &timeout);
+			tvp = &timeout;
+		}
+
+		/* an expired timeout is handled by relay_prepare.  They are
+		 * all taken off the heap first, so that each is handled once
+		 * even if it is given a deadline that has already passed */
+		expired = NULL;
+		while (ntimers > 0 &&
+		       !timercmp(&(timers[0]->deadline), &now, >)) {
+			conn = timers[0];
+			remove_timer(conn);
+			conn->next_ready = expired;
+			expired = conn;
+		}
+		for (conn = expired; conn != NULL; conn = next) {
+			next = conn->next_ready;
+			update(conn);
+		}
+
+		if (ntimers > 0) {
+			conn = timers[0];
+			if (timercmp(&(conn->deadline), &now, >))
+				timersub(&(conn->deadline), &now, &left);
+			else
+				timerclear(&left);
+			if (tvp == NULL || timercmp(&left, tvp, <)) {
+				timeout = left;
+				tvp = &timeout;
+			}
+		}
+
+		/* the last connections may have just timed out */
+		if (listener == NULL && connections == NULL)
+			return 0;
+
+		rr = poller_wait(&poller, tvp);
+		if (rr < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* find the connections with events first, as servicing them
+		 * changes the ready fds of the poller */
+		waits++;
+		ready = NULL;
+		listener_ready = false;
+		for (i = 0; i < poller_nready(&poller); ++i) {
+			fd = poller_ready_fd(&poller, i);
+			conn = (fd < owners_size)? owners[fd] : NULL;
+			if (conn == NULL) {
+				/* only the listener fds are left */
+				listener_ready = (listener != NULL);
+			} else if (conn->serviced != waits) {
+				conn->serviced = waits;
+				conn->next_ready = ready;
+				ready = conn;
+			}
+		}
+
+		for (conn = ready; conn != NULL; conn = next) {
+			next = conn->next_ready;
+			if (relay_service(&(conn->relay)) < 0)
+				finish(conn, -1);
+			else
+				update(conn);
+		}
+
+		/* pass the events for the listener fds on to it */
+		if (listener_ready && (rr = poller_forward(listener)) != 0)
+			return rr;
+	}
+}
+
+
+
+/* record that fd belongs to conn */
+static void own_fd(mplex_conn_t *conn, int fd)
+{
+	int i, size;
+
+	assert(fd >= 0);
+
+	for (i = 0; i < conn->nfds; ++i)
+		if (conn->fds[i] == fd)
+			return;
+	assert(conn->nfds < 4);
+	conn->fds[conn->nfds++] = fd;
+
+	if (fd >= owners_size) {
+		size = (owners_size > 0)? owners_size : 16;
+		while (size <= fd)
+			size *= 2;
+		owners = (mplex_conn_t **)xrealloc(owners,
+		                          size * sizeof(mplex_conn_t *));
+		for (i = owners_size; i < size; ++i)
+			owners[i] = NULL;
+		owners_size = size;
+	}
+	owners[fd] = conn;
+}
+
+
+
+/* reschedule the streams of a connection after it has been serviced or a
+ * timeout has expired.  Returns false if the connection has finished */
+static bool update(mplex_conn_t *conn)
+{
+	struct timeval *tvp;
+	int rr;
+
+	rr = relay_prepare(&(conn->relay), &tvp);
+	if (rr <= 0) {
+		finish(conn, rr);
+		return false;
+	}
+
+	if (tvp != NULL) {
+		timeradd(clock_now(), tvp, &(conn->deadline));
+		set_timer(conn);
+	} else {
+		remove_timer(conn);
+	}
+	return true;
+}
+
+
+
+static void finish(mplex_conn_t *conn, int result)
+{
+	int i;
+
+	/* unlink from the list */
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		connections = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	remove_timer(conn);
+
+	/* the fds may already have been reused by another connection */
+	for (i = 0; i < conn->nfds; ++i) {
+		if (owners[conn->fds[i]] == conn)
+			owners[conn->fds[i]] = NULL;
+	}
+
+	/* the streams are destroyed by the callback, which removes their
+	 * fds from the poller */
+	conn->done(result, conn->ddata);
+	free(conn);
+}
+
+
+
+/* put the timer of a connection where its deadline belongs in the heap,
+ * adding it if it had none */
+static void set_timer(mplex_conn_t *conn)
+{
+	if (conn->timer_slot < 0) {
+		if (ntimers == timers_size) {
+			timers_size = (timers_size > 0)? timers_size * 2 : 16;
+			timers = (mplex_conn_t **)xrealloc(timers,
+			                 timers_size * sizeof(mplex_conn_t *));
+		}
+		conn->timer_slot = ntimers++;
+		timers[conn->timer_slot] = conn;
+	}
+	fix_timer(conn->timer_slot);
+}
+
+
+
+static void remove_timer(mplex_conn_t *conn)
+{
+	int slot = conn->timer_slot;
+
+	if (slot < 0)
+		return;
+	conn->timer_slot = -1;
+
+	/* move the last timer into the freed slot */
+	if (slot != --ntimers) {
+		timers[slot] = timers[ntimers];
+		timers[slot]->timer_slot = slot;
+		fix_timer(slot);
+	}
+}
+
+
+
+/* the deadline of a is before that of b */
+#define timer_before(A, B)	timercmp(&((A)->deadline), &((B)->deadline), <)
+
+/* move the timer in slot up or down the heap until its deadline is after
+ * that of its parent and before those of its children */
+static void fix_timer(int slot)
+{
+	mplex_conn_t *conn = timers[slot];
+	int parent, child;
+
+	while (slot > 0) {
+		parent = (slot - 1) / 2;
+		if (!timer_before(conn, timers[parent]))
+			break;
+		timers[slot] = timers[parent];
+		timers[slot]->timer_slot = slot;
+		slot = parent;
+	}
+
+	for (;;) {
+		child = 2 * slot + 1;
+		if (child >= ntimers)
+			break;
+		if (child + 1 < ntimers &&
+		    timer_before(timers[child + 1], timers[child]))
+			child++;
+		if (!timer_before(timers[child], conn))
+			break;
+		timers[slot] = timers[child];
+		timers[slot]->timer_slot = slot;
+		slot = child;
+	}
+
+	timers[slot] = conn;
+	conn->timer_slot = slot;
+}
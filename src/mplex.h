@@ -0,0 +1,57 @@
+/*
+ *  mplex.h - multiplexed relaying of connections - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef MPLEX_H
+#define MPLEX_H
+
+#include "io_stream.h"
+#include "poller.h"
+
+/* a connection being relayed */
+typedef struct mplex_conn mplex_conn_t;
+
+/* called when the relay of a connection has finished, with the result of
+ * the relay (as returned by readwrite).  It must destroy the streams */
+typedef void (*mplex_done_t)(int result, void *ddata);
+
+/* relay data between ios1 (the remote stream) and ios2 (the local stream)
+ * from the shared event loop, instead of with readwrite.  The fds of the
+ * streams are put into non-blocking mode.  Returns the connection (which
+ * is freed once it has finished), or NULL if it finished straight away */
+mplex_conn_t *mplex_add(io_stream_t *ios1, io_stream_t *ios2,
+		mplex_done_t done, void *ddata);
+
+/* reschedule the relay of a connection after data has been added to the
+ * buffers of its streams other than by the relay (which may finish it) */
+void mplex_update(mplex_conn_t *conn);
+
+/* wait for the fds registered with the poller of a listener, as per
+ * poller_wait, while relaying the data of all the connections that have
+ * been added.  Suitable for use as the wait handler of a listener.  The
+ * listener's poller is attached to the shared one on the first call (see
+ * poller_attach), so its fds are only registered once */
+int mplex_wait(poller_t *listener, const struct timeval *tv, void *wdata);
+
+/* relay the connections that have been added until they have all
+ * finished */
+void mplex_finish(void);
+
+#endif/*MPLEX_H*/
@@ -22,6 +22,8 @@
 #include "system.h"
 #include "misc.h"
 #include "netsupport.h"
+#include "resolver.h"
+#include "poller.h"
 #ifdef ENABLE_BLUEZ
 #include "bluez.h"
 #endif
@@ -48,13 +50,17 @@ char *alloca();
 #endif
 
 
-/* call 'connect' in non-blocking mode and use select to await a timeout */
+static int service_port(const char *service, const struct addrinfo *hints);
+
+
+
+/* call 'connect' in non-blocking mode and use a poller to await a timeout */
 int connect_with_timeout(int fd, const struct sockaddr *sa,
 		socklen_t salen, int timeout)
 {
 	int err;
 	struct timeval tv, *tvp = NULL;
-	fd_set connect_fdset;
+	poller_t poller;
 	socklen_t len;
 	int optval;
 	
@@ -76,19 +82,23 @@ int connect_with_timeout(int fd, const struct sockaddr *sa,
 	
 	if (err != 0 && errno == EINPROGRESS) {
 		/* connection is proceeding
-		 * it is complete (or failed) when select returns */
-
-		/* initialize connect_fdset */
-		FD_ZERO(&connect_fdset);
-		FD_SET(fd, &connect_fdset);
+		 * it is complete (or failed) when fd becomes writable */
+		poller_init(&poller);
+		poller_set(&poller, fd, POLLER_WRITE);
 
-		/* call select */
+		/* wait for the connection */
 		do {
-			err = select(fd + 1, NULL, &connect_fdset, 
-				     NULL, tvp);
+			err = poller_wait(&poller, tvp);
 		} while (err < 0 && errno == EINTR);
 
-		/* select error */
+		/* the fd stays open, so drop the registration before
+		 * releasing the poller (preserving errno from the wait) */
+		optval = errno;
+		poller_del(&poller, fd);
+		poller_destroy(&poller);
+		errno = optval;
+
+		/* poller error */
 		if (err < 0)
 			return -1;
 	
@@ -99,7 +109,7 @@ int connect_with_timeout(int fd, const struct sockaddr *sa,
 			return -1;
 		}
 		
-		/* select returned successfully, but we must test socket 
+		/* poller returned successfully, but we must test socket 
 		 * error for result */
 		len = sizeof(optval);
 		err = getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &len);
@@ -254,6 +264,151 @@ bool sockaddr_compare(const struct sockaddr *a, socklen_t a_len,
 
 
 
+/* parse a comma separated list of services and ranges of them (lo-hi).
+ * Returns the number of ranges, or -1 (having output an error) if the
+ * list is invalid */
+int parse_port_ranges(const char *services,
+		const struct addrinfo *hints, port_range_t **ranges)
+{
+	char *list, *service, *next, *sep;
+	const char *ptr;
+	port_range_t *range;
+	int n;
+
+	assert(services != NULL);
+	assert(ranges != NULL);
+
+	/* there is at most one range for each comma and one more */
+	for (n = 1, ptr = services; *ptr != '\0'; ++ptr) {
+		if (*ptr == ',')
+			n++;
+	}
+	*ranges = (port_range_t *)xmalloc(n * sizeof(port_range_t));
+
+	list = xstrdup(services);
+	n = 0;
+	for (service = list; service != NULL; service = next) {
+		next = strchr(service, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (*service == '\0')
+			continue;
+
+		/* service names may themselves contain a '-', so only treat
+		 * it as a range when it can't be taken as a whole */
+		range = &((*ranges)[n]);
+		range->first = range->last = service_port(service, hints);
+		sep = NULL;
+		if (range->first < 0 && (sep = strchr(service, '-')) != NULL) {
+			*sep = '\0';
+			range->first = service_port(service, hints);
+			range->last = service_port(sep + 1, hints);
+			*sep = '-';
+		}
+
+		if (range->first < 0 || range->last < range->first) {
+			warning(_("invalid port or port range '%s'"), service);
+			free(list);
+			free(*ranges);
+			return -1;
+		}
+		n++;
+	}
+	free(list);
+
+	if (n == 0) {
+		warning(_("no ports given in '%s'"), services);
+		free(*ranges);
+		return -1;
+	}
+
+	return n;
+}
+
+
+
+/* the port number of a service, or -1 if it is unknown */
+static int service_port(const char *service, const struct addrinfo *hints)
+{
+	struct addrinfo svc_hints, *res = NULL;
+	int port;
+
+	if (safe_atoi(service, &port) == 0)
+		return (port > 0 && port <= 65535)? port : -1;
+
+	memset(&svc_hints, 0, sizeof(svc_hints));
+	svc_hints.ai_family   = hints->ai_family;
+	svc_hints.ai_socktype = hints->ai_socktype;
+	svc_hints.ai_protocol = hints->ai_protocol;
+	svc_hints.ai_flags    = AI_PASSIVE;
+
+	if (getaddrinfo_ex(NULL, service, &svc_hints, &res) != 0)
+		return -1;
+	assert(res != NULL);
+
+	port = sockaddr_port(res->ai_addr);
+	freeaddrinfo_ex(res);
+	return port;
+}
+
+
+
+bool gai_family_error(int err)
+{
+	switch (err) {
+#ifdef HAVE_GETADDRINFO_EAI_NODATA
+	case EAI_NODATA:
+#endif
+#ifdef HAVE_GETADDRINFO_EAI_ADDRFAMILY
+	case EAI_ADDRFAMILY:
+#endif
+	case EAI_FAMILY:
+	case EAI_SOCKTYPE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+
+int sockaddr_port(const struct sockaddr *sa)
+{
+	switch (sa->sa_family) {
+	case PF_INET:
+		return ntohs(((const struct sockaddr_in *)sa)->sin_port);
+#ifdef ENABLE_IPV6
+	case PF_INET6:
+		return ntohs(((const struct sockaddr_in6 *)sa)->sin6_port);
+#endif
+	default:
+		return -1;
+	}
+}
+
+
+
+void sockaddr_set_port(struct sockaddr *sa, int port)
+{
+	assert(port > 0 && port <= 65535);
+
+	switch (sa->sa_family) {
+	case PF_INET:
+		((struct sockaddr_in *)sa)->sin_port = htons(port);
+		break;
+#ifdef ENABLE_IPV6
+	case PF_INET6:
+		((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+		break;
+#endif
+	default:
+		fatal_internal("cannot scan ports of address family %d",
+		               sa->sa_family);
+	}
+}
+
+
+
 /* On some systems, getaddrinfo will return results that can't actually be
  * used - resulting in a failure when trying to create the socket.
  * This function checks for all the different error codes that indicate this
@@ -317,7 +472,7 @@ void free_bound_sockets(bound_socket_t *list)
 
 
 /* close all bound sockets in a list and free the list */
-void close_and_destroy_bound_sockets(bound_socket_t *list)
+void close_and_free_bound_sockets(bound_socket_t *list)
 {
 	bound_socket_t *tmp;
 	
@@ -336,14 +491,14 @@ void close_and_destroy_bound_sockets(bound_socket_t *list)
 int getaddrinfo_ex(const char *nodename, const char *servname,
 		const struct addrinfo *hints, struct addrinfo **res)
 {
-	return getaddrinfo(nodename, servname, hints, res);
+	return resolver_getaddrinfo(nodename, servname, hints, res);
 }
 
 
 
 void freeaddrinfo_ex(struct addrinfo *ai)
 {
-	freeaddrinfo(ai);
+	resolver_freeaddrinfo(ai);
 }
 
 
@@ -375,8 +530,8 @@ int getnameinfo_ex(const struct sockaddr *sa, socklen_t len, char *str,
 
 	if (numeric_mode == false) {
 		/* get the real name for this destination as a string */
-		err = getnameinfo(sa, len, hbuf_rev, sizeof(hbuf_rev),
-				  sbuf_rev, sizeof(sbuf_rev), 0);
+		err = resolver_getnameinfo(sa, len, hbuf_rev,
+				  sizeof(hbuf_rev), sbuf_rev, sizeof(sbuf_rev), 0);
 		if (err == 0) {
 			snprintf(str, size, "%s (%s) %s [%s]", hbuf_rev, 
 			         hbuf_num, sbuf_num, sbuf_rev);
@@ -48,6 +48,29 @@ bool is_address_ipv4_mapped(const struct sockaddr *a);
 bool sockaddr_compare(const struct sockaddr *a, socklen_t a_len,
 		const struct sockaddr *b, socklen_t b_len);
 
+/* returns true if a getaddrinfo error just means that the name has no
+ * addresses of the family or socket type asked for */
+bool gai_family_error(int err);
+
+/* the port of an IPv4 or IPv6 address, or -1 for other families */
+int sockaddr_port(const struct sockaddr *sa);
+/* set the port of an IPv4 or IPv6 address */
+void sockaddr_set_port(struct sockaddr *sa, int port);
+
+
+/* an inclusive range of ports */
+typedef struct port_range {
+	int first;
+	int last;
+} port_range_t;
+
+/* parse a comma separated list of services (names or port numbers) and
+ * lo-hi ranges of them into a newly allocated array of ranges.  Returns the
+ * number of ranges, or -1 (having output an error) if the list is invalid */
+int parse_port_ranges(const char *services,
+		const struct addrinfo *hints, port_range_t **ranges);
+
+
 typedef struct bound_socket {
 	int fd;
 	int socktype;
@@ -67,7 +90,8 @@ void free_bound_sockets(bound_socket_t *list);
 void close_and_free_bound_sockets(bound_socket_t *list);
 
 /* wrapper around getaddrinfo that understands some additional protocols
- * that the system getaddrinfo doesn't. */
+ * that the system getaddrinfo doesn't.  Lookups go through the resolver,
+ * so may be answered from its cache or the --resolve overrides */
 int getaddrinfo_ex(const char *nodename, const char *servname,
 		const struct addrinfo *hints, struct addrinfo **res);
 void freeaddrinfo_ex(struct addrinfo *ai);
@@ -23,6 +23,10 @@
 #include "options.h"  
 #include "connection.h"  
 #include "misc.h"  
+#include "poller.h"
+#include "readwrite.h"
+#include "circ_buf.h"
+#include "resolver.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -30,6 +34,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <getopt.h>
@@ -97,7 +103,41 @@ static const struct option options[] = {
 	{"exec",                required_argument,  NULL, 'e' },
 #define OPT_CONTINUOUS          29
 	{"continuous",          no_argument,        NULL, 0 },
-#define OPT_MAX                 30
+#define OPT_POLLER              30
+	{"poller",              required_argument,  NULL, 0 },
+#define OPT_NO_SPLICE           31
+	{"no-splice",           no_argument,        NULL, 0 },
+#define OPT_IO_ENGINE           32
+	{"io-engine",           required_argument,  NULL, 0 },
+#define OPT_BATCH               33
+	{"batch",               required_argument,  NULL, 0 },
+#define OPT_MULTIPLEX           34
+	{"multiplex",           no_argument,        NULL, 0 },
+#define OPT_WORKERS             35
+	{"workers",             required_argument,  NULL, 0 },
+#define OPT_STATS               36
+	{"stats",               no_argument,        NULL, 0 },
+#define OPT_ADAPTIVE_BUFFER     37
+	{"adaptive-buffer",     required_argument,  NULL, 0 },
+#define OPT_CHAIN_BUFFERS       38
+	{"chain-buffers",       no_argument,        NULL, 0 },
+#define OPT_FRAME_DATAGRAMS     39
+	{"frame-datagrams",     no_argument,        NULL, 0 },
+#define OPT_SCAN                40
+	{"scan",                no_argument,        NULL, 'z' },
+#define OPT_SCAN_CONCURRENCY    41
+	{"scan-concurrency",    required_argument,  NULL, 0 },
+#define OPT_RESOLVE             42
+	{"resolve",             required_argument,  NULL, 0 },
+#define OPT_FASTOPEN            43
+	{"fastopen",            no_argument,        NULL, 0 },
+#define OPT_RECONNECT           44
+	{"reconnect",           no_argument,        NULL, 0 },
+#define OPT_BACKLOG             45
+	{"backlog",             required_argument,  NULL, 0 },
+#define OPT_DEFER_ACCEPT        46
+	{"defer-accept",        required_argument,  NULL, 0 },
+#define OPT_MAX                 47
 	{NULL, 0, NULL, 0}
 };
 
@@ -277,6 +317,13 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
                         ca_set_buffer_size(attrs, optarg_atoi(opt_index));
                         buffer_size_set = true;
                         break;
+                case OPT_ADAPTIVE_BUFFER:
+                        assert(optarg != NULL);
+                        if (parse_int_pair(optarg, &i1, &i2) != 2 ||
+                            i1 <= 0 || i2 < i1)
+                                invalid_argument(opt_index);
+                        ca_set_buffer_limits(attrs, i1, i2);
+                        break;
                 case OPT_MTU:
                         ca_set_remote_MTU(attrs, optarg_atoi(opt_index));
                         break;
@@ -312,6 +359,97 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
                 case OPT_CONTINUOUS:
                         ca_set_flag(attrs, CA_CONTINUOUS_ACCEPT);
                         break;
+                case OPT_POLLER:
+                        assert(optarg != NULL);
+                        if (poller_set_default(optarg))
+                                fatal(_("unsupported poller '%s' "
+                                      "(available pollers: %s)"),
+                                      optarg, poller_backends());
+                        break;
+                case OPT_NO_SPLICE:
+                        ca_set_flag(attrs, CA_NO_SPLICE);
+                        break;
+                case OPT_MULTIPLEX:
+                        ca_set_flag(attrs, CA_MULTIPLEX);
+                        break;
+                case OPT_STATS:
+                        ca_set_flag(attrs, CA_STATS);
+                        break;
+                case OPT_CHAIN_BUFFERS:
+                        ca_set_flag(attrs, CA_CHAIN_BUFFERS);
+                        break;
+                case OPT_FRAME_DATAGRAMS:
+                        ca_set_flag(attrs, CA_FRAME_DATAGRAMS);
+                        break;
+                case OPT_SCAN:
+                        ca_set_flag(attrs, CA_SCAN);
+                        break;
+                case OPT_SCAN_CONCURRENCY:
+                        i1 = optarg_atoi(opt_index);
+                        if (i1 < 1)
+                                invalid_argument(opt_index);
+                        ca_set_scan_concurrency(attrs, i1);
+                        break;
+                case OPT_RESOLVE:
+                        assert(optarg != NULL);
+                        if (resolver_add_override(optarg))
+                                invalid_argument(opt_index);
+                        break;
+                case OPT_FASTOPEN:
+#if defined(TCP_FASTOPEN) && defined(TCP_FASTOPEN_CONNECT)
+                        ca_set_flag(attrs, CA_FASTOPEN);
+#else
+                        fatal(_("--fastopen option is not supported "
+                              "on this system"));
+#endif
+                        break;
+                case OPT_RECONNECT:
+                        ca_set_flag(attrs, CA_RECONNECT);
+                        break;
+                case OPT_BACKLOG:
+                        i1 = optarg_atoi(opt_index);
+                        if (i1 < 1)
+                                invalid_argument(opt_index);
+                        ca_set_listen_backlog(attrs, i1);
+                        break;
+                case OPT_DEFER_ACCEPT:
+#ifdef TCP_DEFER_ACCEPT
+                        i1 = optarg_atoi(opt_index);
+                        if (i1 < 1)
+                                invalid_argument(opt_index);
+                        ca_set_defer_accept(attrs, i1);
+#else
+                        fatal(_("--defer-accept option is not supported "
+                              "on this system"));
+#endif
+                        break;
+                case OPT_WORKERS:
+#ifdef SO_REUSEPORT
+                        i1 = optarg_atoi(opt_index);
+                        if (i1 < 1)
+                                invalid_argument(opt_index);
+                        ca_set_workers(attrs, i1);
+#else
+                        fatal(_("--workers option is not supported "
+                              "on this system"));
+#endif
+                        break;
+                case OPT_BATCH:
+                        i1 = optarg_atoi(opt_index);
+                        if (i1 < 1 || i1 > CB_MAX_BATCH)
+                                invalid_argument(opt_index);
+                        ca_set_dgram_batch(attrs, i1);
+                        break;
+                case OPT_IO_ENGINE:
+                        assert(optarg != NULL);
+                        if (readwrite_set_engine(optarg))
+                                fatal(_("unsupported i/o engine '%s' "
+                                      "(available engines: %s)"),
+                                      optarg, readwrite_engines());
+                        /* io_uring works on the buffer memory */
+                        if (strcmp(optarg, "io_uring") == 0)
+                                ca_set_flag(attrs, CA_NO_SPLICE);
+                        break;
                 default:
                         fatal_internal(
                               "getopt returned unexpected long "
@@ -337,8 +475,25 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
                 remote_address.service = non_empty_string(argv[1]);
                 break;
         default:
-                print_usage(stderr);
-                exit(EXIT_FAILURE);
+                /* when scanning, any number of remote addresses can
+                 * precede the services */
+                if (!ca_is_flag_set(attrs, CA_SCAN)) {
+                        print_usage(stderr);
+                        exit(EXIT_FAILURE);
+                }
+                remote_address.nodename = non_empty_string(argv[0]);
+                remote_address.service = non_empty_string(argv[argc - 1]);
+                break;
+        }
+
+        if (ca_is_flag_set(attrs, CA_SCAN) && argc >= 2) {
+                for (i1 = 1; i1 < argc - 1; ++i1) {
+                        if (non_empty_string(argv[i1]) == NULL)
+                                fatal(_("you must specify the address of "
+                                      "the remote endpoint"));
+                }
+                ca_set_scan_hosts(attrs, (const char * const *)argv,
+                                  argc - 1);
         }
 
         ca_set_remote_addr(attrs, remote_address);
@@ -367,6 +522,11 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
                         ca_set_buffer_size(attrs, FILE_TRANSFER_BUFFER_SIZE);
         }
 
+        /* an adaptive buffer has no fixed size */
+        if (ca_is_buffer_adaptive(attrs) && buffer_size_set == true)
+                fatal(_("cannot set both --buffer-size "
+                      "and --adaptive-buffer"));
+
         /* check to make sure the user didn't set both
          * --recv-only and --send-only */
         if (ca_is_flag_set(attrs, CA_RECV_DATA_ONLY) &&
@@ -406,6 +566,47 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
                 if (ca_is_flag_set(attrs, CA_CONTINUOUS_ACCEPT))
                         fatal(_("--continuous option "
                               "can be used only with --listen (-l)"));
+                if (ca_listen_backlog(attrs) > 0)
+                        fatal(_("--backlog option "
+                              "can be used only with --listen (-l)"));
+                if (ca_defer_accept(attrs) > 0)
+                        fatal(_("--defer-accept option "
+                              "can be used only with --listen (-l)"));
+        }
+
+        /* only streams can tell when the remote has gone away */
+        if (ca_is_flag_set(attrs, CA_RECONNECT)) {
+                if (ca_is_flag_set(attrs, CA_PASSIVE))
+                        fatal(_("--reconnect option "
+                              "cannot be used with --listen (-l)"));
+                if (ca_is_flag_set(attrs, CA_SCAN))
+                        fatal(_("--reconnect option "
+                              "cannot be used with --scan (-z)"));
+                if (ca_protocol(attrs) == IPPROTO_UDP ||
+                    (ca_socktype(attrs) != 0 &&
+                     ca_socktype(attrs) != SOCK_STREAM))
+                        fatal(_("--reconnect option only supports "
+                              "stream sockets"));
+        }
+
+        /* scanning only makes stream connections to remote endpoints */
+        if (ca_is_flag_set(attrs, CA_SCAN)) {
+                if (ca_is_flag_set(attrs, CA_PASSIVE))
+                        fatal(_("--scan (-z) cannot be used "
+                              "with --listen (-l)"));
+                if (ca_family(attrs) != PF_UNSPEC &&
+                    ca_family(attrs) != PF_INET &&
+                    ca_family(attrs) != PF_INET6)
+                        fatal(_("--scan (-z) only supports IPv4 and IPv6"));
+                if (ca_protocol(attrs) == IPPROTO_UDP ||
+                    (ca_socktype(attrs) != 0 &&
+                     ca_socktype(attrs) != SOCK_STREAM))
+                        fatal(_("--scan (-z) only supports "
+                              "stream sockets"));
+                /* a fast open connect completes before the SYN is sent */
+                if (ca_is_flag_set(attrs, CA_FASTOPEN))
+                        fatal(_("--fastopen cannot be used "
+                              "with --scan (-z)"));
         }
 
         /* --continuous depends on --exec */
@@ -414,6 +615,20 @@ void parse_arguments(int argc, char **argv, connection_attributes_t *attrs)
         {
                 fatal(_("--continuous option must be used with --exec"));
         }
+
+        /* --multiplex depends on --continuous */
+        if (ca_is_flag_set(attrs, CA_MULTIPLEX) &&
+            !ca_is_flag_set(attrs, CA_CONTINUOUS_ACCEPT))
+        {
+                fatal(_("--multiplex option must be used with --continuous"));
+        }
+
+        /* --workers depends on --continuous */
+        if (ca_workers(attrs) > 0 &&
+            !ca_is_flag_set(attrs, CA_CONTINUOUS_ACCEPT))
+        {
+                fatal(_("--workers option must be used with --continuous"));
+        }
 }
 
 
@@ -484,46 +699,84 @@ static void print_usage(FILE *fp)
         
         fprintf(fp, _("Usage:\n"
 "\t%s [options...] hostname port\n"
-"\t%s -l -p port [-s addr] [options...] [hostname] [port]\n\n"
-"Recognized options are:\n"), program_name, program_name);
+"\t%s -l -p port [-s addr] [options...] [hostname] [port]\n"
+"\t%s -z [options...] hostname... port[-port][,port[-port]...]\n\n"
+"Recognized options are:\n"), program_name, program_name, program_name);
         
         fprintf(fp, " -4, --ipv4             %s\n", _("Use only IPv4"));
         fprintf(fp, " -6, --ipv6             %s\n", _("Use only IPv6"));
         fprintf(fp, " -a, --any-protocol     %s\n",
                         _("Use any available protocol (default is TCP)"));
+        fprintf(fp, " --adaptive-buffer=MIN:MAX\n"
+"                        %s\n",
+                      _("Grow and shrink buffers with their use"));
+        fprintf(fp, " --backlog=N            %s\n",
+                      _("Queue up to N connections waiting to be accepted\n"
+"                        (only in listen mode)"));
         fprintf(fp, " -b, --bluetooth        %s\n",
                         _("Use Bluetooth (defaults to L2CAP protocol)"));
+        fprintf(fp, " --batch=N              %s\n",
+                      _("Receive and send up to N datagrams per system call"));
         fprintf(fp, " --buffer-size=BYTES    %s\n", _("Set buffer size"));
+        fprintf(fp, " --chain-buffers        %s\n",
+                      _("Hold buffered data in chains of pooled segments"));
         fprintf(fp, " --continuous           %s\n",
                       _("Continuously accept connections\n"
 "                        (only in listen mode with --exec)"));
+        fprintf(fp, " --defer-accept=SECONDS %s\n",
+                      _("Wait up to SECONDS for data before accepting\n"
+"                        a connection (only in listen mode)"));
         fprintf(fp, " --disable-nagle        %s\n",
                       _("Disable nagle algorithm for TCP connections"));
         fprintf(fp, " -e, --exec=CMD         %s\n",
                       _("Exec command after connect"));
+        fprintf(fp, " --fastopen             %s\n",
+                      _("Use TCP Fast Open to send data with the SYN"));
+        fprintf(fp, " --frame-datagrams      %s\n",
+                      _("Relay datagrams with their original boundaries"));
         fprintf(fp, " --half-close           %s\n",
                       _("Handle network half-closes correctly"));
         fprintf(fp, " -h, --help             %s\n", _("Display help"));
+        fprintf(fp, " --io-engine=NAME       %s (%s)\n",
+                      _("Engine used to relay data"),
+                      readwrite_engines());
         fprintf(fp, " -l, --listen           %s\n",
                       _("Listen mode, for inbound connects"));
         fprintf(fp, " --mtu=BYTES            %s\n",
                       _("Set MTU for network connection transmits"));
+        fprintf(fp, " --multiplex            %s\n",
+                      _("Relay continuous connections from a single process"));
         fprintf(fp, " -n                     %s\n",
                       _("Numeric-only IP addresses, no DNS"));
         fprintf(fp, " --no-reuseaddr         %s\n",
                       _("Disable SO_REUSEADDR socket option\n"
 "                        (only in listen mode)"));
+        fprintf(fp, " --no-splice            %s\n",
+                      _("Always copy data through memory buffers\n"
+"                        (disables splice and sendfile)"));
         fprintf(fp, " --nru=BYTES            %s\n",
                       _("Set NRU for network connection receives"));
         fprintf(fp, " -p, --port=PORT        %s\n", _("Local port"));
+        fprintf(fp, " --poller=NAME          %s (%s)\n",
+                      _("Readiness notification backend"),
+                      poller_backends());
         fprintf(fp, " -q, --hold-timeout=SEC1[:SEC2]\n"
 "                        %s\n",
                       _("Set hold timeout(s) for local [and remote]"));
         fprintf(fp, " --rcvbuf-size          %s\n",
                       _("Kernel receive buffer size for network sockets"));
+        fprintf(fp, " --reconnect            %s\n",
+                      _("Connect again whenever the remote connection "
+                        "is lost"));
         fprintf(fp, " --recv-only            %s\n",
                       _("Only receive data, don't transmit"));
+        fprintf(fp, " --resolve=HOST:PORT:ADDR[,ADDR...]\n"
+"                        %s\n",
+                      _("Use the addresses given for HOST and PORT\n"
+"                        (or any port if it is '*') instead of DNS"));
         fprintf(fp, " -s, --address=ADDRESS  %s\n", _("Local source address"));
+        fprintf(fp, " --scan-concurrency=N   %s\n",
+                      _("Keep up to N scan connects in flight"));
         fprintf(fp, " --sco                  %s\n",
                       _("Use SCO protocol over Bluetooth"));
         fprintf(fp, " --send-only            %s\n",
@@ -533,6 +786,8 @@ static void print_usage(FILE *fp)
         fprintf(fp, " --socktype=[stream|dgram|seqpacket]"
 "                        %s\n",
                       _("Socket type to use. Default is stream."));
+        fprintf(fp, " --stats                %s\n",
+                      _("Print transfer statistics when connections close"));
         fprintf(fp, " -t, --idle-timeout=SECONDS\n"
 "                        %s\n", _("Idle connection timeout"));
         fprintf(fp, " -u, --udp              %s\n",
@@ -544,9 +799,15 @@ static void print_usage(FILE *fp)
                       _("Display nc6 version information"));
         fprintf(fp, " -w, --timeout=SECONDS  %s\n",
                       _("Timeout for connects/accepts"));
+        fprintf(fp, " --workers=N            %s\n",
+                      _("Accept connections in N worker processes\n"
+"                        (only with --continuous)"));
         fprintf(fp, " -x, --transfer         %s\n", _("File transfer mode"));
         fprintf(fp, " -X, --rev-transfer     %s\n",
                       _("File transfer mode (reverse direction)"));
+        fprintf(fp, " -z, --scan             %s\n",
+                      _("Report which ports accept connects, without\n"
+"                        transferring data (zero-I/O mode)"));
         fprintf(fp, "\n");
 }
 
@@ -582,6 +843,9 @@ _("Configured with Bluetooth (bluez) support\n"));
         fprintf(fp,
 _("Configured without Bluetooth (bluez) support\n"));
 #endif
+
+        fprintf(fp,
+_("Configured with the %s poller by default\n"), DEFAULT_POLLER);
 }
 
 
@@ -0,0 +1,832 @@
+/*
+ *  poller.c - file descriptor readiness notification - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "poller.h"
+#include "clock.h"
+#include "misc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+/* table of the available backends */
+static const struct {
+	const char *name;
+	int backend;
+	bool edge_triggered;
+} backends[] = {
+	{ "select",   POLLER_SELECT, false },
+#ifdef ENABLE_POLL
+	{ "poll",     POLLER_POLL,   false },
+#endif
+#ifdef ENABLE_EPOLL
+	{ "epoll",    POLLER_EPOLL,  false },
+	{ "epoll-et", POLLER_EPOLL,  true },
+#endif
+	{ NULL, 0, false }
+};
+
+/* the backend used by poller_init */
+static int default_backend = -1;
+static bool default_edge_triggered = false;
+
+
+static void grow_table(poller_t *p, int fd);
+static void grow_fds(poller_t *p);
+static int poller_wait_once(poller_t *p, const struct timeval *tv);
+static void forget_results(poller_t *p);
+static void add_ready(poller_t *p, int fd, int events);
+static void update_known(poller_t *p, int fd);
+static int timeout_ms(const struct timeval *tv);
+static void select_update(poller_t *p, int fd, int events);
+static int select_wait(poller_t *p, const struct timeval *tv);
+#ifdef ENABLE_POLL
+static int poll_wait(poller_t *p, const struct timeval *tv);
+#endif
+#ifdef ENABLE_EPOLL
+static void epoll_update(poller_t *p, int fd, int events);
+static int epoll_wait_events(poller_t *p, const struct timeval *tv);
+#endif
+
+
+
+#ifndef NDEBUG
+static void poller_assert(const poller_t *p)
+{
+	if (p == NULL ||
+	    p->nfds < 0 ||
+	    p->nfds > p->fds_size ||
+	    p->nready > p->nfds ||
+	    p->nknown > p->nfds)
+	{
+		fatal_internal("poller assertion failed");
+	}
+}
+#else
+#define poller_assert(P)	do {} while(0)
+#endif
+
+
+
+void poller_init(poller_t *p)
+{
+	/* pick up the configured default on first use */
+	if (default_backend < 0 && poller_set_default(DEFAULT_POLLER) != 0)
+		fatal_internal("unknown default poller '%s'", DEFAULT_POLLER);
+
+	poller_init_backend(p, default_backend, default_edge_triggered);
+}
+
+
+
+void poller_init_backend(poller_t *p, int backend, bool edge_triggered)
+{
+	assert(p != NULL);
+
+	memset(p, 0, sizeof(poller_t));
+	p->backend = backend;
+	p->edge_triggered = false;
+	p->max_fd = -1;
+	FD_ZERO(&(p->read_fdset));
+	FD_ZERO(&(p->write_fdset));
+
+	switch (backend) {
+	case POLLER_SELECT:
+		break;
+#ifdef ENABLE_POLL
+	case POLLER_POLL:
+		break;
+#endif
+#ifdef ENABLE_EPOLL
+	case POLLER_EPOLL:
+#ifdef HAVE_EPOLL_CREATE1
+		p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+		p->epoll_fd = epoll_create(16);
+		if (p->epoll_fd >= 0)
+			fcntl(p->epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+		if (p->epoll_fd >= 0) {
+			p->edge_triggered = edge_triggered;
+			break;
+		}
+
+		/* the kernel may not support epoll, even though the
+		 * headers do - so fall back to a portable backend */
+		if (very_verbose_mode())
+			warning(_("epoll unavailable (%s), falling back"),
+			        strerror(errno));
+#ifdef ENABLE_POLL
+		p->backend = POLLER_POLL;
+#else
+		p->backend = POLLER_SELECT;
+#endif
+		break;
+#endif
+	default:
+		fatal_internal("unsupported poller backend %d", backend);
+	}
+
+	poller_assert(p);
+}
+
+
+
+void poller_destroy(poller_t *p)
+{
+	int i;
+
+	poller_assert(p);
+
+	/* the fds are about to be closed, so the parent must drop them */
+	if (p->parent != NULL) {
+		for (i = 0; i < p->nfds; ++i)
+			poller_del(p->parent, p->fds[i]);
+	}
+
+#ifdef ENABLE_EPOLL
+	if (p->backend == POLLER_EPOLL) {
+		close(p->epoll_fd);
+		free(p->epoll_events);
+	}
+#endif
+#ifdef ENABLE_POLL
+	free(p->pollfds);
+#endif
+	free(p->table);
+	free(p->fds);
+	free(p->ready);
+	free(p->known);
+	memset(p, 0, sizeof(poller_t));
+}
+
+
+
+void poller_set(poller_t *p, int fd, int events)
+{
+	poller_fd_t *ent;
+
+	poller_assert(p);
+	assert(fd >= 0);
+	assert((events & ~(POLLER_READ | POLLER_WRITE)) == 0);
+
+	if (p->parent != NULL)
+		poller_set(p->parent, fd, events);
+
+	/* nothing to do when suspending an fd that was never registered */
+	if (events == 0 && (fd >= p->table_size || p->table[fd].slot < 0))
+		return;
+
+	if (fd >= p->table_size)
+		grow_table(p, fd);
+	ent = &(p->table[fd]);
+
+	/* register the fd */
+	if (ent->slot < 0) {
+		if (p->nfds == p->fds_size)
+			grow_fds(p);
+		ent->slot = p->nfds++;
+		ent->interest = 0;
+		ent->kernel = -1;
+		ent->revents = 0;
+		ent->ready = 0;
+		ent->always_ready = false;
+		ent->known_slot = -1;
+		p->fds[ent->slot] = fd;
+#ifdef ENABLE_POLL
+		if (p->backend == POLLER_POLL) {
+			p->pollfds[ent->slot].fd = fd;
+			p->pollfds[ent->slot].events = 0;
+			p->pollfds[ent->slot].revents = 0;
+		}
+#endif
+	} else if (ent->interest == events) {
+		/* registration is unchanged */
+		return;
+	}
+
+	ent->interest = events;
+
+	switch (p->backend) {
+	case POLLER_SELECT:
+		select_update(p, fd, events);
+		break;
+#ifdef ENABLE_POLL
+	case POLLER_POLL:
+		/* poll ignores negative fds, so suspended fds don't report
+		 * hangups or errors */
+		p->pollfds[ent->slot].fd = (events != 0)? fd : -1;
+		p->pollfds[ent->slot].events =
+			((events & POLLER_READ)? POLLIN : 0) |
+			((events & POLLER_WRITE)? POLLOUT : 0);
+		break;
+#endif
+#ifdef ENABLE_EPOLL
+	case POLLER_EPOLL:
+		epoll_update(p, fd, events);
+		break;
+#endif
+	}
+
+	update_known(p, fd);
+}
+
+
+
+void poller_del(poller_t *p, int fd)
+{
+	poller_fd_t *ent;
+	int slot, last;
+
+	poller_assert(p);
+	assert(fd >= 0);
+
+	if (p->parent != NULL)
+		poller_del(p->parent, fd);
+
+	if (fd >= p->table_size || p->table[fd].slot < 0)
+		return;
+	ent = &(p->table[fd]);
+
+	switch (p->backend) {
+	case POLLER_SELECT:
+		select_update(p, fd, 0);
+		break;
+#ifdef ENABLE_EPOLL
+	case POLLER_EPOLL:
+		if (ent->kernel >= 0) {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			/* the fd may already be closed, so ignore errors */
+			epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+			p->updates++;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	/* and from the fds known to be ready */
+	if (ent->known_slot >= 0) {
+		ent->ready = 0;
+		update_known(p, fd);
+	}
+
+	/* drop the fd from the results of the last wait */
+	if (ent->revents != 0) {
+		for (slot = 0; slot < p->nready; ++slot)
+			if (p->ready[slot] == fd)
+				break;
+		assert(slot < p->nready);
+		p->ready[slot] = p->ready[--p->nready];
+	}
+
+	/* move the last registration into the freed slot */
+	slot = ent->slot;
+	last = p->fds[--p->nfds];
+	if (slot != p->nfds) {
+		p->fds[slot] = last;
+		p->table[last].slot = slot;
+#ifdef ENABLE_POLL
+		if (p->backend == POLLER_POLL)
+			p->pollfds[slot] = p->pollfds[p->nfds];
+#endif
+	}
+
+	memset(ent, 0, sizeof(poller_fd_t));
+	ent->slot = -1;
+	ent->kernel = -1;
+	ent->known_slot = -1;
+}
+
+
+
+int poller_wait(poller_t *p, const struct timeval *tv)
+{
+	struct timeval deadline, remaining;
+	int err;
+
+	poller_assert(p);
+
+	/* the timeout was worked out from the cached clock */
+	if (tv != NULL)
+		timeradd(clock_now(), tv, &deadline);
+
+	/* backends may wake up for events the caller isn't interested in
+	 * (eg. edge triggered epoll reports every change of readiness) - in
+	 * which case wait again for the rest of the timeout */
+	while ((err = poller_wait_once(p, tv)) == 0 && p->spurious) {
+		if (tv == NULL)
+			continue;
+		clock_update();
+		if (!timercmp(clock_now(), &deadline, <))
+			break;
+		timersub(&deadline, clock_now(), &remaining);
+		tv = &remaining;
+	}
+
+	/* the time at which the events occurred */
+	clock_update();
+
+	return err;
+}
+
+
+
+static int poller_wait_once(poller_t *p, const struct timeval *tv)
+{
+	struct timeval zero_tv;
+	int i, err;
+
+	forget_results(p);
+
+	/* don't block if there are already fds known to be ready */
+	if (p->nknown > 0) {
+		timerclear(&zero_tv);
+		tv = &zero_tv;
+	}
+
+	switch (p->backend) {
+	case POLLER_SELECT:
+		err = select_wait(p, tv);
+		break;
+#ifdef ENABLE_POLL
+	case POLLER_POLL:
+		err = poll_wait(p, tv);
+		break;
+#endif
+#ifdef ENABLE_EPOLL
+	case POLLER_EPOLL:
+		err = epoll_wait_events(p, tv);
+		break;
+#endif
+	default:
+		abort();
+	}
+
+	if (err < 0)
+		return -1;
+
+	/* report fds that are still known to be ready */
+	for (i = 0; i < p->nknown; ++i) {
+		const poller_fd_t *ent = &(p->table[p->known[i]]);
+		add_ready(p, p->known[i], ent->ready);
+	}
+
+	/* the wait returned early without anything to report */
+	p->spurious = (err > 0 && p->nready == 0);
+
+	poller_assert(p);
+	return p->nready;
+}
+
+
+
+void poller_attach(poller_t *p, poller_t *parent)
+{
+	int i, fd;
+
+	poller_assert(p);
+	poller_assert(parent);
+	assert(p != parent);
+	assert(p->parent == NULL);
+
+	p->parent = parent;
+	for (i = 0; i < p->nfds; ++i) {
+		fd = p->fds[i];
+		poller_set(parent, fd, p->table[fd].interest);
+	}
+}
+
+
+
+int poller_forward(poller_t *p)
+{
+	const poller_t *parent = p->parent;
+	int i, fd;
+
+	poller_assert(p);
+	assert(parent != NULL);
+
+	forget_results(p);
+
+	/* the parent's results include the fds of all its other users */
+	for (i = 0; i < parent->nready; ++i) {
+		fd = parent->ready[i];
+		if (fd < p->table_size && p->table[fd].slot >= 0)
+			add_ready(p, fd, parent->table[fd].revents);
+	}
+
+	poller_assert(p);
+	return p->nready;
+}
+
+
+
+int poller_revents(const poller_t *p, int fd)
+{
+	poller_assert(p);
+	assert(fd >= 0);
+
+	if (fd >= p->table_size)
+		return 0;
+	return p->table[fd].revents;
+}
+
+
+
+void poller_clear(poller_t *p, int fd, int events)
+{
+	poller_assert(p);
+	assert(fd >= 0);
+
+	/* the parent tracks the readiness that it waits for */
+	if (p->parent != NULL)
+		poller_clear(p->parent, fd, events);
+
+	/* level triggered pollers will simply report the fd again */
+	if (!p->edge_triggered || fd >= p->table_size)
+		return;
+	if (p->table[fd].always_ready)
+		return;
+	p->table[fd].ready &= ~events;
+	update_known(p, fd);
+}
+
+
+
+const char *poller_name(const poller_t *p)
+{
+	int i;
+
+	poller_assert(p);
+
+	for (i = 0; backends[i].name != NULL; ++i) {
+		if (backends[i].backend == p->backend &&
+		    backends[i].edge_triggered == p->edge_triggered)
+			return backends[i].name;
+	}
+	return "poller";
+}
+
+
+
+int poller_set_default(const char *name)
+{
+	int i;
+
+	assert(name != NULL);
+
+	for (i = 0; backends[i].name != NULL; ++i) {
+		if (strcmp(backends[i].name, name) == 0) {
+			default_backend = backends[i].backend;
+			default_edge_triggered = backends[i].edge_triggered;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+
+const char *poller_backends(void)
+{
+	static char list[64];
+	int i;
+
+	if (list[0] == '\0') {
+		for (i = 0; backends[i].name != NULL; ++i) {
+			if (i > 0)
+				strncat(list, "|", sizeof(list) - strlen(list) - 1);
+			strncat(list, backends[i].name,
+			        sizeof(list) - strlen(list) - 1);
+		}
+	}
+	return list;
+}
+
+
+
+/* forget the results of the previous wait */
+static void forget_results(poller_t *p)
+{
+	int i;
+
+	for (i = 0; i < p->nready; ++i)
+		p->table[p->ready[i]].revents = 0;
+	p->nready = 0;
+}
+
+
+
+/* make the fd indexed table large enough to hold fd */
+static void grow_table(poller_t *p, int fd)
+{
+	int i, size;
+
+	size = (p->table_size > 0)? p->table_size : 16;
+	while (size <= fd)
+		size *= 2;
+
+	p->table = (poller_fd_t *)xrealloc(p->table,
+	                                   size * sizeof(poller_fd_t));
+	for (i = p->table_size; i < size; ++i) {
+		memset(&(p->table[i]), 0, sizeof(poller_fd_t));
+		p->table[i].slot = -1;
+		p->table[i].kernel = -1;
+		p->table[i].known_slot = -1;
+	}
+	p->table_size = size;
+}
+
+
+
+/* make room for more registrations */
+static void grow_fds(poller_t *p)
+{
+	int size = (p->fds_size > 0)? p->fds_size * 2 : 8;
+
+	p->fds = (int *)xrealloc(p->fds, size * sizeof(int));
+	p->ready = (int *)xrealloc(p->ready, size * sizeof(int));
+	p->known = (int *)xrealloc(p->known, size * sizeof(int));
+#ifdef ENABLE_POLL
+	if (p->backend == POLLER_POLL) {
+		p->pollfds = (struct pollfd *)xrealloc(p->pollfds,
+		                         size * sizeof(struct pollfd));
+	}
+#endif
+#ifdef ENABLE_EPOLL
+	if (p->backend == POLLER_EPOLL) {
+		p->epoll_events = (struct epoll_event *)xrealloc(
+		              p->epoll_events, size * sizeof(struct epoll_event));
+	}
+#endif
+	p->fds_size = size;
+}
+
+
+
+/* record events for fd as a result of the current wait */
+static void add_ready(poller_t *p, int fd, int events)
+{
+	poller_fd_t *ent = &(p->table[fd]);
+
+	events &= ent->interest;
+	if (events == 0)
+		return;
+
+	if (ent->revents == 0) {
+		assert(p->nready < p->nfds);
+		p->ready[p->nready++] = fd;
+	}
+	ent->revents |= events;
+}
+
+
+
+/* keep the list of fds whose readiness is known without asking the kernel
+ * (edge triggered or always ready fds, with ready events of interest) in
+ * step with the state of fd, so waits only look at those fds */
+static void update_known(poller_t *p, int fd)
+{
+	poller_fd_t *ent = &(p->table[fd]);
+	bool known;
+	int last;
+
+	known = ent->slot >= 0 &&
+	        (ent->always_ready || p->edge_triggered) &&
+	        (ent->ready & ent->interest) != 0;
+
+	if (known && ent->known_slot < 0) {
+		assert(p->nknown < p->nfds);
+		ent->known_slot = p->nknown;
+		p->known[p->nknown++] = fd;
+	} else if (!known && ent->known_slot >= 0) {
+		last = p->known[--p->nknown];
+		p->known[ent->known_slot] = last;
+		p->table[last].known_slot = ent->known_slot;
+		ent->known_slot = -1;
+	}
+}
+
+
+
+/* convert a timeout to milliseconds, rounding up so that the wait doesn't
+ * return just before the timeout expires */
+static int timeout_ms(const struct timeval *tv)
+{
+	if (tv == NULL)
+		return -1;
+	if (tv->tv_sec < 0 || (tv->tv_sec == 0 && tv->tv_usec <= 0))
+		return 0;
+	return (int)(tv->tv_sec * 1000) + (int)((tv->tv_usec + 999) / 1000);
+}
+
+
+
+static void select_update(poller_t *p, int fd, int events)
+{
+	int i;
+
+	if (fd >= FD_SETSIZE) {
+		fatal(_("file descriptor %d exceeds the limit of the select "
+		      "poller (%d), use --poller=%s"),
+		      fd, FD_SETSIZE, poller_backends());
+	}
+
+	if (events & POLLER_READ)
+		FD_SET(fd, &(p->read_fdset));
+	else
+		FD_CLR(fd, &(p->read_fdset));
+
+	if (events & POLLER_WRITE)
+		FD_SET(fd, &(p->write_fdset));
+	else
+		FD_CLR(fd, &(p->write_fdset));
+
+	/* recalculate the highest fd */
+	if (events != 0) {
+		p->max_fd = MAX(p->max_fd, fd);
+	} else if (fd == p->max_fd) {
+		p->max_fd = -1;
+		for (i = 0; i < p->nfds; ++i) {
+			if (p->fds[i] != fd && p->table[p->fds[i]].interest)
+				p->max_fd = MAX(p->max_fd, p->fds[i]);
+		}
+	}
+}
+
+
+
+static int select_wait(poller_t *p, const struct timeval *tv)
+{
+	fd_set read_fdset, write_fdset;
+	struct timeval tmp_tv, *tvp = NULL;
+	int i, err;
+
+	/* select modifies its arguments, so pass copies */
+	memcpy(&read_fdset, &(p->read_fdset), sizeof(fd_set));
+	memcpy(&write_fdset, &(p->write_fdset), sizeof(fd_set));
+	if (tv != NULL) {
+		tmp_tv = *tv;
+		tvp = &tmp_tv;
+	}
+
+	p->waits++;
+	err = select(p->max_fd + 1, &read_fdset, &write_fdset, NULL, tvp);
+	if (err <= 0)
+		return err;
+
+	for (i = 0; i < p->nfds; ++i) {
+		int fd = p->fds[i];
+		add_ready(p, fd,
+		          (FD_ISSET(fd, &read_fdset)? POLLER_READ : 0) |
+		          (FD_ISSET(fd, &write_fdset)? POLLER_WRITE : 0));
+	}
+
+	return err;
+}
+
+
+
+#ifdef ENABLE_POLL
+static int poll_wait(poller_t *p, const struct timeval *tv)
+{
+	int i, err;
+
+	p->waits++;
+	err = poll(p->pollfds, p->nfds, timeout_ms(tv));
+	if (err <= 0)
+		return err;
+
+	for (i = 0; i < p->nfds; ++i) {
+		short revents = p->pollfds[i].revents;
+		if (revents == 0)
+			continue;
+		/* errors and hangups are reported as readiness, so that the
+		 * following read or write returns the condition */
+		if (revents & (POLLERR | POLLHUP | POLLNVAL))
+			revents |= POLLIN | POLLOUT;
+		add_ready(p, p->fds[i],
+		          ((revents & POLLIN)? POLLER_READ : 0) |
+		          ((revents & POLLOUT)? POLLER_WRITE : 0));
+	}
+
+	return err;
+}
+#endif
+
+
+
+#ifdef ENABLE_EPOLL
+static void epoll_update(poller_t *p, int fd, int events)
+{
+	poller_fd_t *ent = &(p->table[fd]);
+	struct epoll_event ev;
+	int err, op;
+
+	if (ent->always_ready)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	if (p->edge_triggered) {
+		/* register once for all events, and track readiness
+		 * ourselves - so changes of interest don't need a syscall */
+		if (ent->kernel >= 0)
+			return;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		events = POLLER_READ | POLLER_WRITE;
+		op = EPOLL_CTL_ADD;
+	} else if (events == 0) {
+		/* drop suspended fds from the kernel, as hangups and errors
+		 * would still be reported for them */
+		if (ent->kernel < 0)
+			return;
+		p->updates++;
+		epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+		ent->kernel = -1;
+		return;
+	} else {
+		ev.events = ((events & POLLER_READ)? EPOLLIN : 0) |
+		            ((events & POLLER_WRITE)? EPOLLOUT : 0);
+		op = (ent->kernel >= 0)? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	}
+
+	p->updates++;
+	err = epoll_ctl(p->epoll_fd, op, fd, &ev);
+	if (err != 0) {
+		/* regular files can't be polled, but are always ready */
+		if (errno == EPERM) {
+			ent->always_ready = true;
+			ent->ready = POLLER_READ | POLLER_WRITE;
+			return;
+		}
+		fatal(_("epoll_ctl error: %s"), strerror(errno));
+	}
+	ent->kernel = events;
+}
+
+
+
+static int epoll_wait_events(poller_t *p, const struct timeval *tv)
+{
+	int i, err;
+
+	p->waits++;
+	err = epoll_wait(p->epoll_fd, p->epoll_events, MAX(p->nfds, 1),
+	                 timeout_ms(tv));
+	if (err <= 0)
+		return err;
+
+	for (i = 0; i < err; ++i) {
+		unsigned int revents = p->epoll_events[i].events;
+		int fd = p->epoll_events[i].data.fd;
+		int events;
+
+		/* ignore events for fds that have since been removed */
+		if (fd >= p->table_size || p->table[fd].slot < 0)
+			continue;
+
+		if (revents & (EPOLLERR | EPOLLHUP))
+			revents |= EPOLLIN | EPOLLOUT;
+		events = ((revents & EPOLLIN)? POLLER_READ : 0) |
+		         ((revents & EPOLLOUT)? POLLER_WRITE : 0);
+
+		if (p->edge_triggered) {
+			p->table[fd].ready |= events;
+			update_known(p, fd);
+		} else
+			add_ready(p, fd, events);
+	}
+
+	return err;
+}
+#endif
@@ -0,0 +1,149 @@
+/*
+ *  poller.h - file descriptor readiness notification - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef ENABLE_POLL
+#include <poll.h>
+#endif
+#ifdef ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* poller backends */
+#define POLLER_SELECT		0
+#define POLLER_POLL		1
+#define POLLER_EPOLL		2
+
+/* events */
+#define POLLER_READ		01
+#define POLLER_WRITE		02
+
+typedef struct poller_fd {
+	int interest;      /* events the caller is waiting for */
+	int kernel;        /* events registered in the kernel, -1 if none */
+	int revents;       /* events reported by the last wait */
+	int ready;         /* edge triggered readiness not yet consumed */
+	bool always_ready; /* fd can't be polled (eg. a regular file) */
+	int slot;          /* index into the fds array, -1 if unregistered */
+	int known_slot;    /* index into the known array, -1 if not in it */
+} poller_fd_t;
+
+typedef struct poller {
+	int backend;          /* one of the POLLER_* backends */
+	bool edge_triggered;  /* readiness is only reported on changes */
+
+	poller_fd_t *table;   /* per fd state, indexed by fd */
+	int table_size;       /* number of entries in table */
+
+	int *fds;             /* registered file descriptors */
+	int nfds;             /* number of registered file descriptors */
+	int fds_size;         /* allocated size of fds (and ready, known) */
+
+	int *known;           /* fds with readiness known without a wait */
+	int nknown;           /* number of entries in known */
+
+	int *ready;           /* fds with events after the last wait */
+	int nready;           /* number of entries in ready */
+	bool spurious;        /* last wait returned without reportable events */
+
+	struct poller *parent; /* the poller that waits on its behalf, if any */
+
+	unsigned long waits;   /* number of wait syscalls issued */
+	unsigned long updates; /* number of registration syscalls issued */
+
+	/* select backend */
+	fd_set read_fdset;
+	fd_set write_fdset;
+	int max_fd;
+
+#ifdef ENABLE_POLL
+	/* poll backend - pollfds[i] corresponds to fds[i] */
+	struct pollfd *pollfds;
+#endif
+
+#ifdef ENABLE_EPOLL
+	/* epoll backend */
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+#endif
+} poller_t;
+
+
+/* initialise a poller using the default backend */
+void poller_init(poller_t *p);
+/* initialise a poller using a specific backend */
+void poller_init_backend(poller_t *p, int backend, bool edge_triggered);
+void poller_destroy(poller_t *p);
+
+/* set the events that fd should be watched for.  Registrations persist
+ * across calls to poller_wait and an events value of 0 suspends watching
+ * without dropping the registration. */
+void poller_set(poller_t *p, int fd, int events);
+/* drop the registration for fd - must be called before fd is closed */
+void poller_del(poller_t *p, int fd);
+
+/* wait for registered fds to become ready, or for the timeout to expire
+ * (tv may be NULL for no timeout).  Returns the number of ready fds, or -1
+ * on error (with errno set appropriately).  The cached clock is updated
+ * before returning */
+int poller_wait(poller_t *p, const struct timeval *tv);
+
+/* have parent wait for the fds of p, which are registered with parent
+ * from now on as they are with p (until p is destroyed), so that a single
+ * wait can cover both.  The results of each wait of parent are passed to
+ * p with poller_forward, instead of p waiting itself */
+void poller_attach(poller_t *p, poller_t *parent);
+/* take the events of the last wait of the parent for the fds of p as the
+ * results of a wait of p.  Returns the number of ready fds, as
+ * poller_wait */
+int poller_forward(poller_t *p);
+
+/* returns the events reported for fd by the last poller_wait */
+int poller_revents(const poller_t *p, int fd);
+
+/* the fds registered with the poller */
+#define poller_nfds(P)			((P)->nfds)
+#define poller_fd(P, I)			((P)->fds[(I)])
+
+/* the ready fds reported by the last poller_wait */
+#define poller_nready(P)		((P)->nready)
+#define poller_ready_fd(P, I)		((P)->ready[(I)])
+
+/* in edge triggered mode, an fd stays ready until the caller reports that
+ * an operation on it would block (returned EAGAIN) */
+void poller_clear(poller_t *p, int fd, int events);
+#define poller_edge_triggered(P)	((P)->edge_triggered)
+
+/* the name of the backend in use (eg. for error messages) */
+const char *poller_name(const poller_t *p);
+
+/* set the backend used by poller_init from a name such as "epoll".
+ * Returns 0 on success and -1 if the name isn't a supported backend */
+int poller_set_default(const char *name);
+/* list of supported backend names, suitable for printing */
+const char *poller_backends(void);
+
+#endif/*POLLER_H*/
@@ -21,8 +21,11 @@
  */  
 #include "system.h"
 #include "readwrite.h"
+#include "clock.h"
 #include "misc.h"
 #include "circ_buf.h"
+#include "poller.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -34,27 +37,135 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef ENABLE_IO_URING
+#include <poll.h>
+#endif
+
+
+/* relay engines */
+#define ENGINE_POLLER		0
+#define ENGINE_IO_URING		1
+
+/* returned by an engine that can't handle the streams */
+#define ENGINE_UNSUPPORTED	-2
+
+static const struct {
+	const char *name;
+	int engine;
+} engines[] = {
+	{ "poller",   ENGINE_POLLER },
+#ifdef ENABLE_IO_URING
+	{ "io_uring", ENGINE_IO_URING },
+#endif
+	{ NULL, 0 }
+};
+
+/* the engine used by readwrite */
+static int engine = ENGINE_POLLER;
+
+
+static int poller_readwrite(io_stream_t *ios1, io_stream_t *ios2,
+		bool resumable);
+static int check_timeouts(io_stream_t *ios1, io_stream_t *ios2,
+		bool timedout1, bool timedout2, struct timeval tv[2],
+		struct timeval **tvp);
+static void hold_timedout(io_stream_t *ios, io_stream_t *other);
+static bool remote_closed(const relay_t *relay);
+static bool awaiting_peer(const relay_t *relay);
+static void register_stream(poller_t *poller, const io_stream_t *ios,
+		int read_fd, int write_fd);
+static void nonblock_stream(const io_stream_t *ios);
+static bool has_events(const poller_t *poller, int read_fd, int write_fd);
+#ifdef ENABLE_IO_URING
+static int uring_readwrite(io_stream_t *ios1, io_stream_t *ios2);
+#endif
+
 
 
 /* ios1 is the remote stream, ios2 the local one */
 int readwrite(io_stream_t *ios1, io_stream_t *ios2)
 {
-	int rr, max_fd = -1;
-	int ios1_read_fd, ios1_write_fd;
-	int ios2_read_fd, ios2_write_fd;
-	fd_set read_fdset, write_fdset;
-	struct timeval tv1, tv2;
-	struct timeval *tvp1, *tvp2, *tvp;
-	bool timedout1 = false, timedout2 = false;
+	int retval;
+
+	/* check function arguments */
+	assert(ios1 != NULL);
+	assert(ios2 != NULL);
+
+#ifdef ENABLE_IO_URING
+	if (engine == ENGINE_IO_URING) {
+		retval = uring_readwrite(ios1, ios2);
+		if (retval != ENGINE_UNSUPPORTED)
+			return retval;
+		if (verbose_mode())
+			warning(_("io_uring can't be used for this connection, "
+			          "falling back to polling"));
+	}
+#endif
+
+	return poller_readwrite(ios1, ios2, false);
+}
+
+
+
+int readwrite_resumable(io_stream_t *ios1, io_stream_t *ios2)
+{
+	/* check function arguments */
+	assert(ios1 != NULL);
+	assert(ios2 != NULL);
+
+	return poller_readwrite(ios1, ios2, true);
+}
+
+
+
+int readwrite_set_engine(const char *name)
+{
+	int i;
+
+	assert(name != NULL);
+
+	for (i = 0; engines[i].name != NULL; ++i) {
+		if (strcmp(engines[i].name, name) == 0) {
+			engine = engines[i].engine;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+
+const char *readwrite_engines(void)
+{
+	return "poller"
+#ifdef ENABLE_IO_URING
+		"|io_uring"
+#endif
+		;
+}
+
+
+
+static int poller_readwrite(io_stream_t *ios1, io_stream_t *ios2,
+		bool resumable)
+{
+	int rr;
+	poller_t poller;
+	relay_t relay;
+	struct timeval *tvp;
 	int retval = 0;
 	
 	/* check function arguments */
 	assert(ios1 != NULL);
 	assert(ios2 != NULL);
 
-	/* setup all the stuff for the select loop */
+	/* setup all the stuff for the poll loop */
+	poller_init(&poller);
+	relay_init(&relay, ios1, ios2, &poller, false);
+	relay.resumable = resumable;
 
-	/* here's the select loop. 
+	/* here's the poll loop. 
 	 *
 	 * the loop continues until one of the following occurs:
 	 *
@@ -69,155 +180,672 @@ int readwrite(io_stream_t *ios1, io_stream_t *ios2)
 	 * side as well.
 	 */
 	for (;;) {
-		/* setup fdsets */
-		FD_ZERO(&read_fdset);
-		FD_ZERO(&write_fdset);
+		/* schedule the streams and check timeouts */
+		rr = relay_prepare(&relay, &tvp);
+		if (rr <= 0) {
+			retval = rr;
+			break;
+		}
 
-		ios1_read_fd  = ios_schedule_read(ios1);
-		ios1_write_fd = ios_schedule_write(ios1);
-		ios2_read_fd  = ios_schedule_read(ios2);
-		ios2_write_fd = ios_schedule_write(ios2);
+		/* blocking wait with timeout */
+		rr = poller_wait(&poller, tvp);
 
-		max_fd = -1;
-		if (ios1_read_fd >= 0) {
-			FD_SET(ios1_read_fd, &read_fdset);
-			max_fd = ios1_read_fd;
+		/* handle poller errors.
+		 * if errno == EINTR we just retry the wait */
+		if (rr < 0) {
+			if (errno == EINTR) 
+				continue;
+			fatal("%s error: %s", poller_name(&poller),
+			      strerror(errno));
 		}
-		if (ios1_write_fd >= 0) {
-			FD_SET(ios1_write_fd, &write_fdset);
-			max_fd = MAX(ios1_write_fd, max_fd);
+
+		rr = relay_service(&relay);
+		if (rr != 0) {
+			/* something bad happened, or the remote closed a
+			 * resumable relay - exit the main loop */
+			retval = rr;
+			break;
 		}
-		if (ios2_read_fd >= 0) {
-			FD_SET(ios2_read_fd, &read_fdset);
-			max_fd = MAX(ios2_read_fd, max_fd);
+	}
+
+	/* the streams outlive the poller */
+	ios_set_poller(ios1, NULL);
+	ios_set_poller(ios2, NULL);
+	poller_destroy(&poller);
+	
+	return retval;
+}
+
+
+
+void relay_init(relay_t *relay, io_stream_t *ios1, io_stream_t *ios2,
+		poller_t *poller, bool nonblocking)
+{
+	/* check function arguments */
+	assert(relay != NULL);
+	assert(ios1 != NULL);
+	assert(ios2 != NULL);
+	assert(poller != NULL);
+
+	relay->ios1 = ios1;
+	relay->ios2 = ios2;
+	relay->poller = poller;
+	relay->ios1_read_fd = relay->ios1_write_fd = -1;
+	relay->ios2_read_fd = relay->ios2_write_fd = -1;
+	relay->resumable = false;
+	relay->timedout1 = relay->timedout2 = false;
+
+	ios_set_poller(ios1, poller);
+	ios_set_poller(ios2, poller);
+
+	/* with edge triggered notification an fd is only known to be idle
+	 * once an operation on it returns EAGAIN, so it must not block */
+	if (nonblocking || poller_edge_triggered(poller)) {
+		nonblock_stream(ios1);
+		nonblock_stream(ios2);
+	}
+}
+
+
+
+int relay_prepare(relay_t *relay, struct timeval **tvp)
+{
+	io_stream_t *ios1, *ios2;
+	int rr;
+
+	/* check function arguments */
+	assert(relay != NULL);
+	assert(tvp != NULL);
+
+	ios1 = relay->ios1;
+	ios2 = relay->ios2;
+
+	for (;;) {
+		relay->ios1_read_fd  = ios_schedule_read(ios1);
+		relay->ios1_write_fd = ios_schedule_write(ios1);
+		relay->ios2_read_fd  = ios_schedule_read(ios2);
+		relay->ios2_write_fd = ios_schedule_write(ios2);
+
+		/* finished if nothing is to be read or written */
+		if (relay->ios1_read_fd < 0 && relay->ios1_write_fd < 0 &&
+		    relay->ios2_read_fd < 0 && relay->ios2_write_fd < 0 &&
+		    !awaiting_peer(relay))
+			return 0;
+
+		/* update the poller registrations (these persist across
+		 * iterations, so usually nothing changes) */
+		register_stream(relay->poller, ios1,
+		                relay->ios1_read_fd, relay->ios1_write_fd);
+		register_stream(relay->poller, ios2,
+		                relay->ios2_read_fd, relay->ios2_write_fd);
+
+		/* check timeouts */
+		rr = check_timeouts(ios1, ios2,
+		                    relay->timedout1, relay->timedout2,
+		                    relay->tv, tvp);
+		if (rr < 0) {
+			return -1;
+		} else if (rr == 1) {
+			hold_timedout(ios1, ios2);
+			relay->timedout1 = true;
+		} else if (rr == 2) {
+			hold_timedout(ios2, ios1);
+			relay->timedout2 = true;
+		} else {
+			return 1;
+		}
+	}
+}
+
+
+
+int relay_service(relay_t *relay)
+{
+	poller_t *poller;
+	io_stream_t *ios1, *ios2;
+	int rr;
+
+	/* check function arguments */
+	assert(relay != NULL);
+
+	poller = relay->poller;
+	ios1 = relay->ios1;
+	ios2 = relay->ios2;
+
+	if (has_events(poller, relay->ios1_read_fd, relay->ios1_write_fd))
+		ios1->wakeups++;
+	if (has_events(poller, relay->ios2_read_fd, relay->ios2_write_fd))
+		ios2->wakeups++;
+
+	if (relay->ios1_read_fd >= 0 &&
+	    (poller_revents(poller, relay->ios1_read_fd) & POLLER_READ))
+	{
+		/* ios1 is ready to read */
+		rr = ios_read(ios1);
+
+		if (rr == 0) {
+			/* would have blocked, unless the buffer
+			 * filled up first */
+			if (ios_schedule_read(ios1) >= 0)
+				poller_clear(poller, relay->ios1_read_fd,
+				             POLLER_READ);
+		} else if (rr < 0) {
+			if (remote_closed(relay))
+				return READWRITE_REMOTE_CLOSED;
+			if (rr == IOS_EOF)
+				ios_write_eof(ios2);
+			else
+				return -1;
+		}
+	}
+
+	if (relay->ios2_read_fd >= 0 &&
+	    (poller_revents(poller, relay->ios2_read_fd) & POLLER_READ))
+	{
+		/* ios2 is ready to read */
+		rr = ios_read(ios2);
+
+		if (rr == 0) {
+			/* would have blocked, unless the buffer
+			 * filled up first */
+			if (ios_schedule_read(ios2) >= 0)
+				poller_clear(poller, relay->ios2_read_fd,
+				             POLLER_READ);
+		} else if (rr < 0) {
+			if (rr == IOS_EOF)
+				ios_write_eof(ios1);
+			else
+				return -1;
+		}
+	}
+
+	if (relay->ios1_write_fd >= 0 &&
+	    (poller_revents(poller, relay->ios1_write_fd) & POLLER_WRITE))
+	{
+		/* ios1 is ready to write */
+		rr = ios_write(ios1);
+
+		if (rr == 0) {
+			/* would have blocked */
+			poller_clear(poller, relay->ios1_write_fd,
+			             POLLER_WRITE);
+		} else if (rr < 0) {
+			/* write failed */
+			if (remote_closed(relay))
+				return READWRITE_REMOTE_CLOSED;
+			return -1;
+		}
+	}
+
+	if (relay->ios2_write_fd >= 0 &&
+	    (poller_revents(poller, relay->ios2_write_fd) & POLLER_WRITE))
+	{
+		/* ios2 is ready to write */
+		rr = ios_write(ios2);
+
+		if (rr == 0) {
+			/* would have blocked */
+			poller_clear(poller, relay->ios2_write_fd,
+			             POLLER_WRITE);
+		} else if (rr < 0) {
+			/* write failed */
+			return -1;
 		}
-		if (ios2_write_fd >= 0) {
-			FD_SET(ios2_write_fd, &write_fdset);
-			max_fd = MAX(ios2_write_fd, max_fd);
+	}
+
+	return 0;
+}
+
+
+
+/* check the timeouts of both streams (skipping those that have already had
+ * a hold timeout).  Returns -1 if a stream has idled for too long, 1 or 2 if
+ * the hold timeout of ios1 or ios2 has expired, or 0 with *tvp set to the
+ * interval to the next timeout (stored in tv, or NULL if there is none) */
+static int check_timeouts(io_stream_t *ios1, io_stream_t *ios2,
+		bool timedout1, bool timedout2, struct timeval tv[2],
+		struct timeval **tvp)
+{
+	struct timeval *tvp1 = NULL, *tvp2 = NULL;
+
+	if (!timedout1) {
+		tvp1 = ios_next_timeout(ios1, &tv[0]);
+
+		if (ios_idle_timedout(ios1))
+			return -1;
+		if (ios_hold_timedout(ios1))
+			return 1;
+	}
+	if (!timedout2) {
+		tvp2 = ios_next_timeout(ios2, &tv[1]);
+
+		if (ios_idle_timedout(ios2))
+			return -1;
+		if (ios_hold_timedout(ios2))
+			return 2;
+	}
+
+	/* select smallest timeout */
+	if (tvp1 != NULL) {
+		if (tvp2 != NULL)
+			*tvp = timercmp(tvp1, tvp2, <) ? tvp1 : tvp2;
+		else
+			*tvp = tvp1;
+	} else {
+		*tvp = tvp2;  /* tvp2 may be NULL */
+	}
+
+	return 0;
+}
+
+
+
+/* the hold timeout of ios has expired */
+static void hold_timedout(io_stream_t *ios, io_stream_t *other)
+{
+	/* stop reading from the other endpoint */
+	ios_shutdown(other, SHUT_RD);
+	/* stop sending to this endpoint */
+	ios_shutdown(ios, SHUT_WR);
+}
+
+
+
+/* returns true if ios1 closing or failing should end a resumable relay.
+ * Once the local stream has nothing more to send, the remote closing is
+ * the end of the relay as usual */
+static bool remote_closed(const relay_t *relay)
+{
+	return relay->resumable &&
+	       (is_read_open(relay->ios2) || !cb_is_empty(relay->ios1->buf_out));
+}
+
+
+
+/* returns true if ios1 is a stream with a peer, whose datagrams are
+ * received for it (see ios_init_peer), and they can still be passed on.
+ * The relay then goes on until it idles out, even with no fds scheduled */
+static bool awaiting_peer(const relay_t *relay)
+{
+	return ios_peer(relay->ios1) != NULL && is_write_open(relay->ios2);
+}
+
+
+
+/* register the fds of a stream with the poller, for the events that the
+ * stream has been scheduled for */
+static void register_stream(poller_t *poller, const io_stream_t *ios,
+		int read_fd, int write_fd)
+{
+	int events;
+
+	/* the input and output of a stream may share an fd */
+	if (ios->fd_in >= 0) {
+		events = (read_fd >= 0)? POLLER_READ : 0;
+		if (write_fd >= 0 && write_fd == ios->fd_in)
+			events |= POLLER_WRITE;
+		poller_set(poller, ios->fd_in, events);
+	}
+
+	if (ios->fd_out >= 0 && ios->fd_out != ios->fd_in)
+		poller_set(poller, ios->fd_out, (write_fd >= 0)? POLLER_WRITE : 0);
+}
+
+
+
+static void nonblock_stream(const io_stream_t *ios)
+{
+	if (ios->fd_in >= 0)
+		nonblock(ios->fd_in);
+	if (ios->fd_out >= 0 && ios->fd_out != ios->fd_in)
+		nonblock(ios->fd_out);
+}
+
+
+
+/* returns true if the last wait reported events on the scheduled fds */
+static bool has_events(const poller_t *poller, int read_fd, int write_fd)
+{
+	return (read_fd >= 0 && poller_revents(poller, read_fd)) ||
+	       (write_fd >= 0 && poller_revents(poller, write_fd));
+}
+
+
+
+#ifdef ENABLE_IO_URING
+
+/* an operation that may be in flight on the ring.  Each direction of each
+ * stream has at most one operation outstanding at any time */
+typedef struct uring_op {
+	io_stream_t *ios;   /* the stream the operation is for */
+	io_stream_t *other; /* the stream on the other side of the relay */
+	bool write;         /* write from buf_out, rather than read to buf_in */
+	bool pending;       /* submitted and not yet completed */
+	int poll_error;     /* error from the linked readiness poll */
+} uring_op_t;
+
+#define URING_ENTRIES		16
+
+/* user_data of the submissions - the index of the op, shifted left by one
+ * with the low bit set for the readiness poll linked before the op */
+#define URING_OP_DATA(I)	((__u64)(I) << 1)
+#define URING_POLL_DATA(I)	(((__u64)(I) << 1) | 1)
+#define URING_CANCEL_DATA	(~(__u64)0)
+
+/* true if the direction of op is scheduled, as per ios_schedule_* */
+#define uring_scheduled(OP)	(((OP)->write? \
+		ios_schedule_write((OP)->ios) : \
+		ios_schedule_read((OP)->ios)) >= 0)
+
+static void uring_submit_op(uring_t *ring, uring_op_t *ops, int i,
+		const circ_buf_t *bufs[2], bool fixed);
+static int uring_reap(uring_t *ring, uring_op_t *ops, bool discard);
+static int uring_cancel_op(uring_t *ring, uring_op_t *ops, int i,
+		bool discard);
+
+
+
+/* the relay loop, driven by io_uring.  Every read and write is submitted
+ * linked behind a readiness poll, so that a single io_uring_enter submits
+ * the operations and waits for their completions.  Returns as readwrite,
+ * or ENGINE_UNSUPPORTED if io_uring can't be used for the streams */
+static int uring_readwrite(io_stream_t *ios1, io_stream_t *ios2)
+{
+	uring_t ring;
+	uring_op_t ops[4];
+	const circ_buf_t *bufs[2];
+	struct iovec iov[CB_MAX_IOV];
+	struct timeval tv[2], *tvp;
+	bool timedout1 = false, timedout2 = false;
+	bool fixed;
+	int i, rr;
+	int retval = 0;
+
+	/* check function arguments */
+	assert(ios1 != NULL);
+	assert(ios2 != NULL);
+
+	/* datagrams need a send/recv per packet, and buffers that are held
+	 * in a pipe or a file have no memory to read into */
+	if (ios1->socktype == SOCK_DGRAM || ios2->socktype == SOCK_DGRAM)
+		return ENGINE_UNSUPPORTED;
+	if (cb_is_spliced(ios1->buf_in) || cb_is_file_backed(ios1->buf_in) ||
+	    cb_is_spliced(ios2->buf_in) || cb_is_file_backed(ios2->buf_in))
+		return ENGINE_UNSUPPORTED;
+	/* and the registered buffers have to be contiguous */
+	if (cb_is_chained(ios1->buf_in) || cb_is_chained(ios2->buf_in))
+		return ENGINE_UNSUPPORTED;
+
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		if (very_verbose_mode())
+			warning(_("unable to setup io_uring: %s"),
+			        strerror(errno));
+		return ENGINE_UNSUPPORTED;
+	}
+
+	/* the two buffers are each the input of one stream and the output
+	 * of the other.  Registering them lets the kernel skip mapping the
+	 * pages for every operation.  The kernel holds on to the memory
+	 * while operations are in flight, so the buffers can't be resized */
+	if ((cb_is_adaptive(ios1->buf_in) || cb_is_adaptive(ios2->buf_in)) &&
+	    very_verbose_mode())
+		warning(_("buffer sizes are fixed with io_uring"));
+	cb_set_adaptive(ios1->buf_in, 0, 0);
+	cb_set_adaptive(ios2->buf_in, 0, 0);
+	/* the fixed operations only use the first contiguous part of a
+	 * buffer, which is all of it if it is mirrored */
+	cb_mirror(ios1->buf_in);
+	cb_mirror(ios2->buf_in);
+	bufs[0] = ios1->buf_in;
+	bufs[1] = ios2->buf_in;
+	for (i = 0; i < 2; ++i) {
+		iov[i].iov_base = bufs[i]->buf;
+		iov[i].iov_len  = cb_mapped_size(bufs[i]);
+	}
+	fixed = (uring_register_buffers(&ring, iov, 2) == 0);
+	if (!fixed && very_verbose_mode())
+		warning(_("unable to register io_uring buffers: %s"),
+		        strerror(errno));
+
+	memset(ops, 0, sizeof(ops));
+	ops[0].ios = ops[1].ios = ios1;
+	ops[2].ios = ops[3].ios = ios2;
+	ops[0].other = ops[1].other = ios2;
+	ops[2].other = ops[3].other = ios1;
+	ops[1].write = ops[3].write = true;
+
+	/* the loop follows the same rules as the poller loop */
+	for (;;) {
+		bool idle = true;
+
+		for (i = 0; i < 4; ++i) {
+			if (ops[i].pending || uring_scheduled(&(ops[i])))
+				idle = false;
 		}
 
 		/* stop loop if nothing is to be read or written */
-		if (max_fd == -1)
+		if (idle)
 			break;
 
 		/* check timeouts */
-		tvp1 = tvp2 = NULL;
-		if (!timedout1) {
-			tvp1 = ios_next_timeout(ios1, &tv1);
-
-			/* handle timeouts */
-			if (ios_idle_timedout(ios1)) {
-				/* stop the readwrite loop */
+		rr = check_timeouts(ios1, ios2, timedout1, timedout2, tv, &tvp);
+		if (rr < 0) {
+			/* stop the readwrite loop */
+			retval = -1;
+			break;
+		} else if (rr > 0) {
+			/* the operations on the fds being shutdown have to
+			 * complete before the fds can be closed */
+			if (uring_cancel_op(&ring, ops, (rr == 1)? 2 : 0,
+			                    false) < 0 ||
+			    uring_cancel_op(&ring, ops, (rr == 1)? 1 : 3,
+			                    false) < 0)
+			{
 				retval = -1;
 				break;
 			}
-			if (ios_hold_timedout(ios1)) {
-				/* stop reading from the other endpoint */
-				ios_shutdown(ios2, SHUT_RD);
-				/* stop sending to this endpoint */
-				ios_shutdown(ios1, SHUT_WR);
+			if (rr == 1) {
+				hold_timedout(ios1, ios2);
 				timedout1 = true;
-				continue;
+			} else {
+				hold_timedout(ios2, ios1);
+				timedout2 = true;
 			}
+			continue;
 		}
-		if (!timedout2) {
-			tvp2 = ios_next_timeout(ios2, &tv2);
 
-			/* handle timeouts */
-			if (ios_idle_timedout(ios2)) {
-				/* stop the readwrite loop */
-				retval = -1;
-				break;
-			}
-			if (ios_hold_timedout(ios2)) {
-				/* stop reading from the other endpoint */
-				ios_shutdown(ios1, SHUT_RD);
-				/* stop sending to this endpoint */
-				ios_shutdown(ios2, SHUT_WR);
-				timedout2 = true;
-				continue;
-			}
+		/* queue an operation for each direction that is scheduled
+		 * and not already in flight */
+		for (i = 0; i < 4; ++i) {
+			if (!ops[i].pending && uring_scheduled(&(ops[i])))
+				uring_submit_op(&ring, ops, i, bufs, fixed);
 		}
 
-		/* select smallest timeout for select */
-		if (tvp1 != NULL) {
-			if (tvp2 != NULL)
-				tvp = timercmp(tvp1, tvp2, <) ? tvp1 : tvp2;
-			else
-				tvp = tvp1;
-		} else {
-			tvp = tvp2;  /* tvp2 may be NULL */
+		/* submit and wait with timeout */
+		if (uring_enter(&ring, 1, tvp) < 0 &&
+		    errno != ETIME && errno != EINTR)
+		{
+			fatal("io_uring error: %s", strerror(errno));
+		}
+		clock_update();
+
+		if (uring_reap(&ring, ops, false) < 0) {
+			retval = -1;
+			break;
 		}
+	}
 
-		/* blocking select with timeout */		
-		rr = select(max_fd + 1, &read_fdset, &write_fdset, NULL, tvp);
+	/* nothing may be left in flight once the streams are released */
+	for (i = 0; i < 4; ++i)
+		uring_cancel_op(&ring, ops, i, true);
 
-		/* handle select errors.
-		 * if errno == EINTR we just retry select */
-		if (rr < 0) {
-			if (errno == EINTR) 
+	if (very_verbose_mode())
+		warning(_("io_uring relay used %lu system calls"), ring.enters);
+	uring_destroy(&ring);
+
+	return retval;
+}
+
+
+
+/* queue a read or write for op i, linked behind a poll for readiness of its
+ * fd.  The fds may be non-blocking, in which case the kernel won't wait for
+ * the operation itself.  Only the first contiguous part of the buffer is
+ * used, as the fixed operations can't scatter (a mirrored buffer is always
+ * contiguous) */
+static void uring_submit_op(uring_t *ring, uring_op_t *ops, int i,
+		const circ_buf_t *bufs[2], bool fixed)
+{
+	uring_op_t *op = &(ops[i]);
+	const circ_buf_t *cb;
+	struct io_uring_sqe *sqe;
+	struct iovec iov[CB_MAX_IOV];
+	int fd;
+
+	assert(!op->pending);
+
+	if (op->write) {
+		cb = op->ios->buf_out;
+		fd = op->ios->fd_out;
+		cb_data_iov(cb, op->ios->mtu, iov);
+	} else {
+		cb = op->ios->buf_in;
+		fd = op->ios->fd_in;
+		cb_space_iov(cb, 0, iov);
+	}
+	assert(fd >= 0);
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = op->write? POLLOUT : POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+	if (uring_has_feature(ring, IORING_FEAT_CQE_SKIP))
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = URING_POLL_DATA(i);
+
+	sqe = uring_get_sqe(ring);
+	if (fixed) {
+		sqe->opcode = op->write? IORING_OP_WRITE_FIXED :
+		                         IORING_OP_READ_FIXED;
+		sqe->buf_index = (cb == bufs[0])? 0 : 1;
+	} else {
+		sqe->opcode = op->write? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov[0].iov_base;
+	sqe->len = iov[0].iov_len;
+	/* use (and update) the current file position */
+	sqe->off = (__u64)-1;
+	sqe->user_data = URING_OP_DATA(i);
+
+	op->pending = true;
+	op->poll_error = 0;
+}
+
+
+
+/* process the available completions.  Returns -1 if a stream failed and the
+ * loop should stop.  With discard, the results are thrown away */
+static int uring_reap(uring_t *ring, uring_op_t *ops, bool discard)
+{
+	struct io_uring_cqe *cqe;
+	uring_op_t *op;
+	ssize_t rr;
+	int retval = 0;
+	int res;
+
+	while ((cqe = uring_peek_cqe(ring)) != NULL) {
+		__u64 data = cqe->user_data;
+		res = cqe->res;
+		uring_cqe_seen(ring);
+
+		if (data == URING_CANCEL_DATA)
+			continue;
+
+		op = &(ops[data >> 1]);
+		if (data & 1) {
+			/* a failed poll cancels the linked operation */
+			if (res >= 0)
+				continue;
+			if (!uring_has_feature(ring, IORING_FEAT_CQE_SKIP)) {
+				if (res != -ECANCELED)
+					op->poll_error = -res;
 				continue;
-			fatal("select error: %s", strerror(errno));
-		}
-		
-		if (ios1_read_fd >= 0 && FD_ISSET(ios1_read_fd, &read_fdset)) {
-			/* ios1 is ready to read */
-			rr = ios_read(ios1);
-
-			if (rr < 0) {
-				if (rr == IOS_EOF) {
-					ios_write_eof(ios2);
-				} else {
-					/* something bad happened -
-					 * exit the main loop */
-					retval = -1;
-					break;
-				}
 			}
+			/* when the poll skips successful completions, the
+			 * cancelled operation doesn't post one at all */
+		} else if (res == -ECANCELED && op->poll_error != 0) {
+			res = -op->poll_error;
 		}
 
-		if (ios2_read_fd >= 0 && FD_ISSET(ios2_read_fd, &read_fdset)) {
-			/* ios2 is ready to read */
-			rr = ios_read(ios2);
+		assert(op->pending);
+		op->pending = false;
+		if (discard)
+			continue;
+		op->ios->wakeups++;
 
-			if (rr < 0) {
-				if (rr == IOS_EOF) {
-					ios_write_eof(ios1);
-				} else {
-					/* something bad happened -
-					 * exit the main loop */
-					retval = -1;
-					break;
-				}
-			}
+		if (res < 0) {
+			/* a cancelled or interrupted operation is simply
+			 * submitted again */
+			errno = (res == -ECANCELED || res == -EINTR)?
+				EAGAIN : -res;
+			rr = -1;
+		} else {
+			rr = res;
 		}
 
-		if (ios1_write_fd >= 0 && FD_ISSET(ios1_write_fd, &write_fdset))
-		{
-			/* ios1 is ready to write */
-			rr = ios_write(ios1);
-
-			if (rr < 0) {
-				/* write failed -
-				 * exit the main loop */
+		if (op->write) {
+			if (rr > 0)
+				cb_consume(op->ios->buf_out, rr);
+			if (ios_write_complete(op->ios, rr) < 0)
+				retval = -1;
+		} else {
+			if (rr > 0)
+				cb_produce(op->ios->buf_in, rr);
+			rr = ios_read_complete(op->ios, rr);
+			if (rr == IOS_EOF)
+				ios_write_eof(op->other);
+			else if (rr < 0)
 				retval = -1;
-				break;
-			}
 		}
+	}
 
-		if (ios2_write_fd >= 0 && FD_ISSET(ios2_write_fd, &write_fdset))
-		{
-			/* ios2 is ready to write */
-			rr = ios_write(ios2);
+	return retval;
+}
 
-			if (rr < 0) {
-				/* write failed -
-				 * exit the main loop */
-				retval = -1;
-				break;
-			}
-		}
+
+
+/* cancel op i, if it is in flight, and wait for it to complete.  Returns as
+ * uring_reap for any completions processed while waiting */
+static int uring_cancel_op(uring_t *ring, uring_op_t *ops, int i,
+		bool discard)
+{
+	struct io_uring_sqe *sqe;
+	int retval = 0;
+
+	if (!ops[i].pending)
+		return 0;
+
+	/* the operation may still be waiting behind its poll */
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_POLL_DATA(i);
+	sqe->user_data = URING_CANCEL_DATA;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_OP_DATA(i);
+	sqe->user_data = URING_CANCEL_DATA;
+
+	while (ops[i].pending) {
+		if (uring_enter(ring, 1, NULL) < 0 && errno != EINTR)
+			fatal("io_uring error: %s", strerror(errno));
+		if (uring_reap(ring, ops, discard) < 0)
+			retval = -1;
 	}
-	
+
 	return retval;
 }
+
+#endif/*ENABLE_IO_URING*/
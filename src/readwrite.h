@@ -24,7 +24,61 @@
 #define READWRITE_H
 
 #include "io_stream.h"
+#include "poller.h"
 
+/* ios1 is the remote stream, ios2 the local one.  Relays data between them
+ * until neither can be read or written, returning 0 or -1 on failure or
+ * timeout */
 int readwrite(io_stream_t *ios1, io_stream_t *ios2);
 
+/* as readwrite, except that the remote stream closing or failing ends the
+ * relay without being passed on to the local stream, which is left open
+ * with any data buffered for the remote.  The relay can then be resumed
+ * with a new remote stream over the same buffers.  Returns
+ * READWRITE_REMOTE_CLOSED in that case, otherwise as readwrite.  This
+ * always relays with the poller */
+int readwrite_resumable(io_stream_t *ios1, io_stream_t *ios2);
+
+#define READWRITE_REMOTE_CLOSED	1
+
+/* set the engine that readwrite relays data with from a name such as
+ * "io_uring".  Returns 0 on success and -1 if the name isn't supported */
+int readwrite_set_engine(const char *name);
+/* list of supported engine names, suitable for printing */
+const char *readwrite_engines(void);
+
+
+/* the state of a relay between two streams, for driving several relays
+ * from one poller.  readwrite is a loop over a single relay */
+typedef struct relay {
+	io_stream_t *ios1;     /* the remote stream */
+	io_stream_t *ios2;     /* the local stream */
+	poller_t *poller;      /* the poller the streams are registered with */
+
+	/* the fds scheduled by the last relay_prepare, or -1 */
+	int ios1_read_fd, ios1_write_fd;
+	int ios2_read_fd, ios2_write_fd;
+
+	bool resumable;        /* ios1 closing ends the relay, as described
+	                        * for readwrite_resumable */
+	bool timedout1;        /* the hold timeout of ios1 has been handled */
+	bool timedout2;        /* the hold timeout of ios2 has been handled */
+	struct timeval tv[2];  /* storage for the next timeout */
+} relay_t;
+
+/* setup a relay between two streams, whose fds are then removed from the
+ * poller as they are closed.  If nonblocking is true, the fds are put in
+ * non-blocking mode (which is always done for edge triggered pollers) */
+void relay_init(relay_t *relay, io_stream_t *ios1, io_stream_t *ios2,
+		poller_t *poller, bool nonblocking);
+/* register the streams with the poller for the events they are waiting for
+ * and handle any expired timeouts.  Returns 1 with *tvp set to the interval
+ * to the next timeout (or NULL), 0 if the relay has finished, or -1 if it
+ * failed or timed out */
+int relay_prepare(relay_t *relay, struct timeval **tvp);
+/* read and write the streams according to the events reported by the last
+ * poller_wait.  Returns 0, -1 if the relay failed, or
+ * READWRITE_REMOTE_CLOSED if the relay is resumable and ios1 closed */
+int relay_service(relay_t *relay);
+
 #endif/*READWRITE_H*/
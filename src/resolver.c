@@ -0,0 +1,771 @@
+/*
+ *  resolver.c - cached and background name resolution - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "resolver.h"
+#include "misc.h"
+#include "clock.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#ifdef ENABLE_RESOLVER_THREADS
+#include <pthread.h>
+#endif
+
+
+/* the states of a forward lookup */
+#define LOOKUP_QUEUED		0  /* waiting to be resolved */
+#define LOOKUP_RUNNING		1  /* being resolved by a helper thread */
+#define LOOKUP_DONE		2  /* err and res hold the results */
+
+/* a forward lookup, as cached */
+typedef struct lookup {
+	char *nodename;           /* NULL if not given */
+	char *servname;           /* NULL if not given */
+	int flags;                /* the hints given */
+	int family;
+	int socktype;
+	int protocol;
+	int state;
+	int err;                  /* the result of getaddrinfo */
+	struct addrinfo *res;
+	struct timeval started;   /* when the lookup was started */
+	struct lookup *next;      /* in the cache, most recent first */
+	struct lookup *next_queued;
+} lookup_t;
+
+/* an inverse lookup, as cached */
+typedef struct name_lookup {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int flags;
+	int err;                  /* the result of getnameinfo */
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	struct timeval started;
+	struct name_lookup *next; /* in the cache, most recent first */
+} name_lookup_t;
+
+/* a --resolve override */
+typedef struct override {
+	char *host;
+	char *port;               /* "*" matches any port */
+	char *addresses;          /* comma separated numeric addresses */
+	struct override *next;
+} override_t;
+
+
+/* results are kept for a minute */
+static const struct timeval LOOKUP_TTL = { 60, 0 };
+/* names found not to exist are looked up again after 10 seconds */
+static const struct timeval NEGATIVE_LOOKUP_TTL = { 10, 0 };
+/* at most 64 results of each kind are kept */
+static const int MAX_CACHED_LOOKUPS = 64;
+
+static lookup_t *lookups = NULL;
+static int nlookups = 0;
+static name_lookup_t *name_lookups = NULL;
+static int nname_lookups = 0;
+static override_t *overrides = NULL;
+static override_t **overrides_end = &overrides;
+
+#ifdef ENABLE_RESOLVER_THREADS
+/* up to 4 helper threads resolve queued lookups */
+static const int MAX_HELPERS = 4;
+
+/* guards the queue and the state and results of the lookups */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* signalled when a lookup is queued */
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+/* broadcast when a helper has finished a lookup */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static lookup_t *queue = NULL;
+static lookup_t **queue_end = &queue;
+static int nhelpers = 0;
+static int nidle_helpers = 0;
+static bool fork_handlers_set = false;
+
+#define resolver_lock()		pthread_mutex_lock(&lock)
+#define resolver_unlock()	pthread_mutex_unlock(&lock)
+#else
+#define resolver_lock()		/* no helpers */
+#define resolver_unlock()	/* no helpers */
+#endif
+
+
+static lookup_t *find_lookup(const char *nodename, const char *servname,
+		const struct addrinfo *hints);
+static lookup_t *add_lookup(const char *nodename, const char *servname,
+		const struct addrinfo *hints);
+static void drop_lookup(lookup_t *l);
+static void complete_lookup(lookup_t *l);
+static void lookup_hints(const lookup_t *l, struct addrinfo *hints);
+static bool is_negative_answer(int err);
+static bool has_expired(const struct timeval *started, int err);
+static struct addrinfo *copy_addrinfo(const struct addrinfo *ai);
+static const override_t *find_override(const char *nodename,
+		const char *servname);
+static int override_lookup(const override_t *o, const char *servname,
+		const struct addrinfo *hints, struct addrinfo **res);
+static bool same_string(const char *a, const char *b);
+#ifdef ENABLE_RESOLVER_THREADS
+static void unqueue(lookup_t *l);
+static void start_helper(void);
+static void *helper_main(void *arg);
+static void before_fork(void);
+static void after_fork_parent(void);
+static void after_fork_child(void);
+#endif
+
+
+
+int resolver_getaddrinfo(const char *nodename, const char *servname,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	const override_t *o;
+	lookup_t *l;
+	int err;
+
+	assert(nodename != NULL || servname != NULL);
+	assert(hints != NULL);
+	assert(res != NULL);
+
+	/* overrides skip the system resolver entirely */
+	if ((o = find_override(nodename, servname)) != NULL)
+		return override_lookup(o, servname, hints, res);
+
+	clock_update();
+
+	resolver_lock();
+	l = find_lookup(nodename, servname, hints);
+	if (l == NULL)
+		l = add_lookup(nodename, servname, hints);
+	resolver_unlock();
+
+	complete_lookup(l);
+
+	err = l->err;
+	*res = (err == 0)? copy_addrinfo(l->res) : NULL;
+
+	/* failures that may be temporary aren't remembered */
+	if (err != 0 && is_negative_answer(err) == false) {
+		resolver_lock();
+		drop_lookup(l);
+		resolver_unlock();
+	}
+
+	return err;
+}
+
+
+
+void resolver_freeaddrinfo(struct addrinfo *ai)
+{
+	struct addrinfo *next;
+
+	/* each copied result is a single allocation */
+	for (; ai != NULL; ai = next) {
+		next = ai->ai_next;
+		free(ai);
+	}
+}
+
+
+
+void resolver_prefetch(const char *nodename, const char *servname,
+		const struct addrinfo *hints)
+{
+#ifdef ENABLE_RESOLVER_THREADS
+	lookup_t *l;
+
+	assert(nodename != NULL || servname != NULL);
+	assert(hints != NULL);
+
+	if (find_override(nodename, servname) != NULL)
+		return;
+
+	clock_update();
+
+	resolver_lock();
+	if (find_lookup(nodename, servname, hints) == NULL) {
+		l = add_lookup(nodename, servname, hints);
+
+		/* queue it for the helpers, starting another if they are
+		 * all busy */
+		l->next_queued = NULL;
+		*queue_end = l;
+		queue_end = &(l->next_queued);
+		if (nidle_helpers == 0 && nhelpers < MAX_HELPERS)
+			start_helper();
+		pthread_cond_signal(&queued_cond);
+	}
+	resolver_unlock();
+#else
+	/* lookups are done when they are wanted */
+	while (0&&nodename&&servname&&hints);
+#endif
+}
+
+
+
+int resolver_getnameinfo(const struct sockaddr *sa, socklen_t salen,
+		char *host, size_t hostlen, char *serv, size_t servlen,
+		int flags)
+{
+	name_lookup_t *n, **ptr, **last_ptr = NULL;
+
+	assert(sa != NULL);
+	assert(salen > 0 && salen <= sizeof(struct sockaddr_storage));
+
+	/* numeric results don't involve the resolver, and only complete
+	 * lookups are cached */
+	if (host == NULL || serv == NULL ||
+	    (flags & (NI_NUMERICHOST | NI_NUMERICSERV)) ==
+	    (NI_NUMERICHOST | NI_NUMERICSERV))
+	{
+		return getnameinfo(sa, salen, host, hostlen,
+		                   serv, servlen, flags);
+	}
+
+	clock_update();
+
+	/* look for a cached result, dropping any that have expired */
+	for (ptr = &name_lookups; (n = *ptr) != NULL; ) {
+		if (has_expired(&(n->started), n->err)) {
+			*ptr = n->next;
+			free(n);
+			nname_lookups--;
+			continue;
+		}
+		if (n->addrlen == salen && n->flags == flags &&
+		    memcmp(&(n->addr), sa, salen) == 0)
+			break;
+		last_ptr = ptr;
+		ptr = &(n->next);
+	}
+
+	if (n == NULL) {
+		n = (name_lookup_t *)xmalloc(sizeof(name_lookup_t));
+		memcpy(&(n->addr), sa, salen);
+		n->addrlen = salen;
+		n->flags = flags;
+		n->started = *clock_now();
+		n->err = getnameinfo(sa, salen, n->host, sizeof(n->host),
+		                     n->serv, sizeof(n->serv), flags);
+
+		/* failures that may be temporary aren't remembered */
+		if (n->err != 0 && is_negative_answer(n->err) == false) {
+			int err = n->err;
+			free(n);
+			return err;
+		}
+
+		/* make room by dropping the oldest result */
+		if (nname_lookups >= MAX_CACHED_LOOKUPS && last_ptr != NULL) {
+			free(*last_ptr);
+			*last_ptr = NULL;
+			nname_lookups--;
+		}
+		n->next = name_lookups;
+		name_lookups = n;
+		nname_lookups++;
+	}
+
+	if (n->err == 0) {
+		snprintf(host, hostlen, "%s", n->host);
+		snprintf(serv, servlen, "%s", n->serv);
+	}
+	return n->err;
+}
+
+
+
+int resolver_add_override(const char *spec)
+{
+	const char *port, *addresses, *ptr, *end;
+	struct addrinfo hints, *res;
+	override_t *o;
+	char *addr;
+	size_t len;
+	int err;
+
+	assert(spec != NULL);
+
+	/* split host:port:addresses */
+	port = strchr(spec, ':');
+	if (port == NULL || port == spec)
+		return -1;
+	port++;
+	addresses = strchr(port, ':');
+	if (addresses == NULL || addresses == port)
+		return -1;
+	addresses++;
+	if (*addresses == '\0')
+		return -1;
+
+	o = (override_t *)xmalloc(sizeof(override_t));
+	len = port - spec - 1;
+	o->host = (char *)xmalloc(len + 1);
+	memcpy(o->host, spec, len);
+	o->host[len] = '\0';
+	len = addresses - port - 1;
+	o->port = (char *)xmalloc(len + 1);
+	memcpy(o->port, port, len);
+	o->port[len] = '\0';
+	o->addresses = (char *)xmalloc(strlen(addresses) + 1);
+	o->addresses[0] = '\0';
+	o->next = NULL;
+
+	/* copy each address, without any brackets around it, checking that
+	 * it is numeric */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	addr = (char *)xmalloc(strlen(addresses) + 1);
+	for (ptr = addresses; ; ptr = end + 1) {
+		end = strchr(ptr, ',');
+		if (end == NULL)
+			end = ptr + strlen(ptr);
+		len = end - ptr;
+		if (len > 2 && ptr[0] == '[' && ptr[len - 1] == ']') {
+			ptr++;
+			len -= 2;
+		}
+		memcpy(addr, ptr, len);
+		addr[len] = '\0';
+
+		err = (len > 0)? getaddrinfo(addr, NULL, &hints, &res) : -1;
+		if (err != 0) {
+			free(addr);
+			free(o->addresses);
+			free(o->port);
+			free(o->host);
+			free(o);
+			return -1;
+		}
+		freeaddrinfo(res);
+
+		if (o->addresses[0] != '\0')
+			strcat(o->addresses, ",");
+		strcat(o->addresses, addr);
+
+		if (*end == '\0')
+			break;
+	}
+	free(addr);
+
+	/* the first override given for a host takes precedence */
+	*overrides_end = o;
+	overrides_end = &(o->next);
+	return 0;
+}
+
+
+
+/* find the cached lookup matching the arguments, dropping any that have
+ * expired on the way.  Called with the lock held */
+static lookup_t *find_lookup(const char *nodename, const char *servname,
+		const struct addrinfo *hints)
+{
+	lookup_t *l, **ptr;
+
+	for (ptr = &lookups; (l = *ptr) != NULL; ) {
+		if (l->state == LOOKUP_DONE &&
+		    has_expired(&(l->started), l->err))
+		{
+			*ptr = l->next;
+			if (l->res != NULL)
+				freeaddrinfo(l->res);
+			free(l->nodename);
+			free(l->servname);
+			free(l);
+			nlookups--;
+			continue;
+		}
+		if (l->flags == hints->ai_flags &&
+		    l->family == hints->ai_family &&
+		    l->socktype == hints->ai_socktype &&
+		    l->protocol == hints->ai_protocol &&
+		    same_string(l->nodename, nodename) &&
+		    same_string(l->servname, servname))
+			return l;
+		ptr = &(l->next);
+	}
+
+	return NULL;
+}
+
+
+
+/* add a queued lookup to the cache, dropping the oldest finished one if it
+ * is full.  Called with the lock held */
+static lookup_t *add_lookup(const char *nodename, const char *servname,
+		const struct addrinfo *hints)
+{
+	lookup_t *l, *oldest = NULL;
+
+	if (nlookups >= MAX_CACHED_LOOKUPS) {
+		for (l = lookups; l != NULL; l = l->next) {
+			if (l->state == LOOKUP_DONE)
+				oldest = l;
+		}
+		if (oldest != NULL)
+			drop_lookup(oldest);
+	}
+
+	l = (lookup_t *)xmalloc(sizeof(lookup_t));
+	l->nodename = (nodename != NULL)? xstrdup(nodename) : NULL;
+	l->servname = (servname != NULL)? xstrdup(servname) : NULL;
+	l->flags = hints->ai_flags;
+	l->family = hints->ai_family;
+	l->socktype = hints->ai_socktype;
+	l->protocol = hints->ai_protocol;
+	l->state = LOOKUP_QUEUED;
+	l->err = 0;
+	l->res = NULL;
+	l->started = *clock_now();
+	l->next_queued = NULL;
+
+	l->next = lookups;
+	lookups = l;
+	nlookups++;
+
+	return l;
+}
+
+
+
+/* remove a finished lookup from the cache.  Called with the lock held */
+static void drop_lookup(lookup_t *l)
+{
+	lookup_t **ptr;
+
+	assert(l->state == LOOKUP_DONE);
+
+	for (ptr = &lookups; *ptr != l; ptr = &((*ptr)->next))
+		assert(*ptr != NULL);
+	*ptr = l->next;
+	nlookups--;
+
+	if (l->res != NULL)
+		freeaddrinfo(l->res);
+	free(l->nodename);
+	free(l->servname);
+	free(l);
+}
+
+
+
+/* wait for a lookup to finish, resolving it in this thread if no helper
+ * has started on it */
+static void complete_lookup(lookup_t *l)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	int err;
+
+	resolver_lock();
+	if (l->state == LOOKUP_QUEUED) {
+#ifdef ENABLE_RESOLVER_THREADS
+		unqueue(l);
+#endif
+		l->state = LOOKUP_RUNNING;
+		resolver_unlock();
+
+		lookup_hints(l, &hints);
+		err = getaddrinfo(l->nodename, l->servname, &hints, &res);
+
+		resolver_lock();
+		l->err = err;
+		l->res = (err == 0)? res : NULL;
+		l->state = LOOKUP_DONE;
+	}
+#ifdef ENABLE_RESOLVER_THREADS
+	while (l->state != LOOKUP_DONE)
+		pthread_cond_wait(&done_cond, &lock);
+#endif
+	resolver_unlock();
+}
+
+
+
+static void lookup_hints(const lookup_t *l, struct addrinfo *hints)
+{
+	memset(hints, 0, sizeof(struct addrinfo));
+	hints->ai_flags = l->flags;
+	hints->ai_family = l->family;
+	hints->ai_socktype = l->socktype;
+	hints->ai_protocol = l->protocol;
+}
+
+
+
+/* some errors just indicate that the name doesn't exist (or has no
+ * addresses of the kind wanted), rather than that it couldn't be resolved */
+static bool is_negative_answer(int err)
+{
+	switch (err) {
+#ifdef HAVE_GETADDRINFO_EAI_NODATA
+	case EAI_NODATA:
+#endif
+#ifdef HAVE_GETADDRINFO_EAI_ADDRFAMILY
+	case EAI_ADDRFAMILY:
+#endif
+	case EAI_NONAME:
+	case EAI_FAMILY:
+	case EAI_SERVICE:
+	case EAI_SOCKTYPE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+
+static bool has_expired(const struct timeval *started, int err)
+{
+	struct timeval age;
+
+	timersub(clock_now(), started, &age);
+	return timercmp(&age,
+	                (err == 0)? &LOOKUP_TTL : &NEGATIVE_LOOKUP_TTL, >);
+}
+
+
+
+/* copy a list of results, each into a single allocation */
+static struct addrinfo *copy_addrinfo(const struct addrinfo *ai)
+{
+	struct addrinfo *copy = NULL, **end = &copy, *c;
+	size_t len;
+
+	for (; ai != NULL; ai = ai->ai_next) {
+		len = sizeof(struct addrinfo) + ai->ai_addrlen;
+		if (ai->ai_canonname != NULL)
+			len += strlen(ai->ai_canonname) + 1;
+
+		c = (struct addrinfo *)xmalloc(len);
+		*c = *ai;
+		c->ai_addr = (struct sockaddr *)(c + 1);
+		memcpy(c->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		if (ai->ai_canonname != NULL) {
+			c->ai_canonname = (char *)c->ai_addr + ai->ai_addrlen;
+			strcpy(c->ai_canonname, ai->ai_canonname);
+		}
+		c->ai_next = NULL;
+
+		*end = c;
+		end = &(c->ai_next);
+	}
+
+	return copy;
+}
+
+
+
+/* the override for nodename, if there is one that matches servname (a
+ * lookup without a service matches whatever port the override is for) */
+static const override_t *find_override(const char *nodename,
+		const char *servname)
+{
+	const override_t *o;
+
+	if (nodename == NULL)
+		return NULL;
+
+	for (o = overrides; o != NULL; o = o->next) {
+		if (strcasecmp(o->host, nodename) == 0 &&
+		    (servname == NULL || strcmp(o->port, "*") == 0 ||
+		     strcmp(o->port, servname) == 0))
+			return o;
+	}
+
+	return NULL;
+}
+
+
+
+/* build the results for a lookup from the addresses of an override */
+static int override_lookup(const override_t *o, const char *servname,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct addrinfo num_hints, *ai, **end = res;
+	char *list, *addr, *next;
+
+	*res = NULL;
+
+	num_hints = *hints;
+	num_hints.ai_flags |= AI_NUMERICHOST;
+
+	/* addresses of other families than those wanted are left out */
+	list = xstrdup(o->addresses);
+	for (addr = list; addr != NULL; addr = next) {
+		next = strchr(addr, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (getaddrinfo(addr, servname, &num_hints, &ai) != 0)
+			continue;
+		*end = copy_addrinfo(ai);
+		freeaddrinfo(ai);
+		while (*end != NULL)
+			end = &((*end)->ai_next);
+	}
+	free(list);
+
+	return (*res != NULL)? 0 : EAI_NONAME;
+}
+
+
+
+static bool same_string(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+
+
+#ifdef ENABLE_RESOLVER_THREADS
+/* take a lookup off the queue, if it is there.  Called with the lock held */
+static void unqueue(lookup_t *l)
+{
+	lookup_t **ptr;
+
+	for (ptr = &queue; *ptr != NULL; ptr = &((*ptr)->next_queued)) {
+		if (*ptr == l) {
+			*ptr = l->next_queued;
+			if (queue_end == &(l->next_queued))
+				queue_end = ptr;
+			l->next_queued = NULL;
+			return;
+		}
+	}
+}
+
+
+
+/* start another helper thread.  Called with the lock held */
+static void start_helper(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (fork_handlers_set == false) {
+		pthread_atfork(before_fork, after_fork_parent,
+		               after_fork_child);
+		fork_handlers_set = true;
+	}
+
+	/* signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	/* if no helper can be started, lookups are done when wanted */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, helper_main, NULL) == 0)
+		nhelpers++;
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+
+static void *helper_main(void *arg)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	lookup_t *l;
+	int err;
+
+	while (0&&arg);
+
+	resolver_lock();
+	for (;;) {
+		while (queue == NULL) {
+			nidle_helpers++;
+			pthread_cond_wait(&queued_cond, &lock);
+			nidle_helpers--;
+		}
+
+		l = queue;
+		unqueue(l);
+		l->state = LOOKUP_RUNNING;
+		resolver_unlock();
+
+		/* the names and hints of a lookup don't change once it has
+		 * been queued */
+		lookup_hints(l, &hints);
+		res = NULL;
+		err = getaddrinfo(l->nodename, l->servname, &hints, &res);
+
+		resolver_lock();
+		l->err = err;
+		l->res = (err == 0)? res : NULL;
+		l->state = LOOKUP_DONE;
+		pthread_cond_broadcast(&done_cond);
+	}
+
+	/* never reached */
+	return NULL;
+}
+
+
+
+/* the lock is held over a fork, so that the child gets it in a consistent
+ * state */
+static void before_fork(void)
+{
+	resolver_lock();
+}
+
+
+
+static void after_fork_parent(void)
+{
+	resolver_unlock();
+}
+
+
+
+static void after_fork_child(void)
+{
+	lookup_t *l;
+
+	/* the helpers don't exist in the child, so the lookups they were
+	 * doing are done again when they are wanted */
+	nhelpers = 0;
+	nidle_helpers = 0;
+	for (l = lookups; l != NULL; l = l->next) {
+		if (l->state == LOOKUP_RUNNING)
+			l->state = LOOKUP_QUEUED;
+	}
+
+	resolver_unlock();
+}
+#endif/*ENABLE_RESOLVER_THREADS*/
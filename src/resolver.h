@@ -0,0 +1,59 @@
+/*
+ *  resolver.h - cached and background name resolution - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* lookups are answered from the --resolve overrides, or from a per process
+ * cache of recent results, before the system resolver is asked.  Where
+ * threads are available, lookups that are known to be needed soon can be
+ * started in the background by a small pool of helper threads */
+
+/* as getaddrinfo, but answered from an override or the cache if possible,
+ * waiting for a background lookup of the same name if there is one.  The
+ * results must be freed with resolver_freeaddrinfo (and can be reordered by
+ * the caller) */
+int resolver_getaddrinfo(const char *nodename, const char *servname,
+		const struct addrinfo *hints, struct addrinfo **res);
+void resolver_freeaddrinfo(struct addrinfo *ai);
+
+/* start a lookup that will be wanted from resolver_getaddrinfo shortly.
+ * Without threads, this does nothing and the lookup is done when it is
+ * wanted */
+void resolver_prefetch(const char *nodename, const char *servname,
+		const struct addrinfo *hints);
+
+/* as getnameinfo, but answered from the cache if possible */
+int resolver_getnameinfo(const struct sockaddr *sa, socklen_t salen,
+		char *host, size_t hostlen, char *serv, size_t servlen,
+		int flags);
+
+/* add an override, from a "host:port:address[,address...]" spec, that
+ * answers lookups of the host (for that port, or any if it is '*') with the
+ * numeric addresses given.  Returns 0 on success and -1 if the spec is
+ * invalid */
+int resolver_add_override(const char *spec);
+
+#endif/*RESOLVER_H*/
@@ -0,0 +1,321 @@
+/*
+ *  sessions.c - table of datagram sessions keyed by peer - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "sessions.h"
+#include "misc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
+
+/* initial number of buckets, doubled whenever there are more sessions */
+#define SESSIONS_INITIAL_BUCKETS	64
+
+#define ROTL64(X, B)	(((X) << (B)) | ((X) >> (64 - (B))))
+#define SIPROUND(V0, V1, V2, V3)					\
+	do {								\
+		V0 += V1; V1 = ROTL64(V1, 13); V1 ^= V0;		\
+		V0 = ROTL64(V0, 32);					\
+		V2 += V3; V3 = ROTL64(V3, 16); V3 ^= V2;		\
+		V0 += V3; V3 = ROTL64(V3, 21); V3 ^= V0;		\
+		V2 += V1; V1 = ROTL64(V1, 17); V1 ^= V2;		\
+		V2 = ROTL64(V2, 32);					\
+	} while (0)
+
+
+static void random_key(uint64_t key[2]);
+static size_t make_key(const struct sockaddr *peer, socklen_t peerlen,
+		unsigned char *key);
+static unsigned long hash_key(const session_table_t *table,
+		const unsigned char *key, size_t keylen);
+static session_t **find_slot(const session_table_t *table,
+		const unsigned char *key, size_t keylen, unsigned long hash);
+static void grow(session_table_t *table);
+
+
+
+void sessions_init(session_table_t *table)
+{
+	assert(table != NULL);
+
+	table->nbuckets = SESSIONS_INITIAL_BUCKETS;
+	table->buckets = (session_t **)xmalloc(table->nbuckets *
+	                                       sizeof(session_t *));
+	memset(table->buckets, 0, table->nbuckets * sizeof(session_t *));
+	table->count = 0;
+
+	/* peers choose their own addresses, so they mustn't be able to
+	 * predict which of them share a bucket: the addresses are hashed
+	 * with SipHash, under a key they can't know */
+	random_key(table->hash_key);
+}
+
+
+
+void sessions_destroy(session_table_t *table)
+{
+	session_t *s, *next;
+	size_t i;
+
+	assert(table != NULL);
+
+	for (i = 0; i < table->nbuckets; ++i) {
+		for (s = table->buckets[i]; s != NULL; s = next) {
+			next = s->next;
+			free(s);
+		}
+	}
+	free(table->buckets);
+	table->buckets = NULL;
+	table->nbuckets = 0;
+	table->count = 0;
+}
+
+
+
+void *sessions_find(const session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen)
+{
+	unsigned char key[SESSION_KEY_SIZE];
+	session_t **slot;
+	size_t keylen;
+
+	assert(table != NULL);
+	assert(peer != NULL);
+
+	keylen = make_key(peer, peerlen, key);
+	slot = find_slot(table, key, keylen, hash_key(table, key, keylen));
+	return (*slot != NULL)? (*slot)->data : NULL;
+}
+
+
+
+void sessions_add(session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen, void *data)
+{
+	session_t *s, **bucket;
+
+	assert(table != NULL);
+	assert(peer != NULL);
+	assert(sessions_find(table, peer, peerlen) == NULL);
+
+	if (table->count >= table->nbuckets)
+		grow(table);
+
+	s = (session_t *)xmalloc(sizeof(session_t));
+	s->keylen = make_key(peer, peerlen, s->key);
+	s->hash = hash_key(table, s->key, s->keylen);
+	s->data = data;
+
+	bucket = &(table->buckets[s->hash & (table->nbuckets - 1)]);
+	s->next = *bucket;
+	*bucket = s;
+	table->count++;
+}
+
+
+
+void sessions_remove(session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen)
+{
+	unsigned char key[SESSION_KEY_SIZE];
+	session_t **slot, *s;
+	size_t keylen;
+
+	assert(table != NULL);
+	assert(peer != NULL);
+
+	keylen = make_key(peer, peerlen, key);
+	slot = find_slot(table, key, keylen, hash_key(table, key, keylen));
+	if ((s = *slot) == NULL)
+		return;
+
+	*slot = s->next;
+	free(s);
+	table->count--;
+}
+
+
+
+/* the bytes of a peer address that identify it, leaving out those that can
+ * differ between datagrams from the same peer (such as the IPv6 flow
+ * label).  Returns the length of the key */
+static size_t make_key(const struct sockaddr *peer, socklen_t peerlen,
+		unsigned char *key)
+{
+	const struct sockaddr_in *sin;
+#ifdef ENABLE_IPV6
+	const struct sockaddr_in6 *sin6;
+#endif
+	size_t len;
+
+	switch (peer->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *)peer;
+		key[0] = AF_INET;
+		memcpy(key + 1, &(sin->sin_port), 2);
+		memcpy(key + 3, &(sin->sin_addr), 4);
+		return 7;
+#ifdef ENABLE_IPV6
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)peer;
+		key[0] = AF_INET6;
+		memcpy(key + 1, &(sin6->sin6_port), 2);
+		memcpy(key + 3, &(sin6->sin6_addr), 16);
+		memcpy(key + 19, &(sin6->sin6_scope_id), 4);
+		return 23;
+#endif
+	default:
+		len = MIN((size_t)peerlen, SESSION_KEY_SIZE);
+		memcpy(key, peer, len);
+		return len;
+	}
+}
+
+
+
+/* fill key with random bytes from the kernel.  Should neither be available
+ * (eg. in a chroot without /dev), the key falls back to values that are
+ * only hard to guess */
+static void random_key(uint64_t key[2])
+{
+	FILE *fp;
+	size_t got = 0;
+
+#if defined(HAVE_GETRANDOM) && defined(GRND_NONBLOCK)
+	ssize_t rr;
+
+	while (got < sizeof(uint64_t[2])) {
+		rr = getrandom((unsigned char *)key + got,
+		               sizeof(uint64_t[2]) - got, GRND_NONBLOCK);
+		if (rr < 0 && errno == EINTR)
+			continue;
+		if (rr <= 0)
+			break;
+		got += rr;
+	}
+	if (got == sizeof(uint64_t[2]))
+		return;
+#endif
+
+	if ((fp = fopen("/dev/urandom", "r")) != NULL) {
+		got = fread(key, 1, sizeof(uint64_t[2]), fp);
+		fclose(fp);
+		if (got == sizeof(uint64_t[2]))
+			return;
+	}
+
+	key[0] = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+	key[1] = (uint64_t)(uintptr_t)key ^ ((uint64_t)clock() << 32);
+}
+
+
+
+/* SipHash-2-4 of key */
+static unsigned long hash_key(const session_table_t *table,
+		const unsigned char *key, size_t keylen)
+{
+	uint64_t v0, v1, v2, v3, m;
+	const unsigned char *end = key + (keylen & ~(size_t)7);
+	int i;
+
+	v0 = table->hash_key[0] ^ 0x736f6d6570736575ULL;
+	v1 = table->hash_key[1] ^ 0x646f72616e646f6dULL;
+	v2 = table->hash_key[0] ^ 0x6c7967656e657261ULL;
+	v3 = table->hash_key[1] ^ 0x7465646279746573ULL;
+
+	for (; key != end; key += 8) {
+		for (m = 0, i = 7; i >= 0; --i)
+			m = (m << 8) | key[i];
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	/* the last 0-7 bytes, with the length in the top byte */
+	m = (uint64_t)keylen << 56;
+	for (i = (int)(keylen & 7) - 1; i >= 0; --i)
+		m |= (uint64_t)key[i] << (8 * i);
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	for (i = 0; i < 4; ++i)
+		SIPROUND(v0, v1, v2, v3);
+
+	return (unsigned long)(v0 ^ v1 ^ v2 ^ v3);
+}
+
+
+
+/* the link pointing to the session with key, or the NULL link at the end of
+ * its bucket if there is none */
+static session_t **find_slot(const session_table_t *table,
+		const unsigned char *key, size_t keylen, unsigned long hash)
+{
+	session_t **slot;
+
+	slot = &(table->buckets[hash & (table->nbuckets - 1)]);
+	while (*slot != NULL &&
+	       ((*slot)->hash != hash || (*slot)->keylen != keylen ||
+	        memcmp((*slot)->key, key, keylen) != 0))
+		slot = &((*slot)->next);
+
+	return slot;
+}
+
+
+
+/* double the number of buckets, moving the sessions to their new ones */
+static void grow(session_table_t *table)
+{
+	session_t **buckets, *s, *next;
+	size_t nbuckets, i;
+
+	nbuckets = table->nbuckets * 2;
+	buckets = (session_t **)xmalloc(nbuckets * sizeof(session_t *));
+	memset(buckets, 0, nbuckets * sizeof(session_t *));
+
+	for (i = 0; i < table->nbuckets; ++i) {
+		for (s = table->buckets[i]; s != NULL; s = next) {
+			next = s->next;
+			s->next = buckets[s->hash & (nbuckets - 1)];
+			buckets[s->hash & (nbuckets - 1)] = s;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->nbuckets = nbuckets;
+}
@@ -0,0 +1,67 @@
+/*
+ *  sessions.h - table of datagram sessions keyed by peer - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* the longest key made from a peer address: the family, port, address and
+ * scope of an IPv6 address, or the whole address for other families */
+#define SESSION_KEY_SIZE	sizeof(struct sockaddr_storage)
+
+typedef struct session {
+	unsigned char key[SESSION_KEY_SIZE];
+	size_t keylen;
+	unsigned long hash;
+	void *data;
+	struct session *next;   /* the next session in the same bucket */
+} session_t;
+
+/* a hash table of the sessions with the peers sending datagrams to a
+ * socket shared between them, so that each datagram can be given to the
+ * session of its sender without a search */
+typedef struct session_table {
+	session_t **buckets;
+	size_t nbuckets;        /* always a power of 2 */
+	size_t count;
+	uint64_t hash_key[2];   /* random SipHash key */
+} session_table_t;
+
+void sessions_init(session_table_t *table);
+/* free the table.  The data of any sessions left in it is not freed */
+void sessions_destroy(session_table_t *table);
+
+/* the data of the session with peer, or NULL if there is none */
+void *sessions_find(const session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen);
+/* add a session with peer, which must not already have one */
+void sessions_add(session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen, void *data);
+/* remove the session with peer, if there is one */
+void sessions_remove(session_table_t *table,
+		const struct sockaddr *peer, socklen_t peerlen);
+
+#define sessions_count(T)	((T)->count)
+
+#endif/*SESSIONS_H*/
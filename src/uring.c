@@ -0,0 +1,265 @@
+/*
+ *  uring.c - minimal io_uring submission/completion ring - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "uring.h"
+#include "misc.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* the rings are shared with the kernel, so the indexes that the other side
+ * updates must be loaded with acquire and stored with release semantics */
+#define load_acquire(P)		__atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define store_release(P, V)	__atomic_store_n((P), (V), __ATOMIC_RELEASE)
+
+
+/* there is no libc wrapper for the io_uring syscalls */
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags,
+		const void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	                    flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+		const void *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+
+int uring_init(uring_t *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+	int err;
+
+	assert(ring != NULL);
+	assert(entries > 0);
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+
+	if ((ring->fd = sys_io_uring_setup(entries, &params)) < 0)
+		return -1;
+	ring->features = params.features;
+
+	/* waiting with a timeout needs the extended enter arguments, and
+	 * without them the ring is of no use to the relay loop */
+	if (!uring_has_feature(ring, IORING_FEAT_EXT_ARG)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* newer kernels map both rings with a single mmap */
+	if (uring_has_feature(ring, IORING_FEAT_SINGLE_MMAP)) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+	                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail_close;
+
+	if (uring_has_feature(ring, IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+		                     PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE,
+		                     ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size,
+	                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ring->sq_ring;
+	ring->sq_head    = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail    = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask    = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned int *)(sq + params.sq_off.ring_entries);
+	ring->sq_array   = (unsigned int *)(sq + params.sq_off.array);
+	ring->sqe_tail   = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+fail_cq:
+	err = errno;
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	errno = err;
+fail_sq:
+	err = errno;
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	errno = err;
+fail_close:
+	err = errno;
+	close(ring->fd);
+	errno = err;
+	return -1;
+}
+
+
+
+void uring_destroy(uring_t *ring)
+{
+	assert(ring != NULL);
+	assert(ring->fd >= 0);
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+
+
+int uring_register_buffers(uring_t *ring, const struct iovec *iov,
+		unsigned int nr)
+{
+	assert(ring != NULL);
+	assert(iov != NULL);
+
+	return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+	                             iov, nr) < 0 ? -1 : 0;
+}
+
+
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	assert(ring != NULL);
+
+	/* the kernel consumes the queue up to sq_head */
+	if (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+		fatal_internal("io_uring submission queue overflow");
+
+	idx = ring->sqe_tail & ring->sq_mask;
+	sqe = &(ring->sqes[idx]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+
+
+int uring_enter(uring_t *ring, unsigned int min_complete,
+		const struct timeval *tv)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit;
+	unsigned int flags = 0;
+	int rr;
+
+	assert(ring != NULL);
+
+	/* publish the new sqes to the kernel */
+	store_release(ring->sq_tail, ring->sqe_tail);
+	to_submit = ring->sqe_tail - load_acquire(ring->sq_head);
+
+	memset(&arg, 0, sizeof(arg));
+	if (tv != NULL) {
+		ts.tv_sec  = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (unsigned long)&ts;
+	}
+
+	if (min_complete > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	ring->enters++;
+	rr = sys_io_uring_enter(ring->fd, to_submit, min_complete,
+	                        flags | IORING_ENTER_EXT_ARG,
+	                        &arg, sizeof(arg));
+
+	/* any unsubmitted sqes are left queued for the next call */
+	return (rr < 0)? -1 : 0;
+}
+
+
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+	unsigned int head;
+
+	assert(ring != NULL);
+
+	head = *ring->cq_head;
+	if (head == load_acquire(ring->cq_tail))
+		return NULL;
+
+	return &(ring->cqes[head & ring->cq_mask]);
+}
+
+
+
+void uring_cqe_seen(uring_t *ring)
+{
+	assert(ring != NULL);
+
+	/* let the kernel reuse the cqe */
+	store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+#endif/*ENABLE_IO_URING*/
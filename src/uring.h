@@ -0,0 +1,91 @@
+/*
+ *  uring.h - minimal io_uring submission/completion ring - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef URING_H
+#define URING_H
+
+#ifdef ENABLE_IO_URING
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct uring {
+	int fd;                  /* the ring file descriptor */
+	unsigned int features;   /* IORING_FEAT_* reported by the kernel */
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;   /* next sqe to hand out */
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* mappings of the rings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;           /* may be the same mapping as sq_ring */
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	unsigned long enters;    /* number of io_uring_enter syscalls issued */
+} uring_t;
+
+
+/* setup a ring with room for at least entries submissions.  Returns 0 on
+ * success, or -1 if io_uring isn't available (with errno set) */
+int uring_init(uring_t *ring, unsigned int entries);
+void uring_destroy(uring_t *ring);
+
+#define uring_has_feature(R, F)	(((R)->features & (F)) != 0)
+
+/* register buffers for use with the fixed read and write operations, where
+ * they are referred to by their index in iov.  Returns 0 or -1 on error */
+int uring_register_buffers(uring_t *ring, const struct iovec *iov,
+		unsigned int nr);
+
+/* returns a zeroed sqe to be filled in, which is submitted by the next
+ * uring_enter.  Aborts if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/* submit the queued sqes and wait for at least min_complete completions, or
+ * for the timeout to expire (tv may be NULL for no timeout).  Returns 0 on
+ * success or -1 on error (with errno set, ETIME if the timeout expired) */
+int uring_enter(uring_t *ring, unsigned int min_complete,
+		const struct timeval *tv);
+
+/* returns the next completion, or NULL if there are none.  Each completion
+ * returned must be released with uring_cqe_seen */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif/*ENABLE_IO_URING*/
+
+#endif/*URING_H*/
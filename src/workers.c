@@ -0,0 +1,224 @@
+/*
+ *  workers.c - supervised pool of worker processes - implementation
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "workers.h"
+#include "misc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+/* a worker that dies sooner than this after starting (in seconds) is
+ * taken to have failed to start, rather than be restarted in a loop */
+#define STARTUP_TIME	1
+
+/* a worker being supervised.  The pid is read by the signal handler, so
+ * it is only changed with the terminate signals blocked */
+typedef struct worker {
+	volatile pid_t pid;    /* -1 if not running */
+	time_t started;
+} worker_t;
+
+/* the workers, indexed by slot */
+static worker_t *workers = NULL;
+static int npids = 0;
+
+/* set once the supervisor has been told to terminate */
+static volatile sig_atomic_t terminating = 0;
+
+
+static pid_t spawn_worker(int slot);
+static void terminate_handler(int signum);
+
+
+
+int workers_run(int nworkers)
+{
+	static const int term_signals[] = { SIGTERM, SIGINT, SIGHUP };
+	struct sigaction sa, old_chld, old_term[3];
+	sigset_t mask, old_mask;
+	siginfo_t info;
+	bool failed = false;
+	int i, status, live;
+	pid_t pid;
+
+	assert(nworkers > 0);
+
+	workers = (worker_t *)xmalloc(nworkers * sizeof(worker_t));
+	npids = nworkers;
+	for (i = 0; i < npids; ++i)
+		workers[i].pid = -1;
+
+	/* the supervisor collects the exit status of the workers itself */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&(sa.sa_mask));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &sa, &old_chld);
+
+	/* terminate signals must interrupt waitpid, so no SA_RESTART */
+	sigemptyset(&mask);
+	sa.sa_handler = terminate_handler;
+	for (i = 0; i < 3; ++i) {
+		sigaction(term_signals[i], &sa, &(old_term[i]));
+		sigaddset(&mask, term_signals[i]);
+	}
+
+	/* block the terminate signals whenever a worker is being forked, so
+	 * that the handler always knows every worker to pass them on to */
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	for (i = 0; i < npids; ++i) {
+		if (spawn_worker(i) == 0)
+			goto worker;
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	live = npids;
+	while (live > 0) {
+		/* leave the worker unreaped, so that its pid can't be reused
+		 * (and then signalled by the handler) before it is cleared */
+		memset(&info, 0, sizeof(info));
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("waitid failed: %s", strerror(errno));
+		}
+		pid = info.si_pid;
+
+		/* find the slot of the worker, then reap it */
+		sigprocmask(SIG_BLOCK, &mask, &old_mask);
+		for (i = 0; i < npids && workers[i].pid != pid; ++i)
+			;
+		if (i < npids) {
+			workers[i].pid = -1;
+			live--;
+		}
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+		if (i == npids)
+			continue;
+
+		if (terminating)
+			continue;
+
+		if (WIFSIGNALED(status)) {
+			warning(_("worker %d (pid %d) killed by signal %d"),
+			        i + 1, (int)pid, WTERMSIG(status));
+		} else if (verbose_mode()) {
+			warning(_("worker %d (pid %d) exited with status %d"),
+			        i + 1, (int)pid, WEXITSTATUS(status));
+		}
+
+		/* don't keep restarting workers that can't start */
+		if ((WIFSIGNALED(status) || WEXITSTATUS(status) != 0) &&
+		    time(NULL) - workers[i].started < STARTUP_TIME)
+		{
+			warning(_("worker %d failed to start, "
+			          "stopping all workers"), i + 1);
+			failed = true;
+			terminate_handler(SIGTERM);
+			continue;
+		}
+
+		sigprocmask(SIG_BLOCK, &mask, &old_mask);
+		if (!terminating) {
+			if (spawn_worker(i) == 0)
+				goto worker;
+			live++;
+		}
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	}
+
+	/* restore the signal handlers */
+	sigaction(SIGCHLD, &old_chld, NULL);
+	for (i = 0; i < 3; ++i)
+		sigaction(term_signals[i], &(old_term[i]), NULL);
+
+	free(workers);
+	workers = NULL;
+	npids = 0;
+
+	return failed? -1 : 1;
+
+worker:
+	/* the worker starts with the signal handling of the caller */
+	sigaction(SIGCHLD, &old_chld, NULL);
+	for (i = 0; i < 3; ++i)
+		sigaction(term_signals[i], &(old_term[i]), NULL);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	free(workers);
+	workers = NULL;
+	npids = 0;
+
+	return 0;
+}
+
+
+
+/* fork a worker into a slot.  Returns as per fork */
+static pid_t spawn_worker(int slot)
+{
+	pid_t pid;
+
+	assert(slot >= 0 && slot < npids);
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork failed: %s", strerror(errno));
+	if (pid == 0)
+		return 0;
+
+	workers[slot].pid = pid;
+	workers[slot].started = time(NULL);
+
+	if (verbose_mode())
+		warning(_("started worker %d (pid %d)"), slot + 1, (int)pid);
+
+	return pid;
+}
+
+
+
+/* pass a terminate signal on to all the workers */
+static void terminate_handler(int signum)
+{
+	pid_t pid;
+	int i;
+
+	/* suppress unused signum warning */
+	while (0&&signum);
+
+	terminating = 1;
+	for (i = 0; i < npids; ++i) {
+		if ((pid = workers[i].pid) > 0)
+			kill(pid, SIGTERM);
+	}
+}
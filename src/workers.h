@@ -0,0 +1,32 @@
+/*
+ *  workers.h - supervised pool of worker processes - header
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/* fork nworkers worker processes and supervise them from the calling
+ * process, replacing any worker that dies.  Returns 0 in each worker.  In
+ * the supervisor, it returns 1 after a SIGTERM, SIGINT or SIGHUP (which is
+ * passed on to the workers) once all the workers have exited, or -1 if a
+ * worker failed immediately after it was started */
+int workers_run(int nworkers);
+
+#endif/*WORKERS_H*/
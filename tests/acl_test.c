@@ -0,0 +1,366 @@
+/*
+ *  acl_test.c - access list tests
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "misc.h"
+#include "acl.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Each test compiles access lists from numeric addresses, prefixes and port
+ * ranges (so that no lookups go out to the network), and checks which
+ * addresses they allow, particularly at the edges of each prefix.
+ *
+ * The result of each test is printed on its own line, and the exit status
+ * is non-zero if any of them failed.
+ */
+
+typedef struct test {
+	const char *name;
+	void (*run)(void);
+} test_t;
+
+static int failures = 0;
+static bool failed;
+
+#define check(COND)	\
+	do { if (!(COND)) check_failed(#COND, __LINE__); } while (0)
+
+
+static void check_failed(const char *cond, int line);
+static bool compile(acl_t *acl, const char *addresses, const char *services);
+static bool allows(const acl_t *acl, const char *address, int port);
+
+static void test_any(void);
+static void test_inet(void);
+static void test_overlap(void);
+static void test_ports(void);
+#ifdef ENABLE_IPV6
+static void test_inet6(void);
+static void test_mapped(void);
+#endif
+static void test_invalid(void);
+
+
+static const test_t tests[] = {
+	{ "any",     test_any },
+	{ "inet",    test_inet },
+	{ "overlap", test_overlap },
+	{ "ports",   test_ports },
+#ifdef ENABLE_IPV6
+	{ "inet6",   test_inet6 },
+	{ "mapped",  test_mapped },
+#endif
+	{ "invalid", test_invalid },
+	{ NULL, NULL }
+};
+
+
+
+const char *get_program_name(void)
+{
+	return "acl_test";
+}
+
+
+
+int main(void)
+{
+	int i;
+
+	for (i = 0; tests[i].name != NULL; ++i) {
+		failed = false;
+		tests[i].run();
+		printf("%s: %s\n", failed? "FAIL" : "PASS", tests[i].name);
+		if (failed)
+			failures++;
+	}
+
+	return (failures > 0)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+static void check_failed(const char *cond, int line)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, line, cond);
+	failed = true;
+}
+
+
+
+/* compile an access list for stream connections.  Returns true on
+ * success */
+static bool compile(acl_t *acl, const char *addresses, const char *services)
+{
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	return (acl_compile(acl, addresses, services, &hints) == 0);
+}
+
+
+
+/* returns true if the access list allows connections from a numeric
+ * address (IPv4, or IPv6 if it contains a ':') and port */
+static bool allows(const acl_t *acl, const char *address, int port)
+{
+	struct sockaddr_in sin;
+#ifdef ENABLE_IPV6
+	struct sockaddr_in6 sin6;
+
+	if (strchr(address, ':') != NULL) {
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_port = htons(port);
+		assert(inet_pton(AF_INET6, address, &(sin6.sin6_addr)) == 1);
+		return acl_allows(acl, (struct sockaddr *)&sin6,
+		                  sizeof(sin6));
+	}
+#endif
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	assert(inet_pton(AF_INET, address, &(sin.sin_addr)) == 1);
+	return acl_allows(acl, (struct sockaddr *)&sin, sizeof(sin));
+}
+
+
+
+/* no addresses or ports allows everything */
+static void test_any(void)
+{
+	acl_t acl;
+
+	check(compile(&acl, NULL, NULL));
+	check(allows(&acl, "0.0.0.0", 0));
+	check(allows(&acl, "192.0.2.1", 80));
+	check(allows(&acl, "255.255.255.255", 65535));
+#ifdef ENABLE_IPV6
+	check(allows(&acl, "2001:db8::1", 80));
+#endif
+	acl_destroy(&acl);
+}
+
+
+
+static void test_inet(void)
+{
+	acl_t acl;
+
+	/* a single address */
+	check(compile(&acl, "192.0.2.1", NULL));
+	check(allows(&acl, "192.0.2.1", 1234));
+	check(!allows(&acl, "192.0.2.0", 1234));
+	check(!allows(&acl, "192.0.2.2", 1234));
+	check(!allows(&acl, "193.0.2.1", 1234));
+	acl_destroy(&acl);
+
+	/* prefixes, at each end of them and just outside */
+	check(compile(&acl, "10.0.0.0/8,192.0.2.64/26", NULL));
+	check(allows(&acl, "10.0.0.0", 1));
+	check(allows(&acl, "10.255.255.255", 1));
+	check(!allows(&acl, "9.255.255.255", 1));
+	check(!allows(&acl, "11.0.0.0", 1));
+	check(allows(&acl, "192.0.2.64", 1));
+	check(allows(&acl, "192.0.2.127", 1));
+	check(!allows(&acl, "192.0.2.63", 1));
+	check(!allows(&acl, "192.0.2.128", 1));
+	acl_destroy(&acl);
+
+	/* a zero length prefix covers every address, and a full length one
+	 * just the address */
+	check(compile(&acl, "0.0.0.0/0", NULL));
+	check(allows(&acl, "203.0.113.9", 1));
+	acl_destroy(&acl);
+	check(compile(&acl, "203.0.113.9/32", NULL));
+	check(allows(&acl, "203.0.113.9", 1));
+	check(!allows(&acl, "203.0.113.8", 1));
+	acl_destroy(&acl);
+}
+
+
+
+/* overlapping prefixes allow their union, whichever order they are in */
+static void test_overlap(void)
+{
+	static const char *lists[] = {
+		"10.1.0.0/16,10.0.0.0/8,10.1.2.3",
+		"10.1.2.3,10.0.0.0/8,10.1.0.0/16",
+		NULL
+	};
+	acl_t acl;
+	int i;
+
+	for (i = 0; lists[i] != NULL; ++i) {
+		check(compile(&acl, lists[i], NULL));
+		check(allows(&acl, "10.1.2.3", 1));
+		check(allows(&acl, "10.1.255.255", 1));
+		check(allows(&acl, "10.2.0.1", 1));
+		check(!allows(&acl, "11.1.2.3", 1));
+		acl_destroy(&acl);
+	}
+
+	/* adjacent halves make up the whole */
+	check(compile(&acl, "192.0.2.0/25,192.0.2.128/25", NULL));
+	check(allows(&acl, "192.0.2.0", 1));
+	check(allows(&acl, "192.0.2.127", 1));
+	check(allows(&acl, "192.0.2.128", 1));
+	check(allows(&acl, "192.0.2.255", 1));
+	check(!allows(&acl, "192.0.3.0", 1));
+	check(!allows(&acl, "192.0.1.255", 1));
+	acl_destroy(&acl);
+}
+
+
+
+static void test_ports(void)
+{
+	acl_t acl;
+
+	check(compile(&acl, NULL, "80,8000-8010"));
+	check(allows(&acl, "192.0.2.1", 80));
+	check(!allows(&acl, "192.0.2.1", 79));
+	check(!allows(&acl, "192.0.2.1", 81));
+	check(allows(&acl, "192.0.2.1", 8000));
+	check(allows(&acl, "192.0.2.1", 8005));
+	check(allows(&acl, "192.0.2.1", 8010));
+	check(!allows(&acl, "192.0.2.1", 7999));
+	check(!allows(&acl, "192.0.2.1", 8011));
+	acl_destroy(&acl);
+
+	/* the extremes of the port range */
+	check(compile(&acl, NULL, "1,65535"));
+	check(allows(&acl, "192.0.2.1", 1));
+	check(allows(&acl, "192.0.2.1", 65535));
+	check(!allows(&acl, "192.0.2.1", 2));
+	check(!allows(&acl, "192.0.2.1", 65534));
+	acl_destroy(&acl);
+
+	/* both the address and the port have to be allowed */
+	check(compile(&acl, "192.0.2.0/24", "22"));
+	check(allows(&acl, "192.0.2.1", 22));
+	check(!allows(&acl, "192.0.2.1", 23));
+	check(!allows(&acl, "192.0.3.1", 22));
+	acl_destroy(&acl);
+}
+
+
+
+#ifdef ENABLE_IPV6
+static void test_inet6(void)
+{
+	acl_t acl;
+
+	check(compile(&acl, "2001:db8::5,2001:db8:1::/48", NULL));
+	check(allows(&acl, "2001:db8::5", 1));
+	check(!allows(&acl, "2001:db8::4", 1));
+	check(!allows(&acl, "2001:db8::6", 1));
+	check(allows(&acl, "2001:db8:1::", 1));
+	check(allows(&acl, "2001:db8:1:ffff:ffff:ffff:ffff:ffff", 1));
+	check(!allows(&acl, "2001:db8:2::", 1));
+	check(!allows(&acl, "2001:db8:0:ffff:ffff:ffff:ffff:ffff", 1));
+	/* the families are kept apart */
+	check(!allows(&acl, "32.1.13.184", 1));
+	acl_destroy(&acl);
+
+	/* prefixes may be in brackets */
+	check(compile(&acl, "[2001:db8::]/32", NULL));
+	check(allows(&acl, "2001:db8:ffff::1", 1));
+	check(!allows(&acl, "2001:db9::1", 1));
+	acl_destroy(&acl);
+
+	check(compile(&acl, "::/0", NULL));
+	check(allows(&acl, "2001:db8::1", 1));
+	check(allows(&acl, "::1", 1));
+	acl_destroy(&acl);
+}
+
+
+
+/* IPv4 mapped IPv6 addresses are the IPv4 addresses they map, whether in
+ * the list or connecting */
+static void test_mapped(void)
+{
+	acl_t acl;
+
+	check(compile(&acl, "192.0.2.0/24", NULL));
+	check(allows(&acl, "::ffff:192.0.2.9", 1));
+	check(!allows(&acl, "::ffff:192.0.3.9", 1));
+	acl_destroy(&acl);
+
+	check(compile(&acl, "::ffff:192.0.2.0/120", NULL));
+	check(allows(&acl, "192.0.2.9", 1));
+	check(allows(&acl, "::ffff:192.0.2.9", 1));
+	check(!allows(&acl, "192.0.3.9", 1));
+	check(!allows(&acl, "2001:db8::1", 1));
+	acl_destroy(&acl);
+
+	check(compile(&acl, "::ffff:192.0.2.1", NULL));
+	check(allows(&acl, "192.0.2.1", 1));
+	check(!allows(&acl, "192.0.2.2", 1));
+	acl_destroy(&acl);
+
+	/* a 96 bit prefix is all of the IPv4 addresses */
+	check(compile(&acl, "::ffff:0.0.0.0/96", NULL));
+	check(allows(&acl, "0.0.0.0", 1));
+	check(allows(&acl, "255.255.255.255", 1));
+	check(!allows(&acl, "2001:db8::1", 1));
+	acl_destroy(&acl);
+}
+#endif
+
+
+
+/* invalid entries fail the whole list */
+static void test_invalid(void)
+{
+	acl_t acl;
+
+	check(!compile(&acl, "10.0.0.0/33", NULL));
+	check(!compile(&acl, "10.0.0.0/-1", NULL));
+	check(!compile(&acl, "10.0.0.0/x", NULL));
+	check(!compile(&acl, "not-an-address/8", NULL));
+	check(!compile(&acl, ",", NULL));
+	check(!compile(&acl, NULL, "90-80"));
+	check(!compile(&acl, NULL, "0"));
+	check(!compile(&acl, NULL, "70000"));
+#ifdef ENABLE_IPV6
+	check(!compile(&acl, "2001:db8::/129", NULL));
+	/* a mapped prefix has to reach into the IPv4 address, rather than
+	 * be taken for a single address */
+	check(!compile(&acl, "::ffff:0.0.0.0/95", NULL));
+	check(!compile(&acl, "::ffff:0.0.0.0/0", NULL));
+#endif
+}
@@ -0,0 +1,1029 @@
+/*
+ *  cb_test.c - circular buffer tests
+ *
+ *  nc6 - an advanced netcat clone
+ *  Copyright (C) 2001-2006 Mauro Tortonesi <mauro _at_ deepspace6.net>
+ *  Copyright (C) 2002-2006 Chris Leishman <chris _at_ leishman.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "system.h"
+#include "misc.h"
+#include "circ_buf.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Every test is run against each way a buffer can hold its data in memory:
+ * plain memory, where regions crossing the end of the buffer are split in
+ * two, a mirrored mapping, where they never are, a chain of segments, where
+ * they are split at every segment boundary, and plain memory backed by huge
+ * pages.  The data passed through the buffers is a running sequence of
+ * bytes, so that anything lost, duplicated or reordered at a wrap shows up.
+ *
+ * The result of each test is printed on its own line, and the exit status
+ * is non-zero if any of them failed.
+ */
+
+typedef enum { PLAIN, MIRRORED, CHAINED, HUGE } backend_t;
+
+static const char *backend_names[] = { "plain", "mirrored", "chained",
+                                       "huge" };
+
+typedef struct test {
+	const char *name;
+	void (*run)(backend_t backend);
+} test_t;
+
+
+/* the bytes of the running sequence moved into and out of the buffers */
+typedef struct stream {
+	unsigned long in;
+	unsigned long out;
+} stream_t;
+
+static int failures = 0;
+static bool failed;
+
+#define check(COND)	\
+	do { if (!(COND)) check_failed(#COND, __LINE__); } while (0)
+
+
+static void check_failed(const char *cond, int line);
+static bool init(circ_buf_t *cb, backend_t backend, size_t size);
+static void generate(stream_t *s, uint8_t *buf, size_t len);
+static bool verify(stream_t *s, const uint8_t *buf, size_t len);
+static size_t iov_total(const struct iovec *iov, int count);
+static void wrap(circ_buf_t *cb, stream_t *s, size_t offset);
+
+static void test_append_extract(backend_t backend);
+static void test_iov(backend_t backend);
+static void test_produce_consume(backend_t backend);
+static void test_read_write(backend_t backend);
+static void test_recv_send(backend_t backend);
+static void test_batch(backend_t backend);
+static void test_frame(backend_t backend);
+static void test_resize(backend_t backend);
+static void test_mirror(backend_t backend);
+static void test_clear(backend_t backend);
+static void test_adaptive(backend_t backend);
+static void test_track_used(backend_t backend);
+static void test_splice(backend_t backend);
+static void test_sendfile(backend_t backend);
+
+
+static const test_t tests[] = {
+	{ "append_extract",  test_append_extract },
+	{ "iov",             test_iov },
+	{ "produce_consume", test_produce_consume },
+	{ "read_write",      test_read_write },
+	{ "recv_send",       test_recv_send },
+	{ "batch",           test_batch },
+	{ "frame",           test_frame },
+	{ "resize",          test_resize },
+	{ "mirror",          test_mirror },
+	{ "clear",           test_clear },
+	{ "adaptive",        test_adaptive },
+	{ "track_used",      test_track_used },
+	{ "splice",          test_splice },
+	{ "sendfile",        test_sendfile },
+	{ NULL, NULL }
+};
+
+
+
+const char *get_program_name(void)
+{
+	return "cb_test";
+}
+
+
+
+int main(void)
+{
+	circ_buf_t cb;
+	int i, b;
+
+	for (i = 0; tests[i].name != NULL; ++i) {
+		for (b = PLAIN; b <= HUGE; ++b) {
+			/* mirroring and huge pages may not be available */
+			if (b == MIRRORED || b == HUGE) {
+				if (!init(&cb, (backend_t)b, 4096)) {
+					printf("SKIP: %s (%s)\n",
+					       tests[i].name,
+					       backend_names[b]);
+					continue;
+				}
+				cb_destroy(&cb);
+			}
+
+			failed = false;
+			tests[i].run((backend_t)b);
+			printf("%s: %s (%s)\n", failed? "FAIL" : "PASS",
+			       tests[i].name, backend_names[b]);
+			if (failed)
+				failures++;
+		}
+	}
+
+	return (failures > 0)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+
+static void check_failed(const char *cond, int line)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, line, cond);
+	failed = true;
+}
+
+
+
+/* create a buffer of size bytes held as the backend does (mirrored buffers
+ * need a size that is a multiple of the page size).  Returns false if the
+ * backend isn't available */
+static bool init(circ_buf_t *cb, backend_t backend, size_t size)
+{
+	cb_set_mirroring((backend == MIRRORED)? 1 : 0);
+	cb_set_huge_pages((backend == HUGE)? 1 : 0);
+	cb_init(cb, size);
+	cb_set_mirroring(CB_MIRROR_THRESHOLD);
+	cb_set_huge_pages(CB_HUGE_THRESHOLD);
+
+	if ((backend == MIRRORED && !cb_is_mirrored(cb)) ||
+	    (backend == HUGE && !cb_is_huge(cb))) {
+		cb_destroy(cb);
+		return false;
+	}
+	if (backend == CHAINED && cb_chain(cb) != 0) {
+		cb_destroy(cb);
+		return false;
+	}
+	return true;
+}
+
+
+
+/* fill buf with the next len bytes of the sequence */
+static void generate(stream_t *s, uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		buf[i] = (uint8_t)(s->in++ % 251);
+}
+
+
+
+/* check that buf holds the next len bytes of the sequence to come out */
+static bool verify(stream_t *s, const uint8_t *buf, size_t len)
+{
+	size_t i;
+	bool ok = true;
+
+	for (i = 0; i < len; ++i) {
+		if (buf[i] != (uint8_t)(s->out++ % 251))
+			ok = false;
+	}
+	return ok;
+}
+
+
+
+static size_t iov_total(const struct iovec *iov, int count)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		total += iov[i].iov_len;
+	return total;
+}
+
+
+
+/* move the start of the data in an empty buffer offset bytes along */
+static void wrap(circ_buf_t *cb, stream_t *s, size_t offset)
+{
+	uint8_t *tmp;
+
+	assert(cb_is_empty(cb));
+
+	tmp = (uint8_t *)xmalloc(offset + 1);
+	generate(s, tmp, offset);
+	check(cb_append(cb, tmp, offset) == (ssize_t)offset);
+	check(cb_extract(cb, tmp, offset) == (ssize_t)offset);
+	check(verify(s, tmp, offset));
+	check(cb_is_empty(cb));
+	free(tmp);
+}
+
+
+
+static size_t test_size(backend_t backend)
+{
+	/* a plain buffer of an odd size, or at least two segments */
+	switch (backend) {
+	case MIRRORED:
+		return 4096;
+	case CHAINED:
+		return 3 * CB_SEGMENT_SIZE;
+	default:
+		return 1000;
+	}
+}
+
+
+
+/* append and extract in varying amounts, so that both wrap around at every
+ * point of the buffer, and check the edge cases of a full and an empty
+ * buffer */
+static void test_append_extract(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t *tmp;
+	size_t size, len, want, i;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	tmp = (uint8_t *)xmalloc(size + 1);
+
+	check(cb_is_empty(&cb));
+	check(cb_size(&cb) == size);
+	check(cb_space(&cb) == size);
+	check(cb_extract(&cb, tmp, 10) == 0);
+
+	for (i = 0; i < 2000; ++i) {
+		want = 1 + (i * 7919) % size;
+
+		/* a partial append when there isn't room for all of it */
+		generate(&s, tmp, want);
+		len = MIN(want, cb_space(&cb));
+		s.in -= want - len;
+		check(cb_append(&cb, tmp, want) == (ssize_t)len);
+		check(cb_used(&cb) == s.in - s.out);
+		check(cb_used(&cb) + cb_space(&cb) == size);
+
+		/* take out about half of what is there */
+		len = cb_used(&cb) / 2 + 1;
+		check(cb_extract(&cb, tmp, len) == (ssize_t)len);
+		check(verify(&s, tmp, len));
+		check(cb_used(&cb) == s.in - s.out);
+	}
+
+	/* fill it up */
+	len = cb_space(&cb);
+	generate(&s, tmp, len);
+	check(cb_append(&cb, tmp, len) == (ssize_t)len);
+	check(cb_is_full(&cb));
+	check(cb_append(&cb, tmp, 1) == -1);
+	check(cb_append(&cb, tmp, 0) == -1);
+
+	/* and drain it, asking for more than there is */
+	len = cb_used(&cb);
+	check(cb_extract(&cb, tmp, size + 1) == (ssize_t)len);
+	check(verify(&s, tmp, len));
+	check(cb_is_empty(&cb));
+	check(cb_extract(&cb, tmp, 1) == 0);
+
+	free(tmp);
+	cb_destroy(&cb);
+}
+
+
+
+/* the free space and the data on either side of the end of the buffer */
+static void test_iov(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 }, peek;
+	struct iovec iov[CB_MAX_IOV];
+	uint8_t tmp[64];
+	size_t size;
+	int count, i;
+	/* whether regions crossing the end are split */
+	bool split = (backend == PLAIN || backend == HUGE);
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+
+	/* an empty buffer has no data */
+	check(cb_data_iov(&cb, 0, iov) == 0);
+
+	/* put 30 bytes across the end of the buffer (or of a segment) */
+	wrap(&cb, &s, size - 10);
+	generate(&s, tmp, 30);
+	check(cb_append(&cb, tmp, 30) == 30);
+
+	count = cb_data_iov(&cb, 0, iov);
+	check(iov_total(iov, count) == 30);
+	if (split) {
+		check(count == 2);
+		check(iov[0].iov_len == 10);
+		check(iov[1].iov_base == cb.buf);
+	} else if (backend == MIRRORED) {
+		check(count == 1);
+	}
+	/* look at the data without taking it out */
+	peek = s;
+	for (i = 0; i < count; ++i)
+		check(verify(&peek, iov[i].iov_base, iov[i].iov_len));
+
+	/* limited to nbytes */
+	count = cb_data_iov(&cb, 5, iov);
+	check(count == 1 && iov[0].iov_len == 5);
+	check(iov[0].iov_base == cb.ptr);
+	count = cb_data_iov(&cb, 15, iov);
+	check(iov_total(iov, count) == 15);
+	check(count == (split? 2 : 1) || backend == CHAINED);
+	count = cb_data_iov(&cb, 100, iov);
+	check(iov_total(iov, count) == 30);
+
+	/* the free space follows on from the data, up to where it starts */
+	count = cb_space_iov(&cb, 0, iov);
+	if (backend != CHAINED) {
+		check(count == 1);
+		check(iov_total(iov, count) == size - 30);
+		check(!split ||
+		      (uint8_t *)iov[0].iov_base == cb.buf + 20);
+	} else {
+		/* only the segments in the chain are described */
+		check(iov_total(iov, count) <= size - 30);
+	}
+	count = cb_space_iov(&cb, 7, iov);
+	check(iov_total(iov, count) == 7);
+
+	/* the free space crossing the end */
+	check(cb_extract(&cb, tmp, 30) == 30);
+	check(verify(&s, tmp, 30));
+	wrap(&cb, &s, 10);
+	if (backend != CHAINED) {
+		count = cb_space_iov(&cb, 0, iov);
+		check(iov_total(iov, count) == size);
+		check(count == (split? 2 : 1));
+	}
+
+	/* a full buffer has no free space */
+	cb_clear(&cb);
+	while (!cb_is_full(&cb)) {
+		generate(&s, tmp, sizeof(tmp));
+		s.in -= sizeof(tmp) - cb_append(&cb, tmp, sizeof(tmp));
+	}
+	check(cb_space_iov(&cb, 0, iov) == 0);
+
+	cb_destroy(&cb);
+}
+
+
+
+/* store into and take from the buffer through the iovecs directly */
+static void test_produce_consume(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	struct iovec iov[CB_MAX_IOV];
+	uint8_t tmp[256];
+	size_t size, len, done;
+	int count, i, n;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+
+	for (n = 0; n < 100; ++n) {
+		/* a chain needs segments to store into */
+		len = 37 + n % 200;
+		if (backend == CHAINED && cb_space_iov(&cb, len, iov) == 0) {
+			generate(&s, tmp, 1);
+			check(cb_append(&cb, tmp, 1) == 1);
+		}
+
+		count = cb_space_iov(&cb, len, iov);
+		len = iov_total(iov, count);
+		for (i = 0; i < count; ++i)
+			generate(&s, iov[i].iov_base, iov[i].iov_len);
+		cb_produce(&cb, len);
+		check(cb_used(&cb) == s.in - s.out);
+
+		/* consume some of it after checking it */
+		count = cb_data_iov(&cb, 3 * len / 4, iov);
+		for (i = 0, done = 0; i < count; ++i) {
+			check(verify(&s, iov[i].iov_base, iov[i].iov_len));
+			done += iov[i].iov_len;
+		}
+		cb_consume(&cb, done);
+		check(cb_used(&cb) == s.in - s.out);
+	}
+
+	len = cb_used(&cb);
+	while (len > 0) {
+		done = cb_extract(&cb, tmp, sizeof(tmp));
+		check(verify(&s, tmp, done));
+		len -= done;
+	}
+	check(cb_is_empty(&cb));
+
+	cb_destroy(&cb);
+}
+
+
+
+/* read from and write to a pipe, with the data wrapping */
+static void test_read_write(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	size_t size, len;
+	ssize_t rr;
+	int fds[2], n;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(pipe(fds) == 0);
+
+	/* nothing to write from an empty buffer */
+	check(cb_write(&cb, fds[1], 0) == 0);
+
+	for (n = 0; n < 200; ++n) {
+		/* read a chunk in, limited by nbytes on odd rounds */
+		len = 100 + (n * 97) % 900;
+		if (len > cb_space(&cb))
+			len = cb_space(&cb);
+		generate(&s, tmp, len);
+		check(write(fds[1], tmp, len) == (ssize_t)len);
+		rr = cb_read(&cb, fds[0], (n & 1)? len : 0);
+		check(rr == (ssize_t)len);
+
+		/* write most of it back out and check it */
+		len = cb_used(&cb) - cb_used(&cb) / 3;
+		rr = cb_write(&cb, fds[1], len);
+		check(rr == (ssize_t)len);
+		check(read(fds[0], tmp, len) == (ssize_t)len);
+		check(verify(&s, tmp, len));
+		check(cb_used(&cb) == s.in - s.out);
+	}
+
+	/* a full buffer refuses to read */
+	len = cb_space(&cb);
+	while (len > 0) {
+		generate(&s, tmp, MIN(len, sizeof(tmp)));
+		check(cb_append(&cb, tmp, MIN(len, sizeof(tmp))) ==
+		      (ssize_t)MIN(len, sizeof(tmp)));
+		len -= MIN(len, sizeof(tmp));
+	}
+	check(cb_read(&cb, fds[0], 0) == -1);
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(&cb);
+}
+
+
+
+/* receive and send datagrams which are split at the end of the buffer */
+static void test_recv_send(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	size_t size, len;
+	ssize_t rr;
+	int fds[2], n;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+	check(cb_send(&cb, fds[0], 0, NULL, 0) == 0);
+
+	for (n = 0; n < 200; ++n) {
+		len = 1 + (n * 131) % 700;
+		if (len > cb_space(&cb))
+			len = cb_space(&cb);
+		generate(&s, tmp, len);
+		check(send(fds[1], tmp, len, 0) == (ssize_t)len);
+		rr = cb_recv(&cb, fds[0], 0, NULL, 0);
+		check(rr == (ssize_t)len);
+
+		/* send back a datagram of half of the data */
+		len = cb_used(&cb) / 2 + 1;
+		rr = cb_send(&cb, fds[0], len, NULL, 0);
+		check(rr == (ssize_t)len);
+		check(recv(fds[1], tmp, sizeof(tmp), 0) == (ssize_t)len);
+		check(verify(&s, tmp, len));
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(&cb);
+}
+
+
+
+/* receive and send several datagrams at a time (or one at a time, where
+ * that isn't possible) */
+static void test_batch(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	size_t size, len, got;
+	ssize_t rr;
+	int fds[2], n, i;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+	for (n = 0; n < 50; ++n) {
+		/* leave the data somewhere new each round */
+		wrap(&cb, &s, 1 + (n * 211) % (size - 1));
+
+		/* send 6 datagrams of at most 100 bytes */
+		for (i = 0, len = 0; i < 6; ++i) {
+			generate(&s, tmp, 20 + (n + i) % 80);
+			check(send(fds[1], tmp, 20 + (n + i) % 80, 0) ==
+			      (ssize_t)(20 + (n + i) % 80));
+			len += 20 + (n + i) % 80;
+		}
+		for (got = 0; got < len; got += rr) {
+			rr = cb_recv_batch(&cb, fds[0], 100, 6);
+			check(rr > 0);
+			if (rr <= 0)
+				break;
+		}
+		check(cb_used(&cb) == len);
+
+		/* send them back cut into datagrams of at most 64 bytes */
+		for (got = 0; got < len; got += rr) {
+			rr = cb_send_batch(&cb, fds[0], 64, 4);
+			check(rr > 0);
+			if (rr <= 0)
+				break;
+		}
+		check(cb_is_empty(&cb));
+		for (got = 0; got < len; got += rr) {
+			rr = recv(fds[1], tmp, sizeof(tmp), 0);
+			check(rr > 0 && rr <= 64);
+			if (rr <= 0)
+				break;
+			check(verify(&s, tmp, rr));
+		}
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(&cb);
+}
+
+
+
+/* datagrams come back out exactly as they went in */
+static void test_frame(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096], *big;
+	size_t size, len, lens[8];
+	ssize_t rr;
+	int fds[2], n, i;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+	generate(&s, tmp, 1);
+	check(cb_append(&cb, tmp, 1) == 1);
+	check(cb_frame(&cb) == -1);
+	check(cb_extract(&cb, tmp, 1) == 1);
+	check(verify(&s, tmp, 1));
+	check(cb_frame(&cb) == 0);
+	check(cb_is_framed(&cb));
+
+	for (n = 0; n < 40; ++n) {
+		wrap(&cb, &s, 1 + (n * 173) % (size - 1));
+		check(cb_frames(&cb) == 0);
+
+		for (i = 0; i < 8; ++i) {
+			lens[i] = 1 + (n * 7 + i * 59) % 120;
+			generate(&s, tmp, lens[i]);
+			check(send(fds[1], tmp, lens[i], 0) ==
+			      (ssize_t)lens[i]);
+		}
+		for (i = 0, len = 0; i < 4; ++i) {
+			rr = cb_recv(&cb, fds[0], 0, NULL, 0);
+			check(rr == (ssize_t)lens[i]);
+			len += lens[i];
+		}
+		for (; i < 8; i += rr) {
+			rr = cb_recv_batch(&cb, fds[0], 16, 8 - i);
+			check(rr > 0);
+			if (rr <= 0)
+				break;
+			/* count the datagrams received */
+			for (rr = 0; len < cb_used(&cb); ++rr)
+				len += lens[i + rr];
+		}
+		check(cb_frames(&cb) == 8);
+
+		/* nbytes is ignored in favour of the datagram lengths */
+		check(cb_send(&cb, fds[0], 1, NULL, 0) == (ssize_t)lens[0]);
+		for (i = 1; i < 8; i += rr) {
+			rr = cb_send_batch(&cb, fds[0], 1, 8 - i);
+			check(rr > 0);
+			if (rr <= 0)
+				break;
+			/* count the datagrams sent */
+			for (len = rr, rr = 0; len > 0; ++rr)
+				len -= lens[i + rr];
+		}
+		check(cb_frames(&cb) == 0);
+		check(cb_is_empty(&cb));
+		for (i = 0; i < 8; ++i) {
+			rr = recv(fds[1], tmp, sizeof(tmp), 0);
+			check(rr == (ssize_t)lens[i]);
+			check(verify(&s, tmp, lens[i]));
+		}
+	}
+
+#ifdef MSG_TRUNC
+	/* a datagram that doesn't fit yet is left to wait for room */
+	if (backend != CHAINED) {
+		cb_produce(&cb, cb_space(&cb) - 50);
+		check(send(fds[1], tmp, 100, 0) == 100);
+		rr = cb_recv(&cb, fds[0], 0, NULL, 0);
+		check(rr == -1 && errno == EMSGSIZE);
+		check(cb_frame_wanted(&cb) == 100);
+		cb_clear(&cb);
+		check(cb_frames(&cb) == 0);
+		check(cb_recv(&cb, fds[0], 0, NULL, 0) == 100);
+		check(cb_frames(&cb) == 1);
+		check(cb_frame_wanted(&cb) == 0);
+
+		/* and one that never will is dropped */
+		big = (uint8_t *)xmalloc(size + 1);
+		memset(big, 0, size + 1);
+		check(send(fds[1], big, size + 1, 0) == (ssize_t)(size + 1));
+		check(send(fds[1], tmp, 10, 0) == 10);
+		rr = cb_recv(&cb, fds[0], 0, NULL, 0);
+		check(rr == -1 && errno == EMSGSIZE);
+		check(cb_frame_wanted(&cb) == 0);
+		check(cb_recv(&cb, fds[0], 0, NULL, 0) == 10);
+		check(cb_frames(&cb) == 2);
+		free(big);
+	}
+#endif
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(&cb);
+}
+
+
+
+/* the data survives the buffer growing and shrinking while it wraps */
+static void test_resize(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[8192];
+	size_t size, len;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(cb_frame(&cb) == 0);
+
+	wrap(&cb, &s, size - 100);
+	generate(&s, tmp, 150);
+	check(cb_append(&cb, tmp, 150) == 150);
+	generate(&s, tmp, 50);
+	check(cb_append(&cb, tmp, 50) == 50);
+	check(cb_frames(&cb) == 2);
+
+	/* grow */
+	cb_resize(&cb, 2 * size);
+	check(cb_size(&cb) == 2 * size);
+	check(cb_used(&cb) == 200);
+	check(cb_frames(&cb) == 2);
+	check(cb_extract(&cb, tmp, 10) == 10);
+	check(verify(&s, tmp, 10));
+
+	/* shrink to just what is held */
+	cb_resize(&cb, 190);
+	check(cb_size(&cb) == 190);
+	check(cb_is_full(&cb));
+	check(cb_frames(&cb) == 2);
+	len = cb_extract(&cb, tmp, sizeof(tmp));
+	check(len == 190);
+	check(verify(&s, tmp, len));
+	check(cb_frames(&cb) == 0);
+
+	/* shrink to less than is held, which loses the end */
+	generate(&s, tmp, 150);
+	check(cb_append(&cb, tmp, 150) == 150);
+	cb_resize(&cb, 100);
+	check(cb_used(&cb) == 100);
+	check(cb_frames(&cb) == 1);
+	check(cb_extract(&cb, tmp, sizeof(tmp)) == 100);
+	check(verify(&s, tmp, 100));
+
+	cb_destroy(&cb);
+}
+
+
+
+/* mirror a buffer holding wrapped data, which must be kept.  Buffers that
+ * are below the threshold are only mirrored when asked to be */
+static void test_mirror(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[8192];
+	size_t size, len;
+	int err;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+
+	wrap(&cb, &s, size - 100);
+	generate(&s, tmp, 200);
+	check(cb_append(&cb, tmp, 200) == 200);
+	err = cb_mirror(&cb);
+	check((err == 0) == cb_is_mirrored(&cb));
+	check(backend != MIRRORED || err == 0);
+	check(backend != CHAINED || err < 0);
+	check(cb_size(&cb) == size);
+	check(cb_used(&cb) == 200);
+	len = cb_extract(&cb, tmp, sizeof(tmp));
+	check(len == 200);
+	check(verify(&s, tmp, len));
+	cb_destroy(&cb);
+
+	if (backend == MIRRORED) {
+		cb_init(&cb, size);
+		check(!cb_is_mirrored(&cb));
+		check(cb_mirror(&cb) == 0);
+		check(cb_is_mirrored(&cb));
+
+		/* and it stays mirrored when resized */
+		cb_resize(&cb, 2 * size);
+		check(cb_is_mirrored(&cb));
+		cb_destroy(&cb);
+	}
+}
+
+
+
+static void test_clear(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[64];
+	size_t size;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+
+	wrap(&cb, &s, size - 10);
+	generate(&s, tmp, 30);
+	check(cb_append(&cb, tmp, 30) == 30);
+	cb_clear(&cb);
+	check(cb_is_empty(&cb));
+	check(cb_space(&cb) == size);
+
+	/* it's usable afterwards */
+	s.out = s.in;
+	generate(&s, tmp, 30);
+	check(cb_append(&cb, tmp, 30) == 30);
+	check(cb_extract(&cb, tmp, 30) == 30);
+	check(verify(&s, tmp, 30));
+
+	cb_destroy(&cb);
+}
+
+
+
+/* the buffer doubles when it keeps filling up and halves after long
+ * enough with little use, keeping its data */
+static void test_adaptive(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	size_t size, len;
+	int n;
+
+	size = test_size(backend);
+	check(init(&cb, backend, size));
+	check(!cb_is_adaptive(&cb));
+	cb_set_adaptive(&cb, size, 4 * size);
+	check(cb_is_adaptive(&cb));
+
+	/* keep filling it, with the data wrapping */
+	wrap(&cb, &s, size / 3);
+	for (n = 0; n < 1000 && cb_size(&cb) < 4 * size; ++n) {
+		while (!cb_is_full(&cb)) {
+			len = MIN(cb_space(&cb), sizeof(tmp));
+			generate(&s, tmp, len);
+			check(cb_append(&cb, tmp, len) == (ssize_t)len);
+		}
+		cb_adapt_size(&cb);
+		len = cb_extract(&cb, tmp, 100);
+		check(verify(&s, tmp, len));
+		cb_adapt_size(&cb);
+	}
+	check(cb_size(&cb) == 4 * size);
+	check(cb_resizes(&cb) == 2);
+	check(cb_used(&cb) == s.in - s.out);
+
+	/* drain it and leave it idle */
+	while (!cb_is_empty(&cb)) {
+		len = cb_extract(&cb, tmp, sizeof(tmp));
+		check(verify(&s, tmp, len));
+	}
+	for (n = 0; n < 10000 && cb_size(&cb) > size; ++n)
+		cb_adapt_size(&cb);
+	check(cb_size(&cb) == size);
+	check(cb_resizes(&cb) == 4);
+
+	/* it stops at the limits */
+	for (n = 0; n < 10000; ++n)
+		cb_adapt_size(&cb);
+	check(cb_size(&cb) == size);
+
+	cb_destroy(&cb);
+}
+
+
+
+static void test_track_used(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[300];
+
+	check(init(&cb, backend, test_size(backend)));
+
+	/* nothing is recorded until tracking is enabled */
+	check(cb_mean_used(&cb) == 0);
+	cb_sample_used(&cb);
+	check(cb_mean_used(&cb) == 0);
+
+	cb_track_used(&cb);
+	generate(&s, tmp, 300);
+	check(cb_append(&cb, tmp, 300) == 300);
+	cb_sample_used(&cb);
+	check(cb_extract(&cb, tmp, 200) == 200);
+	cb_sample_used(&cb);
+	check(cb_peak_used(&cb) == 300);
+	check(cb_mean_used(&cb) == 200.0);
+
+	cb_destroy(&cb);
+}
+
+
+
+/* data held in a pipe moves back into memory when it has to */
+static void test_splice(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	int in[2], out[2], n;
+	size_t len;
+
+	/* a pipe is counted in pages, so give it several */
+	check(init(&cb, backend, 65536));
+
+	/* only an empty buffer in plain or mirrored memory */
+	if (backend == CHAINED) {
+		check(cb_splice(&cb) == -1);
+		cb_destroy(&cb);
+		return;
+	}
+	generate(&s, tmp, 1);
+	check(cb_append(&cb, tmp, 1) == 1);
+	check(cb_splice(&cb) == -1);
+	check(cb_extract(&cb, tmp, 1) == 1);
+	check(verify(&s, tmp, 1));
+	if (cb_splice(&cb) != 0) {
+		/* not supported */
+		cb_destroy(&cb);
+		return;
+	}
+	check(cb_is_spliced(&cb));
+
+	check(pipe(in) == 0);
+	check(pipe(out) == 0);
+	for (n = 0; n < 100; ++n) {
+		len = MIN(1 + (n * 389) % sizeof(tmp), cb_space(&cb));
+		generate(&s, tmp, len);
+		check(write(in[1], tmp, len) == (ssize_t)len);
+		check(cb_read(&cb, in[0], 0) == (ssize_t)len);
+		check(cb_used(&cb) == s.in - s.out);
+		len = cb_used(&cb) / 2 + 1;
+		check(cb_write(&cb, out[1], len) == (ssize_t)len);
+		check(read(out[0], tmp, len) == (ssize_t)len);
+		check(verify(&s, tmp, len));
+	}
+
+	/* an append brings the data back into memory, at the size the
+	 * buffer was rather than that of the pipe */
+	generate(&s, tmp, 10);
+	check(cb_append(&cb, tmp, 10) == 10);
+	check(!cb_is_spliced(&cb));
+	check(cb_size(&cb) == MAX((size_t)65536, cb_used(&cb)));
+	while (!cb_is_empty(&cb)) {
+		len = cb_extract(&cb, tmp, sizeof(tmp));
+		check(verify(&s, tmp, len));
+	}
+	check(s.in == s.out);
+
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	cb_destroy(&cb);
+}
+
+
+
+/* data read from a file stays there until it is sent */
+static void test_sendfile(backend_t backend)
+{
+	circ_buf_t cb;
+	stream_t s = { 0, 0 };
+	uint8_t tmp[4096];
+	char path[] = "/tmp/cb_testXXXXXX";
+	int fd, fds[2], n;
+	size_t len;
+	ssize_t rr;
+
+	check(init(&cb, backend, test_size(backend)));
+	if ((fd = mkstemp(path)) < 0) {
+		check(fd >= 0);
+		cb_destroy(&cb);
+		return;
+	}
+	unlink(path);
+	for (n = 0; n < 16; ++n) {
+		generate(&s, tmp, sizeof(tmp));
+		check(write(fd, tmp, sizeof(tmp)) == sizeof(tmp));
+	}
+	check(lseek(fd, 0, SEEK_SET) == 0);
+
+	if (backend == CHAINED) {
+		check(cb_sendfile(&cb, fd) == -1);
+		goto done;
+	}
+	if (cb_sendfile(&cb, fd) != 0)
+		goto done;
+	check(cb_is_file_backed(&cb));
+
+	check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	for (n = 0; n < 8; ++n) {
+		rr = cb_read(&cb, fd, 3000);
+		check(rr == 3000);
+		len = cb_used(&cb) / 2 + 1;
+		check(cb_write(&cb, fds[0], len) == (ssize_t)len);
+		check(read(fds[1], tmp, len) == (ssize_t)len);
+		check(verify(&s, tmp, len));
+	}
+
+	/* an extract reads the data not yet sent into memory */
+	len = cb_extract(&cb, tmp, 1000);
+	check(len == 1000);
+	check(!cb_is_file_backed(&cb));
+	check(verify(&s, tmp, len));
+	while (!cb_is_empty(&cb)) {
+		len = cb_extract(&cb, tmp, sizeof(tmp));
+		check(verify(&s, tmp, len));
+	}
+	check(s.out == 8 * 3000);
+
+	close(fds[0]);
+	close(fds[1]);
+done:
+	close(fd);
+	cb_destroy(&cb);
+}